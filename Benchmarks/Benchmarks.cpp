@@ -0,0 +1,111 @@
+/*
+* The MIT License (MIT)
+*
+* Copyright (c) Microsoft Corporation
+*
+* Permission is hereby granted, free of charge, to any person obtaining a
+* copy of this software and associated documentation files (the "Software"),
+* to deal in the Software without restriction, including without limitation
+* the rights to use, copy, modify, merge, publish, distribute, sublicense,
+* and/or sell copies of the Software, and to permit persons to whom the
+* Software is furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included
+* in all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+* OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+* THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+* OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+* ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+* OTHER DEALINGS IN THE SOFTWARE.
+*
+*/
+
+/**
+  Runs the benchmarks, writing the results as CSV so runs against different
+  commits can be compared.
+
+  usage: benchmarks [-n repeats] [-o file] [compile] [execute]
+
+  compile times compiling a corpus of real world code, and execute times
+  microbenchmarks of individual features running in the interpreter and in
+  jitted code.  Both run if neither is given, each writing its own table.
+*/
+
+#include "stdafx.h"
+#include "benchmarks.h"
+#include <Python.h>
+#include <pyjit.h>
+#include <stdlib.h>
+#include <string.h>
+
+static int Usage(const char* program) {
+    fprintf(stderr, "usage: %s [-n repeats] [-o file] [compile] [execute]\n", program);
+    return 2;
+}
+
+int main(int argc, char* const argv[]) {
+    int repeats = 5;
+    const char* outFile = nullptr;
+    bool compile = false, execute = false;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            repeats = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            outFile = argv[++i];
+        }
+        else if (strcmp(argv[i], "compile") == 0) {
+            compile = true;
+        }
+        else if (strcmp(argv[i], "execute") == 0) {
+            execute = true;
+        }
+        else {
+            return Usage(argv[0]);
+        }
+    }
+    if (repeats < 1) {
+        return Usage(argv[0]);
+    }
+    if (!compile && !execute) {
+        compile = execute = true;
+    }
+
+    FILE* out = stdout;
+    if (outFile != nullptr) {
+        out = fopen(outFile, "w");
+        if (out == nullptr) {
+            perror(outFile);
+            return 1;
+        }
+    }
+
+    wchar_t* program = Py_DecodeLocale(argv[0], NULL);
+    Py_SetPath(L"Lib");
+    Py_SetPythonHome(program);
+    Py_NoSiteFlag = 1;
+
+    Py_Initialize();
+    JitInit();
+
+    bool ok = true;
+    if (compile) {
+        ok = RunCompileBenchmarks(out, repeats) && ok;
+    }
+    if (compile && execute) {
+        fprintf(out, "\n");
+    }
+    if (execute) {
+        ok = RunExecuteBenchmarks(out, repeats) && ok;
+    }
+
+    Py_Finalize();
+    if (out != stdout) {
+        fclose(out);
+    }
+
+    return ok ? 0 : 1;
+}
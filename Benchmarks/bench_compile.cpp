@@ -0,0 +1,138 @@
+/*
+* The MIT License (MIT)
+*
+* Copyright (c) Microsoft Corporation
+*
+* Permission is hereby granted, free of charge, to any person obtaining a
+* copy of this software and associated documentation files (the "Software"),
+* to deal in the Software without restriction, including without limitation
+* the rights to use, copy, modify, merge, publish, distribute, sublicense,
+* and/or sell copies of the Software, and to permit persons to whom the
+* Software is furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included
+* in all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+* OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+* THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+* OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+* ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+* OTHER DEALINGS IN THE SOFTWARE.
+*
+*/
+
+/**
+  Compile throughput: how quickly the abstract interpreter and RyuJIT turn
+  real world code into native code, and how much memory they need to do it.
+*/
+
+#include "stdafx.h"
+#include "benchmarks.h"
+#include <Python.h>
+#include <absint.h>
+#include <pyjit.h>
+#include <bridge.h>
+#include <util.h>
+
+// The modules whose functions make up the corpus, picked for a mix of
+// numeric, string and container heavy code.
+static const char* g_corpus[] = {
+    "argparse", "base64", "bisect", "calendar", "colorsys", "configparser",
+    "csv", "difflib", "fractions", "heapq", "json.decoder", "json.encoder",
+    "pprint", "shlex", "string", "textwrap", "tokenize",
+};
+
+// Imports a module and returns its globals along with the code of everything
+// defined in it.  The code is compiled from the module's source so none of it
+// has run, just like code which is being compiled for the first time.
+static const char* g_loadModule =
+    "import importlib, importlib.util\n"
+    "def load(name):\n"
+    "    module = importlib.import_module(name)\n"
+    "    codes = []\n"
+    "    def walk(code):\n"
+    "        for const in code.co_consts:\n"
+    "            if isinstance(const, type(code)):\n"
+    "                codes.append(const)\n"
+    "                walk(const)\n"
+    "    walk(importlib.util.find_spec(name).loader.get_code(name))\n"
+    "    return module.__dict__, codes\n";
+
+// Measurements of compiling all of a module's code once.
+struct CompileRun {
+    unsigned long long time;
+    int failures;
+    size_t ilSize, jitBytes;
+
+    CompileRun() : time(0), failures(0), ilSize(0), jitBytes(0) {
+    }
+};
+
+// Compiles each of the code objects once.  The caches the runtime provides are
+// left out so that every compile is independent of the ones before it.
+static CompileRun CompileAll(PyObject* globals, PyObject* codes) {
+    CompileRun run;
+    auto start = pyjit_now();
+    auto factory = PyJit_GetCompilerFactory();
+    for (Py_ssize_t i = 0; i < PyList_GET_SIZE(codes); i++) {
+        AbstractInterpreter interp((PyCodeObject*)PyList_GET_ITEM(codes, i), factory);
+        interp.set_globals(globals);
+        auto res = interp.compile();
+        if (res == nullptr) {
+            run.failures++;
+            PyErr_Clear();
+            continue;
+        }
+        run.ilSize += res->get_stats().ilSize;
+        run.jitBytes += res->get_stats().jitMemory;
+        delete res;
+    }
+    run.time = pyjit_now() - start;
+    return run;
+}
+
+bool RunCompileBenchmarks(FILE* out, int repeats) {
+    auto globals = PyObject_ptr(PyDict_New());
+    PyDict_SetItemString(globals.get(), "__builtins__", PyThreadState_GET()->interp->builtins);
+    auto res = PyObject_ptr(PyRun_String(g_loadModule, Py_file_input, globals.get(), globals.get()));
+    if (res.get() == nullptr) {
+        PyErr_Print();
+        return false;
+    }
+    auto load = PyDict_GetItemString(globals.get(), "load");
+
+    bool ok = true;
+    fprintf(out, "Benchmark,Functions,Failures,Compiles/sec,IL bytes,JIT bytes\n");
+    for (size_t i = 0; i < sizeof(g_corpus) / sizeof(g_corpus[0]); i++) {
+        auto module = PyObject_ptr(PyObject_CallFunction(load, "s", g_corpus[i]));
+        if (module.get() == nullptr) {
+            fprintf(stderr, "Failed to load %s\n", g_corpus[i]);
+            PyErr_Print();
+            ok = false;
+            continue;
+        }
+        auto codes = PyTuple_GET_ITEM(module.get(), 1);
+
+        // Sizes don't change from one run to the next, we report the fastest time
+        CompileRun best;
+        for (int run = 0; run < repeats; run++) {
+            auto cur = CompileAll(PyTuple_GET_ITEM(module.get(), 0), codes);
+            if (run == 0 || cur.time < best.time) {
+                best = cur;
+            }
+        }
+
+        auto count = PyList_GET_SIZE(codes);
+        fprintf(out, "%s,%d,%d,%f,%zu,%zu\n",
+            g_corpus[i],
+            (int)count,
+            best.failures,
+            best.time == 0 ? 0.0 : count / (best.time / 1e9),
+            best.ilSize,
+            best.jitBytes
+        );
+    }
+    return ok;
+}
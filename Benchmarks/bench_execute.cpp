@@ -0,0 +1,192 @@
+/*
+* The MIT License (MIT)
+*
+* Copyright (c) Microsoft Corporation
+*
+* Permission is hereby granted, free of charge, to any person obtaining a
+* copy of this software and associated documentation files (the "Software"),
+* to deal in the Software without restriction, including without limitation
+* the rights to use, copy, modify, merge, publish, distribute, sublicense,
+* and/or sell copies of the Software, and to permit persons to whom the
+* Software is furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included
+* in all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+* OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+* THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+* OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+* ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+* OTHER DEALINGS IN THE SOFTWARE.
+*
+*/
+
+/**
+  Steady state: microbenchmarks of individual features, timed once the jitted
+  code has been compiled and compared with the same code in the interpreter.
+*/
+
+#include "stdafx.h"
+#include "benchmarks.h"
+#include <Python.h>
+#include <frameobject.h>
+#include <pyjit.h>
+#include <bridge.h>
+#include <util.h>
+
+struct Microbenchmark {
+    const char* name;
+    // Defines f(n), along with anything it needs
+    const char* code;
+    long iterations;
+};
+
+static Microbenchmark g_microbenchmarks[] = {
+    { "int_loop",
+        "def f(n):\n"
+        "  x = 0\n"
+        "  for i in range(n):\n"
+        "    x += i * 3 - 1\n"
+        "  return x\n",
+        1000000 },
+    { "float_loop",
+        "def f(n):\n"
+        "  x = 0.0\n"
+        "  y = 1.5\n"
+        "  for i in range(n):\n"
+        "    x = x * 0.5 + y\n"
+        "  return x\n",
+        1000000 },
+    { "float_math",
+        "import math\n"
+        "def f(n):\n"
+        "  x = 2.0\n"
+        "  t = 0.0\n"
+        "  for i in range(n):\n"
+        "    t = math.sqrt(x + t) + abs(t - x)\n"
+        "  return t\n",
+        1000000 },
+    { "calls",
+        "def g(a, b):\n"
+        "  return a + b\n"
+        "def f(n):\n"
+        "  x = 0\n"
+        "  for i in range(n):\n"
+        "    x = g(i, 1)\n"
+        "  return x\n",
+        1000000 },
+    { "method_calls",
+        "class C:\n"
+        "  def m(self, a):\n"
+        "    return a\n"
+        "def f(n):\n"
+        "  c = C()\n"
+        "  for i in range(n):\n"
+        "    c.m(i)\n",
+        1000000 },
+    { "attributes",
+        "class P:\n"
+        "  def __init__(self):\n"
+        "    self.x = 1\n"
+        "    self.y = 2\n"
+        "def f(n):\n"
+        "  p = P()\n"
+        "  for i in range(n):\n"
+        "    p.x = p.y + i\n"
+        "  return p.x\n",
+        1000000 },
+    { "subscripts",
+        "def f(n):\n"
+        "  l = [0] * 16\n"
+        "  d = {'a': 1}\n"
+        "  for i in range(n):\n"
+        "    l[i & 15] = l[(i + 1) & 15] + d['a']\n"
+        "  return l[0]\n",
+        1000000 },
+    { "string_building",
+        "def f(n):\n"
+        "  for i in range(n):\n"
+        "    s = 'a' + str(i)\n"
+        "    s = f'{s}:{i}'\n"
+        "    s += '.'\n"
+        "  return s\n",
+        200000 },
+    { "exceptions",
+        "def f(n):\n"
+        "  c = 0\n"
+        "  for i in range(n):\n"
+        "    try:\n"
+        "      raise ValueError\n"
+        "    except ValueError:\n"
+        "      c += 1\n"
+        "  return c\n",
+        100000 },
+};
+
+// Calls func with the frame evaluation function swapped for evalFrame, once to
+// warm up (which is when jitted code gets compiled) and then repeats more
+// times.  Returns the fastest of the timed calls in nanoseconds, or 0 if a call
+// raised.
+static unsigned long long TimeCalls(PyObject* func, long iterations, int repeats, _PyFrameEvalFunction evalFrame) {
+    auto interp = PyThreadState_GET()->interp;
+    auto prev = interp->eval_frame;
+    interp->eval_frame = evalFrame;
+
+    unsigned long long best = 0;
+    for (int run = 0; run <= repeats; run++) {
+        auto start = pyjit_now();
+        auto res = PyObject_CallFunction(func, "l", iterations);
+        auto elapsed = pyjit_now() - start;
+        if (res == nullptr) {
+            PyErr_Print();
+            best = 0;
+            break;
+        }
+        Py_DECREF(res);
+        if (run != 0 && (best == 0 || elapsed < best)) {
+            best = elapsed;
+        }
+    }
+
+    interp->eval_frame = prev;
+    return best;
+}
+
+bool RunExecuteBenchmarks(FILE* out, int repeats) {
+    bool ok = true;
+    fprintf(out, "Benchmark,Base,Changed\n");
+    for (size_t i = 0; i < sizeof(g_microbenchmarks) / sizeof(g_microbenchmarks[0]); i++) {
+        auto& bench = g_microbenchmarks[i];
+        auto globals = PyObject_ptr(PyDict_New());
+        PyDict_SetItemString(globals.get(), "__builtins__", PyThreadState_GET()->interp->builtins);
+        auto res = PyObject_ptr(PyRun_String(bench.code, Py_file_input, globals.get(), globals.get()));
+        auto func = PyDict_GetItemString(globals.get(), "f");
+        if (res.get() == nullptr || func == nullptr) {
+            fprintf(stderr, "Failed to define %s\n", bench.name);
+            PyErr_Print();
+            ok = false;
+            continue;
+        }
+
+        auto base = TimeCalls(func, bench.iterations, repeats, _PyEval_EvalFrameDefault);
+        auto changed = TimeCalls(func, bench.iterations, repeats, PyJit_EvalFrame);
+        if (base == 0 || changed == 0) {
+            fprintf(stderr, "%s raised\n", bench.name);
+            ok = false;
+            continue;
+        }
+
+        // Numbers for code we didn't manage to compile would be misleading
+        auto jitted = PyJit_EnsureExtra(((PyFunctionObject*)func)->func_code);
+        if (jitted == nullptr || jitted->j_compiles == 0 || jitted->j_compile_failures != 0) {
+            fprintf(stderr, "%s wasn't compiled: %s\n", bench.name,
+                jitted == nullptr || jitted->j_fail_reason == nullptr ? "not called" : jitted->j_fail_reason);
+            ok = false;
+        }
+
+        fprintf(out, "%s,%f,%f\n", bench.name, base / 1e9, changed / 1e9);
+    }
+    return ok;
+}
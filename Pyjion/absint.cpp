@@ -24,11 +24,13 @@
 */
 
 #include "absint.h"
+#include "bridge.h"
 #include <opcode.h>
 #include <deque>
 #include <unordered_map>
 #include <algorithm>
 #include <frameobject.h>
+#include <compile.h>
 #include <stddef.h>
 
 #define NUM_ARGS(n) ((n)&0xFF)
@@ -37,6 +39,9 @@
 #define GET_OPARG(index)  _Py_OPARG(m_byteCode[index/sizeof(_Py_CODEUNIT)])
 #define GET_OPCODE(index) _Py_OPCODE(m_byteCode[index/sizeof(_Py_CODEUNIT)])
 
+// Largest function, in instructions, we'll inline
+#define MAX_INLINE_SIZE 32
+
 #define LD_FIELDA(type, field) m_comp->emit_ptr(offsetof(type, field)); m_comp->emit_add(); 
 #define LD_FIELD(type, field) m_comp->emit_ptr(offsetof(type, field)); m_comp->emit_add(); m_comp->emit_load_indirect_ptr();
 #define ST_FIELD(type, field) m_comp->emit_ptr(offsetof(type, field)); m_comp->emit_add(); m_comp->emit_store_indirect_ptr();
@@ -45,11 +50,50 @@
 AbstractInterpreter::AbstractInterpreter(PyCodeObject *code, CompilerFactory* compFactory) : m_code(code) {
     m_byteCode = (_Py_CODEUNIT *)PyBytes_AS_STRING(code->co_code);
 	m_size = PyBytes_Size(code->co_code);
+    m_startStates.resize(m_size);
+    m_endFinallyIsFinally.resize(m_size);
+    m_handlerCode.resize(m_size);
+    m_blockStarts.resize(m_size);
+    m_breakTo.resize(m_size);
+    m_opcodeSources.resize(m_size);
+    m_offsetLabels.resize(m_size);
+    m_offsetStack.resize(m_size);
+    m_resumeLabels.resize(m_size);
+    m_sequenceLocals.resize(m_size);
+    m_methodLoads.resize(m_size);
+    m_methodCalls.resize(m_size);
+    m_inlinedCalls.resize(m_size);
+    m_rangeLoops.resize(m_size);
+    m_typedRangeLoops.resize(m_size);
+    m_unpackedTuples.resize(m_size);
+    m_slicedSubscrs.resize(m_size);
+    m_strSubscrs.resize(m_size);
+    m_concatLocals.resize(m_size);
+    m_borrowedLoads.resize(m_size);
+    m_borrowedArgs.resize(m_size);
+    m_sideExits.resize(m_size);
+    m_assignmentState.resize(code->co_nlocals);
     m_returnValue = &Undefined;
+    m_baseline = false;
+    m_osrEntry = -1;
+    m_osrStackDepth = 0;
+    m_osrEmitted = false;
+    m_resumeFailed = false;
+    m_deoptFailed = false;
+    m_globalCaches = nullptr;
+    m_attrCaches = nullptr;
+    m_callCaches = nullptr;
+    m_methodLoadCount = 0;
+    m_globals = nullptr;
+    m_deopts = nullptr;
+    m_lazyLasti = -1;
+    m_failReason = nullptr;
+    m_failOpcode = -1;
     if (compFactory != nullptr) {
 		m_module = new UserModule(g_module);
 		m_method = new UserMethod(m_module, LK_Pointer, std::vector <Parameter> {Parameter(LK_Pointer), Parameter(LK_Pointer) });
 		m_comp = compFactory(m_method);
+		m_comp->reserve(m_size);
 		m_lasti = m_comp->emit_define_local(LK_Pointer);
 
         m_retLabel = m_comp->emit_define_label();
@@ -62,6 +106,16 @@ AbstractInterpreter::AbstractInterpreter(PyCodeObject *code, CompilerFactory* co
     init_starting_state();
 }
 
+// Records why the code can't be compiled and returns false.  Only the first
+// reason is kept, as the callers unwinding from it fail as well.
+bool AbstractInterpreter::fail(const char* reason, int opcode) {
+	if (m_failReason == nullptr) {
+		m_failReason = reason;
+		m_failOpcode = opcode;
+	}
+	return false;
+}
+
 void AbstractInterpreter::emit_lasti_init() {
 	load_frame();
 	m_comp->emit_ptr(offsetof(PyFrameObject, f_lasti));
@@ -212,17 +266,7 @@ void AbstractInterpreter::emit_box_tagged_ptr() {
 void AbstractInterpreter::emit_for_next(Label processValue, Local iterValue) {
 	auto error = m_comp->emit_define_local(LK_Int);
 	m_comp->emit_load_local_addr(error);
-
-	/*
-	if (inLoop) {
-	m_comp->emit_load_local_addr(loopOpt1);
-	m_comp->emit_load_local_addr(loopOpt2);
-	m_comp->emit_call(SIG_ITERNEXT_OPTIMIZED_TOKEN);
-	}
-	else*/
-	{
-		m_comp->emit_call(PyJit_IterNext);
-	}
+	m_comp->emit_call(PyJit_IterNext);
 	m_comp->emit_dup();
 	m_comp->emit_ptr(nullptr);
 	m_comp->emit_branch(BranchNotEqual, processValue);
@@ -237,15 +281,121 @@ void AbstractInterpreter::emit_for_next(Label processValue, Local iterValue) {
 	m_comp->emit_free_local(error);
 }
 
-/*
-void PythonCompiler::emit_getiter_opt() {
-m_comp->emit_load_local_addr(loopOpt1);
-m_comp->emit_load_local_addr(loopOpt2);
-m_comp->emit_call(METHOD_GETITER_OPTIMIZED_TOKEN);
-dec_stack();
-emit_error_check();
-inc_stack();
-}*/
+void AbstractInterpreter::emit_getiter_optimized(RangeLoop& loop) {
+	m_comp->emit_load_local_addr(loop.Current);
+	m_comp->emit_load_local_addr(loop.Step);
+	m_comp->emit_load_local_addr(loop.Remaining);
+	m_comp->emit_call(PyJit_GetIterOptimized);
+}
+
+// Checks if the value a GET_ITER gets an iterator for is the result of calling
+// the range builtin, by the CALL_FUNCTION right before it.
+bool AbstractInterpreter::is_range_call(size_t getIter) {
+	auto call = getIter - sizeof(_Py_CODEUNIT);
+	if (getIter < sizeof(_Py_CODEUNIT) || GET_OPCODE(call) != CALL_FUNCTION) {
+		return false;
+	}
+	auto state = m_startStates.find(call);
+	auto argCnt = (size_t)GET_OPARG(call);
+	if (state == nullptr || state->stack_size() < argCnt + 1) {
+		return false;
+	}
+	auto builtin = BuiltinValue::from((*state)[state->stack_size() - argCnt - 1].Value);
+	return builtin != nullptr && builtin->builtin() == KB_Range;
+}
+
+// Checks if the FOR_ITER at forIter loops over a range we'll guard on, so its
+// loop variable is always an int and can be counted without boxing it.  Loops
+// which will run as a kernel keep their loop variable in the frame.
+bool AbstractInterpreter::is_typed_range_loop(size_t forIter) {
+	auto getIter = forIter - sizeof(_Py_CODEUNIT);
+	if (forIter < sizeof(_Py_CODEUNIT) || GET_OPCODE(getIter) != GET_ITER) {
+		return false;
+	}
+	auto state = m_startStates.find(getIter);
+	LoopKernel kernel;
+	return state != nullptr && state->stack_size() != 0 &&
+		(*state)[state->stack_size() - 1].Value->kind() == AVK_Any &&
+		is_range_call(getIter) && predict_deopt(*state, getIter, getIter, 1) &&
+		!find_loop_kernel(forIter, kernel, false);
+}
+
+// Produces the next value of a loop over a range with the native counter, or
+// branches to generic if the loop has a regular iterator (which guarded loops
+// never do).  When the range is exhausted the range is released and 0 is left
+// on the stack, like the error flag emit_for_next leaves when iteration is done.
+// If tagged the loop variable doesn't escape, and the value is left tagged when
+// it fits.
+void AbstractInterpreter::emit_range_next(RangeLoop& loop, Label processValue, Label generic, Local iterValue, bool tagged) {
+	auto exhausted = m_comp->emit_define_label();
+	if (!loop.Guarded) {
+		m_comp->emit_load_local(loop.Step);
+		m_comp->emit_ptr((size_t)0);
+		m_comp->emit_branch(BranchEqual, generic);
+	}
+
+	m_comp->emit_load_local(loop.Remaining);
+	m_comp->emit_ptr((size_t)0);
+	m_comp->emit_branch(BranchEqual, exhausted);
+
+	m_comp->emit_load_local(loop.Remaining);
+	m_comp->emit_ptr((size_t)1);
+	m_comp->emit_subtract();
+	m_comp->emit_store_local(loop.Remaining);
+
+	auto value = m_comp->emit_define_local(LK_Pointer);
+	auto boxValue = m_comp->emit_define_label();
+	auto haveValue = m_comp->emit_define_label();
+	if (tagged) {
+		// It fits if doubling it doesn't change its sign
+		m_comp->emit_load_local(loop.Current);
+		m_comp->emit_load_local(loop.Current);
+		m_comp->emit_add();
+		m_comp->emit_load_local(loop.Current);
+		m_comp->emit_bitwise_xor();
+		m_comp->emit_ptr((size_t)0);
+		m_comp->emit_compare_int(CT_LessThan);
+		m_comp->emit_branch(BranchTrue, boxValue);
+
+		m_comp->emit_load_local(loop.Current);
+		m_comp->emit_load_local(loop.Current);
+		m_comp->emit_add();
+		m_comp->emit_ptr((size_t)1);
+		m_comp->emit_bitwise_or();
+		m_comp->emit_store_local(value);
+		m_comp->emit_branch(BranchAlways, haveValue);
+	}
+	m_comp->emit_mark_label(boxValue);
+	m_comp->emit_load_local(loop.Current);
+	m_comp->emit_call(PyLong_FromSsize_t);
+	m_comp->emit_store_local(value);
+	m_comp->emit_mark_label(haveValue);
+
+	m_comp->emit_load_local(loop.Current);
+	m_comp->emit_load_local(loop.Step);
+	m_comp->emit_add();
+	m_comp->emit_store_local(loop.Current);
+
+	m_comp->emit_load_and_free_local(value);
+	m_comp->emit_dup();
+	m_comp->emit_ptr(nullptr);
+	m_comp->emit_branch(BranchNotEqual, processValue);
+
+	// Boxing failed, report it as an error the same way emit_for_next does
+	m_comp->emit_pop();
+	m_comp->emit_load_local(iterValue);
+	decref();
+	m_comp->emit_int(1);
+	auto done = m_comp->emit_define_label();
+	m_comp->emit_branch(BranchAlways, done);
+
+	m_comp->emit_mark_label(exhausted);
+	m_comp->emit_load_local(iterValue);
+	decref();
+	m_comp->emit_int(0);
+	m_comp->emit_mark_label(done);
+}
+
 
 void AbstractInterpreter::emit_binary_float(int opcode) {
 	switch (opcode) {
@@ -274,7 +424,111 @@ void AbstractInterpreter::emit_binary_float(int opcode) {
 	}
 }
 
+// Branches to notTagged unless both values are tagged rather than longs.
+void AbstractInterpreter::emit_both_tagged(Local left, Local right, Label notTagged) {
+	m_comp->emit_load_local(left);
+	m_comp->emit_load_local(right);
+	m_comp->emit_bitwise_and();
+	m_comp->emit_ptr(1);
+	m_comp->emit_bitwise_and();
+	m_comp->emit_branch(BranchFalse, notTagged);
+}
+
+// Adds, subtracts and the bitwise operators work directly on the tagged
+// representation, 2 * x + 1, when both values are tagged.  We only call the
+// helper when a value is a long or the result no longer fits.
 void AbstractInterpreter::emit_binary_tagged_int(int opcode) {
+	switch (opcode) {
+		case INPLACE_ADD: case BINARY_ADD:
+		case INPLACE_SUBTRACT: case BINARY_SUBTRACT:
+		case INPLACE_AND: case BINARY_AND:
+		case INPLACE_OR: case BINARY_OR:
+		case INPLACE_XOR: case BINARY_XOR:
+			break;
+		default:
+			emit_binary_tagged_int_call(opcode);
+			return;
+	}
+
+	auto right = m_comp->emit_spill();
+	auto left = m_comp->emit_spill();
+	auto res = m_comp->emit_define_local();
+	auto slow = m_comp->emit_define_label();
+	auto done = m_comp->emit_define_label();
+	emit_both_tagged(left, right, slow);
+
+	switch (opcode) {
+		case INPLACE_AND:
+		case BINARY_AND:
+			m_comp->emit_load_local(left);
+			m_comp->emit_load_local(right);
+			m_comp->emit_bitwise_and();
+			break;
+		case INPLACE_OR:
+		case BINARY_OR:
+			m_comp->emit_load_local(left);
+			m_comp->emit_load_local(right);
+			m_comp->emit_bitwise_or();
+			break;
+		case INPLACE_XOR:
+		case BINARY_XOR:
+			m_comp->emit_load_local(left);
+			m_comp->emit_load_local(right);
+			m_comp->emit_bitwise_xor();
+			m_comp->emit_ptr(1);
+			m_comp->emit_bitwise_or();
+			break;
+		case INPLACE_ADD:
+		case BINARY_ADD:
+		case INPLACE_SUBTRACT:
+		case BINARY_SUBTRACT:
+		{
+			bool add = opcode == INPLACE_ADD || opcode == BINARY_ADD;
+			m_comp->emit_load_local(left);
+			m_comp->emit_load_local(right);
+			m_comp->emit_ptr(1);
+			m_comp->emit_subtract();
+			if (add) {
+				m_comp->emit_add();
+			}
+			else {
+				m_comp->emit_subtract();
+			}
+			m_comp->emit_store_local(res);
+
+			// The value is too big to tag if the native operation overflowed.
+			// right - 1 has the same sign as right, so for an add that's when
+			// the result's sign differs from both operands, and for a subtract
+			// when the operands' signs differ and the result's differs from
+			// left's.
+			m_comp->emit_load_local(left);
+			m_comp->emit_load_local(res);
+			m_comp->emit_bitwise_xor();
+			m_comp->emit_load_local(add ? res : left);
+			m_comp->emit_load_local(right);
+			m_comp->emit_bitwise_xor();
+			m_comp->emit_bitwise_and();
+			m_comp->emit_ptr((size_t)0);
+			m_comp->emit_compare_int(CT_LessThan);
+			m_comp->emit_branch(BranchTrue, slow);
+			m_comp->emit_load_local(res);
+			break;
+		}
+	}
+	m_comp->emit_branch(BranchAlways, done);
+
+	m_comp->emit_mark_label(slow);
+	m_comp->emit_load_local(left);
+	m_comp->emit_load_local(right);
+	emit_binary_tagged_int_call(opcode);
+
+	m_comp->emit_mark_label(done);
+	m_comp->emit_free_local(res);
+	m_comp->emit_free_local(left);
+	m_comp->emit_free_local(right);
+}
+
+void AbstractInterpreter::emit_binary_tagged_int_call(int opcode) {
 	switch (opcode) {
 	case INPLACE_ADD:
 	case BINARY_ADD: m_comp->emit_call(PyJit_Add_Int); break;
@@ -363,6 +617,28 @@ void AbstractInterpreter::emit_not_in() {
 }
 
 void AbstractInterpreter::emit_compare_tagged_int(int compareType) {
+	// Tagging preserves the order of values, so tagged values compare directly
+	auto right = m_comp->emit_spill();
+	auto left = m_comp->emit_spill();
+	auto slow = m_comp->emit_define_label();
+	auto done = m_comp->emit_define_label();
+	emit_both_tagged(left, right, slow);
+
+	m_comp->emit_load_local(left);
+	m_comp->emit_load_local(right);
+	switch (compareType) {
+	case Py_EQ: m_comp->emit_compare_int(CT_Equal); break;
+	case Py_LT: m_comp->emit_compare_int(CT_LessThan); break;
+	case Py_LE: m_comp->emit_compare_int(CT_LessThanEqual); break;
+	case Py_NE: m_comp->emit_compare_int(CT_NotEqual); break;
+	case Py_GT: m_comp->emit_compare_int(CT_GreaterThan); break;
+	case Py_GE: m_comp->emit_compare_int(CT_GreaterThanEqual); break;
+	}
+	m_comp->emit_branch(BranchAlways, done);
+
+	m_comp->emit_mark_label(slow);
+	m_comp->emit_load_local(left);
+	m_comp->emit_load_local(right);
 	switch (compareType) {
 	case Py_EQ:  m_comp->emit_call(PyJit_Equals_Int); break;
 	case Py_LT: m_comp->emit_call(PyJit_LessThan_Int); break;
@@ -371,6 +647,10 @@ void AbstractInterpreter::emit_compare_tagged_int(int compareType) {
 	case Py_GT: m_comp->emit_call(PyJit_GreaterThan_Int); break;
 	case Py_GE: m_comp->emit_call(PyJit_GreaterThanEquals_Int); break;
 	}
+
+	m_comp->emit_mark_label(done);
+	m_comp->emit_free_local(left);
+	m_comp->emit_free_local(right);
 }
 
 void AbstractInterpreter::emit_compare_object(int compareType) {
@@ -717,8 +997,9 @@ void AbstractInterpreter::emit_dict_store() {
 	m_comp->emit_call(PyJit_StoreMap);
 }
 
-void AbstractInterpreter::emit_dict_store_no_decref() {
-	m_comp->emit_call(PyJit_StoreMap);
+void AbstractInterpreter::emit_build_const_key_map() {
+	// stack is values, keys, count
+	m_comp->emit_call(PyJit_BuildConstKeyMap);
 }
 
 void AbstractInterpreter::emit_map_extend() {
@@ -747,9 +1028,14 @@ void AbstractInterpreter::emit_delete_name(void* name) {
 	m_comp->emit_call(PyJit_DeleteName);
 }
 
-void AbstractInterpreter::emit_store_attr(void* name) {
+void AbstractInterpreter::emit_store_attr(void* name, AttrCache* cache) {
 	m_comp->emit_ptr(name);
-	m_comp->emit_call(PyJit_StoreAttr);
+	if (cache == nullptr) {
+		m_comp->emit_call(PyJit_StoreAttr);
+		return;
+	}
+	m_comp->emit_ptr(cache);
+	m_comp->emit_call(PyJit_StoreAttrCached);
 }
 
 void AbstractInterpreter::emit_delete_attr(void* name) {
@@ -757,151 +1043,1069 @@ void AbstractInterpreter::emit_delete_attr(void* name) {
 	m_comp->emit_call(PyJit_DeleteAttr);
 }
 
-void AbstractInterpreter::emit_load_attr(void* name) {
-	m_comp->emit_ptr(name);
-	m_comp->emit_call(PyJit_LoadAttr);
-}
-
-void AbstractInterpreter::emit_store_global(void* name) {
-	// value is on the stack
-	load_frame();
+void AbstractInterpreter::emit_load_attr(void* name, AttrCache* cache) {
 	m_comp->emit_ptr(name);
-	m_comp->emit_call(PyJit_StoreGlobal);
+	if (cache == nullptr) {
+		m_comp->emit_call(PyJit_LoadAttr);
+		return;
+	}
+	m_comp->emit_ptr(cache);
+	m_comp->emit_call(PyJit_LoadAttrCached);
 }
 
-void AbstractInterpreter::emit_delete_global(void* name) {
-	load_frame();
+// Loads the function for a method call, storing the object it's called on
+// into self, or null if the attribute isn't a method we can call unbound.
+void AbstractInterpreter::emit_load_method(void* name, AttrCache* cache, Local self) {
 	m_comp->emit_ptr(name);
-	m_comp->emit_call(PyJit_DeleteGlobal);
+	m_comp->emit_ptr(cache);
+	m_comp->emit_load_local_addr(self);
+	m_comp->emit_call(PyJit_LoadMethod);
 }
 
-void AbstractInterpreter::emit_load_global(void* name) {
-	load_frame();
-	m_comp->emit_ptr(name);
-	m_comp->emit_call(PyJit_LoadGlobal);
-}
+// Calls the function and self pushed by emit_load_method, with argCnt
+// arguments on the stack above them.
+void AbstractInterpreter::emit_method_call(size_t opcodeIndex, size_t argCnt) {
+	if (argCnt > 3) {
+		build_tuple(argCnt);
+		m_comp->emit_call(PyJit_CallMethodN);
+		return;
+	}
 
-void AbstractInterpreter::emit_delete_fast(int index) {
-	load_local(index);
-	load_frame();
-	m_comp->emit_ptr(offsetof(PyFrameObject, f_localsplus) + index * sizeof(size_t));
-	m_comp->emit_add();
-	m_comp->emit_null();
-	m_comp->emit_store_indirect_ptr();
-	decref();
+	m_comp->emit_ptr(call_cache(opcodeIndex));
+	switch (argCnt) {
+		case 0: m_comp->emit_call(PyJit_CallMethod0); break;
+		case 1: m_comp->emit_call(PyJit_CallMethod1); break;
+		case 2: m_comp->emit_call(PyJit_CallMethod2); break;
+		case 3: m_comp->emit_call(PyJit_CallMethod3); break;
+	}
 }
 
-void AbstractInterpreter::emit_new_tuple(size_t size) {
-	if (size == 0) {
-		m_comp->emit_ptr(PyTuple_New(0));
-		m_comp->emit_dup();
-		emit_incref(false);
-	}
-	else {
-		m_comp->emit_ptr(size);
-		m_comp->emit_call(PyTuple_New);
+// Calls a function through the site's call cache, so calls to jitted
+// functions can go straight to their compiled code.
+bool AbstractInterpreter::emit_direct_call(size_t opcodeIndex, size_t argCnt) {
+	if (m_callCaches == nullptr || argCnt > 4) {
+		return false;
 	}
-}
 
-// Loads the specified index from a tuple that's already on the stack
-void AbstractInterpreter::emit_tuple_load(size_t index) {
-	m_comp->emit_ptr(index * sizeof(size_t) + offsetof(PyTupleObject, ob_item));
-	m_comp->emit_add();
-	m_comp->emit_load_indirect_ptr();
+	m_comp->emit_ptr(call_cache(opcodeIndex));
+	switch (argCnt) {
+		case 0: m_comp->emit_call(PyJit_CallDirect0); break;
+		case 1: m_comp->emit_call(PyJit_CallDirect1); break;
+		case 2: m_comp->emit_call(PyJit_CallDirect2); break;
+		case 3: m_comp->emit_call(PyJit_CallDirect3); break;
+		case 4: m_comp->emit_call(PyJit_CallDirect4); break;
+	}
+	return true;
 }
 
-void AbstractInterpreter::emit_tuple_store(size_t argCnt) {
-	auto valueTmp = m_comp->emit_define_local(LK_Pointer);
-	auto tupleTmp = m_comp->emit_define_local(LK_Pointer);
-	m_comp->emit_store_local(tupleTmp);
+AttrCache* AbstractInterpreter::attr_cache(size_t opcodeIndex) {
+	if (m_attrCaches == nullptr) {
+		return nullptr;
+	}
+	return &m_attrCaches[opcodeIndex / sizeof(_Py_CODEUNIT)];
+}
+
+// Emits the body of a function we're inlining, guarded by a check that the
+// function being called still has the code we inlined.  The function and the
+// arguments stay on the stack while the body runs so they're released if it
+// raises, and they're only borrowed by the body.  If the guard fails we branch
+// past the body, leaving the stack for the call to be emitted as usual, and the
+// returned done label is marked after it by emit_inlined_result.
+bool AbstractInterpreter::emit_inlined_call(size_t opcodeIndex, size_t argCnt, Label& done) {
+	auto inlined = m_inlinedCalls.find(opcodeIndex);
+	if (inlined == nullptr) {
+		return false;
+	}
+	auto code = *inlined;
 
-	for (size_t i = 0, arg = argCnt - 1; i < argCnt; i++, arg--) {
-		// save the argument into a temporary...
-		m_comp->emit_store_local(valueTmp);
+	vector<Local> args;
+	for (size_t i = 0; i < argCnt; i++) {
+		auto arg = m_comp->emit_define_local(LK_Pointer);
+		m_comp->emit_store_local(arg);
+		args.insert(args.begin(), arg);
+	}
+	auto func = m_comp->emit_define_local(LK_Pointer);
+	m_comp->emit_store_local(func);
+	m_comp->emit_load_local(func);
+	for (size_t i = 0; i < argCnt; i++) {
+		m_comp->emit_load_local(args[i]);
+	}
 
-		// load the address of the tuple item...
-		m_comp->emit_load_local(tupleTmp);
-		m_comp->emit_ptr(arg * sizeof(size_t) + offsetof(PyTupleObject, ob_item));
-		m_comp->emit_add();
+	auto notInlined = m_comp->emit_define_label();
+	done = m_comp->emit_define_label();
+	m_comp->emit_load_local(func);
+	LD_FIELD(PyObject, ob_type);
+	m_comp->emit_ptr(&PyFunction_Type);
+	m_comp->emit_branch(BranchNotEqual, notInlined);
+	m_comp->emit_load_local(func);
+	LD_FIELD(PyFunctionObject, func_code);
+	m_comp->emit_ptr(code);
+	m_comp->emit_branch(BranchNotEqual, notInlined);
+
+	auto byteCode = (_Py_CODEUNIT *)PyBytes_AS_STRING(code->co_code);
+	auto size = PyBytes_GET_SIZE(code->co_code) / sizeof(_Py_CODEUNIT);
+	for (size_t i = 0; i < size; i++) {
+		auto oparg = _Py_OPARG(byteCode[i]);
+		switch (_Py_OPCODE(byteCode[i])) {
+			case LOAD_FAST:
+				m_comp->emit_load_local(args[oparg]);
+				m_comp->emit_dup();
+				emit_incref();
+				inc_stack();
+				break;
+			case LOAD_CONST:
+				m_comp->emit_ptr(PyTuple_GET_ITEM(code->co_consts, oparg));
+				m_comp->emit_dup();
+				emit_incref();
+				inc_stack();
+				break;
+			case UNARY_POSITIVE:
+				emit_unary_positive();
+				dec_stack();
+				error_check("inlined unary positive failed");
+				inc_stack();
+				break;
+			case UNARY_NEGATIVE:
+				emit_unary_negative();
+				dec_stack();
+				error_check("inlined unary negative failed");
+				inc_stack();
+				break;
+			case UNARY_INVERT:
+				emit_unary_invert();
+				dec_stack();
+				error_check("inlined unary invert failed");
+				inc_stack();
+				break;
+			case COMPARE_OP:
+				emit_compare_object(oparg);
+				dec_stack(2);
+				error_check("inlined compare failed");
+				inc_stack();
+				break;
+			case RETURN_VALUE:
+			{
+				// Release the function and arguments from under the result
+				auto result = m_comp->emit_define_local(LK_Pointer);
+				m_comp->emit_store_local(result);
+				dec_stack();
+				for (size_t j = 0; j < argCnt + 1; j++) {
+					emit_pop_top();
+				}
+				dec_stack(argCnt + 1);
+				m_comp->emit_load_local(result);
+				m_comp->emit_free_local(result);
+				inc_stack();
+				break;
+			}
+			default:
+				// can_inline only accepts the binary operators otherwise
+				emit_binary_object(_Py_OPCODE(byteCode[i]));
+				dec_stack(2);
+				error_check("inlined binary op failed");
+				inc_stack();
+				break;
+		}
+	}
+	m_comp->emit_branch(BranchAlways, done);
 
-		// reload the value
-		m_comp->emit_load_local(valueTmp);
+	// The stack we're left with for the call is the one we came in with
+	dec_stack();
+	inc_stack(argCnt + 1);
+	m_comp->emit_mark_label(notInlined);
 
-		// store into the array
-		m_comp->emit_store_indirect_ptr();
+	for (size_t i = 0; i < argCnt; i++) {
+		m_comp->emit_free_local(args[i]);
 	}
-	m_comp->emit_load_local(tupleTmp);
-
-	m_comp->emit_free_local(valueTmp);
-	m_comp->emit_free_local(tupleTmp);
+	m_comp->emit_free_local(func);
+	return true;
+}
+
+// Interprets the body of the function inlined at opcodeIndex with the kinds of
+// the arguments the caller passes it, returning the kind of value it produces
+// when it's a float or an int.  Whatever the call is rebound to can return
+// anything, so like find_intrinsic we need to be somewhere we can deoptimize.
+AbstractValue* AbstractInterpreter::find_inlined_result(InterpreterState& state, size_t opcodeIndex, size_t curByte, size_t argCnt) {
+	auto inlined = m_inlinedCalls.find(opcodeIndex);
+	if (inlined == nullptr || !predict_deopt(state, opcodeIndex, curByte, argCnt + 1)) {
+		return nullptr;
+	}
+	auto code = *inlined;
+	auto& stack = state.m_stack;
+
+	vector<AbstractValueWithSources> values;
+	auto byteCode = (_Py_CODEUNIT *)PyBytes_AS_STRING(code->co_code);
+	auto size = PyBytes_GET_SIZE(code->co_code) / sizeof(_Py_CODEUNIT);
+	for (size_t i = 0; i < size; i++) {
+		auto oparg = _Py_OPARG(byteCode[i]);
+		auto opcode = _Py_OPCODE(byteCode[i]);
+		switch (opcode) {
+			case LOAD_FAST:
+				values.push_back(stack[stack.size() - argCnt + oparg].Value);
+				break;
+			case LOAD_CONST:
+				values.push_back(to_abstract(PyTuple_GET_ITEM(code->co_consts, oparg)));
+				break;
+			case UNARY_POSITIVE:
+			case UNARY_NEGATIVE:
+			case UNARY_INVERT:
+				values.back() = values.back().Value->unary(nullptr, opcode);
+				break;
+			case RETURN_VALUE:
+				switch (values.back().Value->kind()) {
+					case AVK_Float: return &Float;
+					case AVK_Integer: return &Integer;
+					default: return nullptr;
+				}
+			default:
+			{
+				auto two = values.back();
+				values.pop_back();
+				auto one = values.back();
+				values.back() = opcode == COMPARE_OP ?
+					one.Value->compare(nullptr, oparg, two) :
+					one.Value->binary(nullptr, opcode, two);
+				break;
+			}
+		}
+	}
+	return nullptr;
 }
 
-void AbstractInterpreter::emit_store_subscr() {
-	// stack is value, container, index
-	m_comp->emit_call(PyJit_StoreSubscr);
+// Finishes a call emit_inlined_call has inlined once the call it falls back
+// to has been emitted.  If we know what kind of value the body produces then
+// we check the call produced it too, and floats which don't escape are unboxed.
+void AbstractInterpreter::emit_inlined_result(size_t opcodeIndex, size_t curByte, size_t argCnt, Label done) {
+	auto result = find_inlined_result(m_startStates[opcodeIndex], opcodeIndex, curByte, argCnt);
+	if (result != nullptr) {
+		emit_result_guard(result->kind(), curByte);
+	}
+	m_comp->emit_mark_label(done);
+	if (result == &Float && !should_box(opcodeIndex)) {
+		emit_unbox_result();
+	}
 }
 
-void AbstractInterpreter::emit_delete_subscr() {
-	// stack is container, index
-	m_comp->emit_call(PyJit_DeleteSubscr);
+CallCache* AbstractInterpreter::call_cache(size_t opcodeIndex) {
+	if (m_callCaches == nullptr) {
+		return nullptr;
+	}
+	return &m_callCaches[opcodeIndex / sizeof(_Py_CODEUNIT)];
 }
 
-void AbstractInterpreter::emit_build_slice() {
-	m_comp->emit_call(PyJit_BuildSlice);
+void AbstractInterpreter::emit_store_global(void* name) {
+	// value is on the stack
+	load_frame();
+	m_comp->emit_ptr(name);
+	m_comp->emit_call(PyJit_StoreGlobal);
 }
 
-void AbstractInterpreter::emit_unary_positive() {
-	m_comp->emit_call(PyJit_UnaryPositive);
+void AbstractInterpreter::emit_delete_global(void* name) {
+	load_frame();
+	m_comp->emit_ptr(name);
+	m_comp->emit_call(PyJit_DeleteGlobal);
 }
 
-void AbstractInterpreter::emit_unary_negative() {
-	m_comp->emit_call(PyJit_UnaryNegative);
-}
+void AbstractInterpreter::emit_load_global(int nameIndex) {
+	auto name = PyTuple_GetItem(m_code->co_names, nameIndex);
+	if (m_globalCaches == nullptr) {
+		load_frame();
+		m_comp->emit_ptr(name);
+		m_comp->emit_call(PyJit_LoadGlobal);
+		return;
+	}
 
-void AbstractInterpreter::emit_unary_not_push_int() {
-	m_comp->emit_call(PyJit_UnaryNot_Int);
-}
+	// If neither the globals nor the builtins have changed since the cache was
+	// filled it holds the value we'd look up.  The version tags are loaded as
+	// pointers, which are the same size on the platforms we target.
+	static_assert(sizeof(PY_UINT64_T) == sizeof(void*), "dict versions are loaded as pointers");
+	auto cache = &m_globalCaches[nameIndex];
+	auto slowPath = m_comp->emit_define_label();
+	auto done = m_comp->emit_define_label();
 
-void AbstractInterpreter::emit_unary_not() {
-	m_comp->emit_call(PyJit_UnaryNot);
-}
+	load_frame();
+	m_comp->emit_ptr(offsetof(PyFrameObject, f_globals));
+	m_comp->emit_add();
+	m_comp->emit_load_indirect_ptr();
+	m_comp->emit_ptr(offsetof(PyDictObject, ma_version_tag));
+	m_comp->emit_add();
+	m_comp->emit_load_indirect_ptr();
+	m_comp->emit_ptr(&cache->GlobalsVersion);
+	m_comp->emit_load_indirect_ptr();
+	m_comp->emit_branch(BranchNotEqual, slowPath);
 
-void AbstractInterpreter::emit_unary_negative_float() {
-	m_comp->emit_negate();
-}
+	load_frame();
+	m_comp->emit_ptr(offsetof(PyFrameObject, f_builtins));
+	m_comp->emit_add();
+	m_comp->emit_load_indirect_ptr();
+	m_comp->emit_ptr(&cache->Builtins);
+	m_comp->emit_load_indirect_ptr();
+	m_comp->emit_branch(BranchNotEqual, slowPath);
 
-void AbstractInterpreter::emit_unary_negative_tagged_int() {
-	m_comp->emit_call(PyJit_UnaryNegative_Int);
-}
+	// The globals version matched so the cache has been filled, and holds a
+	// reference to the builtins.
+	m_comp->emit_ptr(&cache->Builtins);
+	m_comp->emit_load_indirect_ptr();
+	m_comp->emit_ptr(offsetof(PyDictObject, ma_version_tag));
+	m_comp->emit_add();
+	m_comp->emit_load_indirect_ptr();
+	m_comp->emit_ptr(&cache->BuiltinsVersion);
+	m_comp->emit_load_indirect_ptr();
+	m_comp->emit_branch(BranchNotEqual, slowPath);
 
-void AbstractInterpreter::emit_unary_not_float_push_bool() {
-	m_comp->emit_float(0);
-	m_comp->emit_compare_equal();
-}
+	m_comp->emit_ptr(&cache->Value);
+	m_comp->emit_load_indirect_ptr();
+	m_comp->emit_dup();
+	emit_incref();
+	m_comp->emit_branch(BranchAlways, done);
 
-void AbstractInterpreter::emit_unary_not_tagged_int_push_bool() {
-	m_comp->emit_call(PyJit_UnaryNot_Int_PushBool);
-}
+	m_comp->emit_mark_label(slowPath);
+	load_frame();
+	m_comp->emit_ptr(name);
+	m_comp->emit_ptr(cache);
+	m_comp->emit_call(PyJit_LoadGlobalCached);
 
-void AbstractInterpreter::emit_unary_invert() {
-	m_comp->emit_call(PyJit_UnaryInvert);
+	m_comp->emit_mark_label(done);
 }
 
-void AbstractInterpreter::emit_import_name(void* name) {
-	m_comp->emit_ptr(name);
-	load_frame();
-	m_comp->emit_call(PyJit_ImportName);
-}
+// Calls to globals which look like the builtins we know about go through a
+// helper for that builtin, which checks it's really what's being called.
+bool AbstractInterpreter::emit_builtin_call(size_t opcodeIndex, size_t argCnt) {
+	auto state = m_startStates.find(opcodeIndex);
+	if (state == nullptr || state->stack_size() < argCnt + 1) {
+		return false;
+	}
 
-void AbstractInterpreter::emit_import_from(void* name) {
-	m_comp->emit_dup();
-	m_comp->emit_ptr(name);
-	m_comp->emit_call(PyJit_ImportFrom);
-}
+	auto builtin = BuiltinValue::from((*state)[state->stack_size() - argCnt - 1].Value);
+	if (builtin == nullptr) {
+		return false;
+	}
 
-void AbstractInterpreter::emit_import_star() {
-	load_frame();
-	m_comp->emit_call(PyJit_ImportStar);
+	switch (builtin->builtin()) {
+		case KB_Len:
+			if (argCnt == 1) {
+				m_comp->emit_call(PyJit_CallLen);
+				return true;
+			}
+			break;
+		case KB_IsInstance:
+			if (argCnt == 2) {
+				m_comp->emit_call(PyJit_CallIsInstance);
+				return true;
+			}
+			break;
+		case KB_Int:
+			if (argCnt == 1) {
+				m_comp->emit_call(PyJit_CallInt);
+				return true;
+			}
+			break;
+		case KB_Float:
+			if (argCnt == 1) {
+				m_comp->emit_call(PyJit_CallFloat);
+				return true;
+			}
+			break;
+		default:
+			break;
+	}
+	return false;
+}
+
+// Finds the function a LOAD_ATTR at curByte loads if it's one we know about
+// from a module, e.g. math.sqrt, loaded straight after the module is loaded
+// from the globals.  Like builtins the module is speculated from its name.
+BuiltinValue* AbstractInterpreter::find_module_attr(size_t curByte, int oparg) {
+	if (curByte < sizeof(_Py_CODEUNIT)) {
+		return nullptr;
+	}
+	auto load = curByte - sizeof(_Py_CODEUNIT);
+	if (GET_OPCODE(load) != LOAD_GLOBAL ||
+		(load >= sizeof(_Py_CODEUNIT) && GET_OPCODE(load - sizeof(_Py_CODEUNIT)) == EXTENDED_ARG)) {
+		return nullptr;
+	}
+	auto module = PyTuple_GetItem(m_code->co_names, GET_OPARG(load));
+	auto name = PyTuple_GetItem(m_code->co_names, oparg);
+	return BuiltinValue::find_attr(PyUnicode_AsUTF8(module), PyUnicode_AsUTF8(name));
+}
+
+// The value a call to builtin is guarded on, the type object for types and the
+// C implementation otherwise, or nullptr if we don't have one.
+static void* builtin_impl(KnownBuiltin builtin) {
+	switch (builtin) {
+		case KB_Int: return &PyLong_Type;
+		case KB_Float: return &PyFloat_Type;
+		case KB_Abs: return (void*)g_builtinAbs;
+		case KB_Min: return (void*)g_builtinMin;
+		case KB_Max: return (void*)g_builtinMax;
+		case KB_MathSqrt: return (void*)g_mathSqrt;
+		case KB_MathFloor: return (void*)g_mathFloor;
+		case KB_MathCeil: return (void*)g_mathCeil;
+		default: break;
+	}
+	return nullptr;
+}
+
+// Predicts while we're interpreting whether we'll be able to deoptimize at curByte
+// once the instruction has consumed the top consumed values on the stack, for
+// speculating on the kinds of values which are guarded.  It mirrors can_deopt,
+// conservatively as we don't know yet what will be boxed, and the guard mustn't
+// have failed too often already.
+bool AbstractInterpreter::predict_deopt(InterpreterState& state, size_t opcodeIndex, size_t curByte, size_t consumed) {
+	auto& stack = state.m_stack;
+	if (is_generator() || m_osrEntry != -1 || m_handlerCode.contains(opcodeIndex) || stack.size() < consumed) {
+		return false;
+	}
+	// The interpreter can't pick up unboxed floats from the stack, or unboxed
+	// locals which might not have been assigned yet
+	for (size_t i = 0; i < stack.size() - consumed; i++) {
+		if (stack[i].Value->kind() == AVK_Float) {
+			return false;
+		}
+	}
+	for (size_t i = 0; i < state.local_count(); i++) {
+		auto local = state.get_local(i);
+		auto kind = local.ValueInfo.Value->kind();
+		if (local.IsMaybeUndefined && (kind == AVK_Float || kind == AVK_Integer)) {
+			return false;
+		}
+	}
+	if (m_deopts != nullptr) {
+		auto count = m_deopts->find((int)curByte);
+		if (count != m_deopts->end() && count->second >= DEOPT_LIMIT) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// Called when predict_deopt got it wrong and we can't emit a guard we've
+// speculated on.  The compile fails, and the guard is counted as having failed
+// too often so that we don't speculate on it when it's retried.
+void AbstractInterpreter::deopt_failed(size_t curByte) {
+	m_deoptFailed = true;
+	if (m_deopts != nullptr) {
+		(*m_deopts)[(int)curByte] = DEOPT_LIMIT;
+	}
+}
+
+// Finds the intrinsic a call to a builtin with argCnt arguments on the stack can
+// be replaced with, storing the kind of value it produces in result.  All of the
+// arguments need to be floats or ints.  Something else can be called which can
+// return anything, so we also need to be able to deoptimize when it doesn't give
+// us back the kind of value the intrinsic would have.
+IntrinsicOp AbstractInterpreter::find_intrinsic(InterpreterState& state, size_t opcodeIndex, size_t curByte, size_t argCnt, AbstractValueKind& result) {
+	auto& stack = state.m_stack;
+	if (argCnt == 0 || argCnt > 2 || stack.size() < argCnt + 1 ||
+		m_methodCalls.contains(opcodeIndex) || m_inlinedCalls.contains(opcodeIndex) ||
+		!predict_deopt(state, opcodeIndex, curByte, argCnt + 1)) {
+		return IO_None;
+	}
+
+	auto builtin = BuiltinValue::from(stack[stack.size() - argCnt - 1].Value);
+	if (builtin == nullptr || builtin_impl(builtin->builtin()) == nullptr) {
+		return IO_None;
+	}
+
+	AbstractValueKind args[2];
+	for (size_t i = 0; i < argCnt; i++) {
+		args[i] = stack[stack.size() - argCnt + i].Value->kind();
+		if (args[i] != AVK_Float && args[i] != AVK_Integer) {
+			return IO_None;
+		}
+	}
+
+	bool isFloat = args[0] == AVK_Float;
+	if (argCnt == 2) {
+		// Mixing the two, the kind returned depends on which one is picked
+		if (args[1] != args[0]) {
+			return IO_None;
+		}
+		result = args[0];
+		switch (builtin->builtin()) {
+			case KB_Min: return IO_Min;
+			case KB_Max: return IO_Max;
+			default: break;
+		}
+		return IO_None;
+	}
+
+	switch (builtin->builtin()) {
+		case KB_MathSqrt:
+			result = AVK_Float;
+			return IO_Sqrt;
+		case KB_MathFloor:
+			result = AVK_Integer;
+			return isFloat ? IO_Floor : IO_Identity;
+		case KB_MathCeil:
+			result = AVK_Integer;
+			return isFloat ? IO_Ceil : IO_Identity;
+		case KB_Abs:
+			result = args[0];
+			return isFloat ? IO_FloatAbs : IO_IntAbs;
+		case KB_Int:
+			result = AVK_Integer;
+			return isFloat ? IO_FloatToInt : IO_Identity;
+		case KB_Float:
+			result = AVK_Float;
+			return isFloat ? IO_Identity : IO_IntToFloat;
+		default:
+			break;
+	}
+	return IO_None;
+}
+
+// Updates the state for a call which can be replaced with an intrinsic.  Like
+// a binary operation the arguments stay unboxed unless the result escapes.
+bool AbstractInterpreter::interpret_intrinsic_call(InterpreterState& state, size_t opcodeIndex, size_t curByte, size_t argCnt) {
+	AbstractValueKind result;
+	if (find_intrinsic(state, opcodeIndex, curByte, argCnt, result) == IO_None) {
+		// We may have kept the arguments unboxed when we knew more about them
+		auto sources = m_opcodeSources.find(opcodeIndex);
+		if (sources != nullptr && *sources != nullptr) {
+			(*sources)->escapes();
+		}
+		return false;
+	}
+
+	auto sources = add_intermediate_source(opcodeIndex);
+	for (size_t i = 0; i < argCnt; i++) {
+		auto arg = state.pop_no_escape();
+		AbstractSource::combine(arg.Sources, sources);
+	}
+	// the function
+	state.pop();
+	state.push(AbstractValueWithSources(result == AVK_Float ? (AbstractValue*)&Float : &Integer, sources));
+	return true;
+}
+
+// Replaces a call with the intrinsic find_intrinsic finds for it, guarded by a
+// check that the target is the builtin.  Anything else is called with the
+// arguments boxed, and we carry on if it returns the kind of value the
+// intrinsic would have.
+bool AbstractInterpreter::emit_intrinsic_call(size_t opcodeIndex, size_t curByte, size_t argCnt) {
+	AbstractValueKind resultKind;
+	auto& stack = get_stack_info(opcodeIndex);
+	auto op = find_intrinsic(m_startStates[opcodeIndex], opcodeIndex, curByte, argCnt, resultKind);
+	if (op == IO_None) {
+		return false;
+	}
+	auto builtin = BuiltinValue::from(stack[stack.size() - argCnt - 1].Value)->builtin();
+
+	Local args[2];
+	AbstractValueKind argKinds[2];
+	for (size_t i = argCnt; i-- > 0; ) {
+		argKinds[i] = stack[stack.size() - argCnt + i].Value->kind();
+		args[i] = m_comp->emit_define_local(argKinds[i] == AVK_Float ? LK_Float : LK_Pointer);
+		m_comp->emit_store_local(args[i]);
+	}
+	dec_stack(argCnt);
+
+	auto notBuiltin = m_comp->emit_define_label();
+	auto done = m_comp->emit_define_label();
+	emit_builtin_guard(builtin, notBuiltin);
+
+	decref();
+	dec_stack();
+	emit_intrinsic(op, args, argKinds);
+	inc_stack(1, resultKind == AVK_Float ? STACK_KIND_VALUE : STACK_KIND_OBJECT);
+	m_comp->emit_branch(BranchAlways, done);
+
+	m_comp->emit_mark_label(notBuiltin);
+	dec_stack();
+	inc_stack();
+	for (size_t i = 0; i < argCnt; i++) {
+		m_comp->emit_load_local(args[i]);
+		if (argKinds[i] == AVK_Float) {
+			emit_box_float();
+		}
+		else {
+			emit_box_tagged_ptr();
+		}
+	}
+	emit_call(argCnt);
+	dec_stack();
+	error_check("call function failed");
+	inc_stack();
+	emit_intrinsic_result(resultKind, curByte);
+
+	m_comp->emit_mark_label(done);
+	for (size_t i = 0; i < argCnt; i++) {
+		m_comp->emit_free_local(args[i]);
+	}
+	return true;
+}
+
+// Branches to notBuiltin unless the call target on the top of the stack is the
+// builtin, leaving the target on the stack.
+void AbstractInterpreter::emit_builtin_guard(KnownBuiltin builtin, Label notBuiltin) {
+	auto impl = builtin_impl(builtin);
+	m_comp->emit_dup();
+	if (builtin == KB_Int || builtin == KB_Float) {
+		m_comp->emit_ptr(impl);
+		m_comp->emit_branch(BranchNotEqual, notBuiltin);
+		return;
+	}
+
+	// Each interpreter has its own builtin function objects, and the module
+	// could have been imported again, so we check the C implementation
+	auto target = m_comp->emit_spill();
+	m_comp->emit_load_local(target);
+	LD_FIELD(PyObject, ob_type);
+	m_comp->emit_ptr(&PyCFunction_Type);
+	m_comp->emit_branch(BranchNotEqual, notBuiltin);
+	m_comp->emit_load_local(target);
+	LD_FIELD(PyCFunctionObject, m_ml);
+	LD_FIELD(PyMethodDef, ml_meth);
+	m_comp->emit_ptr(impl);
+	m_comp->emit_branch(BranchNotEqual, notBuiltin);
+	m_comp->emit_free_local(target);
+}
+
+// Emits the operation a call is replaced with, which takes ownership of the
+// arguments in args.
+void AbstractInterpreter::emit_intrinsic(IntrinsicOp op, Local* args, AbstractValueKind* argKinds) {
+	switch (op) {
+		case IO_Identity:
+			m_comp->emit_load_local(args[0]);
+			break;
+		case IO_Sqrt:
+		{
+			auto value = argKinds[0] == AVK_Float ? args[0] : emit_int_to_float(args[0]);
+			auto inDomain = m_comp->emit_define_label();
+			m_comp->emit_load_local(value);
+			m_comp->emit_float(0);
+			m_comp->emit_compare_float(CT_LessThan);
+			m_comp->emit_branch(BranchFalse, inDomain);
+			emit_pyerr_setstring(PyExc_ValueError, "math domain error");
+			branch_raise("math domain error");
+			m_comp->emit_mark_label(inDomain);
+
+			m_comp->emit_load_local(value);
+			m_comp->emit_call(PyJit_Sqrt);
+			if (argKinds[0] != AVK_Float) {
+				m_comp->emit_free_local(value);
+			}
+			break;
+		}
+		case IO_Floor:
+		case IO_Ceil:
+			m_comp->emit_load_local(args[0]);
+			m_comp->emit_call(op == IO_Floor ? PyJit_Floor : PyJit_Ceil);
+			m_comp->emit_call(PyJit_Float_ToInt);
+			error_check("float to int failed");
+			break;
+		case IO_FloatToInt:
+			m_comp->emit_load_local(args[0]);
+			m_comp->emit_call(PyJit_Float_ToInt);
+			error_check("float to int failed");
+			break;
+		case IO_IntToFloat:
+			m_comp->emit_load_and_free_local(emit_int_to_float(args[0]));
+			break;
+		case IO_FloatAbs:
+			m_comp->emit_load_local(args[0]);
+			m_comp->emit_call(PyJit_FAbs);
+			break;
+		case IO_IntAbs:
+			m_comp->emit_load_local(args[0]);
+			m_comp->emit_call(PyJit_Abs_Int);
+			error_check("abs failed");
+			break;
+		case IO_Min:
+		case IO_Max:
+		{
+			if (argKinds[0] == AVK_Integer) {
+				m_comp->emit_load_local(args[0]);
+				m_comp->emit_load_local(args[1]);
+				m_comp->emit_call(op == IO_Min ? PyJit_Min_Int : PyJit_Max_Int);
+				error_check("compare failed");
+				break;
+			}
+
+			// The second value is only picked if it's smaller (or larger), so
+			// like the builtins we return the first of equal values, and NaNs
+			// are only returned if they're first.
+			auto res = m_comp->emit_define_local(LK_Float);
+			auto keepFirst = m_comp->emit_define_label();
+			auto chosen = m_comp->emit_define_label();
+			m_comp->emit_load_local(args[1]);
+			m_comp->emit_load_local(args[0]);
+			m_comp->emit_compare_float(op == IO_Min ? CT_LessThan : CT_GreaterThan);
+			m_comp->emit_branch(BranchFalse, keepFirst);
+			m_comp->emit_load_local(args[1]);
+			m_comp->emit_store_local(res);
+			m_comp->emit_branch(BranchAlways, chosen);
+			m_comp->emit_mark_label(keepFirst);
+			m_comp->emit_load_local(args[0]);
+			m_comp->emit_store_local(res);
+			m_comp->emit_mark_label(chosen);
+			m_comp->emit_load_and_free_local(res);
+			break;
+		}
+		default:
+			break;
+	}
+}
+
+// Checks the value returned by something other than the builtin is the kind of
+// value the intrinsic produces, unboxing it if it's a float.
+void AbstractInterpreter::emit_intrinsic_result(AbstractValueKind kind, size_t curByte) {
+	emit_result_guard(kind, curByte);
+	if (kind == AVK_Float) {
+		emit_unbox_result();
+	}
+}
+
+// Checks the value on the top of the stack is the float or int we've speculated
+// it is, and deoptimizes if it isn't.  We only speculate where predict_deopt says
+// we can deoptimize, but if it got it wrong we give up on compiling rather than
+// raise something the interpreter wouldn't.
+void AbstractInterpreter::emit_result_guard(AbstractValueKind kind, size_t curByte) {
+	auto expected = m_comp->emit_define_label();
+	m_comp->emit_dup();
+	LD_FIELD(PyObject, ob_type);
+	m_comp->emit_ptr(kind == AVK_Float ? &PyFloat_Type : &PyLong_Type);
+	m_comp->emit_branch(BranchEqual, expected);
+	if (can_deopt((int)curByte)) {
+		emit_deopt((int)curByte);
+	}
+	else {
+		deopt_failed(curByte);
+	}
+	m_comp->emit_mark_label(expected);
+}
+
+// Replaces the float object on the top of the stack with its value.
+void AbstractInterpreter::emit_unbox_result() {
+	auto result = m_comp->emit_spill();
+	m_comp->emit_load_local(result);
+	emit_unbox_float();
+	m_comp->emit_load_and_free_local(result);
+	decref();
+	dec_stack();
+	inc_stack(1, STACK_KIND_VALUE);
+}
+
+// Converts the int in value, which may be tagged, into a new float local and
+// releases the int.
+Local AbstractInterpreter::emit_int_to_float(Local value) {
+	auto res = m_comp->emit_define_local(LK_Float);
+	m_comp->emit_load_local(value);
+	m_comp->emit_load_local_addr(res);
+	emit_tagged_int_to_float();
+	m_comp->emit_load_local(value);
+	decref();
+	int_error_check("int too big for float");
+	return res;
+}
+
+void AbstractInterpreter::emit_delete_fast(int index) {
+	load_local(index);
+	load_frame();
+	m_comp->emit_ptr(offsetof(PyFrameObject, f_localsplus) + index * sizeof(size_t));
+	m_comp->emit_add();
+	m_comp->emit_null();
+	m_comp->emit_store_indirect_ptr();
+	decref();
+}
+
+void AbstractInterpreter::emit_new_tuple(size_t size) {
+	if (size == 0) {
+		m_comp->emit_ptr(PyTuple_New(0));
+		m_comp->emit_dup();
+		emit_incref(false);
+	}
+	else {
+		m_comp->emit_ptr(size);
+		m_comp->emit_call(PyTuple_New);
+	}
+}
+
+// Loads the specified index from a tuple that's already on the stack
+void AbstractInterpreter::emit_tuple_load(size_t index) {
+	m_comp->emit_ptr(index * sizeof(size_t) + offsetof(PyTupleObject, ob_item));
+	m_comp->emit_add();
+	m_comp->emit_load_indirect_ptr();
+}
+
+void AbstractInterpreter::emit_tuple_store(size_t argCnt) {
+	auto valueTmp = m_comp->emit_define_local(LK_Pointer);
+	auto tupleTmp = m_comp->emit_define_local(LK_Pointer);
+	m_comp->emit_store_local(tupleTmp);
+
+	for (size_t i = 0, arg = argCnt - 1; i < argCnt; i++, arg--) {
+		// save the argument into a temporary...
+		m_comp->emit_store_local(valueTmp);
+
+		// load the address of the tuple item...
+		m_comp->emit_load_local(tupleTmp);
+		m_comp->emit_ptr(arg * sizeof(size_t) + offsetof(PyTupleObject, ob_item));
+		m_comp->emit_add();
+
+		// reload the value
+		m_comp->emit_load_local(valueTmp);
+
+		// store into the array
+		m_comp->emit_store_indirect_ptr();
+	}
+	m_comp->emit_load_local(tupleTmp);
+
+	m_comp->emit_free_local(valueTmp);
+	m_comp->emit_free_local(tupleTmp);
+}
+
+void AbstractInterpreter::emit_store_subscr() {
+	// stack is value, container, index
+	m_comp->emit_call(PyJit_StoreSubscr);
+}
+
+void AbstractInterpreter::emit_get_slice() {
+	// stack is container, start, stop
+	m_comp->emit_call(PyJit_GetSlice);
+}
+
+void AbstractInterpreter::emit_store_slice() {
+	// stack is value, container, start, stop
+	m_comp->emit_call(PyJit_StoreSlice);
+}
+
+// Checks if a subscript has a constant str key and a container which may be a
+// dict.  The container is checked when the code runs, so this includes
+// containers we know nothing about.
+bool AbstractInterpreter::is_str_dict_subscr(size_t opcodeIndex, size_t curByte) {
+	if (!m_strSubscrs.contains(curByte)) {
+		return false;
+	}
+	auto stackInfo = get_stack_info(opcodeIndex);
+	auto kind = stackInfo[stackInfo.size() - 2].Value->kind();
+	return kind == AVK_Dict || kind == AVK_Any;
+}
+
+// Checks if an add is assigned straight back to a local, e.g. s += t, and its
+// operands may be strs.
+bool AbstractInterpreter::can_concatenate(size_t opcodeIndex, size_t curByte) {
+	if (!m_concatLocals.contains(curByte)) {
+		return false;
+	}
+	auto stackInfo = get_stack_info(opcodeIndex);
+	auto left = stackInfo[stackInfo.size() - 2].Value->kind();
+	auto right = stackInfo[stackInfo.size() - 1].Value->kind();
+	return (left == AVK_String || left == AVK_Any) && (right == AVK_String || right == AVK_Any);
+}
+
+// Reverses the order of the top count values on the stack, which is all that
+// unpacking a tuple we've just built does.  Unboxed values stay unboxed.
+void AbstractInterpreter::reverse_stack(size_t count) {
+	vector<Local> values;
+	vector<bool> kinds;
+	for (size_t i = 0; i < count; i++) {
+		bool kind = m_stack.back();
+		auto value = m_comp->emit_define_local(kind == STACK_KIND_VALUE ? LK_Float : LK_Pointer);
+		m_comp->emit_store_local(value);
+		values.push_back(value);
+		kinds.push_back(kind);
+		dec_stack();
+	}
+	for (size_t i = 0; i < count; i++) {
+		m_comp->emit_load_and_free_local(values[i]);
+		inc_stack(1, kinds[i]);
+	}
+}
+
+// Pushes the address of the item a list or tuple is being indexed by with a
+// tagged int, branching to generic if the container isn't exactly the type we
+// expect, the index didn't fit in a tagged int, or the index is out of range.
+void AbstractInterpreter::emit_sequence_item_addr(AbstractValueKind kind, Local container, Local index, Label generic) {
+	m_comp->emit_load_local(container);
+	LD_FIELD(PyObject, ob_type);
+	m_comp->emit_ptr(kind == AVK_List ? &PyList_Type : &PyTuple_Type);
+	m_comp->emit_branch(BranchNotEqual, generic);
+
+	m_comp->emit_load_local(index);
+	m_comp->emit_ptr(1);
+	m_comp->emit_bitwise_and();
+	m_comp->emit_branch(BranchFalse, generic);
+
+	// The tagged value is 2 * i + 1, rather than untagging it we work with
+	// 2 * i against twice the size.
+	auto offset = m_comp->emit_define_local();
+	auto size = m_comp->emit_define_local();
+	m_comp->emit_load_local(index);
+	m_comp->emit_ptr(1);
+	m_comp->emit_subtract();
+	m_comp->emit_store_local(offset);
+
+	m_comp->emit_load_local(container);
+	LD_FIELD(PyVarObject, ob_size);
+	m_comp->emit_dup();
+	m_comp->emit_add();
+	m_comp->emit_store_local(size);
+
+	// Negative indexes count back from the end
+	auto positive = m_comp->emit_define_label();
+	m_comp->emit_load_local(offset);
+	m_comp->emit_ptr((size_t)0);
+	m_comp->emit_compare_int(CT_LessThan);
+	m_comp->emit_branch(BranchFalse, positive);
+	m_comp->emit_load_local(offset);
+	m_comp->emit_load_local(size);
+	m_comp->emit_add();
+	m_comp->emit_store_local(offset);
+	m_comp->emit_mark_label(positive);
+
+	// Anything still out of range gets the IndexError from the generic path
+	m_comp->emit_load_local(offset);
+	m_comp->emit_ptr((size_t)0);
+	m_comp->emit_compare_int(CT_LessThan);
+	m_comp->emit_branch(BranchTrue, generic);
+	m_comp->emit_load_local(offset);
+	m_comp->emit_load_local(size);
+	m_comp->emit_compare_int(CT_LessThan);
+	m_comp->emit_branch(BranchFalse, generic);
+
+	m_comp->emit_load_local(container);
+	if (kind == AVK_List) {
+		LD_FIELD(PyListObject, ob_item);
+	}
+	else {
+		LD_FIELDA(PyTupleObject, ob_item);
+	}
+	m_comp->emit_load_local(offset);
+	m_comp->emit_ptr(sizeof(PyObject*) / 2);
+	m_comp->emit_multiply();
+	m_comp->emit_add();
+
+	m_comp->emit_free_local(offset);
+	m_comp->emit_free_local(size);
+}
+
+void AbstractInterpreter::emit_sequence_subscr(AbstractValueKind kind) {
+	// stack is container, index
+	auto index = m_comp->emit_spill();
+	auto container = m_comp->emit_spill();
+	auto generic = m_comp->emit_define_label();
+	auto done = m_comp->emit_define_label();
+
+	emit_sequence_item_addr(kind, container, index, generic);
+	m_comp->emit_load_indirect_ptr();
+	m_comp->emit_dup();
+	emit_incref();
+	m_comp->emit_load_local(container);
+	decref();
+	m_comp->emit_branch(BranchAlways, done);
+
+	m_comp->emit_mark_label(generic);
+	m_comp->emit_load_local(container);
+	m_comp->emit_load_local(index);
+	m_comp->emit_call(PyJit_Subscr_Tagged);
+
+	m_comp->emit_mark_label(done);
+	m_comp->emit_free_local(index);
+	m_comp->emit_free_local(container);
+}
+
+void AbstractInterpreter::emit_list_store_subscr() {
+	// stack is value, list, index
+	auto index = m_comp->emit_spill();
+	auto container = m_comp->emit_spill();
+	auto value = m_comp->emit_spill();
+	auto generic = m_comp->emit_define_label();
+	auto done = m_comp->emit_define_label();
+
+	// The list takes over our reference to the value
+	auto addr = m_comp->emit_define_local();
+	auto old = m_comp->emit_define_local();
+	emit_sequence_item_addr(AVK_List, container, index, generic);
+	m_comp->emit_store_local(addr);
+	m_comp->emit_load_local(addr);
+	m_comp->emit_load_indirect_ptr();
+	m_comp->emit_store_local(old);
+	m_comp->emit_load_local(addr);
+	m_comp->emit_load_local(value);
+	m_comp->emit_store_indirect_ptr();
+	m_comp->emit_load_local(old);
+	decref();
+	m_comp->emit_load_local(container);
+	decref();
+	m_comp->emit_int(0);
+	m_comp->emit_branch(BranchAlways, done);
+
+	m_comp->emit_mark_label(generic);
+	m_comp->emit_load_local(value);
+	m_comp->emit_load_local(container);
+	m_comp->emit_load_local(index);
+	m_comp->emit_call(PyJit_StoreSubscr_Tagged);
+
+	m_comp->emit_mark_label(done);
+	m_comp->emit_free_local(addr);
+	m_comp->emit_free_local(old);
+	m_comp->emit_free_local(index);
+	m_comp->emit_free_local(container);
+	m_comp->emit_free_local(value);
+}
+
+void AbstractInterpreter::emit_delete_subscr() {
+	// stack is container, index
+	m_comp->emit_call(PyJit_DeleteSubscr);
+}
+
+void AbstractInterpreter::emit_build_slice() {
+	m_comp->emit_call(PyJit_BuildSlice);
+}
+
+void AbstractInterpreter::emit_unary_positive() {
+	m_comp->emit_call(PyJit_UnaryPositive);
+}
+
+void AbstractInterpreter::emit_unary_negative() {
+	m_comp->emit_call(PyJit_UnaryNegative);
+}
+
+void AbstractInterpreter::emit_unary_not_push_int() {
+	m_comp->emit_call(PyJit_UnaryNot_Int);
+}
+
+void AbstractInterpreter::emit_unary_not() {
+	m_comp->emit_call(PyJit_UnaryNot);
+}
+
+void AbstractInterpreter::emit_unary_negative_float() {
+	m_comp->emit_negate();
+}
+
+void AbstractInterpreter::emit_unary_negative_tagged_int() {
+	m_comp->emit_call(PyJit_UnaryNegative_Int);
+}
+
+void AbstractInterpreter::emit_unary_not_float_push_bool() {
+	m_comp->emit_float(0);
+	m_comp->emit_compare_equal();
+}
+
+void AbstractInterpreter::emit_unary_not_tagged_int_push_bool() {
+	m_comp->emit_call(PyJit_UnaryNot_Int_PushBool);
+}
+
+void AbstractInterpreter::emit_unary_invert() {
+	m_comp->emit_call(PyJit_UnaryInvert);
+}
+
+void AbstractInterpreter::emit_import_name(void* name) {
+	m_comp->emit_ptr(name);
+	load_frame();
+	m_comp->emit_call(PyJit_ImportName);
+}
+
+void AbstractInterpreter::emit_import_from(void* name) {
+	m_comp->emit_dup();
+	m_comp->emit_ptr(name);
+	m_comp->emit_call(PyJit_ImportFrom);
+}
+
+void AbstractInterpreter::emit_import_star() {
+	load_frame();
+	m_comp->emit_call(PyJit_ImportStar);
 }
 
 void AbstractInterpreter::emit_load_build_class() {
@@ -909,45 +2113,424 @@ void AbstractInterpreter::emit_load_build_class() {
 	m_comp->emit_call(PyJit_BuildClass);
 }
 
-void AbstractInterpreter::emit_unpack_sequence(Local sequence, Local sequenceStorage, Label success, size_t size) {
-	// load the iterable, the count, and our temporary 
-	// storage if we need to iterate over the object.
-	m_comp->emit_load_local(sequence);
-	m_comp->emit_ptr(size);
-	m_comp->emit_load_local(sequenceStorage);
-	m_comp->emit_call(PyJit_UnpackSequence);
+void AbstractInterpreter::emit_unpack_sequence(Local sequence, Local sequenceStorage, Label success, size_t size) {
+	// load the iterable, the count, and our temporary 
+	// storage if we need to iterate over the object.
+	m_comp->emit_load_local(sequence);
+	m_comp->emit_ptr(size);
+	m_comp->emit_load_local(sequenceStorage);
+	m_comp->emit_call(PyJit_UnpackSequence);
+
+	m_comp->emit_dup();
+	m_comp->emit_null();
+	m_comp->emit_branch(BranchNotEqual, success);
+	m_comp->emit_pop();
+	m_comp->emit_load_local(sequence);
+	decref();
+}
+
+void AbstractInterpreter::decref() {
+	m_comp->emit_call(PyJit_DecRef);
+	// It might be nice to inline this at some point:
+	//LD_FIELDA(PyObject, ob_refcnt);
+	//m_il.push_back(CEE_DUP);
+	//m_il.push_back(CEE_LDIND_I4);
+	//m_il.push_back(CEE_LDC_I4_1);
+	//m_il.push_back(CEE_SUB);
+	////m_il.push_back(CEE_DUP);
+	//// _Py_Dealloc(_py_decref_tmp)
+
+	//m_il.push_back(CEE_STIND_I4);
+}
+
+
+void AbstractInterpreter::emit_push_frame() {
+	load_frame();
+	m_comp->emit_call(PyJit_PushFrame);
+}
+
+void AbstractInterpreter::emit_pop_frame() {
+	load_frame();
+	m_comp->emit_call(PyJit_PopFrame);
+}
+
+// Emits the entry point for on-stack replacement at the current loop head, which
+// the start of the method branches to.  The values on the frame's value stack are
+// moved onto our stack, with the top value going into iterValue if we're at a
+// FOR_ITER.  We can only take the frame over if its stack lines up with ours.
+void AbstractInterpreter::emit_osr_entry(Local iterValue) {
+	size_t onStack = m_stack.size();
+	if (onStack + (iterValue.is_valid() ? 1 : 0) != m_osrStackDepth) {
+		return;
+	}
+	for (auto cur = m_stack.begin(); cur != m_stack.end(); cur++) {
+		if (*cur != STACK_KIND_OBJECT) {
+			return;
+		}
+	}
+	for (auto cur = m_blockStack.begin(); cur != m_blockStack.end(); cur++) {
+		// Exception handlers keep their state differently from the interpreter
+		if (cur->Kind == END_FINALLY || cur->Kind == POP_EXCEPT) {
+			return;
+		}
+	}
+
+	auto skip = m_comp->emit_define_label();
+	m_comp->emit_branch(BranchAlways, skip);
+	m_comp->emit_mark_label(m_osrLabel);
+	for (size_t i = 0; i < m_osrStackDepth; i++) {
+		load_frame();
+		m_comp->emit_ptr(offsetof(PyFrameObject, f_valuestack));
+		m_comp->emit_add();
+		m_comp->emit_load_indirect_ptr();
+		m_comp->emit_ptr(i * sizeof(PyObject*));
+		m_comp->emit_add();
+		m_comp->emit_load_indirect_ptr();
+	}
+	if (iterValue.is_valid()) {
+		m_comp->emit_store_local(iterValue);
+	}
+	m_comp->emit_mark_label(skip);
+	m_osrEmitted = true;
+}
+
+bool AbstractInterpreter::is_generator() {
+    return (m_code->co_flags & (CO_GENERATOR | CO_COROUTINE)) != 0;
+}
+
+// Emits the start of a generator.  A generator which is being resumed has f_lasti
+// set to where it was suspended and we jump back into the code for that yield.
+void AbstractInterpreter::emit_resume_dispatch() {
+    load_frame();
+    m_comp->emit_call(PyJit_GenEnter);
+
+    auto start = m_comp->emit_define_label();
+    m_comp->emit_load_local(m_lasti);
+    m_comp->emit_load_indirect_int32();
+    m_comp->emit_int(-1);
+    m_comp->emit_branch(BranchEqual, start);
+
+    for (auto cur = m_resumePoints.begin(); cur != m_resumePoints.end(); cur++) {
+        auto resume = m_resumeLabels[*cur] = m_comp->emit_define_label();
+        m_comp->emit_load_local(m_lasti);
+        m_comp->emit_load_indirect_int32();
+        m_comp->emit_int(*cur);
+        m_comp->emit_branch(BranchEqual, resume);
+    }
+
+    emit_pyerr_setstring(PyExc_SystemError, "generator resumed at an unknown location");
+    branch_raise("unknown resume point");
+
+    m_comp->emit_mark_label(start);
+}
+
+// Gets the depth of the frame's value stack in the interpreter at this point.  We
+// keep the iterators for for loops in locals instead of on our stack.
+size_t AbstractInterpreter::frame_stack_level() {
+    size_t level = m_stack.size();
+    for (auto cur = m_blockStack.begin(); cur != m_blockStack.end(); cur++) {
+        if (cur->Kind == SETUP_LOOP && cur->LoopVar.is_valid()) {
+            level++;
+        }
+    }
+    return level;
+}
+
+// Locals which hold unboxed values live in our own locals rather than the frame.
+static bool is_unboxed(AbstractLocalInfo& local) {
+    if (local.ValueInfo.needs_boxing()) {
+        return false;
+    }
+    auto kind = local.ValueInfo.Value->kind();
+    return kind == AVK_Float || kind == AVK_Integer;
+}
+
+// Lists and tuples indexed by an int can take the index unboxed.
+static bool is_sequence_subscr(AbstractValueWithSources& container, AbstractValueWithSources& index) {
+    auto kind = container.Value->kind();
+    return (kind == AVK_List || kind == AVK_Tuple) && index.Value->kind() == AVK_Integer;
+}
+
+// Checks if we can save our state into the frame at a yield.  The frame needs to
+// look just like the interpreter would have left it, so that it can resume the
+// generator as well, which we can't do from within an exception handler.
+bool AbstractInterpreter::can_suspend(int opcodeIndex) {
+    for (auto cur = m_stack.begin(); cur != m_stack.end(); cur++) {
+        if (*cur != STACK_KIND_OBJECT) {
+            return false;
+        }
+    }
+    for (size_t i = 1; i < m_blockStack.size(); i++) {
+        auto kind = m_blockStack[i].Kind;
+        if (kind != SETUP_LOOP && kind != SETUP_EXCEPT && kind != SETUP_FINALLY) {
+            return false;
+        }
+    }
+    if (!m_baseline) {
+        auto& state = m_startStates[opcodeIndex];
+        for (size_t i = 0; i < state.local_count(); i++) {
+            auto local = state.get_local(i);
+            if (is_unboxed(local) && local.IsMaybeUndefined) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// Describes where each value on the frame's value stack lives while we're running.
+// Iterators for loops are in their loop variable and everything else (marked with
+// an invalid local) is on our stack.
+vector<Local> AbstractInterpreter::get_frame_layout() {
+    vector<Local> layout;
+    size_t onStack = 0;
+    for (size_t i = 1; i < m_blockStack.size(); i++) {
+        auto& block = m_blockStack[i];
+        if (block.Kind == SETUP_LOOP && block.LoopVar.is_valid()) {
+            while (layout.size() < block.FrameLevel) {
+                layout.push_back(Local());
+                onStack++;
+            }
+            layout.push_back(block.LoopVar);
+        }
+    }
+    for (; onStack < m_stack.size(); onStack++) {
+        layout.push_back(Local());
+    }
+    return layout;
+}
+
+// Pushes the address of an entry in the frame's value stack.
+void AbstractInterpreter::load_frame_stack_slot(size_t index) {
+    load_frame();
+    m_comp->emit_ptr(offsetof(PyFrameObject, f_valuestack));
+    m_comp->emit_add();
+    m_comp->emit_load_indirect_ptr();
+    m_comp->emit_ptr(index * sizeof(PyObject*));
+    m_comp->emit_add();
+}
+
+// Moves our stack and loop iterators into the frame's value stack, which takes
+// ownership of them.
+void AbstractInterpreter::emit_spill_to_frame(vector<Local>& layout) {
+    for (size_t i = layout.size(); i-- > 0; ) {
+        if (layout[i].is_valid()) {
+            load_frame_stack_slot(i);
+            m_comp->emit_load_local(layout[i]);
+        }
+        else {
+            auto value = m_comp->emit_spill();
+            load_frame_stack_slot(i);
+            m_comp->emit_load_and_free_local(value);
+        }
+        m_comp->emit_store_indirect_ptr();
+    }
+}
+
+// Takes back the values stored by emit_spill_to_frame.
+void AbstractInterpreter::emit_reload_from_frame(vector<Local>& layout) {
+    for (size_t i = 0; i < layout.size(); i++) {
+        load_frame_stack_slot(i);
+        m_comp->emit_load_indirect_ptr();
+        if (layout[i].is_valid()) {
+            m_comp->emit_store_local(layout[i]);
+        }
+    }
+}
+
+// Boxes the locals we're holding unboxed into the frame.
+void AbstractInterpreter::emit_spill_locals(int opcodeIndex) {
+    if (m_baseline) {
+        return;
+    }
+    auto& state = m_startStates[opcodeIndex];
+    for (size_t i = 0; i < state.local_count(); i++) {
+        auto local = state.get_local(i);
+        if (!is_unboxed(local)) {
+            continue;
+        }
+        if (local.ValueInfo.Value->kind() == AVK_Float) {
+            m_comp->emit_load_local(get_optimized_local(i, AVK_Float));
+            emit_box_float();
+        }
+        else {
+            m_comp->emit_load_local(get_optimized_local(i, AVK_Any));
+            emit_box_tagged_ptr();
+        }
+        error_check("box local failed");
+        emit_store_fast(i);
+    }
+}
+
+// Unboxes the locals stored by emit_spill_locals back into our locals.
+void AbstractInterpreter::emit_reload_locals(int opcodeIndex) {
+    if (m_baseline) {
+        return;
+    }
+    auto& state = m_startStates[opcodeIndex];
+    for (size_t i = 0; i < state.local_count(); i++) {
+        auto local = state.get_local(i);
+        if (!is_unboxed(local)) {
+            continue;
+        }
+        load_local(i);
+        if (local.ValueInfo.Value->kind() == AVK_Float) {
+            emit_unbox_float();
+            m_comp->emit_store_local(get_optimized_local(i, AVK_Float));
+        }
+        else {
+            emit_unbox_int_tagged();
+            m_comp->emit_dup();
+            emit_incref(true);
+            m_comp->emit_store_local(get_optimized_local(i, AVK_Any));
+        }
+    }
+}
+
+void AbstractInterpreter::emit_store_frame_int(size_t offset, int value) {
+    load_frame();
+    m_comp->emit_ptr(offset);
+    m_comp->emit_add();
+    m_comp->emit_int(value);
+    m_comp->emit_store_indirect_int32();
+}
+
+// Marks the frame as suspended with stackDepth values on its value stack.  The
+// blocks we're in are recorded the same way the interpreter does, so that it can
+// take over the generator, e.g. to throw an exception into it.
+void AbstractInterpreter::emit_suspend(size_t stackDepth, int resumePoint) {
+    int blockCount = 0;
+    for (size_t i = 1; i < m_blockStack.size(); i++, blockCount++) {
+        auto& block = m_blockStack[i];
+        auto offset = offsetof(PyFrameObject, f_blockstack) + blockCount * sizeof(PyTryBlock);
+        emit_store_frame_int(offset + offsetof(PyTryBlock, b_type), block.Kind);
+        emit_store_frame_int(offset + offsetof(PyTryBlock, b_handler), block.EndOffset);
+        emit_store_frame_int(offset + offsetof(PyTryBlock, b_level), (int)block.FrameLevel);
+    }
+    emit_store_frame_int(offsetof(PyFrameObject, f_iblock), blockCount);
+
+    load_frame();
+    m_comp->emit_ptr(offsetof(PyFrameObject, f_stacktop));
+    m_comp->emit_add();
+    load_frame_stack_slot(stackDepth);
+    m_comp->emit_store_indirect_ptr();
+
+    emit_lasti_update(resumePoint);
+}
+
+// Checks if a guard following the instruction at opcodeIndex can deoptimize,
+// which needs the same state as a yield does.  Guards which have failed too
+// often in code we've compiled before aren't used again.
+bool AbstractInterpreter::can_deopt(int opcodeIndex) {
+    if (m_baseline || is_generator() || m_osrEntry != -1) {
+        return false;
+    }
+    if (m_deopts != nullptr) {
+        auto count = m_deopts->find(opcodeIndex);
+        if (count != m_deopts->end() && count->second >= DEOPT_LIMIT) {
+            return false;
+        }
+    }
+    return can_suspend(opcodeIndex);
+}
+
+// Update the state for an instruction the interpreter runs for us, which the
+// rest of the frame runs in as well.  Everything on the stack is handed over to
+// the frame, and the following instructions are still analyzed so they can be
+// compiled for the other paths which reach them.
+void AbstractInterpreter::interpret_side_exit(InterpreterState& state, int opcode, int oparg) {
+    size_t depth = state.stack_size() + PyCompile_OpcodeStackEffect(opcode, oparg);
+    while (state.stack_size() != 0) {
+        state.pop();
+    }
+    while (state.stack_size() < depth) {
+        state.push(&Any);
+    }
+}
+
+// Checks if the instruction at opcodeIndex can be handed over to the interpreter.
+// Generators can't be resumed in jitted code once the interpreter has run them.
+bool AbstractInterpreter::can_side_exit(int opcodeIndex) {
+    return !is_generator() && m_osrEntry == -1 && can_suspend(opcodeIndex);
+}
+
+// Hands the frame over to the interpreter to run from the instruction at
+// opcodeIndex, which we can't compile, to the end.  The frame is left as it is
+// for a deopt, but suspended before the instruction rather than after it; the
+// compile stack then reflects the instruction's effect for the code which
+// follows, which is only reachable by other paths.
+void AbstractInterpreter::emit_side_exit(int opcodeIndex, int stackEffect) {
+    emit_spill_locals(opcodeIndex);
+
+    auto layout = get_frame_layout();
+    emit_spill_to_frame(layout);
+    for (size_t i = 1; i < m_blockStack.size(); i++) {
+        auto& block = m_blockStack[i];
+        if (block.Kind == SETUP_LOOP && block.LoopVar.is_valid() && block.Range != nullptr) {
+            emit_range_to_frame(block);
+        }
+    }
+    emit_suspend(layout.size(), opcodeIndex == 0 ? -1 : opcodeIndex - (int)sizeof(_Py_CODEUNIT));
+
+    load_frame();
+    m_comp->emit_call(PyJit_SideExit);
+    m_comp->emit_store_local(m_retValue);
+    m_comp->emit_branch(BranchLeave, m_retLabel);
 
-	m_comp->emit_dup();
-	m_comp->emit_null();
-	m_comp->emit_branch(BranchNotEqual, success);
-	m_comp->emit_pop();
-	m_comp->emit_load_local(sequence);
-	decref();
+    m_stack = vector<bool>(m_stack.size() + stackEffect, STACK_KIND_OBJECT);
 }
 
-void AbstractInterpreter::decref() {
-	m_comp->emit_call(PyJit_DecRef);
-	// It might be nice to inline this at some point:
-	//LD_FIELDA(PyObject, ob_refcnt);
-	//m_il.push_back(CEE_DUP);
-	//m_il.push_back(CEE_LDIND_I4);
-	//m_il.push_back(CEE_LDC_I4_1);
-	//m_il.push_back(CEE_SUB);
-	////m_il.push_back(CEE_DUP);
-	//// _Py_Dealloc(_py_decref_tmp)
+// Bails out to the interpreter when the guard following the instruction at
+// opcodeIndex fails, which must not have changed any locals.  The frame is
+// left just as a yield would leave it, with ranges we're counting natively
+// turned back into iterators, and the interpreter finishes running it from
+// the next instruction.
+void AbstractInterpreter::emit_deopt(int opcodeIndex) {
+    emit_spill_locals(opcodeIndex);
 
-	//m_il.push_back(CEE_STIND_I4);
+    auto layout = get_frame_layout();
+    emit_spill_to_frame(layout);
+    for (size_t i = 1; i < m_blockStack.size(); i++) {
+        auto& block = m_blockStack[i];
+        if (block.Kind == SETUP_LOOP && block.LoopVar.is_valid() && block.Range != nullptr) {
+            emit_range_to_frame(block);
+        }
+    }
+    emit_suspend(layout.size(), opcodeIndex);
+
+    load_frame();
+    m_comp->emit_call(PyJit_Deopt);
+    m_comp->emit_store_local(m_retValue);
+    m_comp->emit_branch(BranchLeave, m_retLabel);
 }
 
+// Replaces the range a loop's iterator slot in the frame holds with an iterator
+// for the rest of the range.  Failures leave NULL in the slot for PyJit_Deopt
+// to report.
+void AbstractInterpreter::emit_range_to_frame(BlockInfo& block) {
+    auto notRange = m_comp->emit_define_label();
+    m_comp->emit_load_local(block.Range->Step);
+    m_comp->emit_ptr((size_t)0);
+    m_comp->emit_branch(BranchEqual, notRange);
 
-void AbstractInterpreter::emit_push_frame() {
-	load_frame();
-	m_comp->emit_call(PyJit_PushFrame);
+    load_frame_stack_slot(block.FrameLevel);
+    m_comp->emit_load_local(block.LoopVar);
+    m_comp->emit_load_local(block.Range->Current);
+    m_comp->emit_load_local(block.Range->Step);
+    m_comp->emit_load_local(block.Range->Remaining);
+    m_comp->emit_call(PyJit_RangeIterRemaining);
+    m_comp->emit_store_indirect_ptr();
+
+    m_comp->emit_mark_label(notRange);
 }
 
-void AbstractInterpreter::emit_pop_frame() {
-	load_frame();
-	m_comp->emit_call(PyJit_PopFrame);
+void AbstractInterpreter::emit_get_yield_from_iter() {
+    m_comp->emit_int((m_code->co_flags & (CO_COROUTINE | CO_ITERABLE_COROUTINE)) ? 1 : 0);
+    m_comp->emit_call(PyJit_GetYieldFromIter);
+}
+
+void AbstractInterpreter::emit_get_awaitable() {
+    m_comp->emit_call(PyJit_GetAwaitable);
 }
 
 void AbstractInterpreter::emit_eh_trace() {
@@ -991,21 +2574,17 @@ void AbstractInterpreter::emit_incref(bool maybeTagged) {
 }
 
 AbstractInterpreter::~AbstractInterpreter() {
-    // clean up any dynamically allocated objects...
 	delete m_comp;
-    for (auto source : m_sources) {
-        delete source;
-    }
-    for (auto absValue : m_values) {
-        delete absValue;
-    }
+	for (auto cur = m_inlinedCode.begin(); cur != m_inlinedCode.end(); cur++) {
+		Py_DECREF(*cur);
+	}
 }
 
 bool AbstractInterpreter::preprocess() {
-    if (m_code->co_flags & (CO_COROUTINE | CO_GENERATOR)) {
-        // Don't compile co-routines or generators.  We can't rely on
-        // detecting yields because they could be optimized out.
-        return false;
+    if (m_code->co_flags & CO_ASYNC_GENERATOR) {
+        // Async generators wrap the values they yield with an object the runtime
+        // doesn't expose to us.
+        return fail("async generator");
     }
     for (int i = 0; i < m_code->co_argcount; i++) {
         // all parameters are initially definitely assigned
@@ -1014,6 +2593,7 @@ bool AbstractInterpreter::preprocess() {
 
     int oparg;
     vector<bool> ehKind;
+    vector<size_t> handlerStarts;
     vector<AbsIntBlockInfo> blockStarts;
     for (size_t curByte = 0; curByte < m_size; curByte += sizeof(_Py_CODEUNIT)) {
         auto opcodeIndex = curByte;
@@ -1047,9 +2627,14 @@ bool AbstractInterpreter::preprocess() {
                 byte = GET_OPCODE(curByte);
                 goto processOpCode;
             }
-            case YIELD_FROM:
             case YIELD_VALUE:
-                return false;
+                m_resumePoints.push_back(curByte);
+                break;
+            case YIELD_FROM:
+                // The interpreter suspends a yield from with f_lasti at the previous
+                // instruction so that it re-runs the YIELD_FROM when it's resumed.
+                m_resumePoints.push_back(curByte - sizeof(_Py_CODEUNIT));
+                break;
 
             case UNPACK_EX:
                 if (m_comp != nullptr) {
@@ -1057,10 +2642,11 @@ bool AbstractInterpreter::preprocess() {
                 }
                 break;
             case BUILD_STRING:
+            case BUILD_CONST_KEY_MAP:
             case UNPACK_SEQUENCE:
                 // we need a buffer for the slow case, but we need 
                 // to avoid allocating it in loops.
-                if (m_comp != nullptr) {
+                if (m_comp != nullptr && !m_unpackedTuples.contains(curByte)) {
                     m_sequenceLocals[curByte] = m_comp->emit_allocate_stack_array(oparg * sizeof(void*));
                 }
                 break;
@@ -1070,78 +2656,460 @@ bool AbstractInterpreter::preprocess() {
                     m_assignmentState[oparg] = false;
                 }
                 break;
-            case SETUP_WITH:
-                // not supported...
-                return false;
             case SETUP_LOOP:
                 blockStarts.push_back(AbsIntBlockInfo(opcodeIndex, oparg + curByte + sizeof(_Py_CODEUNIT), true));
                 break;
-            case POP_BLOCK:
-            {
-                auto blockStart = blockStarts.back();
-                blockStarts.pop_back();
-                m_blockStarts[opcodeIndex] = blockStart.BlockStart;
+            case POP_BLOCK:
+            {
+                auto blockStart = blockStarts.back();
+                blockStarts.pop_back();
+                m_blockStarts[opcodeIndex] = blockStart.BlockStart;
+                break;
+            }
+            case SETUP_EXCEPT:
+                blockStarts.push_back(AbsIntBlockInfo(opcodeIndex, oparg + curByte + sizeof(_Py_CODEUNIT), false));
+                ehKind.push_back(false);
+                handlerStarts.push_back(oparg + curByte + sizeof(_Py_CODEUNIT));
+                break;
+            case SETUP_WITH:
+            case SETUP_FINALLY:
+                blockStarts.push_back(AbsIntBlockInfo(opcodeIndex, oparg + curByte + sizeof(_Py_CODEUNIT), false));
+                ehKind.push_back(true);
+                handlerStarts.push_back(oparg + curByte + sizeof(_Py_CODEUNIT));
+                break;
+            case END_FINALLY:
+                m_endFinallyIsFinally[opcodeIndex] = ehKind.back();
+                ehKind.pop_back();
+                // The handler runs from its target to here
+                if (handlerStarts.size() != 0) {
+                    for (auto handler = handlerStarts.back(); handler <= curByte; handler += sizeof(_Py_CODEUNIT)) {
+                        m_handlerCode[handler] = true;
+                    }
+                    handlerStarts.pop_back();
+                }
+                break;
+            case BREAK_LOOP:
+                for (auto iter = blockStarts.rbegin(); iter != blockStarts.rend(); ++iter) {
+                    if (iter->IsLoop) {
+                        m_breakTo[opcodeIndex] = *iter;
+                        break;
+                    }
+                }
+                break;
+            case LOAD_GLOBAL:
+            {
+                auto name = PyUnicode_AsUTF8(PyTuple_GetItem(m_code->co_names, oparg));
+                if (!strcmp(name, "vars") || 
+                    !strcmp(name, "dir") || 
+                    !strcmp(name, "locals") || 
+                    !strcmp(name, "eval")) {
+                    // In the future we might be able to do better, e.g. keep locals in fast locals,
+                    // but for now this is a known limitation that if you load vars/dir we won't
+                    // optimize your code, and if you alias them you won't get the correct behavior.
+                    // Longer term we should patch vars/dir/_getframe and be able to provide the
+                    // correct values from generated code.  For now the frame goes back to
+                    // the interpreter before the load.
+                    m_sideExits[curByte] = "uses vars, dir, locals or eval";
+                }
+            }
+            break;
+            case JUMP_FORWARD:
+                m_jumpsTo.insert(oparg + curByte + sizeof(_Py_CODEUNIT));
+                break;
+            case JUMP_ABSOLUTE:
+                if (oparg <= opcodeIndex) {
+                    m_loopHeads.insert(oparg);
+                }
+                m_jumpsTo.insert(oparg);
+                break;
+            case JUMP_IF_FALSE_OR_POP:
+            case JUMP_IF_TRUE_OR_POP:
+            case POP_JUMP_IF_TRUE:
+            case POP_JUMP_IF_FALSE:
+                m_jumpsTo.insert(oparg);
+                break;
+
+        }
+    }
+
+    find_temporaries();
+    find_borrowed_loads();
+    if ((m_attrCaches != nullptr || m_globals != nullptr) && !is_generator()) {
+        find_calls();
+    }
+    return true;
+}
+
+// Finds the tuples and slices which are consumed by the very next instruction,
+// e.g. for a, b, c, d = d, c, b, a or s[i:j], so that they don't need to be
+// built at all.  Also finds subscripts with constant str keys, e.g. d['name'],
+// and adds which are stored straight to a local, e.g. s += t.
+void AbstractInterpreter::find_temporaries() {
+    int prevOp = 0;
+    size_t prevByte = 0, prevArg = 0;
+    for (size_t curByte = 0; curByte < m_size; curByte += sizeof(_Py_CODEUNIT)) {
+        auto opcodeIndex = curByte;
+        auto byte = GET_OPCODE(curByte);
+        size_t oparg = GET_OPARG(curByte);
+        while (byte == EXTENDED_ARG) {
+            curByte += sizeof(_Py_CODEUNIT);
+            oparg = (oparg << 8) | GET_OPARG(curByte);
+            byte = GET_OPCODE(curByte);
+        }
+
+        if (m_jumpsTo.find(opcodeIndex) == m_jumpsTo.end()) {
+            if (prevOp == BUILD_TUPLE && byte == UNPACK_SEQUENCE && prevArg == oparg) {
+                m_unpackedTuples[prevByte] = true;
+                m_unpackedTuples[curByte] = true;
+            }
+            else if (prevOp == BUILD_SLICE && prevArg == 2 && (byte == BINARY_SUBSCR || byte == STORE_SUBSCR)) {
+                m_slicedSubscrs[prevByte] = true;
+                m_slicedSubscrs[curByte] = true;
+            }
+            else if (prevOp == LOAD_CONST && (byte == BINARY_SUBSCR || byte == STORE_SUBSCR)) {
+                auto key = PyTuple_GetItem(m_code->co_consts, prevArg);
+                if (PyUnicode_CheckExact(key)) {
+                    m_strSubscrs[curByte] = key;
+                }
+            }
+            else if ((prevOp == BINARY_ADD || prevOp == INPLACE_ADD) && byte == STORE_FAST) {
+                m_concatLocals[prevByte] = oparg;
+            }
+        }
+        prevOp = byte;
+        prevByte = curByte;
+        prevArg = oparg;
+    }
+}
+
+static bool is_borrowing_load(int opcode) {
+    return opcode == LOAD_FAST || opcode == LOAD_CONST;
+}
+
+// Finds the loads which are consumed by the very next binary operation or
+// comparison, e.g. both of the loads in x + 1.  Fast locals and constants stay
+// alive until the operation is done, so it can borrow them.
+void AbstractInterpreter::find_borrowed_loads() {
+    size_t prevIndex[2] = { 0, 0 };
+    int prevOp[2] = { 0, 0 };
+    bool prevTarget = false;
+    for (size_t curByte = 0; curByte < m_size; curByte += sizeof(_Py_CODEUNIT)) {
+        auto opcodeIndex = curByte;
+        auto byte = GET_OPCODE(curByte);
+        size_t oparg = GET_OPARG(curByte);
+        while (byte == EXTENDED_ARG) {
+            curByte += sizeof(_Py_CODEUNIT);
+            oparg = (oparg << 8) | GET_OPARG(curByte);
+            byte = GET_OPCODE(curByte);
+        }
+
+        bool isTarget = m_jumpsTo.find(opcodeIndex) != m_jumpsTo.end();
+        bool borrows;
+        switch (byte) {
+            case BINARY_SUBSCR:
+            case BINARY_ADD:
+            case BINARY_TRUE_DIVIDE:
+            case BINARY_FLOOR_DIVIDE:
+            case BINARY_POWER:
+            case BINARY_MODULO:
+            case BINARY_MATRIX_MULTIPLY:
+            case BINARY_LSHIFT:
+            case BINARY_RSHIFT:
+            case BINARY_AND:
+            case BINARY_XOR:
+            case BINARY_OR:
+            case BINARY_MULTIPLY:
+            case BINARY_SUBTRACT:
+            case INPLACE_POWER:
+            case INPLACE_MULTIPLY:
+            case INPLACE_MATRIX_MULTIPLY:
+            case INPLACE_TRUE_DIVIDE:
+            case INPLACE_FLOOR_DIVIDE:
+            case INPLACE_MODULO:
+            case INPLACE_ADD:
+            case INPLACE_SUBTRACT:
+            case INPLACE_LSHIFT:
+            case INPLACE_RSHIFT:
+            case INPLACE_AND:
+            case INPLACE_XOR:
+            case INPLACE_OR:
+                borrows = true;
+                break;
+            case COMPARE_OP:
+                // Only comparisons which end up in PyJit_RichCompare
+                borrows = oparg <= Py_GE && !(oparg == Py_EQ && can_optimize_pop_jump(opcodeIndex));
+                break;
+            default:
+                borrows = false;
+                break;
+        }
+
+        if (borrows && !isTarget && is_borrowing_load(prevOp[1])) {
+            m_borrowedLoads[prevIndex[1]] = BorrowedLoad{ curByte, BORROWED_RIGHT };
+            if (!prevTarget && is_borrowing_load(prevOp[0])) {
+                m_borrowedLoads[prevIndex[0]] = BorrowedLoad{ curByte, BORROWED_LEFT };
+            }
+        }
+
+        prevIndex[0] = prevIndex[1];
+        prevOp[0] = prevOp[1];
+        prevIndex[1] = opcodeIndex;
+        prevOp[1] = byte;
+        prevTarget = isTarget;
+    }
+}
+
+// Checks if the value loaded at opcodeIndex can be borrowed by the instruction
+// consuming it, which it can if that's going to call one of the _Borrowed
+// helpers with it.  The consumer is told that the value was borrowed.
+bool AbstractInterpreter::can_borrow(size_t opcodeIndex) {
+    auto load = m_borrowedLoads.find(opcodeIndex);
+    if (load == nullptr || !should_box(load->Consumer)) {
+        return false;
+    }
+    m_borrowedArgs[load->Consumer] |= load->Arg;
+    return true;
+}
+
+// Finds the values which are only ever called, i.e. o.m(args) or f(args), where
+// the arguments are computed by straight line code that nothing else jumps into.
+// Method loads are paired with their calls, and calls to small functions found
+// in the globals are inlined.
+void AbstractInterpreter::find_calls() {
+    unordered_set<size_t> jumpTargets;
+    for (size_t curByte = 0; curByte < m_size; curByte += sizeof(_Py_CODEUNIT)) {
+        auto byte = GET_OPCODE(curByte);
+        size_t oparg = GET_OPARG(curByte);
+        while (byte == EXTENDED_ARG) {
+            curByte += sizeof(_Py_CODEUNIT);
+            oparg = (oparg << 8) | GET_OPARG(curByte);
+            byte = GET_OPCODE(curByte);
+        }
+        switch (byte) {
+            case JUMP_FORWARD:
+            case FOR_ITER:
+            case SETUP_LOOP:
+            case SETUP_EXCEPT:
+            case SETUP_FINALLY:
+            case SETUP_WITH:
+            case SETUP_ASYNC_WITH:
+                jumpTargets.insert(oparg + curByte + sizeof(_Py_CODEUNIT));
+                break;
+            case JUMP_ABSOLUTE:
+            case CONTINUE_LOOP:
+            case JUMP_IF_FALSE_OR_POP:
+            case JUMP_IF_TRUE_OR_POP:
+            case POP_JUMP_IF_TRUE:
+            case POP_JUMP_IF_FALSE:
+                jumpTargets.insert(oparg);
+                break;
+        }
+    }
+
+    for (size_t curByte = 0; curByte < m_size; curByte += sizeof(_Py_CODEUNIT)) {
+        auto loadIndex = curByte;
+        auto byte = GET_OPCODE(curByte);
+        size_t oparg = GET_OPARG(curByte);
+        while (byte == EXTENDED_ARG) {
+            curByte += sizeof(_Py_CODEUNIT);
+            oparg = (oparg << 8) | GET_OPARG(curByte);
+            byte = GET_OPCODE(curByte);
+        }
+
+        size_t callIndex, argCnt;
+        if (byte == LOAD_ATTR && m_attrCaches != nullptr) {
+            // Functions from modules we know about are called like builtins
+            if (find_module_attr(curByte, oparg) == nullptr && find_call(curByte, jumpTargets, callIndex, argCnt)) {
+                m_methodLoads[loadIndex] = true;
+                m_methodCalls[callIndex] = true;
+                m_methodLoadCount++;
+            }
+        }
+        else if (byte == LOAD_GLOBAL && m_globals != nullptr) {
+            if (find_call(curByte, jumpTargets, callIndex, argCnt)) {
+                auto callee = PyDict_GetItem(m_globals, PyTuple_GET_ITEM(m_code->co_names, oparg));
+                if (callee != nullptr && can_inline(callee, argCnt)) {
+                    auto code = PyFunction_GET_CODE(callee);
+                    Py_INCREF(code);
+                    m_inlinedCode.push_back(code);
+                    m_inlinedCalls[callIndex] = (PyCodeObject*)code;
+                }
+            }
+        }
+    }
+}
+
+// Finds the CALL_FUNCTION which calls the value pushed by the instruction at
+// curByte, storing the offset of its first prefix in callIndex and the number
+// of arguments it's called with in argCnt.
+bool AbstractInterpreter::find_call(size_t curByte, unordered_set<size_t>& jumpTargets, size_t& callIndex, size_t& argCnt) {
+    // Track how many values are on the stack above the value, until we
+    // find the call which consumes it or anything we can't follow.
+    size_t depth = 0;
+    for (size_t scan = curByte + sizeof(_Py_CODEUNIT); scan < m_size; scan += sizeof(_Py_CODEUNIT)) {
+        auto scanIndex = scan;
+        if (jumpTargets.find(scanIndex) != jumpTargets.end()) {
+            break;
+        }
+        auto scanOp = GET_OPCODE(scan);
+        size_t scanArg = GET_OPARG(scan);
+        while (scanOp == EXTENDED_ARG) {
+            scan += sizeof(_Py_CODEUNIT);
+            scanArg = (scanArg << 8) | GET_OPARG(scan);
+            scanOp = GET_OPCODE(scan);
+        }
+        if (m_sideExits.contains(scan)) {
+            // The interpreter needs the stack as it would have built it
+            break;
+        }
+
+        size_t pops;
+        switch (scanOp) {
+            case LOAD_CONST:
+            case LOAD_FAST:
+            case LOAD_GLOBAL:
+            case LOAD_NAME:
+            case LOAD_DEREF:
+            case LOAD_CLOSURE:
+            case LOAD_CLASSDEREF:
+                pops = 0;
+                break;
+            case LOAD_ATTR:
+            case UNARY_POSITIVE:
+            case UNARY_NEGATIVE:
+            case UNARY_NOT:
+            case UNARY_INVERT:
+                pops = 1;
+                break;
+            case BINARY_POWER:
+            case BINARY_MULTIPLY:
+            case BINARY_MATRIX_MULTIPLY:
+            case BINARY_FLOOR_DIVIDE:
+            case BINARY_TRUE_DIVIDE:
+            case BINARY_MODULO:
+            case BINARY_ADD:
+            case BINARY_SUBTRACT:
+            case BINARY_LSHIFT:
+            case BINARY_RSHIFT:
+            case BINARY_AND:
+            case BINARY_XOR:
+            case BINARY_OR:
+            case BINARY_SUBSCR:
+            case COMPARE_OP:
+                pops = 2;
+                break;
+            case BUILD_TUPLE:
+            case BUILD_LIST:
+            case BUILD_SET:
+            case BUILD_STRING:
+            case BUILD_SLICE:
+                pops = scanArg;
+                break;
+            case BUILD_MAP:
+                pops = scanArg * 2;
+                break;
+            case FORMAT_VALUE:
+                pops = (scanArg & FVS_MASK) == FVS_HAVE_SPEC ? 2 : 1;
+                break;
+            case CALL_FUNCTION:
+                if (scanArg == depth) {
+                    callIndex = scanIndex;
+                    argCnt = scanArg;
+                    return true;
+                }
+                pops = scanArg + 1;
                 break;
-            }
-            case SETUP_EXCEPT:
-                blockStarts.push_back(AbsIntBlockInfo(opcodeIndex, oparg + curByte + sizeof(_Py_CODEUNIT), false));
-                ehKind.push_back(false);
+            case CALL_FUNCTION_KW:
+                pops = scanArg + 2;
                 break;
-            case SETUP_FINALLY:
-                blockStarts.push_back(AbsIntBlockInfo(opcodeIndex, oparg + curByte + sizeof(_Py_CODEUNIT), false));
-                ehKind.push_back(true);
+            default:
+                pops = SIZE_MAX;
                 break;
-            case END_FINALLY:
-                m_endFinallyIsFinally[opcodeIndex] = ehKind.back();
-                ehKind.pop_back();
+        }
+        if (pops > depth) {
+            break;
+        }
+        depth = depth - pops + 1;
+    }
+    return false;
+}
+
+// Checks if callee is a function simple enough to be inlined into a call with
+// argCnt arguments.  It needs to compute its result from its arguments and
+// constants with straight line code, as running it needs nothing but the
+// values we have on the stack: there's no frame or globals.
+bool AbstractInterpreter::can_inline(PyObject* callee, size_t argCnt) {
+    if (!PyFunction_Check(callee)) {
+        return false;
+    }
+    auto code = (PyCodeObject*)PyFunction_GET_CODE(callee);
+    if (code->co_flags != (CO_OPTIMIZED | CO_NEWLOCALS | CO_NOFREE) ||
+        code->co_argcount != argCnt ||
+        code->co_kwonlyargcount != 0 ||
+        code->co_nlocals != code->co_argcount) {
+        return false;
+    }
+
+    auto byteCode = (_Py_CODEUNIT *)PyBytes_AS_STRING(code->co_code);
+    auto size = PyBytes_GET_SIZE(code->co_code) / sizeof(_Py_CODEUNIT);
+    if (size > MAX_INLINE_SIZE) {
+        return false;
+    }
+
+    size_t depth = 0;
+    for (size_t i = 0; i < size; i++) {
+        auto oparg = _Py_OPARG(byteCode[i]);
+        switch (_Py_OPCODE(byteCode[i])) {
+            case LOAD_FAST:
+            case LOAD_CONST:
+                depth++;
                 break;
-            case BREAK_LOOP:
-                for (auto iter = blockStarts.rbegin(); iter != blockStarts.rend(); ++iter) {
-                    if (iter->IsLoop) {
-                        m_breakTo[opcodeIndex] = *iter;
-                        break;
-                    }
-                }
+            case UNARY_POSITIVE:
+            case UNARY_NEGATIVE:
+            case UNARY_INVERT:
                 break;
-            case LOAD_GLOBAL:
-            {
-                auto name = PyUnicode_AsUTF8(PyTuple_GetItem(m_code->co_names, oparg));
-                if (!strcmp(name, "vars") || 
-                    !strcmp(name, "dir") || 
-                    !strcmp(name, "locals") || 
-                    !strcmp(name, "eval")) {
-                    // In the future we might be able to do better, e.g. keep locals in fast locals,
-                    // but for now this is a known limitation that if you load vars/dir we won't
-                    // optimize your code, and if you alias them you won't get the correct behavior.
-                    // Longer term we should patch vars/dir/_getframe and be able to provide the
-                    // correct values from generated code.
+            case COMPARE_OP:
+                if (oparg >= PyCmp_IN) {
                     return false;
                 }
-            }
-            break;
-            case JUMP_FORWARD:
-                m_jumpsTo.insert(oparg + curByte + sizeof(_Py_CODEUNIT));
-                break;
-            case JUMP_ABSOLUTE:
-            case JUMP_IF_FALSE_OR_POP:
-            case JUMP_IF_TRUE_OR_POP:
-            case POP_JUMP_IF_TRUE:
-            case POP_JUMP_IF_FALSE:
-                m_jumpsTo.insert(oparg);
+                // fall through
+            case BINARY_POWER:
+            case BINARY_MULTIPLY:
+            case BINARY_MATRIX_MULTIPLY:
+            case BINARY_FLOOR_DIVIDE:
+            case BINARY_TRUE_DIVIDE:
+            case BINARY_MODULO:
+            case BINARY_ADD:
+            case BINARY_SUBTRACT:
+            case BINARY_LSHIFT:
+            case BINARY_RSHIFT:
+            case BINARY_AND:
+            case BINARY_XOR:
+            case BINARY_OR:
+            case BINARY_SUBSCR:
+                depth--;
                 break;
-
+            case RETURN_VALUE:
+                // Only a single return at the very end
+                return i == size - 1 && depth == 1;
+            default:
+                return false;
         }
     }
-    return true;
+    return false;
 }
 
 void AbstractInterpreter::set_local_type(int index, AbstractValueKind kind) {
+    if (is_generator()) {
+        // Generators can be resumed after their arguments have been rebound
+        return;
+    }
     auto& lastState = m_startStates[0];
-    if (kind == AVK_Integer || kind == AVK_Float) {
+    if (kind != AVK_Any) {
         // Replace our starting state with a local which has a known source
         // so that we know it's boxed...
         auto localInfo = AbstractLocalInfo(to_abstract(kind));
-        localInfo.ValueInfo.Sources = new_source(new LocalSource());
+        localInfo.ValueInfo.Sources = new_source<LocalSource>();
         lastState.replace_local(index, localInfo);
     }
 }
@@ -1172,7 +3140,10 @@ void AbstractInterpreter::init_starting_state() {
 }
 
 bool AbstractInterpreter::interpret() {
-    if (!preprocess()) {
+    auto start = pyjit_now();
+    bool preprocessed = preprocess();
+    m_stats.preprocessTime = pyjit_now() - start;
+    if (!preprocessed) {
         return false;
     }
 
@@ -1186,7 +3157,7 @@ bool AbstractInterpreter::interpret() {
         queue.pop_front();
         for (size_t curByte = cur; curByte < m_size; curByte += sizeof(_Py_CODEUNIT)) {
             // get our starting state when we entered this opcode
-            InterpreterState lastState = m_startStates.find(curByte)->second;
+            InterpreterState lastState = m_startStates[curByte];
 
             auto opcodeIndex = curByte;
 
@@ -1194,6 +3165,11 @@ bool AbstractInterpreter::interpret() {
             oparg = GET_OPARG(curByte);
 
         processOpCode:
+            if (opcode != EXTENDED_ARG && m_sideExits.contains(curByte)) {
+                interpret_side_exit(lastState, opcode, oparg);
+                update_start_state(lastState, curByte + sizeof(_Py_CODEUNIT));
+                continue;
+            }
             switch (opcode) {
                 case EXTENDED_ARG:
                 {
@@ -1329,6 +3305,14 @@ bool AbstractInterpreter::interpret() {
                 {
                     auto two = lastState.pop_no_escape();
                     auto one = lastState.pop_no_escape();
+                    if (opcode == BINARY_SUBSCR && is_sequence_subscr(one, two)) {
+                        // The index can stay unboxed as we'll read the item
+                        // directly, the item itself can be anything.
+                        one.escapes();
+                        AbstractSource::combine(two.Sources, add_intermediate_source(opcodeIndex));
+                        lastState.push(&Any);
+                        break;
+                    }
                     auto binaryRes = one.Value->binary(one.Sources, opcode, two);
 
                     // create an intermediate source which will propagate changes up...
@@ -1445,23 +3429,48 @@ bool AbstractInterpreter::interpret() {
                     lastState.pop();
                     break;
                 case DELETE_NAME:
+                case DELETE_GLOBAL:
+                    break;
+                case PRINT_EXPR:
+                case IMPORT_STAR:
+                    lastState.pop();
                     break;
                 case LOAD_CLASSDEREF:
                     lastState.push(&Any);
                     break;
                 case LOAD_GLOBAL:
-                    // TODO: Look in globals, then builtins, and see if we can resolve
-                    // this to anything concrete.
-                    lastState.push(&Any);
+                {
+                    // Well known builtins are speculated from their names, we can't
+                    // know what other globals will hold.
+                    auto builtin = BuiltinValue::find(PyUnicode_AsUTF8(PyTuple_GetItem(m_code->co_names, oparg)));
+                    if (builtin != nullptr) {
+                        lastState.push(builtin);
+                    }
+                    else {
+                        lastState.push(&Any);
+                    }
                     break;
+                }
                 case STORE_GLOBAL:
                     lastState.pop();
                     break;
                 case LOAD_ATTR:
+                {
                     // TODO: Add support for resolving known members of known types
                     lastState.pop();
-                    lastState.push(&Any);
+                    auto attr = find_module_attr(curByte, oparg);
+                    if (attr != nullptr) {
+                        lastState.push(attr);
+                    }
+                    else {
+                        lastState.push(&Any);
+                    }
+                    if (m_methodLoads.contains(opcodeIndex)) {
+                        // self, which the call will consume
+                        lastState.push(&Any);
+                    }
                     break;
+                }
                 case STORE_ATTR:
                     lastState.pop();
                     lastState.pop();
@@ -1479,6 +3488,18 @@ bool AbstractInterpreter::interpret() {
                 case BUILD_TUPLE:
                 case BUILD_TUPLE_UNPACK:
                 {
+                    if (m_unpackedTuples.contains(curByte)) {
+                        // The values are pushed straight back in the order they'd
+                        // be unpacked, so they don't escape.
+                        vector<AbstractValueWithSources> values;
+                        for (int i = 0; i < oparg; i++) {
+                            values.push_back(lastState.pop_no_escape());
+                        }
+                        for (auto cur = values.begin(); cur != values.end(); cur++) {
+                            lastState.push(*cur);
+                        }
+                        break;
+                    }
                     vector<AbstractValueWithSources> sources;
                     for (int i = 0; i < oparg; i++) {
                         lastState.pop();
@@ -1559,6 +3580,13 @@ bool AbstractInterpreter::interpret() {
                     int argCnt = oparg & 0xff;
                     int kwArgCnt = (oparg >> 8) & 0xff;
 
+                    if (kwArgCnt == 0 && interpret_intrinsic_call(lastState, opcodeIndex, curByte, argCnt)) {
+                        break;
+                    }
+                    // The arguments of inlined calls are boxed, but we know what
+                    // they're called with
+                    auto inlinedResult = find_inlined_result(lastState, opcodeIndex, curByte, argCnt);
+
                     for (int i = 0; i < argCnt; i++) {
                         lastState.pop();
                     }
@@ -1567,14 +3595,20 @@ bool AbstractInterpreter::interpret() {
                         lastState.pop();
                     }
 
-                    // TODO: If the function was a known quantity we could
-                    // abstract interpret it here with the known args, and
-                    // potentially consider inlining it.
-
                     // pop the function...
                     lastState.pop();
+                    if (m_methodCalls.contains(opcodeIndex)) {
+                        // ...and self
+                        lastState.pop();
+                    }
 
-                    lastState.push(&Any);
+                    if (inlinedResult != nullptr) {
+                        // Like an intrinsic the result stays unboxed unless it escapes
+                        lastState.push(AbstractValueWithSources(inlinedResult, add_intermediate_source(opcodeIndex)));
+                    }
+                    else {
+                        lastState.push(&Any);
+                    }
                     break;
                 }
 				case CALL_FUNCTION_KW:
@@ -1675,6 +3709,10 @@ bool AbstractInterpreter::interpret() {
                     }
                     break;
                 case UNPACK_SEQUENCE:
+                    if (m_unpackedTuples.contains(curByte)) {
+                        // The BUILD_TUPLE already left the values to be unpacked
+                        break;
+                    }
                     // TODO: If the sequence is a known type we could know what types we're pushing here.
                     lastState.pop();
                     for (int i = 0; i < oparg; i++) {
@@ -1687,11 +3725,19 @@ bool AbstractInterpreter::interpret() {
                     }
                     goto next;
                 case STORE_SUBSCR:
+                {
                     // TODO: Do we want to track types on store for lists?
+                    auto index = lastState.pop_no_escape();
+                    auto container = lastState.pop();
                     lastState.pop();
-                    lastState.pop();
-                    lastState.pop();
+                    if (container->kind() == AVK_List && index.Value->kind() == AVK_Integer) {
+                        AbstractSource::combine(index.Sources, add_intermediate_source(opcodeIndex));
+                    }
+                    else {
+                        index.escapes();
+                    }
                     break;
+                }
                 case DELETE_SUBSCR:
                     lastState.pop();
                     lastState.pop();
@@ -1720,6 +3766,27 @@ bool AbstractInterpreter::interpret() {
                     lastState.pop();
                     lastState.push(&Any);
                     break;
+                case GET_YIELD_FROM_ITER:
+                case GET_AWAITABLE:
+                    lastState.pop();
+                    lastState.push(&Any);
+                    break;
+                case YIELD_VALUE:
+                case YIELD_FROM:
+                {
+                    // Everything left on the stack gets stored in the frame while
+                    // we're suspended, so it needs to be boxed.
+                    for (auto cur = lastState.m_stack.begin(); cur != lastState.m_stack.end(); cur++) {
+                        cur->escapes();
+                    }
+                    lastState.pop();
+                    if (opcode == YIELD_FROM) {
+                        lastState.pop();
+                    }
+                    // The value which is sent in
+                    lastState.push(&Any);
+                    break;
+                }
                 case FOR_ITER:
                 {
                     // For branches out with the value consumed
@@ -1732,7 +3799,14 @@ bool AbstractInterpreter::interpret() {
                     // When we compile this we don't actually leave the value on the stack,
                     // but the sequence of opcodes assumes that happens.  to keep our stack
                     // properly balanced we match what's really going on.
-                    lastState.push(&Any);
+                    if (is_typed_range_loop(opcodeIndex)) {
+                        // The counter only needs boxing if the loop variable escapes
+                        m_typedRangeLoops[opcodeIndex] = true;
+                        lastState.push(AbstractValueWithSources(&Integer, add_intermediate_source(opcodeIndex)));
+                    }
+                    else {
+                        lastState.push(&Any);
+                    }
 
                     break;
                 }
@@ -1841,23 +3915,47 @@ bool AbstractInterpreter::interpret() {
                     lastState.push(&String);
                     break;
                 case SETUP_WITH:
-                case YIELD_VALUE:
-                    return false;
-                case BUILD_TUPLE_UNPACK_WITH_CALL:
-                case BUILD_MAP_UNPACK_WITH_CALL:
-                    return false;
+                {
+                    // The context manager is replaced with its __exit__ method, which
+                    // stays on the stack for the finally portion of the block
+                    lastState.pop();
+                    lastState.push(&Any);
+
+                    auto finallyState = lastState;
+                    finallyState.push(&Any);
+                    if (update_start_state(finallyState, (size_t)oparg + curByte + sizeof(_Py_CODEUNIT))) {
+                        queue.push_back((size_t)oparg + curByte + sizeof(_Py_CODEUNIT));
+                    }
+
+                    // The result of __enter__
+                    lastState.push(&Any);
+                    break;
+                }
+                case WITH_CLEANUP_START:
+                    // __exit__ is called and consumed, leaving the reason the finally
+                    // is running for END_FINALLY
+                    lastState.pop();
+                    lastState.pop();
+                    lastState.push(&Any);
+                    break;
+                case WITH_CLEANUP_FINISH:
+                    // Handled entirely by WITH_CLEANUP_START
+                    break;
                 case BUILD_CONST_KEY_MAP:
                     lastState.pop(); //keys
                     for (auto i = 0; i < oparg; i++) {
                         lastState.pop(); // values
                     }
                     lastState.push(&Dict);
-                    return false;
+                    break;
                 default:
+                    // Includes BUILD_TUPLE_UNPACK_WITH_CALL and BUILD_MAP_UNPACK_WITH_CALL
 #ifdef _DEBUG
                     printf("Unknown unsupported opcode: %s", opcode_name(opcode));
 #endif
-                    return false;
+                    m_sideExits[curByte] = "unsupported opcode";
+                    interpret_side_exit(lastState, opcode, oparg);
+                    break;
             }
             update_start_state(lastState, curByte + sizeof(_Py_CODEUNIT));
 
@@ -1868,10 +3966,33 @@ bool AbstractInterpreter::interpret() {
     return true;
 }
 
+bool AbstractInterpreter::get_loop_heads(unordered_set<size_t>& loopHeads) {
+    if (!preprocess()) {
+        return false;
+    }
+    loopHeads = m_loopHeads;
+    return true;
+}
+
+bool AbstractInterpreter::interpret_baseline() {
+    auto start = pyjit_now();
+    bool preprocessed = preprocess();
+    m_stats.preprocessTime = pyjit_now() - start;
+    if (!preprocessed) {
+        return false;
+    }
+
+    // Nothing is known about any values, so everything will be boxed and we'll
+    // always go through the generic helpers.
+    m_baseline = true;
+    m_baselineStack = vector<AbstractValueWithSources>(m_code->co_stacksize + m_methodLoadCount, AbstractValueWithSources(&Any));
+    return true;
+}
+
 bool AbstractInterpreter::update_start_state(InterpreterState& newState, size_t index) {
     auto initialState = m_startStates.find(index);
-    if (initialState != m_startStates.end()) {
-        return merge_states(newState, initialState->second);
+    if (initialState != nullptr) {
+        return merge_states(newState, *initialState);
     }
     else {
         m_startStates[index] = newState;
@@ -2010,8 +4131,8 @@ void AbstractInterpreter::dump() {
         auto byteIndex = curByte;
 
         auto find = m_startStates.find(byteIndex);
-        if (find != m_startStates.end()) {
-            auto state = find->second;
+        if (find != nullptr) {
+            auto state = *find;
             for (size_t i = 0; i < state.local_count(); i++) {
                 auto local = state.get_local(i);
                 if (local.IsMaybeUndefined) {
@@ -2099,8 +4220,8 @@ void AbstractInterpreter::dump() {
             {
                 auto store = m_opcodeSources.find(byteIndex);
                 AbstractSource* source = nullptr;
-                if (store != m_opcodeSources.end()) {
-                    source = store->second;
+                if (store != nullptr) {
+                    source = *store;
                 }
                 auto repr = PyObject_Repr(PyTuple_GetItem(m_code->co_consts, oparg));
                 auto reprStr = PyUnicode_AsUTF8(repr);
@@ -2132,17 +4253,46 @@ void AbstractInterpreter::dump() {
 
 bool AbstractInterpreter::should_box(size_t opcodeIndex) {
     auto boxInfo = m_opcodeSources.find(opcodeIndex);
-    if (boxInfo != m_opcodeSources.end()) {
-        if (boxInfo->second == nullptr) {
+    if (boxInfo != nullptr) {
+        if (*boxInfo == nullptr) {
             return true;
         }
-        return boxInfo->second->needs_boxing();
+        return (*boxInfo)->needs_boxing();
     }
     return true;
 }
 
+// Checks if the instruction can skip updating f_lasti because nothing it does
+// can call back into Python code to look at the frame.  f_lasti is then only
+// updated on the paths which raise, and before any periodic work.
 bool AbstractInterpreter::can_skip_lasti_update(size_t opcodeIndex) {
     switch (GET_OPCODE(opcodeIndex)) {
+        case DUP_TOP:
+        case DUP_TOP_TWO:
+        case SETUP_EXCEPT:
+        case SETUP_FINALLY:
+        case SETUP_LOOP:
+        case NOP:
+        case ROT_TWO:
+        case ROT_THREE:
+        case POP_BLOCK:
+        case POP_JUMP_IF_FALSE:
+        case POP_JUMP_IF_TRUE:
+        case POP_TOP:
+        case BREAK_LOOP:
+        case CONTINUE_LOOP:
+        case END_FINALLY:
+        case LOAD_CONST:
+        case LOAD_FAST:
+        case LOAD_DEREF:
+        case LOAD_CLOSURE:
+        case BUILD_TUPLE:
+        case BUILD_LIST:
+        case BUILD_SLICE:
+        case BUILD_STRING:
+        case JUMP_FORWARD:
+        case JUMP_ABSOLUTE:
+            return true;
         case BINARY_TRUE_DIVIDE:
         case BINARY_FLOOR_DIVIDE:
         case BINARY_POWER:
@@ -2170,18 +4320,20 @@ bool AbstractInterpreter::can_skip_lasti_update(size_t opcodeIndex) {
         case INPLACE_XOR:
         case INPLACE_OR:
         case COMPARE_OP:
-        case LOAD_FAST:
+        case STORE_FAST:
+            // Unboxed values don't have any methods to call or be freed
             return !should_box(opcodeIndex);
     }
 
     return false;
-
 }
 
 void AbstractInterpreter::dump_sources(AbstractSource* sources) {
     if (sources != nullptr) {
-        for (auto value : sources->Sources->Sources) {
-            printf("              %s (%p)\r\n", value->describe(), value);
+        for (auto value : m_sources) {
+            if (value->same_set(sources)) {
+                printf("              %s (%p)\r\n", value->describe(), value);
+            }
         }
     }
 }
@@ -2317,6 +4469,9 @@ AbstractLocalInfo AbstractInterpreter::get_local_info(size_t byteCodeIndex, size
 
 // Returns information about the stack at the specific byte code index.
 vector<AbstractValueWithSources>& AbstractInterpreter::get_stack_info(size_t byteCodeIndex) {
+    if (m_baseline) {
+        return m_baselineStack;
+    }
     return m_startStates[byteCodeIndex].m_stack;
 }
 
@@ -2325,35 +4480,35 @@ AbstractValue* AbstractInterpreter::get_return_info() {
 }
 
 bool AbstractInterpreter::has_info(size_t byteCodeIndex) {
-    return m_startStates.find(byteCodeIndex) != m_startStates.end();
+    return m_startStates.contains(byteCodeIndex);
 }
 
 
 AbstractSource* AbstractInterpreter::add_local_source(size_t opcodeIndex, size_t localIndex) {
     auto store = m_opcodeSources.find(opcodeIndex);
-    if (store == m_opcodeSources.end()) {
-        return m_opcodeSources[opcodeIndex] = new_source(new LocalSource());
+    if (store == nullptr) {
+        return m_opcodeSources[opcodeIndex] = new_source<LocalSource>();
     }
 
-    return store->second;
+    return *store;
 }
 
 AbstractSource* AbstractInterpreter::add_const_source(size_t opcodeIndex, size_t constIndex) {
     auto store = m_opcodeSources.find(opcodeIndex);
-    if (store == m_opcodeSources.end()) {
-        return m_opcodeSources[opcodeIndex] = new_source(new ConstSource());
+    if (store == nullptr) {
+        return m_opcodeSources[opcodeIndex] = new_source<ConstSource>();
     }
 
-    return store->second;
+    return *store;
 }
 
 AbstractSource* AbstractInterpreter::add_intermediate_source(size_t opcodeIndex) {
     auto store = m_opcodeSources.find(opcodeIndex);
-    if (store == m_opcodeSources.end()) {
-        return m_opcodeSources[opcodeIndex] = new_source(new IntermediateSource());
+    if (store == nullptr) {
+        return m_opcodeSources[opcodeIndex] = new_source<IntermediateSource>();
     }
 
-    return store->second;
+    return *store;
 }
 
 /*****************
@@ -2396,11 +4551,11 @@ void AbstractInterpreter::error_check(const char *reason) {
 Label AbstractInterpreter::getOffsetLabel(int jumpTo) {
     auto jumpToLabelIter = m_offsetLabels.find(jumpTo);
     Label jumpToLabel;
-    if (jumpToLabelIter == m_offsetLabels.end()) {
+    if (jumpToLabelIter == nullptr) {
         m_offsetLabels[jumpTo] = jumpToLabel = m_comp->emit_define_label();
     }
     else {
-        jumpToLabel = jumpToLabelIter->second;
+        jumpToLabel = *jumpToLabelIter;
     }
     return jumpToLabel;
 }
@@ -2469,6 +4624,10 @@ void AbstractInterpreter::branch_raise(const char *reason) {
     auto& ehBlock = get_ehblock();
     auto& entry_stack = ehBlock.EntryStack;
 
+    if (m_lazyLasti != -1) {
+        emit_lasti_update(m_lazyLasti);
+    }
+
 #if DEBUG_TRACE
     if (reason != nullptr) {
         emit_debug_msg(reason);
@@ -2842,8 +5001,30 @@ void AbstractInterpreter::free_iter_locals_on_exception() {
 }
 
 void AbstractInterpreter::periodic_work() {
+    // --g_periodicTicks, and only call the helper when it runs out
+    auto noWork = m_comp->emit_define_label();
+    auto ticks = m_comp->emit_define_local(LK_Int);
+    m_comp->emit_ptr(&g_periodicTicks);
+    m_comp->emit_ptr(&g_periodicTicks);
+    m_comp->emit_load_indirect_int32();
+    m_comp->emit_int(1);
+    m_comp->emit_subtract();
+    m_comp->emit_dup();
+    m_comp->emit_store_local(ticks);
+    m_comp->emit_store_indirect_int32();
+
+    m_comp->emit_load_and_free_local(ticks);
+    m_comp->emit_int(0);
+    m_comp->emit_compare_int(CT_GreaterThan);
+    m_comp->emit_branch(BranchTrue, noWork);
+
+    if (m_lazyLasti != -1) {
+        emit_lasti_update(m_lazyLasti);
+    }
     emit_periodic_work();
     int_error_check("periodic work");
+
+    m_comp->emit_mark_label(noWork);
 }
 
 int AbstractInterpreter::get_extended_opcode(int curByte) {
@@ -2920,7 +5101,7 @@ void AbstractInterpreter::branch(int& curByte) {
     m_offsetStack[oparg] = m_stack;
 }
 
-JittedCode* AbstractInterpreter::compile_worker() {
+bool AbstractInterpreter::compile_worker() {
     Label ok;
 
     auto raiseNoHandlerLabel = m_comp->emit_define_label();
@@ -2941,7 +5122,8 @@ JittedCode* AbstractInterpreter::compile_worker() {
         )
     );
 
-    for (int i = 0; i < m_code->co_argcount + m_code->co_kwonlyargcount; i++) {
+    // Baseline code skips the interpreter pass, so it keeps all of the arguments boxed
+    for (int i = 0; !m_baseline && i < m_code->co_argcount + m_code->co_kwonlyargcount; i++) {
         auto local = get_local_info(0, i);
         if (!local.ValueInfo.needs_boxing()) {
             emit_load_fast(i);
@@ -2956,6 +5138,16 @@ JittedCode* AbstractInterpreter::compile_worker() {
             }
         }
     }
+
+    if (m_osrEntry != -1) {
+        // The frame is already running, skip straight to the loop it's in
+        m_osrLabel = m_comp->emit_define_label();
+        m_comp->emit_branch(BranchAlways, m_osrLabel);
+    }
+
+    if (is_generator()) {
+        emit_resume_dispatch();
+    }
     
 	for (int curByte = 0; curByte < m_size; curByte += sizeof(_Py_CODEUNIT)) {
 		assert(curByte % sizeof(_Py_CODEUNIT) == 0);
@@ -2966,16 +5158,19 @@ JittedCode* AbstractInterpreter::compile_worker() {
         auto oparg = GET_OPARG(curByte);
 
     processOpCode:
+        auto curStackDepth = m_offsetStack.find(curByte);
+        if (curStackDepth != nullptr) {
+            m_stack = *curStackDepth;
+        }
+
         // See FOR_ITER for special handling of the offset label
         if (get_extended_opcode(curByte) != FOR_ITER) {
+            if (curByte == m_osrEntry) {
+                emit_osr_entry(Local());
+            }
             mark_offset_label(curByte);
         }
 
-        auto curStackDepth = m_offsetStack.find(curByte);
-        if (curStackDepth != m_offsetStack.end()) {
-            m_stack = curStackDepth->second;
-        }
-
         if (m_blockStack.size() > 1 && 
             curByte >= m_blockStack.back().EndOffset &&
             m_blockStack.back().EndOffset != -1) {
@@ -2983,10 +5178,24 @@ JittedCode* AbstractInterpreter::compile_worker() {
         }
 
         // update f_lasti
-        if (!can_skip_lasti_update(curByte)) {
+        m_comp->mark_sequence_point(curByte);
+        if (can_skip_lasti_update(curByte)) {
+            m_lazyLasti = curByte;
+        }
+        else {
+            m_lazyLasti = -1;
             emit_lasti_update(curByte);
         }
 
+        auto sideExit = m_sideExits.find(curByte);
+        if (sideExit != nullptr) {
+            if (!can_side_exit(opcodeIndex)) {
+                return fail(*sideExit, byte);
+            }
+            emit_side_exit(opcodeIndex, PyCompile_OpcodeStackEffect(byte, oparg));
+            continue;
+        }
+
         switch (byte) {
             case NOP: break;
             case ROT_TWO: 
@@ -3046,11 +5255,13 @@ JittedCode* AbstractInterpreter::compile_worker() {
                 break;
             case COMPARE_OP: compare_op(oparg, curByte, opcodeIndex); break;
             case SETUP_LOOP:
+            {
                 // offset is relative to end of current instruction
-                m_blockStack.push_back(
-                    BlockInfo(oparg + curByte + sizeof(_Py_CODEUNIT), SETUP_LOOP, m_blockStack.back().CurrentHandler)
-                );
+                auto blockInfo = BlockInfo(oparg + curByte + sizeof(_Py_CODEUNIT), SETUP_LOOP, m_blockStack.back().CurrentHandler);
+                blockInfo.FrameLevel = frame_stack_level();
+                m_blockStack.push_back(blockInfo);
                 break;
+            }
             case BREAK_LOOP:
             case CONTINUE_LOOP:
                 // if we have finally blocks we need to unwind through them...
@@ -3139,7 +5350,7 @@ JittedCode* AbstractInterpreter::compile_worker() {
                 inc_stack();
                 break;
             case STORE_ATTR:
-                emit_store_attr(PyTuple_GetItem(m_code->co_names, oparg));
+                emit_store_attr(PyTuple_GetItem(m_code->co_names, oparg), attr_cache(opcodeIndex));
                 dec_stack(2);
                 int_error_check("store attr failed");
                 break;
@@ -3149,7 +5360,18 @@ JittedCode* AbstractInterpreter::compile_worker() {
                 int_error_check("delete attr failed");
                 break;
             case LOAD_ATTR:
-                emit_load_attr(PyTuple_GetItem(m_code->co_names, oparg));
+                if (m_methodLoads.contains(opcodeIndex)) {
+                    auto self = m_comp->emit_define_local(LK_Pointer);
+                    emit_load_method(PyTuple_GetItem(m_code->co_names, oparg), attr_cache(opcodeIndex), self);
+                    dec_stack();
+                    error_check("load method failed");
+                    inc_stack();
+                    m_comp->emit_load_local(self);
+                    m_comp->emit_free_local(self);
+                    inc_stack();
+                    break;
+                }
+                emit_load_attr(PyTuple_GetItem(m_code->co_names, oparg), attr_cache(opcodeIndex));
                 dec_stack();
                 error_check("load attr failed");
                 inc_stack();
@@ -3164,7 +5386,7 @@ JittedCode* AbstractInterpreter::compile_worker() {
                 int_error_check("delete global failed");
                 break;
             case LOAD_GLOBAL:
-                emit_load_global(PyTuple_GetItem(m_code->co_names, oparg));
+                emit_load_global(oparg);
                 error_check("load global failed");
                 inc_stack();
                 break;
@@ -3186,7 +5408,9 @@ JittedCode* AbstractInterpreter::compile_worker() {
             case STORE_FAST: store_fast(oparg, opcodeIndex); break;
             case LOAD_FAST: load_fast(oparg, opcodeIndex); break;
             case UNPACK_SEQUENCE:
-                unpack_sequence(oparg, curByte);
+                if (!m_unpackedTuples.contains(curByte)) {
+                    unpack_sequence(oparg, curByte);
+                }
                 break;
             case UNPACK_EX: unpack_ex(oparg, curByte); break;
             case CALL_FUNCTION_KW:
@@ -3222,7 +5446,24 @@ JittedCode* AbstractInterpreter::compile_worker() {
 				break;
             case CALL_FUNCTION:
             {
-				if (!emit_call(oparg)) {
+				if (!should_box(opcodeIndex) && emit_intrinsic_call(opcodeIndex, curByte, oparg)) {
+					break;
+				}
+
+				Label inlineDone;
+				bool inlined = emit_inlined_call(opcodeIndex, oparg, inlineDone);
+				if (m_methodCalls.contains(opcodeIndex)) {
+					emit_method_call(opcodeIndex, oparg);
+					if (oparg > 3) {
+						dec_stack(2);	// function and self
+					}
+					else {
+						dec_stack(oparg + 2); // + function and self
+					}
+				}
+				else if (!emit_builtin_call(opcodeIndex, oparg) &&
+					!emit_direct_call(opcodeIndex, oparg) &&
+					!emit_call(oparg)) {
 					build_tuple(oparg);
 					emit_call_with_tuple();
 					dec_stack();// function
@@ -3233,9 +5474,16 @@ JittedCode* AbstractInterpreter::compile_worker() {
 				
                 error_check("call function failed");
                 inc_stack();
+                if (inlined) {
+                    emit_inlined_result(opcodeIndex, curByte, oparg, inlineDone);
+                }
                 break;
             }
             case BUILD_TUPLE:
+                if (m_unpackedTuples.contains(curByte)) {
+                    reverse_stack(oparg);
+                    break;
+                }
                 build_tuple(oparg);
                 inc_stack();
                 break;
@@ -3260,8 +5508,23 @@ JittedCode* AbstractInterpreter::compile_worker() {
                 inc_stack();
                 break;
             case STORE_SUBSCR:
+                if (m_slicedSubscrs.contains(curByte)) {
+                    dec_stack(4);
+                    emit_store_slice();
+                    int_error_check("store slice failed");
+                    break;
+                }
                 dec_stack(3);
-                emit_store_subscr();
+                if (!should_box(opcodeIndex)) {
+                    emit_list_store_subscr();
+                }
+                else if (is_str_dict_subscr(opcodeIndex, curByte)) {
+                    m_comp->emit_ptr((size_t)PyObject_Hash(*m_strSubscrs.find(curByte)));
+                    m_comp->emit_call(PyJit_DictStoreSubscr_Str);
+                }
+                else {
+                    emit_store_subscr();
+                }
                 int_error_check("store subscr failed");
                 break;
             case DELETE_SUBSCR:
@@ -3270,6 +5533,10 @@ JittedCode* AbstractInterpreter::compile_worker() {
                 int_error_check("delete subscr failed");
                 break;
             case BUILD_SLICE:
+                if (m_slicedSubscrs.contains(curByte)) {
+                    // The bounds are left for the subscript
+                    break;
+                }
                 dec_stack(oparg);
                 if (oparg != 3) {
                     m_comp->emit_null();
@@ -3318,6 +5585,22 @@ JittedCode* AbstractInterpreter::compile_worker() {
             case INPLACE_AND:
             case INPLACE_XOR:
             case INPLACE_OR:
+                if (byte == BINARY_SUBSCR && m_slicedSubscrs.contains(curByte)) {
+                    dec_stack(3);
+                    emit_get_slice();
+                    error_check("get slice failed");
+                    inc_stack();
+                    break;
+                }
+                if (byte == BINARY_SUBSCR && should_box(opcodeIndex) && is_str_dict_subscr(opcodeIndex, curByte)) {
+                    dec_stack(2);
+                    m_comp->emit_ptr((size_t)PyObject_Hash(*m_strSubscrs.find(curByte)));
+                    m_comp->emit_int(m_borrowedArgs.contains(curByte) ? m_borrowedArgs[curByte] : 0);
+                    m_comp->emit_call(PyJit_DictSubscr_Str);
+                    error_check("dict subscr failed");
+                    inc_stack();
+                    break;
+                }
                 if (!should_box(opcodeIndex)) {
                     auto stackInfo = get_stack_info(opcodeIndex);
                     auto one = stackInfo[stackInfo.size() - 1];
@@ -3396,6 +5679,17 @@ JittedCode* AbstractInterpreter::compile_worker() {
                         inc_stack(1, STACK_KIND_VALUE);
                         break;
                     }
+                    else if (byte == BINARY_SUBSCR) {
+                        // A list or tuple indexed by a tagged int
+                        dec_stack(2);
+
+                        emit_sequence_subscr(two.Value->kind());
+
+                        error_check("subscr failed");
+
+                        inc_stack();
+                        break;
+                    }
                     else if (one.Value->kind() == AVK_Integer && two.Value->kind() == AVK_Integer) {
                         dec_stack(2);
 
@@ -3409,7 +5703,24 @@ JittedCode* AbstractInterpreter::compile_worker() {
                 }
                 dec_stack(2);
 
-                emit_binary_object(byte);
+                if (can_concatenate(opcodeIndex, curByte)) {
+                    // The local being assigned to is cleared if it holds the left
+                    // operand so the str can be resized in place
+                    load_frame();
+                    m_comp->emit_ptr(offsetof(PyFrameObject, f_localsplus) + *m_concatLocals.find(curByte) * sizeof(size_t));
+                    m_comp->emit_add();
+                    m_comp->emit_int(byte);
+                    m_comp->emit_int(m_borrowedArgs.contains(curByte) ? m_borrowedArgs[curByte] : 0);
+                    m_comp->emit_call(PyJit_UnicodeConcatenate);
+                }
+                else if (m_borrowedArgs.contains(curByte)) {
+                    m_comp->emit_int(byte);
+                    m_comp->emit_int(m_borrowedArgs[curByte]);
+                    m_comp->emit_call(PyJit_Binary_Borrowed);
+                }
+                else {
+                    emit_binary_object(byte);
+                }
 
                 error_check("binary op failed");
                 inc_stack();
@@ -3442,32 +5753,59 @@ JittedCode* AbstractInterpreter::compile_worker() {
                 inc_stack();
                 break;
             case GET_ITER:
-                // GET_ITER can be followed by FOR_ITER, or a CALL_FUNCTION.                
+                // GET_ITER can be followed by FOR_ITER, or a CALL_FUNCTION.
             {
-                /*
-                bool optFor = false;
-                Local loopOpt1, loopOpt2;
-                if (GET_OPCODE(curByte + sizeof(_Py_CODEUNIT)) == FOR_ITER) {
-                for (size_t blockIndex = m_blockStack.size() - 1; blockIndex != (-1); blockIndex--) {
-                if (m_blockStack[blockIndex].Kind == SETUP_LOOP) {
-                // save our iter variable so we can free it on break, continue, return, and
-                // when encountering an exception.
-                m_blockStack.data()[blockIndex].LoopOpt1 = loopOpt1 = m_comp->emit_define_local(Parameter(CORINFO_TYPE_NATIVEINT));
-                m_blockStack.data()[blockIndex].LoopOpt2 = loopOpt2 = m_comp->emit_define_local(Parameter(CORINFO_TYPE_NATIVEINT));
-                optFor = true;
-                break;
+                // A loop over a range can count natively.  Generators don't keep
+                // locals across yields and OSR can enter at the FOR_ITER, so
+                // those always iterate generically, as do loops over values we
+                // know aren't ranges.
+                size_t forIter = curByte + sizeof(_Py_CODEUNIT);
+                while (forIter < m_size && GET_OPCODE(forIter) == EXTENDED_ARG) {
+                    forIter += sizeof(_Py_CODEUNIT);
+                }
+                RangeLoop* rangeLoop = nullptr;
+                if (forIter < m_size && GET_OPCODE(forIter) == FOR_ITER &&
+                    !is_generator() && (int)(curByte + sizeof(_Py_CODEUNIT)) != m_osrEntry &&
+                    get_stack_info(opcodeIndex).back().Value->kind() == AVK_Any) {
+                    rangeLoop = &m_rangeLoops[curByte + sizeof(_Py_CODEUNIT)];
+                    rangeLoop->Current = m_comp->emit_define_local(LK_Pointer);
+                    rangeLoop->Step = m_comp->emit_define_local(LK_Pointer);
+                    rangeLoop->Remaining = m_comp->emit_define_local(LK_Pointer);
+                    emit_getiter_optimized(*rangeLoop);
+                }
+                else {
+                    emit_getiter();
                 }
+                dec_stack();
+                error_check("get iter failed");
+                inc_stack();
+
+                // If we're calling the range builtin, anything other than a range
+                // goes back to the interpreter, and the loop doesn't need to
+                // iterate generically.  Other values which might be ranges get
+                // both.
+                if (rangeLoop != nullptr) {
+                    rangeLoop->Guarded = is_range_call(opcodeIndex) && can_deopt(curByte);
                 }
+                if ((rangeLoop == nullptr || !rangeLoop->Guarded) &&
+                    m_typedRangeLoops.contains(curByte + sizeof(_Py_CODEUNIT))) {
+                    // We've typed the loop variable as an int on the basis of the guard
+                    deopt_failed(curByte);
                 }
-                */
-                /*if (optFor) {
-                m_comp->emit_getiter_opt();
+                if (rangeLoop != nullptr) {
+                    if (rangeLoop->Guarded) {
+                        auto isRange = m_comp->emit_define_label();
+                        m_comp->emit_load_local(rangeLoop->Step);
+                        m_comp->emit_ptr((size_t)0);
+                        m_comp->emit_branch(BranchNotEqual, isRange);
+                        emit_deopt(curByte);
+                        m_comp->emit_mark_label(isRange);
+                    }
                 }
-                else*/ {
-                    emit_getiter();
-                    dec_stack();
-                    error_check("get iter failed");
-                    inc_stack();
+
+                LoopKernel kernel;
+                if (rangeLoop != nullptr && find_loop_kernel(forIter, kernel)) {
+                    emit_loop_kernel(*rangeLoop, kernel);
                 }
             }
             break;
@@ -3479,9 +5817,6 @@ JittedCode* AbstractInterpreter::compile_worker() {
                         // save our iter variable so we can free it on break, continue, return, and
                         // when encountering an exception.
                         loopBlock = &m_blockStack.data()[blockIndex];
-                        //loopOpt1 = m_blockStack.data()[blockIndex].LoopOpt1;
-                        //loopOpt2 = m_blockStack.data()[blockIndex].LoopOpt2;
-                        //inLoop = true;
                         break;
                     }
                 }
@@ -3585,6 +5920,7 @@ JittedCode* AbstractInterpreter::compile_worker() {
                 auto handlerLabel = getOffsetLabel(oparg + curByte + sizeof(_Py_CODEUNIT));
 
                 auto blockInfo = BlockInfo(oparg + curByte + sizeof(_Py_CODEUNIT), SETUP_EXCEPT, m_allHandlers.size());
+                blockInfo.FrameLevel = frame_stack_level();
                 m_blockStack.push_back(blockInfo);
 
                 m_allHandlers.push_back(
@@ -3606,29 +5942,12 @@ JittedCode* AbstractInterpreter::compile_worker() {
                 m_offsetStack[oparg + curByte + sizeof(_Py_CODEUNIT)] = newStack;
             }
             break;
-            case SETUP_FINALLY:
-            {
-                auto handlerLabel = getOffsetLabel(oparg + curByte + sizeof(_Py_CODEUNIT));
-                auto blockInfo = BlockInfo(oparg + curByte + sizeof(_Py_CODEUNIT), SETUP_FINALLY, m_allHandlers.size());
-
-                m_blockStack.push_back(blockInfo);
-                m_allHandlers.push_back(
-                    ExceptionHandler(
-                        m_allHandlers.size(),
-                        ExceptionVars(m_comp, true),
-                        m_comp->emit_define_label(),
-                        m_comp->emit_define_label(),
-                        handlerLabel,
-                        m_stack,
-                        EHF_TryFinally
-                    )
-                );
-
-                vector<bool> newStack = m_stack;
-                newStack.push_back(STACK_KIND_OBJECT);
-                m_offsetStack[oparg + curByte + sizeof(_Py_CODEUNIT)] = newStack;
-            }
-            break;
+            case SETUP_FINALLY: setup_finally(oparg + curByte + sizeof(_Py_CODEUNIT)); break;
+            case SETUP_WITH: setup_with(oparg + curByte + sizeof(_Py_CODEUNIT)); break;
+            case WITH_CLEANUP_START: with_cleanup(); break;
+            case WITH_CLEANUP_FINISH:
+                // Handled entirely by WITH_CLEANUP_START
+                break;
             case POP_EXCEPT: pop_except(); break;
             case POP_BLOCK: compile_pop_block(); break;
             case END_FINALLY:
@@ -3736,7 +6055,7 @@ JittedCode* AbstractInterpreter::compile_worker() {
                     // a bare try/except: which handles all exceptions.  In that case
                     // we have no values to pop off, and this code will never be invoked
                     // anyway.
-                    if (m_offsetStack.find(curByte) != m_offsetStack.end()) {
+                    if (m_offsetStack.contains(curByte)) {
                         dec_stack(3);
 						free_iter_locals_on_exception();
 						emit_restore_err();
@@ -3750,9 +6069,20 @@ JittedCode* AbstractInterpreter::compile_worker() {
             }
             break;
 
-            case YIELD_FROM:
-            case YIELD_VALUE:
-                return nullptr;
+            case YIELD_VALUE: yield_value(opcodeIndex); break;
+            case YIELD_FROM: yield_from(opcodeIndex); break;
+            case GET_YIELD_FROM_ITER:
+                emit_get_yield_from_iter();
+                dec_stack();
+                error_check("get yield from iter failed");
+                inc_stack();
+                break;
+            case GET_AWAITABLE:
+                emit_get_awaitable();
+                dec_stack();
+                error_check("get awaitable failed");
+                inc_stack();
+                break;
 
             case IMPORT_NAME:
                 emit_import_name(PyTuple_GetItem(m_code->co_names, oparg));
@@ -3770,13 +6100,6 @@ JittedCode* AbstractInterpreter::compile_worker() {
                 dec_stack(1);
                 int_error_check("import star failed");
                 break;
-            case SETUP_WITH:
-            case WITH_CLEANUP_START:
-            case WITH_CLEANUP_FINISH:
-                return nullptr;
-			case BUILD_MAP_UNPACK_WITH_CALL:
-			case BUILD_TUPLE_UNPACK_WITH_CALL:
-				return nullptr;
 			case FORMAT_VALUE:
 			{
 				Local fmtSpec;
@@ -3788,6 +6111,11 @@ JittedCode* AbstractInterpreter::compile_worker() {
 
 				int which_conversion = oparg & FVC_MASK;
 
+				// ints and floats go straight to their formatters
+				auto stackInfo = get_stack_info(opcodeIndex);
+				auto kind = stackInfo[stackInfo.size() - ((oparg & FVS_MASK) == FVS_HAVE_SPEC ? 2 : 1)].Value->kind();
+				bool number = !which_conversion && (kind == AVK_Integer || kind == AVK_Float);
+
 				dec_stack();
 				if (which_conversion) {
 					// Save the original value so we can decref it...
@@ -3826,16 +6154,26 @@ JittedCode* AbstractInterpreter::compile_worker() {
 				if ((oparg & FVS_MASK) == FVS_HAVE_SPEC) {
 					// format spec
 					m_comp->emit_load_and_free_local(fmtSpec);
-					emit_pyobject_format();
+					if (number) {
+						m_comp->emit_call(PyJit_FormatNumberSpec);
+					}
+					else {
+						emit_pyobject_format();
+					}
 
 					error_check("format object");
 				}
 				else if (!which_conversion) {
-					// TODO: This could also be avoided if we knew we had a string on the stack
-
 					// If we did a conversion we know we have a string...
 					// Otherwise we need to convert
-					emit_format_value();
+					if (number) {
+						m_comp->emit_call(PyJit_FormatNumber);
+					}
+					else {
+						emit_format_value();
+					}
+
+					error_check("format value failed");
 				}
 
 				inc_stack();
@@ -3856,51 +6194,63 @@ JittedCode* AbstractInterpreter::compile_worker() {
 					m_comp->emit_ptr((size_t)oparg);
 
 					emit_unicode_joinarray();
+					error_check("build string failed");
 
 					inc_stack();
 				}
 				break;
 			case BUILD_CONST_KEY_MAP:
 				{
-					auto names = m_comp->emit_spill();
-					emit_new_dict(oparg);
-					auto dict = m_comp->emit_spill();
-					for (auto i = 0; i < oparg; i++) {
-						auto value = m_comp->emit_spill();
-						// key
-						m_comp->emit_load_local(names);
-						emit_tuple_load(i);
-
-						// value
-						m_comp->emit_load_and_free_local(value);
-
-						// dict
-						m_comp->emit_load_local(dict);
-
-						emit_dict_store_no_decref();
+					// The dict is built presized from the values in one call
+					auto keys = m_comp->emit_spill();
+					dec_stack();
 
-						dec_stack(1);
+					Local stackArray = m_sequenceLocals[curByte];
+					for (auto i = 0; i < oparg; i++) {
+						m_comp->emit_store_to_array(stackArray, oparg - i - 1);
+						dec_stack();
 					}
 
-					dec_stack(1); // names
-					m_comp->emit_load_local(names);
-					emit_pop_top();
-
-					m_comp->emit_free_local(names);
-
-					m_comp->emit_load_local(dict);
+					m_comp->emit_load_local(stackArray);
+					m_comp->emit_load_and_free_local(keys);
+					m_comp->emit_ptr((size_t)oparg);
+					emit_build_const_key_map();
+					error_check("build const key map failed");
 
 					inc_stack();
 				}
 				break;
 			default:
+                // Only baseline code gets here, the side exits are found as the code
+                // is interpreted otherwise.
 #if _DEBUG
                 printf("Unsupported opcode: %d (with related)\r\n", byte);
 #endif
-                return nullptr;
+                if (!can_side_exit(opcodeIndex)) {
+                    return fail("unsupported opcode", byte);
+                }
+                emit_side_exit(opcodeIndex, PyCompile_OpcodeStackEffect(byte, oparg));
+                break;
         }
     }
 
+    m_lazyLasti = -1;
+
+    if (m_osrEntry != -1 && !m_osrEmitted) {
+        // We couldn't enter the code at the loop head
+        return fail("can't enter at the loop head");
+    }
+
+    if (m_resumeFailed) {
+        // There's a yield where we can't save our state into the frame
+        return fail("can't suspend at a yield");
+    }
+
+    if (m_deoptFailed) {
+        // A guard we've speculated on has nowhere to go if it fails
+        return fail("guard can't deoptimize");
+    }
+
     // for each exception handler we need to load the exception
     // information onto the stack, and then branch to the correct
     // handler.  When we take an error we'll branch down to this
@@ -3948,21 +6298,17 @@ JittedCode* AbstractInterpreter::compile_worker() {
     m_comp->emit_load_local(m_retValue);
 
     m_comp->emit_mark_label(finalRet);
+    if (is_generator()) {
+        load_frame();
+        m_comp->emit_call(PyJit_GenExit);
+    }
     emit_pop_frame();
 
     m_comp->emit_ret();
 
 	//dump();
 
-    auto res = m_comp->emit_compile();
-	if (res == nullptr) {
-		printf("Compiling failed %s from %s line %d\r\n",
-			PyUnicode_AsUTF8(m_code->co_name),
-			PyUnicode_AsUTF8(m_code->co_filename),
-			m_code->co_firstlineno
-		);
-	}
-	return res;
+	return true;
 }
 
 void AbstractInterpreter::compile_pop_block() {
@@ -4012,6 +6358,123 @@ void AbstractInterpreter::compile_pop_block() {
     }
 }
 
+void AbstractInterpreter::setup_finally(int handlerOffset) {
+    auto handlerLabel = getOffsetLabel(handlerOffset);
+    auto blockInfo = BlockInfo(handlerOffset, SETUP_FINALLY, m_allHandlers.size());
+    blockInfo.FrameLevel = frame_stack_level();
+
+    m_blockStack.push_back(blockInfo);
+    m_allHandlers.push_back(
+        ExceptionHandler(
+            m_allHandlers.size(),
+            ExceptionVars(m_comp, true),
+            m_comp->emit_define_label(),
+            m_comp->emit_define_label(),
+            handlerLabel,
+            m_stack,
+            EHF_TryFinally
+        )
+    );
+
+    vector<bool> newStack = m_stack;
+    newStack.push_back(STACK_KIND_OBJECT);
+    m_offsetStack[handlerOffset] = newStack;
+}
+
+// A with block is a try/finally block which has the __exit__ method of the context
+// manager on the stack below it, just like the interpreter sets it up.  Returns,
+// breaks, continues and exceptions all flow into WITH_CLEANUP_START the same way
+// they flow into a finally block.
+void AbstractInterpreter::setup_with(int handlerOffset) {
+    auto exit = m_comp->emit_define_local();
+    m_comp->emit_load_local_addr(exit);
+    m_comp->emit_call(PyJit_SetupWith);
+    dec_stack();
+    error_check("setup with failed");
+
+    auto enterRes = m_comp->emit_spill();
+    m_comp->emit_load_and_free_local(exit);
+    inc_stack();
+
+    setup_finally(handlerOffset);
+
+    m_comp->emit_load_and_free_local(enterRes);
+    inc_stack();
+}
+
+// Calls __exit__ for a with block.  We're entered with the __exit__ method and the
+// reason for the finally block running on the stack, and leave just the reason for
+// END_FINALLY.  If the block is exiting with an exception which __exit__ suppresses
+// then we unwind the exception and the reason becomes None.
+void AbstractInterpreter::with_cleanup() {
+    auto& block = m_blockStack.back();
+    auto& exVars = m_allHandlers[block.CurrentHandler].ExVars;
+
+    dec_stack();
+    m_comp->emit_store_local(exVars.FinallyExc);
+
+    // Returns, breaks and continues call __exit__ without an exception
+    auto noException = m_comp->emit_define_label();
+    auto callExit = m_comp->emit_define_label();
+    m_comp->emit_load_local(exVars.FinallyExc);
+    m_comp->emit_ptr(Py_None);
+    m_comp->emit_branch(BranchEqual, noException);
+    EhFlags reasons[] = { EHF_BlockReturns, EHF_BlockBreaks, EHF_BlockContinues };
+    for (auto reason : reasons) {
+        if (block.Flags & reason) {
+            m_comp->emit_load_local(exVars.FinallyExc);
+            m_comp->emit_int(reason);
+            m_comp->emit_branch(BranchEqual, noException);
+        }
+    }
+
+    m_comp->emit_load_local(exVars.FinallyExc);
+    m_comp->emit_load_local(exVars.FinallyValue);
+    m_comp->emit_load_local(exVars.FinallyTb);
+    m_comp->emit_branch(BranchAlways, callExit);
+
+    m_comp->emit_mark_label(noException);
+    m_comp->emit_ptr(Py_None);
+    m_comp->emit_ptr(Py_None);
+    m_comp->emit_ptr(Py_None);
+
+    m_comp->emit_mark_label(callExit);
+    m_comp->emit_call(PyJit_WithCleanup);
+    dec_stack();
+
+    auto status = m_comp->emit_define_local(LK_Int);
+    m_comp->emit_store_local(status);
+
+    auto noError = m_comp->emit_define_label();
+    m_comp->emit_load_local(status);
+    m_comp->emit_int(-1);
+    m_comp->emit_branch(BranchNotEqual, noError);
+    branch_raise("with cleanup failed");
+    m_comp->emit_mark_label(noError);
+
+    auto notSuppressed = m_comp->emit_define_label();
+    m_comp->emit_load_and_free_local(status);
+    m_comp->emit_int(1);
+    m_comp->emit_branch(BranchNotEqual, notSuppressed);
+
+    // The exception is suppressed, we're done handling it
+    emit_unwind_eh(exVars.PrevExc, exVars.PrevExcVal, exVars.PrevTraceback);
+    m_comp->emit_load_local(exVars.FinallyTb);
+    emit_pop_top();
+    m_comp->emit_load_local(exVars.FinallyValue);
+    emit_pop_top();
+    m_comp->emit_load_local(exVars.FinallyExc);
+    emit_pop_top();
+    m_comp->emit_ptr(Py_None);
+    m_comp->emit_dup();
+    emit_incref();
+    m_comp->emit_store_local(exVars.FinallyExc);
+
+    m_comp->emit_mark_label(notSuppressed);
+    m_comp->emit_load_local(exVars.FinallyExc);
+    inc_stack();
+}
+
 const char* AbstractInterpreter::op_to_string(int op) {
     switch(op) {
         case BINARY_AND: 
@@ -4370,37 +6833,62 @@ void AbstractInterpreter::unary_not(int& opcodeIndex) {
     }
 }
 
-JittedCode* AbstractInterpreter::compile() {
-    bool interpreted = interpret();
+bool AbstractInterpreter::interpret_and_emit(CompileTier tier) {
+    auto start = pyjit_now();
+    bool interpreted = tier == TierBaseline ? interpret_baseline() : interpret();
+    auto interpretEnd = pyjit_now();
+    m_stats.interpretTime = interpretEnd - start - m_stats.preprocessTime;
     if (!interpreted) {
+        return false;
+    }
+
+    bool emitted = compile_worker();
+    m_stats.emitTime = pyjit_now() - interpretEnd;
+    return emitted;
+}
+
+JittedCode* AbstractInterpreter::compile(CompileTier tier) {
+    if (!interpret_and_emit(tier)) {
         return nullptr;
     }
-    
-    return compile_worker();
+
+    auto res = m_comp->emit_compile(tier);
+	if (res == nullptr) {
+		printf("Compiling failed %s from %s line %d\r\n",
+			PyUnicode_AsUTF8(m_code->co_name),
+			PyUnicode_AsUTF8(m_code->co_filename),
+			m_code->co_firstlineno
+		);
+		fail("native compile failed");
+		return nullptr;
+	}
+
+	auto& stats = res->get_stats();
+	stats.preprocessTime = m_stats.preprocessTime;
+	stats.interpretTime = m_stats.interpretTime;
+	stats.emitTime = m_stats.emitTime;
+	return res;
 }
 
-bool AbstractInterpreter::can_skip_lasti_update(int opcodeIndex) {
-    switch (GET_OPCODE(opcodeIndex)) {
-        case DUP_TOP:
-        case SETUP_EXCEPT:
-        case NOP:
-        case ROT_TWO:
-        case ROT_THREE:
-        case POP_BLOCK:
-        case POP_JUMP_IF_FALSE:
-        case POP_JUMP_IF_TRUE:
-        case POP_TOP:
-        case DUP_TOP_TWO:
-        case BREAK_LOOP:
-        case CONTINUE_LOOP:
-        case END_FINALLY:
-        case LOAD_CONST:
-        case JUMP_FORWARD:
-        case JUMP_ABSOLUTE:
-            return true;
+PendingCode* AbstractInterpreter::compile_deferred(CompileTier tier) {
+    if (!interpret_and_emit(tier)) {
+        return nullptr;
     }
 
-    return false;
+    auto res = m_comp->emit_deferred_compile(tier);
+    if (res == nullptr) {
+        fail("native compile failed");
+    }
+    else {
+        res->get_stats() = m_stats;
+    }
+    return res;
+}
+
+JittedCode* AbstractInterpreter::compile_osr(int loopHead, size_t stackDepth) {
+    m_osrEntry = loopHead;
+    m_osrStackDepth = stackDepth;
+    return compile(TierBaseline);
 }
 
 void AbstractInterpreter::store_fast(int local, int opcodeIndex) {
@@ -4446,6 +6934,10 @@ void AbstractInterpreter::load_const(int constIndex, int opcodeIndex) {
         }
     }
 	m_comp->emit_ptr(constValue);
+	if (can_borrow(opcodeIndex)) {
+		inc_stack(1, STACK_KIND_VALUE);
+		return;
+	}
 	m_comp->emit_dup();
 	emit_incref();
     inc_stack();
@@ -4525,6 +7017,91 @@ void AbstractInterpreter::return_value(int opcodeIndex) {
 }
 
 
+// Yields the value on the top of the stack.  Our state is saved into the frame just
+// as the interpreter would have done, and we pick it back up from the frame when
+// we're resumed.
+void AbstractInterpreter::yield_value(int opcodeIndex) {
+    if (!can_suspend(opcodeIndex)) {
+        m_resumeFailed = true;
+        return;
+    }
+
+    // Box our locals while we're still in a state where we can raise
+    emit_spill_locals(opcodeIndex);
+
+    dec_stack();
+    m_comp->emit_store_local(m_retValue);
+    auto layout = get_frame_layout();
+    emit_spill_to_frame(layout);
+    emit_suspend(layout.size(), opcodeIndex);
+    m_comp->emit_branch(BranchLeave, m_retLabel);
+
+    // The value being sent in is pushed on top of the frame's stack
+    m_comp->emit_mark_label(m_resumeLabels[opcodeIndex]);
+    emit_reload_from_frame(layout);
+    emit_reload_locals(opcodeIndex);
+    load_frame_stack_slot(layout.size());
+    m_comp->emit_load_indirect_ptr();
+    inc_stack();
+}
+
+// Delegates to the iterator below the value being sent in, yielding each of its
+// values until it finishes.  The first time through we store our state into the
+// frame so that starting and resuming are the same.
+void AbstractInterpreter::yield_from(int opcodeIndex) {
+    int resumePoint = opcodeIndex - sizeof(_Py_CODEUNIT);
+    if (!can_suspend(opcodeIndex)) {
+        m_resumeFailed = true;
+        dec_stack();
+        return;
+    }
+
+    emit_spill_locals(opcodeIndex);
+
+    // The receiver stays on the stack, the value being sent in goes on top of it
+    auto sent = m_comp->emit_spill();
+    dec_stack();
+    auto layout = get_frame_layout();
+    emit_spill_to_frame(layout);
+    load_frame_stack_slot(layout.size());
+    m_comp->emit_load_and_free_local(sent);
+    m_comp->emit_store_indirect_ptr();
+
+    m_comp->emit_mark_label(m_resumeLabels[resumePoint]);
+    emit_reload_from_frame(layout);
+
+    auto result = m_comp->emit_define_local();
+    auto status = m_comp->emit_define_local(LK_Int);
+    m_comp->emit_dup();
+    load_frame_stack_slot(layout.size());
+    m_comp->emit_load_indirect_ptr();
+    m_comp->emit_load_local_addr(result);
+    m_comp->emit_call(PyJit_YieldFrom);
+    m_comp->emit_store_local(status);
+
+    auto notYielded = m_comp->emit_define_label();
+    m_comp->emit_load_local(status);
+    m_comp->emit_int(1);
+    m_comp->emit_branch(BranchNotEqual, notYielded);
+
+    // Pass the value from the iterator along to our caller
+    m_comp->emit_load_local(result);
+    m_comp->emit_store_local(m_retValue);
+    emit_spill_to_frame(layout);
+    emit_suspend(layout.size(), resumePoint);
+    m_comp->emit_branch(BranchLeave, m_retLabel);
+
+    m_comp->emit_mark_label(notYielded);
+    emit_reload_locals(opcodeIndex);
+    m_comp->emit_load_local(status);
+    m_comp->emit_free_local(status);
+    int_error_check("yield from failed");
+
+    // The iterator is finished (and has been freed), replace it with its result
+    m_comp->emit_pop();
+    m_comp->emit_load_and_free_local(result);
+}
+
 void AbstractInterpreter::unpack_sequence(size_t size, int opcode) {
     auto valueTmp = m_comp->emit_spill();
     dec_stack();
@@ -4557,6 +7134,141 @@ void AbstractInterpreter::unpack_sequence(size_t size, int opcode) {
     m_comp->emit_free_local(fastTmp);
 }
 
+// Checks if the body of the range loop at forIter is a single statement which
+// PyJit_RunLoopKernel can run, either target[i] = x op y or target += x op y.
+// Without checkLocals we only look at the byte code, for while we're still
+// working out which locals are unboxed.
+bool AbstractInterpreter::find_loop_kernel(size_t forIter, LoopKernel& kernel, bool checkLocals) {
+	const size_t unit = sizeof(_Py_CODEUNIT);
+	auto end = forIter + unit + GET_OPARG(forIter);
+	if (GET_OPCODE(forIter) != FOR_ITER || end > m_size || end < forIter + 4 * unit ||
+		GET_OPCODE(end - unit) != JUMP_ABSOLUTE || GET_OPARG(end - unit) != forIter ||
+		GET_OPCODE(forIter + unit) != STORE_FAST) {
+		return false;
+	}
+	for (auto cur = forIter; cur < end; cur += unit) {
+		if (GET_OPCODE(cur) == EXTENDED_ARG) {
+			return false;
+		}
+	}
+
+	size_t loopVar = GET_OPARG(forIter + unit);
+	auto start = forIter + 2 * unit;
+	auto stop = end - unit;
+	size_t target;
+	if (stop - start > 3 * unit &&
+		GET_OPCODE(stop - unit) == STORE_SUBSCR &&
+		GET_OPCODE(stop - 2 * unit) == LOAD_FAST && GET_OPARG(stop - 2 * unit) == loopVar &&
+		GET_OPCODE(stop - 3 * unit) == LOAD_FAST) {
+		// expr; LOAD_FAST target; LOAD_FAST i; STORE_SUBSCR
+		kernel.Kind = LKK_Store;
+		target = GET_OPARG(stop - 3 * unit);
+		stop -= 3 * unit;
+	}
+	else if (stop - start > 3 * unit &&
+		GET_OPCODE(stop - unit) == STORE_FAST &&
+		(GET_OPCODE(stop - 2 * unit) == INPLACE_ADD || GET_OPCODE(stop - 2 * unit) == BINARY_ADD) &&
+		GET_OPCODE(start) == LOAD_FAST && GET_OPARG(start) == GET_OPARG(stop - unit)) {
+		// LOAD_FAST target; expr; INPLACE_ADD; STORE_FAST target
+		kernel.Kind = LKK_Reduce;
+		target = GET_OPARG(start);
+		start += unit;
+		stop -= 2 * unit;
+	}
+	else {
+		return false;
+	}
+
+	auto cur = start;
+	kernel.Op = 0;
+	kernel.Right = KERNEL_OPERAND(KOK_None, 0);
+	if (!find_kernel_operand(cur, loopVar, kernel.Left) || cur > stop) {
+		return false;
+	}
+	if (cur != stop) {
+		if (!find_kernel_operand(cur, loopVar, kernel.Right) || cur + unit != stop) {
+			return false;
+		}
+		kernel.Op = GET_OPCODE(cur);
+		if (kernel.Op != BINARY_ADD && kernel.Op != BINARY_SUBTRACT && kernel.Op != BINARY_MULTIPLY) {
+			return false;
+		}
+	}
+	if (KERNEL_OPERAND_KIND(kernel.Left) != KOK_Element && KERNEL_OPERAND_KIND(kernel.Right) != KOK_Element) {
+		return false;
+	}
+
+	// The kernel reads and writes the locals in the frame, and an accumulator
+	// can't be used as an operand as it changes every iteration.
+	size_t locals[] = { loopVar, target, 0, 0 };
+	size_t localCount = 2;
+	for (auto operand : { kernel.Left, kernel.Right }) {
+		auto kind = KERNEL_OPERAND_KIND(operand);
+		if (kind == KOK_Element || kind == KOK_Local) {
+			locals[localCount++] = KERNEL_OPERAND_INDEX(operand);
+			if (kernel.Kind == LKK_Reduce && KERNEL_OPERAND_INDEX(operand) == target) {
+				return false;
+			}
+		}
+	}
+	for (size_t i = 0; checkLocals && i < localCount; i++) {
+		auto local = get_local_info(forIter, locals[i]);
+		if (is_unboxed(local)) {
+			return false;
+		}
+	}
+
+	kernel.Target = (int)target;
+	return target != loopVar;
+}
+
+// Reads an operand of a loop kernel, either a local indexed by the loop
+// variable, another local, or a numeric constant.
+bool AbstractInterpreter::find_kernel_operand(size_t& curByte, size_t loopVar, int& operand) {
+	const size_t unit = sizeof(_Py_CODEUNIT);
+	int oparg = GET_OPARG(curByte);
+	switch (GET_OPCODE(curByte)) {
+		case LOAD_FAST:
+			if (oparg == loopVar) {
+				return false;
+			}
+			if (curByte + 2 * unit < m_size &&
+				GET_OPCODE(curByte + unit) == LOAD_FAST && GET_OPARG(curByte + unit) == loopVar &&
+				GET_OPCODE(curByte + 2 * unit) == BINARY_SUBSCR) {
+				operand = KERNEL_OPERAND(KOK_Element, oparg);
+				curByte += 3 * unit;
+				return true;
+			}
+			operand = KERNEL_OPERAND(KOK_Local, oparg);
+			curByte += unit;
+			return true;
+		case LOAD_CONST:
+		{
+			auto value = PyTuple_GetItem(m_code->co_consts, oparg);
+			if (!PyFloat_CheckExact(value) && !PyLong_CheckExact(value)) {
+				return false;
+			}
+			operand = KERNEL_OPERAND(KOK_Const, oparg);
+			curByte += unit;
+			return true;
+		}
+	}
+	return false;
+}
+
+void AbstractInterpreter::emit_loop_kernel(RangeLoop& loop, LoopKernel& kernel) {
+	load_frame();
+	m_comp->emit_int(kernel.Kind);
+	m_comp->emit_int(kernel.Op);
+	m_comp->emit_int(kernel.Left);
+	m_comp->emit_int(kernel.Right);
+	m_comp->emit_int(kernel.Target);
+	m_comp->emit_load_local_addr(loop.Current);
+	m_comp->emit_load_local(loop.Step);
+	m_comp->emit_load_local_addr(loop.Remaining);
+	m_comp->emit_call(PyJit_RunLoopKernel);
+}
+
 void AbstractInterpreter::for_iter(int loopIndex, int opcodeIndex, BlockInfo *loopInfo) {
     // CPython always generates LOAD_FAST or a GET_ITER before a FOR_ITER.
     // Therefore we know that we always fall into a FOR_ITER when it is
@@ -4568,22 +7280,40 @@ void AbstractInterpreter::for_iter(int loopIndex, int opcodeIndex, BlockInfo *lo
     // oparg is where to jump on break
     auto iterValue = m_comp->emit_spill();
     dec_stack();
-    //bool inLoop = false;
-    //Local loopOpt1, loopOpt2;
+    auto rangeLoop = m_rangeLoops.find(opcodeIndex);
     if (loopInfo != nullptr) {
         loopInfo->LoopVar = iterValue;
+        loopInfo->Range = rangeLoop;
     }
 
     // now that we've saved the value into a temp we can mark the offset
     // label.
+    if (opcodeIndex == m_osrEntry) {
+        emit_osr_entry(iterValue);
+    }
     mark_offset_label(opcodeIndex);
 
-    m_comp->emit_load_local(iterValue);
-
     // TODO: It'd be nice to inline this...
     auto processValue = m_comp->emit_define_label();
 
-    emit_for_next(processValue, iterValue);
+    if (rangeLoop != nullptr && rangeLoop->Guarded) {
+        emit_range_next(*rangeLoop, processValue, Label(), iterValue, !should_box(opcodeIndex));
+    }
+    else if (rangeLoop != nullptr) {
+        auto generic = m_comp->emit_define_label();
+        auto checkDone = m_comp->emit_define_label();
+        emit_range_next(*rangeLoop, processValue, generic, iterValue, false);
+        m_comp->emit_branch(BranchAlways, checkDone);
+
+        m_comp->emit_mark_label(generic);
+        m_comp->emit_load_local(iterValue);
+        emit_for_next(processValue, iterValue);
+        m_comp->emit_mark_label(checkDone);
+    }
+    else {
+        m_comp->emit_load_local(iterValue);
+        emit_for_next(processValue, iterValue);
+    }
 
     int_error_check("for_iter failed");
 
@@ -4708,7 +7438,14 @@ void AbstractInterpreter::compare_op(int compareType, int& i, int opcodeIndex) {
             }
 
             if (!generated) {
-                emit_compare_object(compareType);
+                if (m_borrowedArgs.contains(opcodeIndex)) {
+                    m_comp->emit_int(compareType);
+                    m_comp->emit_int(m_borrowedArgs[opcodeIndex]);
+                    m_comp->emit_call(PyJit_RichCompare_Borrowed);
+                }
+                else {
+                    emit_compare_object(compareType);
+                }
                 dec_stack(2);
                 error_check("compare failed");
                 inc_stack();
@@ -4737,12 +7474,18 @@ void AbstractInterpreter::load_fast(int local, int opcodeIndex) {
         }
     }
 
-    bool checkUnbound = m_assignmentState.find(local) == m_assignmentState.end() || !m_assignmentState.find(local)->second;
+    bool checkUnbound = !m_assignmentState[local];
+    if (can_borrow(opcodeIndex)) {
+        // Borrowed values aren't ours to free, so they're tracked like unboxed ones
+        load_fast_worker(local, checkUnbound, false);
+        inc_stack(1, STACK_KIND_VALUE);
+        return;
+    }
     load_fast_worker(local, checkUnbound);
     inc_stack();
 }
 
-void AbstractInterpreter::load_fast_worker(int local, bool checkUnbound) {
+void AbstractInterpreter::load_fast_worker(int local, bool checkUnbound, bool incref) {
     emit_load_fast(local);
 
     if (checkUnbound) {
@@ -4763,8 +7506,10 @@ void AbstractInterpreter::load_fast_worker(int local, bool checkUnbound) {
         m_comp->emit_load_local(m_errorCheckLocal);
     }
 
-    m_comp->emit_dup();
-    emit_incref(false);
+    if (incref) {
+        m_comp->emit_dup();
+        emit_incref(false);
+    }
 }
 
 void AbstractInterpreter::unpack_ex(size_t size, int opcode) {
@@ -4852,8 +7597,8 @@ ExceptionHandler& AbstractInterpreter::get_ehblock() {
 // opcode then we'll branch to the generated label.
 void AbstractInterpreter::mark_offset_label(int index) {
     auto existingLabel = m_offsetLabels.find(index);
-    if (existingLabel != m_offsetLabels.end()) {
-        m_comp->emit_mark_label(existingLabel->second);
+    if (existingLabel != nullptr) {
+        m_comp->emit_mark_label(*existingLabel);
     }
     else {
         auto label = m_comp->emit_define_label();
@@ -31,9 +31,11 @@
 #include <unordered_map>
 
 #include "absvalue.h"
+#include "arena.h"
 #include "taggedptr.h"
 #include "intrins.h"
 #include "cowvector.h"
+#include "opcodemap.h"
 #include "ipycomp.h"
 
 using namespace std;
@@ -120,6 +122,44 @@ struct AbsIntBlockInfo {
 	}
 };
 
+// The native counter for a for loop which may be iterating over a range.  Step
+// is 0 if the loop ended up with a regular iterator.  Guarded loops deoptimize
+// when they don't get a range, so they never iterate generically.
+struct RangeLoop {
+	Local Current, Step, Remaining;
+	bool Guarded;
+};
+
+// A load whose value only needs to be borrowed by the instruction consuming it,
+// Arg is BORROWED_LEFT or BORROWED_RIGHT for which of its operands it is.
+struct BorrowedLoad {
+	size_t Consumer;
+	int Arg;
+};
+
+// The body of a range loop which PyJit_RunLoopKernel can run, see intrins.h
+// for what the fields hold.
+struct LoopKernel {
+	int Kind, Op, Left, Right, Target;
+};
+
+// What a call to a builtin or math function with unboxed arguments is replaced
+// with, see find_intrinsic.
+enum IntrinsicOp {
+	IO_None,
+	// The argument is already what the call would return
+	IO_Identity,
+	IO_Sqrt,
+	IO_Floor,
+	IO_Ceil,
+	IO_FloatAbs,
+	IO_IntAbs,
+	IO_Min,
+	IO_Max,
+	IO_FloatToInt,
+	IO_IntToFloat
+};
+
 // Represents the state of the program at each opcode.  Captures the state of both
 // the Python stack and the local variables.  We store the state for each opcode in
 // AbstractInterpreter.m_startStates which represents the state before the indexed
@@ -128,7 +168,7 @@ struct AbsIntBlockInfo {
 // The stack is a unique vector for each interpreter state.  There's currently no
 // attempts at sharing because most instructions will alter the value stack.
 //
-// The locals are shared between InterpreterState's using a shared_ptr because the
+// The locals are shared between InterpreterState's using a reference count because the
 // values of locals won't change between most opcodes (via CowVector).  When updating
 // a local we first check if the locals are currently shared, and if not simply update
 // them in place.  If they are shared then we will issue a copy.
@@ -286,8 +326,15 @@ struct BlockInfo {
     EhFlags Flags;
     size_t CurrentHandler;  // the current exception handler, an index into m_allHandlers
     Local LoopVar; //, LoopOpt1, LoopOpt2;
+    // Set when LoopVar may hold a range which is being counted natively rather
+    // than an iterator.
+    RangeLoop* Range;
+    // The depth of the frame's value stack when the block was setup, which is what the
+    // interpreter records in the frame's block stack.
+    size_t FrameLevel;
 
     BlockInfo() {
+        Range = nullptr;
     }
 
     BlockInfo(int endOffset, int kind, size_t currentHandler = 0, EhFlags flags = EHF_None, int continueOffset = 0) {
@@ -296,6 +343,8 @@ struct BlockInfo {
         Flags = flags;
         CurrentHandler = currentHandler;
         ContinueOffset = continueOffset;
+        FrameLevel = 0;
+        Range = nullptr;
     }
 };
 
@@ -376,7 +425,7 @@ class DLL_EXPORT AbstractInterpreter {
 #pragma warning (disable:4251)
 	// ** Results produced:
 	// Tracks the interpreter state before each opcode
-	unordered_map<size_t, InterpreterState> m_startStates;
+	OpcodeMap<InterpreterState> m_startStates;
 	AbstractValue* m_returnValue;
 	IMethod* m_method;
 
@@ -385,19 +434,30 @@ class DLL_EXPORT AbstractInterpreter {
 	_Py_CODEUNIT *m_byteCode;
 	size_t m_size;
 	Local m_errorCheckLocal, m_lasti;
+	// The instruction being compiled when it skipped updating f_lasti, which
+	// the paths which raise update it to instead, or -1.
+	int m_lazyLasti;
 
 	// ** Data consumed during analysis:
 	// Tracks whether an END_FINALLY is being consumed by a finally block (true) or exception block (false)
-	unordered_map<size_t, bool> m_endFinallyIsFinally;
+	OpcodeMap<bool> m_endFinallyIsFinally;
+	// Instructions in except and finally handlers, where we're holding the
+	// exception and can't hand the frame over to the interpreter.
+	OpcodeMap<bool> m_handlerCode;
 	// Tracks the entry point for each POP_BLOCK opcode, so we can restore our
 	// stack state back after the POP_BLOCK
-	unordered_map<size_t, size_t> m_blockStarts;
+	OpcodeMap<size_t> m_blockStarts;
 	// Tracks the location where each BREAK_LOOP will break to, so we can merge
 	// state with the current state to the breaked location.
-	unordered_map<size_t, AbsIntBlockInfo> m_breakTo;
-	unordered_map<size_t, AbstractSource*> m_opcodeSources;
-	// all values produced during abstract interpretation, need to be freed
-	vector<AbstractValue*> m_values;
+	OpcodeMap<AbsIntBlockInfo> m_breakTo;
+	OpcodeMap<AbstractSource*> m_opcodeSources;
+	// Set when we're producing baseline code, in which case no type inference is
+	// done and every value on the stack is treated as an object.
+	bool m_baseline;
+	vector<AbstractValueWithSources> m_baselineStack;
+	// All of the sources created during abstract interpretation, which live in
+	// m_arena and are freed with it
+	Arena m_arena;
 	vector<AbstractSource*> m_sources;
 	vector<Local> m_raiseAndFreeLocals;
 	IPythonCompiler* m_comp;
@@ -411,7 +471,7 @@ class DLL_EXPORT AbstractInterpreter {
 	vector<ExceptionHandler> m_allHandlers;
 	// Labels that map from a Python byte code offset to an ilgen label.  This allows us to branch to any
 	// byte code offset.
-	unordered_map<int, Label> m_offsetLabels;
+	OpcodeMap<Label> m_offsetLabels;
 	// Tracks the depth of the Python stack
 	size_t m_blockIds;
 	// Tracks the current depth of the stack,  as well as if we have an object reference that needs to be freed.
@@ -419,7 +479,7 @@ class DLL_EXPORT AbstractInterpreter {
 	vector<bool> m_stack;
 	// Tracks the state of the stack when we perform a branch.  We copy the existing state to the map and
 	// reload it when we begin processing at the stack.
-	unordered_map<size_t, vector<bool>> m_offsetStack;
+	OpcodeMap<vector<bool>> m_offsetStack;
 	// Set of labels used for when we need to raise an error but have values on the stack
 	// that need to be freed.  We have one set of labels which fall through to each other
 	// before doing the raise:
@@ -429,26 +489,156 @@ class DLL_EXPORT AbstractInterpreter {
 	//  This was so we don't need to have decref/frees spread all over the code
 	vector<vector<Label>> m_raiseAndFree, m_reraiseAndFree;
 	unordered_set<size_t> m_jumpsTo;
+	// Targets of backwards jumps, where on-stack replacement can enter the code
+	unordered_set<size_t> m_loopHeads;
+	// When compiling for on-stack replacement, the loop head we're entered at and
+	// the depth of the frame's value stack there.
+	int m_osrEntry;
+	size_t m_osrStackDepth;
+	Label m_osrLabel;
+	bool m_osrEmitted;
+	// The values of f_lasti a suspended generator can be resumed at, and the labels
+	// for resuming at each one.  Set if we hit a yield we can't suspend at.
+	vector<int> m_resumePoints;
+	OpcodeMap<Label> m_resumeLabels;
+	bool m_resumeFailed;
+	// Set if we speculated on a guard somewhere it turned out we can't deoptimize,
+	// see predict_deopt.
+	bool m_deoptFailed;
+	// Caches for the values of LOAD_GLOBALs, indexed by name.  When not set globals
+	// are looked up on every load.
+	GlobalCache* m_globalCaches;
+	// Caches for LOAD_ATTR and STORE_ATTR, indexed by instruction.  When not set
+	// attributes always go through the generic lookup.
+	AttrCache* m_attrCaches;
+	// Caches for CALL_FUNCTION, indexed by instruction.  When not set calls are
+	// dispatched through the frame evaluation function.
+	CallCache* m_callCaches;
+	// LOAD_ATTRs which load a method for the CALL_FUNCTION they're paired with,
+	// pushing the function and self separately so no bound method is created.
+	OpcodeMap<bool> m_methodLoads;
+	OpcodeMap<bool> m_methodCalls;
+	size_t m_methodLoadCount;
+	// The globals of the frame we're compiling for, used to find the functions
+	// we're calling so small ones can be inlined.  Calls to inlined functions
+	// are indexed by the CALL_FUNCTION, and we hold references to their code
+	// until they're handed off to the compiled code.
+	PyObject* m_globals;
+	OpcodeMap<PyCodeObject*> m_inlinedCalls;
+	vector<PyObject*> m_inlinedCode;
+	// How many times each guard has failed in code previously compiled for the
+	// function, indexed by the instruction the guard follows.  When not set
+	// every guard we can deoptimize at is used.
+	unordered_map<int, int>* m_deopts;
 	Label m_retLabel;
 	Local m_retValue;
 	// Stores information for a stack allocated local used for sequence unpacking.  We need to allocate
 	// one of these when we enter the method, and we use it if we don't have a sequence we can efficiently
 	// unpack.
-	unordered_map<int, Local> m_sequenceLocals;
-	unordered_map<int, bool> m_assignmentState;
+	OpcodeMap<Local> m_sequenceLocals;
+	// Counters for FOR_ITERs which can iterate over ranges natively, indexed by
+	// the FOR_ITER.
+	OpcodeMap<RangeLoop> m_rangeLoops;
+	// FOR_ITERs whose loop variable we've typed as an int, which have to be
+	// guarded, see is_typed_range_loop.
+	OpcodeMap<bool> m_typedRangeLoops;
+	// Temporaries which are never allocated.  BUILD_TUPLEs which are immediately
+	// unpacked are marked along with their UNPACK_SEQUENCE, and the values are
+	// just reordered on the stack.  BUILD_SLICEs which are only subscripted with
+	// are marked along with their BINARY_SUBSCR or STORE_SUBSCR, which take the
+	// bounds directly.
+	OpcodeMap<bool> m_unpackedTuples;
+	OpcodeMap<bool> m_slicedSubscrs;
+	// BINARY_SUBSCRs and STORE_SUBSCRs whose key is a str constant loaded by the
+	// previous instruction, which can look up dicts with the key's cached hash.
+	OpcodeMap<PyObject*> m_strSubscrs;
+	// BINARY_ADDs and INPLACE_ADDs which are stored to a local by the next
+	// instruction, indexed by the add.  For strs the local is cleared before
+	// concatenating, like CPython's unicode_concatenate.
+	OpcodeMap<int> m_concatLocals;
+	// LOAD_FASTs and LOAD_CONSTs which are consumed by the next binary operation
+	// or comparison, which can borrow the value instead of taking a reference.
+	// The operands which were borrowed are recorded for the consumer as the
+	// loads are compiled.
+	OpcodeMap<BorrowedLoad> m_borrowedLoads;
+	OpcodeMap<int> m_borrowedArgs;
+	// Instructions we can't compile, with why, where the frame is handed over to
+	// the interpreter to finish running.
+	OpcodeMap<const char*> m_sideExits;
+	// Tracks which locals are definitely assigned on entry, indexed by local
+	vector<bool> m_assignmentState;
 	unordered_map<int, unordered_map<AbstractValueKind, Local>> m_optLocals;
 	UserModule *m_module;
+	// Timings of the phases run so far, which are handed off to the compiled code
+	CompileStats m_stats;
+	// Why the code couldn't be compiled, and the opcode responsible or -1
+	const char* m_failReason;
+	int m_failOpcode;
 #pragma warning (default:4251)
 
 public:
 	AbstractInterpreter(PyCodeObject *code, CompilerFactory* compFactory);
 	~AbstractInterpreter();
 
-	JittedCode* compile();
+	JittedCode* compile(CompileTier tier = TierOptimized);
+	// Does all of the work which requires the GIL (interpreting and generating the
+	// IL) and returns the method ready to be compiled to native code later.
+	PendingCode* compile_deferred(CompileTier tier = TierOptimized);
 	bool interpret();
+	// Prepares for generating baseline code, skipping type inference.
+	bool interpret_baseline();
+	// Compiles baseline code which is entered at the loop head loopHead by a frame
+	// which is already running in the interpreter, taking over the stackDepth values
+	// on its value stack.
+	JittedCode* compile_osr(int loopHead, size_t stackDepth);
+	// Finds the loop heads which on-stack replacement can enter the code at.
+	// Returns false if the code can't be compiled.
+	bool get_loop_heads(unordered_set<size_t>& loopHeads);
+	// Gets why the last compile failed and the opcode which caused it (or -1 if
+	// it wasn't down to a single opcode).
+	const char* get_fail_reason() {
+		return m_failReason == nullptr ? "unknown" : m_failReason;
+	}
+	int get_fail_opcode() {
+		return m_failOpcode;
+	}
 	void dump();
 
 	void set_local_type(int index, AbstractValueKind kind);
+	// Provides caches for LOAD_GLOBAL, one for each of the code's names, which
+	// must live as long as the compiled code.
+	void set_global_caches(GlobalCache* caches) {
+		m_globalCaches = caches;
+	}
+	// Provides caches for attribute access, one for each instruction in the code,
+	// which must live as long as the compiled code.  Must be set before the code
+	// is interpreted for method calls to be compiled without bound methods.
+	void set_attr_caches(AttrCache* caches) {
+		m_attrCaches = caches;
+	}
+	// Provides caches for calls, one for each instruction in the code, which must
+	// live as long as the compiled code.
+	void set_call_caches(CallCache* caches) {
+		m_callCaches = caches;
+	}
+	// Provides the globals of the frame being compiled, which calls to small
+	// functions are resolved against so they can be inlined.  Must be set before
+	// the code is interpreted.
+	void set_globals(PyObject* globals) {
+		m_globals = globals;
+	}
+	// Provides the counts of failed guards for the function, which must be set
+	// before the code is compiled.  Guards which have failed too often aren't
+	// used again.
+	void set_deopts(unordered_map<int, int>* deopts) {
+		m_deopts = deopts;
+	}
+	// Hands off the references to the code of the functions we've inlined, which
+	// must be kept alive as long as the compiled code.
+	void take_inlined_code(vector<PyObject*>& code) {
+		code.insert(code.end(), m_inlinedCode.begin(), m_inlinedCode.end());
+		m_inlinedCode.clear();
+	}
 	// Returns information about the specified local variable at a specific
 	// byte code index.
 	AbstractLocalInfo get_local_info(size_t byteCodeIndex, size_t localIndex);
@@ -467,11 +657,15 @@ public:
 	bool has_info(size_t byteCodeIndex);
 
 private:
+	bool fail(const char* reason, int opcode = -1);
 	void emit_lasti_init();
 	void emit_lasti_update(int index);
 	void load_frame();
 	const char * op_to_string(int op);
 	void compile_pop_block();
+	void setup_finally(int handlerOffset);
+	void setup_with(int handlerOffset);
+	void with_cleanup();
 	AbstractValue* to_abstract(PyObject* obj);
 	AbstractValue* to_abstract(AbstractValueKind kind);
 	bool merge_states(InterpreterState& newState, InterpreterState& mergeTo);
@@ -479,8 +673,17 @@ private:
 	void init_starting_state();
 	const char* opcode_name(int opcode);
 	bool preprocess();
+	void find_calls();
+	void find_temporaries();
+	void find_borrowed_loads();
+	bool can_borrow(size_t opcodeIndex);
+	bool find_call(size_t curByte, unordered_set<size_t>& jumpTargets, size_t& callIndex, size_t& argCnt);
+	bool can_inline(PyObject* callee, size_t argCnt);
+	AttrCache* attr_cache(size_t opcodeIndex);
+	CallCache* call_cache(size_t opcodeIndex);
 	void dump_sources(AbstractSource* sources);
-	AbstractSource* new_source(AbstractSource* source) {
+	template<typename T> AbstractSource* new_source() {
+		auto source = m_arena.make<T>();
 		m_sources.push_back(source);
 		return source;
 	}
@@ -491,7 +694,6 @@ private:
 
 	void make_function(int oparg);
 	void emit_debug_msg(const char * message);
-	bool can_skip_lasti_update(int opcodeIndex);
 	void build_tuple(size_t argCnt);
 	void extend_tuple(size_t argCnt);
 	void build_list(size_t argCnt);
@@ -566,7 +768,9 @@ private:
 	// Branches based if the current value is true/false based upon the current opcode
 	void branch(int& i);
 	void compare_op(int compareType, int& i, int opcodeIndex);
-	JittedCode* compile_worker();
+	bool compile_worker();
+	// Interprets the code for the given tier and generates its IL, timing each phase.
+	bool interpret_and_emit(CompileTier tier);
 
 	void periodic_work();
 	void store_fast(int local, int opcodeIndex);
@@ -574,9 +778,11 @@ private:
 	void load_const(int constIndex, int opcodeIndex);
 
 	void return_value(int opcodeIndex);
+	void yield_value(int opcodeIndex);
+	void yield_from(int opcodeIndex);
 
 	void load_fast(int local, int opcodeIndex);
-	void load_fast_worker(int local, bool checkUnbound);
+	void load_fast_worker(int local, bool checkUnbound, bool incref = true);
 	void unpack_sequence(size_t size, int opcode);
 	Local get_optimized_local(int index, AbstractValueKind kind);
 	void pop_except();
@@ -609,6 +815,18 @@ private:
 	void emit_print_expr();
 	void emit_load_classderef(int index);
 	void emit_getiter();
+	void reverse_stack(size_t count);
+	void emit_get_slice();
+	void emit_store_slice();
+	bool is_str_dict_subscr(size_t opcodeIndex, size_t curByte);
+	bool can_concatenate(size_t opcodeIndex, size_t curByte);
+	void emit_getiter_optimized(RangeLoop& loop);
+	bool is_range_call(size_t getIter);
+	bool is_typed_range_loop(size_t forIter);
+	void emit_range_next(RangeLoop& loop, Label processValue, Label generic, Local iterValue, bool tagged);
+	bool find_loop_kernel(size_t forIter, LoopKernel& kernel, bool checkLocals = true);
+	bool find_kernel_operand(size_t& curByte, size_t loopVar, int& operand);
+	void emit_loop_kernel(RangeLoop& loop, LoopKernel& kernel);
 
 	void emit_box_bool();
 	void emit_box_float();
@@ -623,6 +841,8 @@ private:
 	void emit_is_push_int(bool isNot);
 	void emit_binary_object(int opcode);
 	void emit_binary_tagged_int(int opcode);
+	void emit_binary_tagged_int_call(int opcode);
+	void emit_both_tagged(Local left, Local right, Label notTagged);
 	void emit_binary_float(int opcode);
 
 	void emit_compare_tagged_int(int compareType);
@@ -680,23 +900,45 @@ private:
 	void emit_set_extend();
 	void emit_new_dict(size_t size);
 	void emit_dict_store();
-	void emit_dict_store_no_decref();
+	void emit_build_const_key_map();
 	void emit_map_extend();
 	void emit_is_true();
 	void emit_load_name(void* name);
 	void emit_store_name(void* name);
 	void emit_delete_name(void* name);
-	void emit_store_attr(void* name);
+	void emit_store_attr(void* name, AttrCache* cache);
 	void emit_delete_attr(void* name);
-	void emit_load_attr(void* name);
+	void emit_load_attr(void* name, AttrCache* cache);
+	void emit_load_method(void* name, AttrCache* cache, Local self);
+	void emit_method_call(size_t opcodeIndex, size_t argCnt);
+	bool emit_direct_call(size_t opcodeIndex, size_t argCnt);
+	bool emit_inlined_call(size_t opcodeIndex, size_t argCnt, Label& done);
+	AbstractValue* find_inlined_result(InterpreterState& state, size_t opcodeIndex, size_t curByte, size_t argCnt);
+	void emit_inlined_result(size_t opcodeIndex, size_t curByte, size_t argCnt, Label done);
 	void emit_store_global(void* name);
 	void emit_delete_global(void* name);
-	void emit_load_global(void* name);
+	void emit_load_global(int nameIndex);
+	bool emit_builtin_call(size_t opcodeIndex, size_t argCnt);
+	BuiltinValue* find_module_attr(size_t curByte, int oparg);
+	bool predict_deopt(InterpreterState& state, size_t opcodeIndex, size_t curByte, size_t consumed);
+	void deopt_failed(size_t curByte);
+	IntrinsicOp find_intrinsic(InterpreterState& state, size_t opcodeIndex, size_t curByte, size_t argCnt, AbstractValueKind& result);
+	bool interpret_intrinsic_call(InterpreterState& state, size_t opcodeIndex, size_t curByte, size_t argCnt);
+	bool emit_intrinsic_call(size_t opcodeIndex, size_t curByte, size_t argCnt);
+	void emit_builtin_guard(KnownBuiltin builtin, Label notBuiltin);
+	void emit_intrinsic(IntrinsicOp op, Local* args, AbstractValueKind* argKinds);
+	void emit_intrinsic_result(AbstractValueKind kind, size_t curByte);
+	void emit_result_guard(AbstractValueKind kind, size_t curByte);
+	void emit_unbox_result();
+	Local emit_int_to_float(Local value);
 	void emit_delete_fast(int index);
 	void emit_new_tuple(size_t size);
 	void emit_tuple_load(size_t index);
 	void emit_tuple_store(size_t argCnt);
 	void emit_store_subscr();
+	void emit_sequence_item_addr(AbstractValueKind kind, Local container, Local index, Label generic);
+	void emit_sequence_subscr(AbstractValueKind kind);
+	void emit_list_store_subscr();
 	void emit_delete_subscr();
 	void emit_build_slice();
 	void emit_unary_positive();
@@ -717,6 +959,27 @@ private:
 	void decref();
 
 	void emit_push_frame();
+	void emit_osr_entry(Local iterValue);
+	bool is_generator();
+	size_t frame_stack_level();
+	bool can_suspend(int opcodeIndex);
+	vector<Local> get_frame_layout();
+	void load_frame_stack_slot(size_t index);
+	void emit_spill_to_frame(vector<Local>& layout);
+	void emit_reload_from_frame(vector<Local>& layout);
+	void emit_spill_locals(int opcodeIndex);
+	void emit_reload_locals(int opcodeIndex);
+	void emit_store_frame_int(size_t offset, int value);
+	void emit_suspend(size_t stackDepth, int resumePoint);
+	bool can_deopt(int opcodeIndex);
+	void emit_deopt(int opcodeIndex);
+	void interpret_side_exit(InterpreterState& state, int opcode, int oparg);
+	bool can_side_exit(int opcodeIndex);
+	void emit_side_exit(int opcodeIndex, int stackEffect);
+	void emit_range_to_frame(BlockInfo& block);
+	void emit_resume_dispatch();
+	void emit_get_yield_from_iter();
+	void emit_get_awaitable();
 	void emit_pop_frame();
 	void emit_eh_trace();
 	void load_local(int oparg);
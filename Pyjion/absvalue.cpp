@@ -38,12 +38,41 @@ BytesValue Bytes;
 DictValue Dict;
 NoneValue None;
 FunctionValue Function;
+static BuiltinValue g_builtins[KB_Count] = {
+    BuiltinValue(KB_Len, "len"),
+    BuiltinValue(KB_IsInstance, "isinstance"),
+    BuiltinValue(KB_Int, "int"),
+    BuiltinValue(KB_Float, "float"),
+    BuiltinValue(KB_Range, "range"),
+    BuiltinValue(KB_Abs, "abs"),
+    BuiltinValue(KB_Min, "min"),
+    BuiltinValue(KB_Max, "max"),
+    // Globals can't have a . in their name, so these are only found as attributes
+    BuiltinValue(KB_MathSqrt, "math.sqrt"),
+    BuiltinValue(KB_MathFloor, "math.floor"),
+    BuiltinValue(KB_MathCeil, "math.ceil"),
+};
 SliceValue Slice;
 ComplexValue Complex;
 
 AbstractSource::AbstractSource() {
-    Sources = shared_ptr<AbstractSources>(new AbstractSources());
-    Sources->Sources.insert(this);
+    m_parent = this;
+    m_rank = 0;
+    m_escapes = false;
+}
+
+AbstractSource* AbstractSource::find() {
+    auto cur = this;
+    while (cur->m_parent != cur) {
+        // path halving keeps the trees flat
+        cur->m_parent = cur->m_parent->m_parent;
+        cur = cur->m_parent;
+    }
+    return cur;
+}
+
+bool AbstractSource::same_set(AbstractSource* other) {
+    return find() == other->find();
 }
 
 AbstractValue* AbstractValue::binary(AbstractSource* selfSources, int op, AbstractValueWithSources& other) {
@@ -92,16 +121,11 @@ AbstractValue* AbstractValue::merge_with(AbstractValue*other) {
 }
 
 void AbstractSource::escapes() {
-    if (Sources) {
-        Sources->m_escapes = true;
-    }
+    find()->m_escapes = true;
 }
 
 bool AbstractSource::needs_boxing() {
-    if (Sources) {
-        return Sources->m_escapes;
-    }
-    return true;
+    return find()->m_escapes;
 }
 
 AbstractSource* AbstractSource::combine(AbstractSource* one, AbstractSource* two) {
@@ -110,37 +134,24 @@ AbstractSource* AbstractSource::combine(AbstractSource* one, AbstractSource* two
     }
     if (one != nullptr) {
         if (two != nullptr) {
-            if (one->Sources.get() == two->Sources.get()) {
+            auto rootOne = one->find();
+            auto rootTwo = two->find();
+            if (rootOne == rootTwo) {
                 return one;
             }
 
             // link the sources...
-            if (one->Sources->Sources.size() > two->Sources->Sources.size()) {
-                for (auto source : two->Sources->Sources) {
-                    one->Sources->Sources.insert(source);
-                    if (source != two) {
-                        source->Sources = one->Sources;
-                    }
-                }
-                if (two->needs_boxing() && !one->needs_boxing()) {
-                    one->escapes();
-                }
-                two->Sources = one->Sources;
-                return one;
+            if (rootOne->m_rank < rootTwo->m_rank) {
+                swap(rootOne, rootTwo);
             }
-            else {
-                for (auto source : one->Sources->Sources) {
-                    two->Sources->Sources.insert(source);
-                    if (source != one) {
-                        source->Sources = two->Sources;
-                    }
-                }
-                if (one->needs_boxing() && !two->needs_boxing()) {
-                    two->escapes();
-                }
-                one->Sources = two->Sources;
-                return two;
+            rootTwo->m_parent = rootOne;
+            if (rootOne->m_rank == rootTwo->m_rank) {
+                rootOne->m_rank++;
             }
+            if (rootTwo->m_escapes) {
+                rootOne->m_escapes = true;
+            }
+            return one;
         }
         else {
             // merging with an unknown source...
@@ -1054,6 +1065,41 @@ const char* FunctionValue::describe() {
     return "function";
 }
 
+// BuiltinValue methods
+const char* BuiltinValue::describe() {
+    return m_name;
+}
+
+BuiltinValue* BuiltinValue::find(const char* name) {
+    for (int i = 0; i < KB_Count; i++) {
+        if (!strcmp(g_builtins[i].m_name, name)) {
+            return &g_builtins[i];
+        }
+    }
+    return nullptr;
+}
+
+BuiltinValue* BuiltinValue::find_attr(const char* module, const char* name) {
+    auto len = strlen(module);
+    for (int i = 0; i < KB_Count; i++) {
+        auto builtinName = g_builtins[i].m_name;
+        if (!strncmp(builtinName, module, len) && builtinName[len] == '.' &&
+            !strcmp(builtinName + len + 1, name)) {
+            return &g_builtins[i];
+        }
+    }
+    return nullptr;
+}
+
+BuiltinValue* BuiltinValue::from(AbstractValue* value) {
+    for (int i = 0; i < KB_Count; i++) {
+        if (value == &g_builtins[i]) {
+            return &g_builtins[i];
+        }
+    }
+    return nullptr;
+}
+
 // SliceValue methods
 AbstractValueKind SliceValue::kind() {
     return AVK_Slice;
@@ -33,7 +33,6 @@
 class AbstractValue;
 struct AbstractValueWithSources;
 class LocalSource;
-struct AbstractSources;
 class AbstractSource;
 
 enum AbstractValueKind {
@@ -86,16 +85,25 @@ static bool is_known_type(AbstractValueKind kind) {
 }
 
 
+// Tracks where a value came from, and whether it escapes to code which needs it
+// boxed.  Sources which flow into the same value are linked into a single set
+// (a union-find forest) and the root of the set records if any of them escape.
 class AbstractSource {
-public:
-    shared_ptr<AbstractSources> Sources;
+    AbstractSource* m_parent;
+    unsigned int m_rank;
+    bool m_escapes;
 
+    AbstractSource* find();
+public:
     AbstractSource();
 
     void escapes();
 
     bool needs_boxing();
 
+    // Checks if the two sources have been combined into the same set.
+    bool same_set(AbstractSource* other);
+
     virtual const char* describe() {
         return "unknown source";
     }
@@ -103,24 +111,6 @@ public:
     static AbstractSource* combine(AbstractSource* one, AbstractSource*two);
 };
 
-struct AbstractSources {
-    unordered_set<AbstractSource*> Sources;
-    bool m_escapes;
-
-    AbstractSources() {
-        Sources = unordered_set<AbstractSource*>();
-        m_escapes = false;
-    }
-    void escapes() {
-        m_escapes = true;
-    }
-
-    bool needs_boxing() {
-        return m_escapes;
-    }
-
-};
-
 class ConstSource : public AbstractSource {
 public:
     virtual const char* describe() {
@@ -259,7 +249,7 @@ struct AbstractValueWithSources {
             return false;
         }
 
-        return Sources->Sources.get() == other.Sources->Sources.get();
+        return Sources->same_set(other.Sources);
     }
 
     bool operator!= (AbstractValueWithSources& other) {
@@ -373,6 +363,48 @@ class FunctionValue : public AbstractValue {
     virtual const char* describe();
 };
 
+// The builtins, and functions from the math module, we specialize calls to.
+enum KnownBuiltin {
+    KB_Len,
+    KB_IsInstance,
+    KB_Int,
+    KB_Float,
+    KB_Range,
+    KB_Abs,
+    KB_Min,
+    KB_Max,
+    KB_MathSqrt,
+    KB_MathFloor,
+    KB_MathCeil,
+    KB_Count
+};
+
+// A global which we speculate is one of the well known builtins based upon its
+// name.  Nothing stops the name from being rebound in the module or in builtins,
+// so code generated using this must check the value it really gets.
+class BuiltinValue : public FunctionValue {
+    KnownBuiltin m_builtin;
+    const char* m_name;
+public:
+    BuiltinValue(KnownBuiltin builtin, const char* name) : m_builtin(builtin), m_name(name) {
+    }
+
+    KnownBuiltin builtin() {
+        return m_builtin;
+    }
+
+    virtual const char* describe();
+
+    // Gets the value for a global with the given name, or nullptr if it's not a
+    // builtin we know about.
+    static BuiltinValue* find(const char* name);
+    // Gets the value for an attribute of a module imported into the globals,
+    // e.g. math.sqrt, or nullptr if it's not one we know about.
+    static BuiltinValue* find_attr(const char* module, const char* name);
+    // Gets value as a builtin, or nullptr if it isn't one.
+    static BuiltinValue* from(AbstractValue* value);
+};
+
 class SliceValue : public AbstractValue {
     virtual AbstractValueKind kind();
     virtual AbstractValue* unary(AbstractSource* selfSources, int op);
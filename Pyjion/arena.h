@@ -0,0 +1,100 @@
+/*
+* The MIT License (MIT)
+*
+* Copyright (c) Microsoft Corporation
+*
+* Permission is hereby granted, free of charge, to any person obtaining a
+* copy of this software and associated documentation files (the "Software"),
+* to deal in the Software without restriction, including without limitation
+* the rights to use, copy, modify, merge, publish, distribute, sublicense,
+* and/or sell copies of the Software, and to permit persons to whom the
+* Software is furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included
+* in all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+* OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+* THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+* OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+* ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+* OTHER DEALINGS IN THE SOFTWARE.
+*
+*/
+
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <cstddef>
+#include <new>
+#include <utility>
+#include <vector>
+
+using namespace std;
+
+// Bump allocator for objects which all live exactly as long as a compile.  The
+// memory is released in one go when the arena is destroyed and destructors are
+// never run, so only trivially destructible objects should be allocated from it.
+class Arena {
+    vector<char*> m_blocks;
+    char* m_cur;
+    size_t m_remaining;
+    size_t m_allocations;
+
+    static const size_t BlockSize = 16 * 1024;
+
+    Arena(const Arena&);
+    Arena& operator=(const Arena&);
+public:
+    Arena() {
+        m_cur = nullptr;
+        m_remaining = 0;
+        m_allocations = 0;
+    }
+
+    ~Arena() {
+        for (auto cur = m_blocks.begin(); cur != m_blocks.end(); cur++) {
+            free(*cur);
+        }
+    }
+
+    void* allocate(size_t size, size_t align = alignof(max_align_t)) {
+        size_t padding = (align - ((uintptr_t)m_cur & (align - 1))) & (align - 1);
+        if (m_cur == nullptr || padding + size > m_remaining) {
+            size_t blockSize = size + align > BlockSize ? size + align : BlockSize;
+            auto block = (char*)malloc(blockSize);
+            if (block == nullptr) {
+                throw bad_alloc();
+            }
+            m_blocks.push_back(block);
+            m_cur = block;
+            m_remaining = blockSize;
+            padding = (align - ((uintptr_t)m_cur & (align - 1))) & (align - 1);
+        }
+
+        auto res = m_cur + padding;
+        m_cur = res + size;
+        m_remaining -= padding + size;
+        m_allocations++;
+        return res;
+    }
+
+    template<typename T, typename... Args> T* make(Args&&... args) {
+        return new (allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+    }
+
+    // The number of objects allocated and the number of blocks of memory they
+    // were carved out of.
+    size_t allocations() {
+        return m_allocations;
+    }
+
+    size_t block_count() {
+        return m_blocks.size();
+    }
+};
+
+#endif
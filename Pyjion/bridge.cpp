@@ -9,22 +9,17 @@
  * bring in any header files, and just exports the implementation defines here.
  */
 #ifdef PLATFORM_UNIX
-#include <sys/mman.h>
 #include <unistd.h>
 #endif
 
 #include <cstdarg>
 #include <cstdio>
+#include <chrono>
 
 #if !PLATFORM_UNIX
 #include <windows.h>
 #endif
 
-#ifdef PLATFORM_UNIX
-extern "C" int g_executableMmapProt = PROT_READ | PROT_WRITE | PROT_EXEC;
-extern "C" int g_privateAnonMmapFlags = MAP_PRIVATE | MAP_ANONYMOUS;
-#endif
-
 extern "C" size_t pyjit_pagesize() {
 #ifdef PLATFORM_UNIX
 	return sysconf(_SC_PAGESIZE);
@@ -35,6 +30,11 @@ extern "C" size_t pyjit_pagesize() {
 #endif
 }
 
+extern "C" unsigned long long pyjit_now() {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
 int pyjit_log(const char *__restrict format, ...) {
 	va_list arglist;
 
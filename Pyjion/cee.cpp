@@ -39,6 +39,7 @@ HRESULT __stdcall GetCORSystemDirectoryInternal(SString& pbuffer) {
 #endif
 
 CCorJitHost g_pyjionjitHost;
+thread_local size_t CCorJitHost::s_allocated = 0;
 
 void CeeInit() {
 	CoreClrCallbacks cccallbacks;
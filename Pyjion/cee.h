@@ -43,6 +43,8 @@
 #include "openum.h"
 
 #include "bridge.h"
+#include "codeheap.h"
+#include "compilearena.h"
 
 #define DUMMY_CODE_HEAP (HANDLE)0x12345679
 class CExecutionEngine : public IExecutionEngine, public IEEMemoryManager {
@@ -373,16 +375,29 @@ public:
 
 	void* AllocExecutable(ULONG size) {
 #ifdef PLATFORM_UNIX
-		// TODO: Implement a heap on top of VirtualAlloc
-		return mmap(NULL, size, g_executableMmapProt, g_privateAnonMmapFlags, -1, 0);
+		return pyjit_code_alloc(size, 0, nullptr);
 #else
 		return HeapAlloc(m_codeHeap, 0, size); 
 #endif
 	}
 
+#ifdef PLATFORM_UNIX
+	// Allocates code along with read-only data that is within rel32 range of it.
+	// Both blocks are writable until they're sealed.
+	void* AllocExecutable(ULONG codeSize, ULONG dataSize, void** data) {
+		return pyjit_code_alloc(codeSize, dataSize, data);
+	}
+
+	// Makes a block from AllocExecutable executable (or read-only for data) once
+	// the JIT is done writing to it.
+	BOOL SealExecutable(PVOID block) {
+		return pyjit_code_seal(block) == 0;
+	}
+#endif
+
 	BOOL FreeExecutable(PVOID code) {
 #ifdef PLATFORM_UNIX
-		return munmap(code, 0);
+		return pyjit_code_free(code) == 0;
 #else
 		return HeapFree(m_codeHeap, 0, code);
 #endif
@@ -393,12 +408,21 @@ private:
 };  // interface IExecutionEngine
 
 class CCorJitHost : public ICorJitHost {
+public:
+	// Bytes the JIT has allocated on the current thread.  The JIT frees its
+	// allocations when a compile finishes, so the difference across a compile is
+	// how much memory it needed.
+	static thread_local size_t s_allocated;
+
+private:
+	// Pages for the JIT's arena are recycled for the thread's next compile
 	void * allocateMemory(size_t size, bool usePageAllocator = false) {
-		return malloc(size);
+		s_allocated += size;
+		return JitPagePool::current().allocate(size, usePageAllocator);
 	}
 
 	void freeMemory(void * block, bool usePageAllocator = false) {
-        free(block);
+		JitPagePool::current().free(block, usePageAllocator);
 	}
 
 	int getIntConfigValue(const wchar_t * name, int defaultValue) {
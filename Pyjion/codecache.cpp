@@ -0,0 +1,229 @@
+/*
+* The MIT License (MIT)
+*
+* Copyright (c) Microsoft Corporation
+*
+* Permission is hereby granted, free of charge, to any person obtaining a
+* copy of this software and associated documentation files (the "Software"),
+* to deal in the Software without restriction, including without limitation
+* the rights to use, copy, modify, merge, publish, distribute, sublicense,
+* and/or sell copies of the Software, and to permit persons to whom the
+* Software is furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included
+* in all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+* OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+* THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+* OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+* ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+* OTHER DEALINGS IN THE SOFTWARE.
+*
+*/
+
+#include "codecache.h"
+
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <sys/stat.h>
+#ifdef PLATFORM_UNIX
+#include <unistd.h>
+#else
+#include <direct.h>
+#include <process.h>
+#endif
+
+using namespace std;
+
+// Anything compiled by a different build of Pyjion or CPython could have made
+// different decisions, so the build is part of every key.
+static const char g_buildId[] = "pyjion " PY_VERSION " " __DATE__ " " __TIME__;
+
+#define CACHE_ENTRY_EXTENSION ".pjc"
+
+// 64-bit FNV-1a, which is stable across processes unlike the str hash.
+class StableHash {
+	PY_UINT64_T m_value;
+
+public:
+	StableHash() {
+		m_value = 0xcbf29ce484222325ULL;
+	}
+
+	PY_UINT64_T value() {
+		return m_value;
+	}
+
+	void add(const void* data, size_t size) {
+		auto bytes = (const unsigned char*)data;
+		for (size_t i = 0; i < size; i++) {
+			m_value ^= bytes[i];
+			m_value *= 0x100000001b3ULL;
+		}
+	}
+
+	void add(const char* str) {
+		add(str, strlen(str) + 1);
+	}
+
+	void add_int(PY_INT64_T value) {
+		add(&value, sizeof(value));
+	}
+
+	bool add_repr(PyObject* obj) {
+		auto repr = PyObject_Repr(obj);
+		if (repr == nullptr) {
+			PyErr_Clear();
+			return false;
+		}
+		auto res = add_object(repr);
+		Py_DECREF(repr);
+		return res;
+	}
+
+	bool add_code(PyCodeObject* code) {
+		add_int(code->co_argcount);
+		add_int(code->co_kwonlyargcount);
+		add_int(code->co_nlocals);
+		add_int(code->co_flags);
+		return add_object(code->co_code) &&
+			add_object(code->co_consts) &&
+			add_object(code->co_names) &&
+			add_object(code->co_varnames) &&
+			add_object(code->co_freevars) &&
+			add_object(code->co_cellvars);
+	}
+
+	// Hashes the kinds of objects which show up in co_consts.  Anything else
+	// (e.g. frozensets, whose iteration order depends on the str hash) makes
+	// the code uncacheable.
+	bool add_object(PyObject* obj) {
+		if (obj == Py_None || obj == Py_True || obj == Py_False || obj == Py_Ellipsis) {
+			add(Py_TYPE(obj)->tp_name);
+			add_int(obj == Py_True);
+			return true;
+		}
+		else if (PyLong_CheckExact(obj) || PyFloat_CheckExact(obj) || PyComplex_CheckExact(obj)) {
+			add(Py_TYPE(obj)->tp_name);
+			return add_repr(obj);
+		}
+		else if (PyUnicode_CheckExact(obj)) {
+			Py_ssize_t size;
+			auto str = PyUnicode_AsUTF8AndSize(obj, &size);
+			if (str == nullptr) {
+				PyErr_Clear();
+				return false;
+			}
+			add("str");
+			add_int(size);
+			add(str, size);
+			return true;
+		}
+		else if (PyBytes_CheckExact(obj)) {
+			add("bytes");
+			add_int(PyBytes_GET_SIZE(obj));
+			add(PyBytes_AS_STRING(obj), PyBytes_GET_SIZE(obj));
+			return true;
+		}
+		else if (PyTuple_CheckExact(obj)) {
+			add("tuple");
+			add_int(PyTuple_GET_SIZE(obj));
+			for (Py_ssize_t i = 0; i < PyTuple_GET_SIZE(obj); i++) {
+				if (!add_object(PyTuple_GET_ITEM(obj, i))) {
+					return false;
+				}
+			}
+			return true;
+		}
+		else if (PyCode_Check(obj)) {
+			add("code");
+			return add_code((PyCodeObject*)obj);
+		}
+		return false;
+	}
+};
+
+bool CodeCache::set_dir(const char* dir) {
+	if (dir[0] != '\0') {
+		struct stat info;
+		if (stat(dir, &info) != 0) {
+#ifdef PLATFORM_UNIX
+			if (mkdir(dir, 0777) != 0 && errno != EEXIST) {
+#else
+			if (_mkdir(dir) != 0 && errno != EEXIST) {
+#endif
+				return false;
+			}
+		}
+		else if (!(info.st_mode & S_IFDIR)) {
+			return false;
+		}
+	}
+	m_dir = dir;
+	return true;
+}
+
+bool CodeCache::get_key(PyCodeObject* code, vector<PyTypeObject*>& types, PY_UINT64_T& key) {
+	StableHash hash;
+	hash.add(g_buildId);
+	if (!hash.add_code(code)) {
+		return false;
+	}
+
+	hash.add_int(types.size());
+	for (auto cur = types.begin(); cur != types.end(); cur++) {
+		hash.add(*cur == nullptr ? "*" : (*cur)->tp_name);
+	}
+
+	key = hash.value();
+	return true;
+}
+
+string CodeCache::entry_path(PY_UINT64_T key) {
+	char name[32];
+	snprintf(name, sizeof(name), "/%016llx" CACHE_ENTRY_EXTENSION, (unsigned long long)key);
+	return m_dir + name;
+}
+
+bool CodeCache::is_known_failure(PY_UINT64_T key) {
+	struct stat info;
+	return stat(entry_path(key).c_str(), &info) == 0;
+}
+
+void CodeCache::record_failure(PY_UINT64_T key, PyCodeObject* code) {
+	// Other processes can be using the cache at the same time, so write the entry
+	// out under a name which is unique to us and then rename it into place.  The
+	// rename is atomic, readers either see the whole entry or no entry.
+	auto path = entry_path(key);
+	char suffix[32];
+#ifdef PLATFORM_UNIX
+	snprintf(suffix, sizeof(suffix), ".%d.tmp", (int)getpid());
+#else
+	snprintf(suffix, sizeof(suffix), ".%d.tmp", (int)_getpid());
+#endif
+	auto tmpPath = path + suffix;
+
+	auto file = fopen(tmpPath.c_str(), "w");
+	if (file == nullptr) {
+		return;
+	}
+	auto name = PyUnicode_AsUTF8(code->co_name);
+	auto filename = PyUnicode_AsUTF8(code->co_filename);
+	if (name == nullptr || filename == nullptr) {
+		PyErr_Clear();
+	}
+	fprintf(file, "%s\nfailed %s from %s line %d\n",
+		g_buildId,
+		name != nullptr ? name : "?",
+		filename != nullptr ? filename : "?",
+		code->co_firstlineno
+	);
+	bool written = fclose(file) == 0;
+
+	if (!written || rename(tmpPath.c_str(), path.c_str()) != 0) {
+		remove(tmpPath.c_str());
+	}
+}
@@ -0,0 +1,75 @@
+/*
+* The MIT License (MIT)
+*
+* Copyright (c) Microsoft Corporation
+*
+* Permission is hereby granted, free of charge, to any person obtaining a
+* copy of this software and associated documentation files (the "Software"),
+* to deal in the Software without restriction, including without limitation
+* the rights to use, copy, modify, merge, publish, distribute, sublicense,
+* and/or sell copies of the Software, and to permit persons to whom the
+* Software is furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included
+* in all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+* OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+* THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+* OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+* ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+* OTHER DEALINGS IN THE SOFTWARE.
+*
+*/
+
+#ifndef CODECACHE_H
+#define CODECACHE_H
+
+#include <Python.h>
+#include <string>
+#include <vector>
+
+/* Persistent negative cache of compilation results, shared between processes
+ * through a directory on disk.  Entries are keyed on a hash of the code object
+ * (byte code, constants, names and signature), the types a specialization was
+ * compiled for, and the Pyjion/CPython build.
+ *
+ * Jitted code can't be stored: it embeds the addresses of the Python objects it
+ * uses (constants, names, types, None, ...) as immediates, so it's only valid in
+ * the process which produced it.  All we persist is which functions fail to
+ * compile, so that new processes don't need to run the abstract interpreter to
+ * find that out again.  An entry lasts as long as the build does, so only
+ * failures which won't go away on a retry should be recorded.
+ */
+class CodeCache {
+	std::string m_dir;
+
+public:
+	bool enabled() {
+		return m_dir.size() != 0;
+	}
+
+	const std::string& get_dir() {
+		return m_dir;
+	}
+
+	// Sets the cache directory, creating it if needed.  An empty string disables
+	// the cache.  Returns false if the directory can't be used.
+	bool set_dir(const char* dir);
+
+	// Computes the cache key for a specialization of a code object.  Returns false
+	// if the code holds constants which can't be hashed stably across processes.
+	static bool get_key(PyCodeObject* code, std::vector<PyTypeObject*>& types, PY_UINT64_T& key);
+
+	// Checks for and records a failure to compile the specialization with key.
+	// The entry holds the function's name and location for anyone looking
+	// through the directory.
+	bool is_known_failure(PY_UINT64_T key);
+	void record_failure(PY_UINT64_T key, PyCodeObject* code);
+
+private:
+	std::string entry_path(PY_UINT64_T key);
+};
+
+#endif
@@ -0,0 +1,437 @@
+/*
+* The MIT License (MIT)
+*
+* Copyright (c) Microsoft Corporation
+*
+* Permission is hereby granted, free of charge, to any person obtaining a
+* copy of this software and associated documentation files (the "Software"),
+* to deal in the Software without restriction, including without limitation
+* the rights to use, copy, modify, merge, publish, distribute, sublicense,
+* and/or sell copies of the Software, and to permit persons to whom the
+* Software is furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included
+* in all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+* OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+* THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+* OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+* ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+* OTHER DEALINGS IN THE SOFTWARE.
+*
+*/
+
+/* The executable code heap, see codeheap.h for an overview.  This lives on the
+ * normal C++ side of the world (like bridge.cpp) so it can use the standard
+ * library and the platform headers.
+ */
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <map>
+#include <vector>
+#include <mutex>
+
+#ifdef PLATFORM_UNIX
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#include "codeheap.h"
+
+using namespace std;
+
+#ifdef PLATFORM_UNIX
+
+// Address space reserved up front for each region.  Being well under 2GB every
+// block within a region is reachable from every other one with a rel32.
+#define CODE_HEAP_REGION_SIZE	(64 * 1024 * 1024)
+#define CODE_HEAP_SLAB_SIZE		(64 * 1024)
+#define CODE_HEAP_REL32_RANGE	((size_t)0x7fffffff)
+
+// Size classes in pages.  Every block has pages of its own so that changing
+// the protection of one never affects its neighbors.
+static const size_t g_codeSizeClasses[] = { 1, 2, 4 };
+#define CODE_SIZE_CLASS_COUNT	(sizeof(g_codeSizeClasses) / sizeof(g_codeSizeClasses[0]))
+// Blocks bigger than the largest size class get a page rounded span of their own.
+#define CODE_SIZE_CLASS_LARGE	CODE_SIZE_CLASS_COUNT
+
+enum CodeHeapKind {
+	CHK_Code,
+	CHK_Data,
+	CHK_Count
+};
+
+struct CodeRegion;
+
+struct CodeSlab {
+	CodeRegion* Region;
+	char* Base;
+	size_t Size;			// bytes of pages backing the slab
+	size_t BlockSize;		// equal to Size for large blocks
+	size_t SizeClass;
+	CodeHeapKind Kind;
+	size_t Live;
+	// The free list is kept out of line so that we never need to write to
+	// sealed pages to maintain it.
+	vector<uint32_t> Free;
+};
+
+struct CodeRegion {
+	char* Base;
+	size_t Size;
+	map<size_t, size_t> FreeSpans;	// offset -> length, page granular
+	vector<CodeSlab*> Partial[CHK_Count][CODE_SIZE_CLASS_COUNT];
+};
+
+class CodeHeap {
+	mutex m_lock;
+	vector<CodeRegion*> m_regions;
+	map<char*, CodeSlab*> m_slabs;
+	size_t m_pageSize, m_slabSize;
+	size_t m_reserved, m_committed, m_inUse, m_blocks;
+	bool m_reportedRange;
+
+public:
+	CodeHeap() {
+		m_pageSize = sysconf(_SC_PAGESIZE);
+		m_slabSize = round_to(CODE_HEAP_SLAB_SIZE, m_pageSize * g_codeSizeClasses[CODE_SIZE_CLASS_COUNT - 1]);
+		m_reserved = m_committed = m_inUse = m_blocks = 0;
+		m_reportedRange = false;
+	}
+
+	void* alloc(size_t codeSize, size_t dataSize, void** data) {
+		lock_guard<mutex> guard(m_lock);
+
+		// Prefer the most recently reserved region, it's the one most likely
+		// to have room without creating new slabs.
+		for (auto cur = m_regions.rbegin(); cur != m_regions.rend(); cur++) {
+			auto res = alloc_in(*cur, codeSize, dataSize, data);
+			if (res != nullptr) {
+				return res;
+			}
+		}
+
+		auto region = reserve_region(
+			round_to(codeSize, m_slabSize) + round_to(dataSize, m_slabSize)
+		);
+		if (region == nullptr) {
+			return nullptr;
+		}
+		return alloc_in(region, codeSize, dataSize, data);
+	}
+
+	int seal(void* block) {
+		lock_guard<mutex> guard(m_lock);
+
+		auto slab = find_slab(block);
+		if (slab == nullptr) {
+			return -1;
+		}
+		return protect((char*)block, slab->BlockSize, sealed_protection(slab->Kind));
+	}
+
+	int free(void* block) {
+		lock_guard<mutex> guard(m_lock);
+
+		auto slab = find_slab(block);
+		if (slab == nullptr) {
+			return -1;
+		}
+		free_block(slab, (char*)block);
+		return 0;
+	}
+
+	void stats(PyjitCodeHeapStats* stats) {
+		lock_guard<mutex> guard(m_lock);
+
+		stats->reserved = m_reserved;
+		stats->committed = m_committed;
+		stats->in_use = m_inUse;
+		stats->blocks = m_blocks;
+		stats->regions = m_regions.size();
+	}
+
+private:
+	static size_t round_to(size_t size, size_t align) {
+		return (size + align - 1) / align * align;
+	}
+
+	size_t size_class(size_t size) {
+		for (size_t i = 0; i < CODE_SIZE_CLASS_COUNT; i++) {
+			if (size <= g_codeSizeClasses[i] * m_pageSize) {
+				return i;
+			}
+		}
+		return CODE_SIZE_CLASS_LARGE;
+	}
+
+	static int sealed_protection(CodeHeapKind kind) {
+		return kind == CHK_Code ? PROT_READ | PROT_EXEC : PROT_READ;
+	}
+
+	// Changes the protection of a block, which owns all of its pages.
+	int protect(char* block, size_t size, int prot) {
+		return mprotect(block, size, prot);
+	}
+
+	CodeRegion* reserve_region(size_t minSize) {
+		size_t size = CODE_HEAP_REGION_SIZE;
+		if (minSize > size) {
+			size = round_to(minSize, CODE_HEAP_REGION_SIZE);
+		}
+
+		// Try and place new regions right after the previous one so that
+		// all of the jitted code stays close together.
+		void* hint = nullptr;
+		if (m_regions.size() != 0) {
+			hint = m_regions.back()->Base + m_regions.back()->Size;
+		}
+
+		auto base = (char*)mmap(hint, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		if (base == MAP_FAILED) {
+			return nullptr;
+		}
+
+		if (m_regions.size() != 0 && !m_reportedRange) {
+			// Code and its data always come from the same region so this is
+			// fine for correctness, but calls between regions won't be
+			// able to use rel32s.
+			auto first = m_regions.front()->Base;
+			auto low = base < first ? base : first;
+			auto high = base + size > first ? base + size : first;
+			if ((size_t)(high - low) > CODE_HEAP_REL32_RANGE) {
+				m_reportedRange = true;
+#if _DEBUG
+				printf("Code heap region %p is out of rel32 range of %p\r\n", base, first);
+#endif
+			}
+		}
+
+		auto region = new CodeRegion();
+		region->Base = base;
+		region->Size = size;
+		region->FreeSpans[0] = size;
+		m_regions.push_back(region);
+		m_reserved += size;
+		return region;
+	}
+
+	// Hands out a page aligned, writable span of the region.
+	char* alloc_span(CodeRegion* region, size_t size) {
+		for (auto cur = region->FreeSpans.begin(); cur != region->FreeSpans.end(); cur++) {
+			if (cur->second >= size) {
+				auto offset = cur->first;
+				auto length = cur->second;
+				auto res = region->Base + offset;
+				if (mprotect(res, size, PROT_READ | PROT_WRITE) != 0) {
+					return nullptr;
+				}
+
+				region->FreeSpans.erase(cur);
+				if (length > size) {
+					region->FreeSpans[offset + size] = length - size;
+				}
+				m_committed += size;
+				return res;
+			}
+		}
+		return nullptr;
+	}
+
+	void free_span(CodeRegion* region, char* span, size_t size) {
+		// Map fresh pages over the span, this gives the memory back to the
+		// OS and puts the range back to being inaccessible.
+		mmap(span, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+		m_committed -= size;
+
+		// Coalesce with the neighboring free spans
+		auto offset = (size_t)(span - region->Base);
+		auto next = region->FreeSpans.lower_bound(offset);
+		if (next != region->FreeSpans.end() && offset + size == next->first) {
+			size += next->second;
+			next = region->FreeSpans.erase(next);
+		}
+		if (next != region->FreeSpans.begin()) {
+			auto prev = next;
+			prev--;
+			if (prev->first + prev->second == offset) {
+				prev->second += size;
+				return;
+			}
+		}
+		region->FreeSpans[offset] = size;
+	}
+
+	CodeSlab* new_slab(CodeRegion* region, CodeHeapKind kind, size_t sizeClass, size_t size) {
+		auto slabSize = sizeClass == CODE_SIZE_CLASS_LARGE ? round_to(size, m_pageSize) : m_slabSize;
+		auto base = alloc_span(region, slabSize);
+		if (base == nullptr) {
+			return nullptr;
+		}
+
+		auto slab = new CodeSlab();
+		slab->Region = region;
+		slab->Base = base;
+		slab->Size = slabSize;
+		slab->SizeClass = sizeClass;
+		slab->Kind = kind;
+		slab->Live = 0;
+		if (sizeClass == CODE_SIZE_CLASS_LARGE) {
+			slab->BlockSize = slabSize;
+			slab->Free.push_back(0);
+		}
+		else {
+			slab->BlockSize = g_codeSizeClasses[sizeClass] * m_pageSize;
+			// Push in reverse order so blocks get handed out from low addresses up.
+			auto count = slabSize / slab->BlockSize;
+			slab->Free.reserve(count);
+			for (auto i = count; i-- > 0; ) {
+				slab->Free.push_back((uint32_t)i);
+			}
+			region->Partial[kind][sizeClass].push_back(slab);
+		}
+		m_slabs[base] = slab;
+		return slab;
+	}
+
+	char* alloc_block(CodeRegion* region, CodeHeapKind kind, size_t size) {
+		auto sizeClass = size_class(size);
+		CodeSlab* slab;
+		if (sizeClass == CODE_SIZE_CLASS_LARGE || region->Partial[kind][sizeClass].size() == 0) {
+			slab = new_slab(region, kind, sizeClass, size);
+			if (slab == nullptr) {
+				return nullptr;
+			}
+		}
+		else {
+			slab = region->Partial[kind][sizeClass].back();
+		}
+
+		auto block = slab->Base + slab->Free.back() * slab->BlockSize;
+
+		// Freed blocks are left inaccessible, open it up for writing until
+		// it's sealed.
+		if (protect(block, slab->BlockSize, PROT_READ | PROT_WRITE) != 0) {
+			if (slab->Live == 0) {
+				release_slab(slab);
+			}
+			return nullptr;
+		}
+
+		slab->Free.pop_back();
+		slab->Live++;
+		if (slab->Free.size() == 0 && sizeClass != CODE_SIZE_CLASS_LARGE) {
+			region->Partial[kind][sizeClass].pop_back();
+		}
+
+		m_inUse += slab->BlockSize;
+		m_blocks++;
+		return block;
+	}
+
+	void* alloc_in(CodeRegion* region, size_t codeSize, size_t dataSize, void** data) {
+		auto code = alloc_block(region, CHK_Code, codeSize == 0 ? 1 : codeSize);
+		if (code == nullptr) {
+			return nullptr;
+		}
+
+		char* dataBlock = nullptr;
+		if (dataSize != 0) {
+			dataBlock = alloc_block(region, CHK_Data, dataSize);
+			if (dataBlock == nullptr) {
+				free_block(find_slab(code), code);
+				return nullptr;
+			}
+		}
+		if (data != nullptr) {
+			*data = dataBlock;
+		}
+		return code;
+	}
+
+	CodeSlab* find_slab(void* block) {
+		auto slab = m_slabs.upper_bound((char*)block);
+		if (slab == m_slabs.begin()) {
+			return nullptr;
+		}
+		slab--;
+		if ((char*)block >= slab->first + slab->second->Size) {
+			return nullptr;
+		}
+		return slab->second;
+	}
+
+	void release_slab(CodeSlab* slab) {
+		if (slab->SizeClass != CODE_SIZE_CLASS_LARGE) {
+			auto& partial = slab->Region->Partial[slab->Kind][slab->SizeClass];
+			for (auto cur = partial.begin(); cur != partial.end(); cur++) {
+				if (*cur == slab) {
+					partial.erase(cur);
+					break;
+				}
+			}
+		}
+		m_slabs.erase(slab->Base);
+		free_span(slab->Region, slab->Base, slab->Size);
+		delete slab;
+	}
+
+	void free_block(CodeSlab* slab, char* block) {
+		bool wasFull = slab->Free.size() == 0;
+		slab->Free.push_back((uint32_t)((block - slab->Base) / slab->BlockSize));
+		slab->Live--;
+		m_inUse -= slab->BlockSize;
+		m_blocks--;
+
+		if (slab->Live == 0) {
+			// Nothing left in the slab, give the pages back so they can be
+			// reused for other size classes.
+			release_slab(slab);
+			return;
+		}
+
+		if (wasFull) {
+			slab->Region->Partial[slab->Kind][slab->SizeClass].push_back(slab);
+		}
+		// The block may have been freed without ever being sealed (e.g. the JIT
+		// failed), make sure its pages don't stay writable.
+		protect(block, slab->BlockSize, PROT_NONE);
+	}
+};
+
+// Constructed on first use so that it's safe to allocate from other static
+// initializers.
+static CodeHeap& code_heap() {
+	static CodeHeap heap;
+	return heap;
+}
+
+extern "C" void* pyjit_code_alloc(size_t codeSize, size_t dataSize, void** data) {
+	return code_heap().alloc(codeSize, dataSize, data);
+}
+
+extern "C" int pyjit_code_seal(void* block) {
+	return code_heap().seal(block);
+}
+
+extern "C" int pyjit_code_free(void* block) {
+	return code_heap().free(block);
+}
+
+extern "C" void pyjit_code_heap_stats(PyjitCodeHeapStats* stats) {
+	code_heap().stats(stats);
+}
+
+#else
+
+// On Windows jitted code comes from an executable heap created by the
+// execution engine, so there's nothing to report.
+extern "C" void pyjit_code_heap_stats(PyjitCodeHeapStats* stats) {
+	stats->reserved = stats->committed = stats->in_use = stats->blocks = stats->regions = 0;
+}
+
+#endif
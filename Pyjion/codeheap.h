@@ -0,0 +1,66 @@
+/*
+* The MIT License (MIT)
+*
+* Copyright (c) Microsoft Corporation
+*
+* Permission is hereby granted, free of charge, to any person obtaining a
+* copy of this software and associated documentation files (the "Software"),
+* to deal in the Software without restriction, including without limitation
+* the rights to use, copy, modify, merge, publish, distribute, sublicense,
+* and/or sell copies of the Software, and to permit persons to whom the
+* Software is furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included
+* in all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+* OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+* THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+* OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+* ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+* OTHER DEALINGS IN THE SOFTWARE.
+*
+*/
+
+#ifndef CODEHEAP_H
+#define CODEHEAP_H
+
+/* The executable code heap used for jitted code on Unix.  Like bridge.h this
+ * header is shared between the CoreCLR (PAL) portion of Pyjion and the normal
+ * C++ portion, so it only brings in <cstddef> which both sides can use.
+ *
+ * Memory is reserved in large regions which are carved into slabs, each slab
+ * serving a single size class of either code or read-only data.  Code and the
+ * data allocated alongside it always come from the same region so the JIT's
+ * rel32 accesses between the two stay in range.  Blocks are handed out
+ * writable and non-executable; pyjit_code_seal flips them to executable (code)
+ * or read-only (data) once the JIT is done writing them.  Size classes are
+ * whole pages, so no two blocks share a page: allocating, sealing or freeing
+ * a block never changes the protection of code which is running, and methods
+ * can be emitted on any thread.
+ */
+
+#include <cstddef>
+
+struct PyjitCodeHeapStats {
+	size_t reserved;		// address space reserved for the heap
+	size_t committed;		// bytes of pages handed out to slabs and large blocks
+	size_t in_use;			// bytes in live blocks, rounded up to their size class
+	size_t blocks;			// number of live blocks
+	size_t regions;			// number of reserved regions
+};
+
+// Allocates codeSize bytes of code and, if dataSize is non-zero, dataSize bytes
+// of read-only data within rel32 range of it.  Returns nullptr on failure.
+extern "C" void* pyjit_code_alloc(size_t codeSize, size_t dataSize, void** data);
+
+// Makes a block allocated from the heap executable (code) or read-only (data).
+extern "C" int pyjit_code_seal(void* block);
+
+// Returns a code or data block to the heap.
+extern "C" int pyjit_code_free(void* block);
+
+extern "C" void pyjit_code_heap_stats(PyjitCodeHeapStats* stats);
+
+#endif
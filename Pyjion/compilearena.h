@@ -0,0 +1,244 @@
+/*
+* The MIT License (MIT)
+*
+* Copyright (c) Microsoft Corporation
+*
+* Permission is hereby granted, free of charge, to any person obtaining a
+* copy of this software and associated documentation files (the "Software"),
+* to deal in the Software without restriction, including without limitation
+* the rights to use, copy, modify, merge, publish, distribute, sublicense,
+* and/or sell copies of the Software, and to permit persons to whom the
+* Software is furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included
+* in all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+* OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+* THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+* OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+* ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+* OTHER DEALINGS IN THE SOFTWARE.
+*
+*/
+
+#ifndef COMPILEARENA_H
+#define COMPILEARENA_H
+
+// This is included on the CLR side, so it can't use the STL.
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+
+// Memory for the IL, labels and sequence points generated by the compiles on a
+// thread.  Allocations are bumped out of blocks which are kept when the thread's
+// last compile session ends, so the next compile reuses them rather than going
+// back to the heap.  Sessions nest, as compiling can run Python code which
+// compiles something else, and memory is only recycled once the outermost ends.
+class CompileArena {
+	struct Block {
+		Block* next;
+		size_t size;
+	};
+
+	// Newest first, allocations come out of the first
+	Block* m_blocks;
+	char* m_cur;
+	char* m_end;
+	char* m_last;
+	int m_sessions;
+
+	static const size_t Align = 2 * sizeof(void*);
+	static const size_t MinBlockSize = 64 * 1024;
+	// We don't hold on to more than this between compiles
+	static const size_t MaxRetained = 4 * 1024 * 1024;
+
+	static size_t align(size_t size) {
+		return (size + Align - 1) & ~(Align - 1);
+	}
+
+	bool add_block(size_t size) {
+		if (size < MinBlockSize) {
+			size = MinBlockSize;
+		}
+		auto block = (Block*)malloc(align(sizeof(Block)) + size);
+		if (block == nullptr) {
+			return false;
+		}
+		block->next = m_blocks;
+		block->size = size;
+		m_blocks = block;
+		m_cur = (char*)block + align(sizeof(Block));
+		m_end = m_cur + size;
+		return true;
+	}
+
+	void free_blocks() {
+		while (m_blocks != nullptr) {
+			auto next = m_blocks->next;
+			::free(m_blocks);
+			m_blocks = next;
+		}
+		m_cur = m_end = m_last = nullptr;
+	}
+
+public:
+	// constexpr so the per thread instance is initialized statically
+	constexpr CompileArena() : m_blocks(nullptr), m_cur(nullptr), m_end(nullptr), m_last(nullptr), m_sessions(0) {
+	}
+
+	// The arena for the current thread.  Threads which stop compiling should call
+	// release() before they exit.
+	static CompileArena& current() {
+		static thread_local CompileArena arena;
+		return arena;
+	}
+
+	void* allocate(size_t size) {
+		size = align(size);
+		if (m_cur == nullptr || (size_t)(m_end - m_cur) < size) {
+			if (!add_block(size)) {
+				return nullptr;
+			}
+		}
+		m_last = m_cur;
+		m_cur += size;
+		return m_last;
+	}
+
+	// Grows an allocation, in place if it's the most recent one.  The contents
+	// are preserved.
+	void* grow(void* ptr, size_t oldSize, size_t newSize) {
+		if (ptr != nullptr && ptr == m_last && (size_t)(m_end - m_last) >= align(newSize)) {
+			m_cur = m_last + align(newSize);
+			return ptr;
+		}
+		auto res = allocate(newSize);
+		if (res != nullptr && ptr != nullptr) {
+			memcpy(res, ptr, oldSize);
+		}
+		return res;
+	}
+
+	void enter() {
+		m_sessions++;
+	}
+
+	// Ends a compile session, everything allocated becomes available again
+	// once there aren't any left.
+	void leave() {
+		if (--m_sessions == 0) {
+			reset();
+		}
+	}
+
+	// Recycles all of the memory.  If the last compile needed more than one block
+	// they're replaced with a single block as big as all of them, so compiles of
+	// a similar size get by without allocating.
+	void reset() {
+		if (m_blocks != nullptr && m_blocks->next != nullptr) {
+			size_t total = 0;
+			for (auto cur = m_blocks; cur != nullptr; cur = cur->next) {
+				total += cur->size;
+			}
+			free_blocks();
+			add_block(total < MaxRetained ? total : MaxRetained);
+		}
+		else if (m_blocks != nullptr) {
+			m_cur = (char*)m_blocks + align(sizeof(Block));
+		}
+		m_last = nullptr;
+	}
+
+	// Frees everything the arena is holding on to.
+	void release() {
+		free_blocks();
+	}
+
+	size_t block_count() {
+		size_t count = 0;
+		for (auto cur = m_blocks; cur != nullptr; cur = cur->next) {
+			count++;
+		}
+		return count;
+	}
+};
+
+// Recycles the pages RyuJIT's arena allocator gets from the host.  Each compile
+// allocates a few pages and frees them all when it's done, so the pages freed on
+// a thread are kept for the thread's next compile.  Every block records its size
+// so we know where it can go when it's freed.
+class JitPagePool {
+	struct Page {
+		Page* next;
+		size_t size;
+	};
+
+	Page* m_free;
+	size_t m_freeCount;
+
+	static const size_t MaxFreePages = 16;
+
+public:
+	constexpr JitPagePool() : m_free(nullptr), m_freeCount(0) {
+	}
+
+	static JitPagePool& current() {
+		static thread_local JitPagePool pool;
+		return pool;
+	}
+
+	// Allocates a block, reusing a free page of the same size for page allocator
+	// requests.
+	void* allocate(size_t size, bool page) {
+		if (page) {
+			for (Page** cur = &m_free; *cur != nullptr; cur = &(*cur)->next) {
+				if ((*cur)->size == size) {
+					auto res = *cur;
+					*cur = res->next;
+					m_freeCount--;
+					return res + 1;
+				}
+			}
+		}
+
+		auto res = (Page*)malloc(sizeof(Page) + size);
+		if (res == nullptr) {
+			return nullptr;
+		}
+		res->size = size;
+		return res + 1;
+	}
+
+	void free(void* block, bool page) {
+		if (block == nullptr) {
+			return;
+		}
+		auto header = (Page*)block - 1;
+		if (page && m_freeCount < MaxFreePages) {
+			header->next = m_free;
+			m_free = header;
+			m_freeCount++;
+		}
+		else {
+			::free(header);
+		}
+	}
+
+	size_t free_count() {
+		return m_freeCount;
+	}
+
+	// Frees the pages being held for reuse.
+	void release() {
+		while (m_free != nullptr) {
+			auto next = m_free->next;
+			::free(m_free);
+			m_free = next;
+		}
+		m_freeCount = 0;
+	}
+};
+
+#endif
@@ -26,46 +26,114 @@
 #ifndef COWVECTOR_H
 #define COWVECTOR_H
 
-#include <memory>
 #include <vector>
+#include <utility>
 #include <unordered_set>
 
 using namespace std;
 
-// Copy on write data implementation
+// Copy on write data implementation.  The data is reference counted intrusively
+// rather than with a shared_ptr: interpreter states are only ever touched by the
+// thread compiling the function, so the count doesn't need to be atomic, and the
+// count lives in the same allocation as the data.  A null pointer is the empty
+// value, so default constructed data doesn't allocate until it's mutated.
 template<typename T> class CowData {
-    shared_ptr<T> m_data;
+    struct Node {
+        size_t RefCount;
+        T Value;
+
+        Node() : RefCount(1) {
+        }
+
+        Node(const T& value) : RefCount(1), Value(value) {
+        }
+
+        Node(T&& value) : RefCount(1), Value(std::move(value)) {
+        }
+    };
+
+    Node* m_data;
+
+    void release() {
+        if (m_data != nullptr && --m_data->RefCount == 0) {
+            delete m_data;
+        }
+    }
+
 public:
-    CowData() {
+    CowData() : m_data(nullptr) {
+    }
+
+    CowData(T&& data) : m_data(new Node(std::move(data))) {
     }
 
-    CowData(T *data) : m_data(data) {
+    CowData(const CowData<T>& other) : m_data(other.m_data) {
+        if (m_data != nullptr) {
+            m_data->RefCount++;
+        }
     }
 
-    CowData(shared_ptr<T> data) : m_data(data) {
+    CowData(CowData<T>&& other) : m_data(other.m_data) {
+        other.m_data = nullptr;
     }
 
-    bool operator ==(CowData<T> other) {
-        return m_data.get() == other.m_data.get();
+    ~CowData() {
+        release();
     }
 
-    bool operator !=(CowData<T> other) {
-        return m_data.get() != other.m_data.get();
+    CowData<T>& operator =(const CowData<T>& other) {
+        if (other.m_data != nullptr) {
+            other.m_data->RefCount++;
+        }
+        release();
+        m_data = other.m_data;
+        return *this;
+    }
+
+    CowData<T>& operator =(CowData<T>&& other) {
+        if (this != &other) {
+            release();
+            m_data = other.m_data;
+            other.m_data = nullptr;
+        }
+        return *this;
+    }
+
+    bool operator ==(const CowData<T>& other) const {
+        return m_data == other.m_data;
+    }
+
+    bool operator !=(const CowData<T>& other) const {
+        return m_data != other.m_data;
     }
 
 protected:
     // Returns an instance of the data which isn't shared and is safe to mutate.
     T & get_mutable() {
-        if (!m_data.unique()) {
-            m_data = shared_ptr<T>(new T(*m_data));
+        if (m_data == nullptr) {
+            m_data = new Node();
+        }
+        else if (m_data->RefCount != 1) {
+            auto copy = new Node(m_data->Value);
+            m_data->RefCount--;
+            m_data = copy;
         }
-        return *m_data;
+        return m_data->Value;
     }
 
     // Returns an instance of the data which may be shared and is not safe to
     // mutate.
     T & get_current() {
-        return *m_data;
+        if (m_data == nullptr) {
+            return get_empty();
+        }
+        return m_data->Value;
+    }
+
+private:
+    static T& get_empty() {
+        static T empty;
+        return empty;
     }
 };
 
@@ -75,7 +143,7 @@ public:
     CowVector() {
     }
 
-    CowVector(size_t size) : CowData<vector<T>>(new vector<T>(size)) {
+    CowVector(size_t size) : CowData<vector<T>>(vector<T>(size)) {
     }
 
     T operator[](size_t index) {
@@ -107,10 +175,8 @@ template<typename T> class CowSet : public CowData<unordered_set<T>> {
     typedef typename unordered_set<T>::value_type value_type;
     typedef typename unordered_set<T>::key_type key_type;
     typedef typename unordered_set<T>::iterator iterator;
-    static shared_ptr<unordered_set<T>> s_empty;
 public:
-    CowSet() : CowData<unordered_set<T>>(get_empty()) {
-
+    CowSet() {
     }
 
     iterator find(const key_type& k) {
@@ -149,16 +215,6 @@ public:
         }
         return res;
     }
-
-private:
-    static shared_ptr<unordered_set<T>> get_empty() {
-        if (s_empty.get() == nullptr) {
-            s_empty = shared_ptr<unordered_set<T>>(new unordered_set<T>());
-        }
-        return s_empty;
-    }
 };
 
-template<typename T> shared_ptr<unordered_set<T>> CowSet<T>::s_empty;
-
 #endif
\ No newline at end of file
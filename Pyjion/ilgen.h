@@ -45,19 +45,26 @@
 
 #include "ipycomp.h"
 #include "bridge.h"
+#include "compilearena.h"
 
 extern const signed char    opcodeSizes[];
 extern const char * const   opcodeNames[];
 extern const BYTE           opcodeArgKinds[];
 
+// A vector that doesn't need the STL.  Its items live in the compile arena when
+// it has one, in which case they're recycled when the compile session ends,
+// and on the heap otherwise.  Heap items aren't freed automatically, the owner
+// calls release().
 template<typename T> struct simple_vector {
 	T* m_items;
 	size_t m_count, m_allocated;
+	CompileArena* m_arena;
 
 public:
-	simple_vector() {
+	simple_vector(CompileArena* arena = nullptr) {
 		m_items = nullptr;
 		m_count = m_allocated = 0;
+		m_arena = arena;
 	}
 
 	size_t size() {
@@ -68,18 +75,30 @@ public:
 		return m_items[n];
 	}
 
-	void push_back(T item) {
-		if (m_count >= m_allocated) {
-			auto newCount = max(4, m_allocated * 2);
-			T* newItems = (T*)malloc(sizeof(T) * newCount);
+	void reserve(size_t count) {
+		if (count <= m_allocated) {
+			return;
+		}
 
+		T* newItems;
+		if (m_arena != nullptr) {
+			newItems = (T*)m_arena->grow(m_items, m_count * sizeof(T), sizeof(T) * count);
+		}
+		else {
+			newItems = (T*)malloc(sizeof(T) * count);
 			if (m_items != nullptr) {
 				memcpy(newItems, m_items, m_count * sizeof(T));
 				free(m_items);
 			}
+		}
+
+		m_items = newItems;
+		m_allocated = count;
+	}
 
-			m_items = newItems;
-			m_allocated = newCount;
+	void push_back(T item) {
+		if (m_count >= m_allocated) {
+			reserve(max(4, m_allocated * 2));
 		}
 		m_items[m_count++] = item;
 	}
@@ -88,6 +107,26 @@ public:
 		_ASSERTE(m_count > 0);
 		m_count--;
 	}
+
+	// Copies the items onto the heap, so they outlive the compile session.
+	simple_vector<T> detach() const {
+		simple_vector<T> res;
+		if (m_count != 0) {
+			res.reserve(m_count);
+			memcpy(res.m_items, m_items, m_count * sizeof(T));
+			res.m_count = m_count;
+		}
+		return res;
+	}
+
+	// Frees heap allocated items, the arena takes care of its own.
+	void release() {
+		if (m_arena == nullptr) {
+			free(m_items);
+		}
+		m_items = nullptr;
+		m_count = m_allocated = 0;
+	}
 };
 
 class LabelInfo {
@@ -95,12 +134,14 @@ public:
 	int m_location;
 	simple_vector<int> m_branchOffsets;
 
-	LabelInfo() {
+	LabelInfo(CompileArena* arena = nullptr) : m_branchOffsets(arena) {
 		m_location = -1;
 	}
 };
 
 class ILGenerator {
+	// Null for a copy which has been detached from the compile session
+	CompileArena* m_arena;
 	simple_vector<Parameter> m_locals;
 	simple_vector<Local> m_freedLocals[CORINFO_TYPE_COUNT];
 	IMethod* m_method;
@@ -109,11 +150,51 @@ public:
 	simple_vector<BYTE> m_il;
 	int m_localCount;
 	simple_vector<LabelInfo> m_labels;
+	// The IL offset each bytecode instruction starts at, in increasing order
+	simple_vector<SequencePoint> m_sequencePoints;
 
 public:
-	ILGenerator(IMethod* method) {
+	ILGenerator(IMethod* method) : m_arena(&CompileArena::current()), m_locals(m_arena),
+		m_il(m_arena), m_labels(m_arena), m_sequencePoints(m_arena) {
+		for (int i = 0; i < CORINFO_TYPE_COUNT; i++) {
+			m_freedLocals[i] = simple_vector<Local>(m_arena);
+		}
 		m_method = method;
 		m_localCount = 0;
+		m_arena->enter();
+	}
+
+	// Copies what's needed to compile the IL onto the heap, so it can be compiled
+	// after the generator's compile session is done.
+	ILGenerator(const ILGenerator& other) : m_arena(nullptr), m_locals(other.m_locals.detach()),
+		m_il(other.m_il.detach()), m_sequencePoints(other.m_sequencePoints.detach()) {
+		m_method = other.m_method;
+		m_localCount = other.m_localCount;
+	}
+
+	ILGenerator& operator=(const ILGenerator&) = delete;
+
+	~ILGenerator() {
+		if (m_arena != nullptr) {
+			m_arena->leave();
+		}
+		else {
+			m_locals.release();
+			m_il.release();
+			m_sequencePoints.release();
+		}
+	}
+
+	// Sizes the buffers for a method with the given amount of bytecode, so they
+	// don't need to grow while it's being generated.
+	void reserve(size_t codeSize) {
+		m_il.reserve(codeSize * 16);
+		m_labels.reserve(codeSize / 2);
+		m_sequencePoints.reserve(codeSize / 2 + 1);
+	}
+
+	void mark_sequence_point(int bytecodeIndex) {
+		m_sequencePoints.push_back(SequencePoint((unsigned int)m_il.size(), bytecodeIndex));
 	}
 
 	Local define_local(Parameter param) {
@@ -146,7 +227,7 @@ public:
 	}
 
 	Label define_label() {
-		m_labels.push_back(LabelInfo());
+		m_labels.push_back(LabelInfo(m_arena));
 		return Label((int)m_labels.size() - 1);
 	}
 
@@ -304,6 +385,14 @@ public:
 		m_il.push_back(CEE_AND);
 	}
 
+	void bitwise_or() {
+		m_il.push_back(CEE_OR);
+	}
+
+	void bitwise_xor() {
+		m_il.push_back(CEE_XOR);
+	}
+
 	void pop() {
 		m_il.push_back(CEE_POP);
 	}
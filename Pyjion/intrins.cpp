@@ -29,6 +29,7 @@
 #include "taggedptr.h"
 #include <cstdint>
 #include <cstdlib>
+#include <climits>
 #ifdef PLATFORM_UNIX
 #include <x86intrin.h>
 #endif
@@ -43,6 +44,8 @@ using namespace msl::utilities;
 //#define DEBUG_TRACE
 extern PyObject* g_emptyTuple;
 #include <dictobject.h>
+#include <structmember.h>
+#include <opcode.h>
 #define NAME_ERROR_MSG \
     "name '%.200s' is not defined"
 
@@ -534,6 +537,82 @@ PyObject* PyJit_InplaceOr(PyObject *left, PyObject *right) {
     return res;
 }
 
+static void PyJit_ReleaseOwned(PyObject *left, PyObject *right, int borrowed) {
+    if (!(borrowed & BORROWED_LEFT)) {
+        Py_DECREF(left);
+    }
+    if (!(borrowed & BORROWED_RIGHT)) {
+        Py_DECREF(right);
+    }
+}
+
+PyObject* PyJit_Binary_Borrowed(PyObject *left, PyObject *right, int opcode, int borrowed) {
+    PyObject* res;
+    switch (opcode) {
+        case BINARY_SUBSCR: res = PyObject_GetItem(left, right); break;
+        case BINARY_ADD: res = PyNumber_Add(left, right); break;
+        case BINARY_TRUE_DIVIDE: res = PyNumber_TrueDivide(left, right); break;
+        case BINARY_FLOOR_DIVIDE: res = PyNumber_FloorDivide(left, right); break;
+        case BINARY_POWER: res = PyNumber_Power(left, right, Py_None); break;
+        case BINARY_MODULO: res = PyNumber_Remainder(left, right); break;
+        case BINARY_MATRIX_MULTIPLY: res = PyNumber_MatrixMultiply(left, right); break;
+        case BINARY_LSHIFT: res = PyNumber_Lshift(left, right); break;
+        case BINARY_RSHIFT: res = PyNumber_Rshift(left, right); break;
+        case BINARY_AND: res = PyNumber_And(left, right); break;
+        case BINARY_XOR: res = PyNumber_Xor(left, right); break;
+        case BINARY_OR: res = PyNumber_Or(left, right); break;
+        case BINARY_MULTIPLY: res = PyNumber_Multiply(left, right); break;
+        case BINARY_SUBTRACT: res = PyNumber_Subtract(left, right); break;
+        case INPLACE_POWER: res = PyNumber_InPlacePower(left, right, Py_None); break;
+        case INPLACE_MULTIPLY: res = PyNumber_InPlaceMultiply(left, right); break;
+        case INPLACE_MATRIX_MULTIPLY: res = PyNumber_InPlaceMatrixMultiply(left, right); break;
+        case INPLACE_TRUE_DIVIDE: res = PyNumber_InPlaceTrueDivide(left, right); break;
+        case INPLACE_FLOOR_DIVIDE: res = PyNumber_InPlaceFloorDivide(left, right); break;
+        case INPLACE_MODULO: res = PyNumber_InPlaceRemainder(left, right); break;
+        case INPLACE_ADD: res = PyNumber_InPlaceAdd(left, right); break;
+        case INPLACE_SUBTRACT: res = PyNumber_InPlaceSubtract(left, right); break;
+        case INPLACE_LSHIFT: res = PyNumber_InPlaceLshift(left, right); break;
+        case INPLACE_RSHIFT: res = PyNumber_InPlaceRshift(left, right); break;
+        case INPLACE_AND: res = PyNumber_InPlaceAnd(left, right); break;
+        case INPLACE_XOR: res = PyNumber_InPlaceXor(left, right); break;
+        case INPLACE_OR: res = PyNumber_InPlaceOr(left, right); break;
+        default:
+            PyErr_SetString(PyExc_SystemError, "unknown binary operation");
+            res = nullptr;
+            break;
+    }
+    PyJit_ReleaseOwned(left, right, borrowed);
+    return res;
+}
+
+PyObject* PyJit_RichCompare_Borrowed(PyObject *left, PyObject *right, int op, int borrowed) {
+    auto res = PyObject_RichCompare(left, right, op);
+    PyJit_ReleaseOwned(left, right, borrowed);
+    return res;
+}
+
+PyObject* PyJit_UnicodeConcatenate(PyObject *left, PyObject *right, PyObject** target, int opcode, int borrowed) {
+    if (!PyUnicode_CheckExact(left) || !PyUnicode_CheckExact(right)) {
+        return PyJit_Binary_Borrowed(left, right, opcode, borrowed);
+    }
+    if (borrowed & BORROWED_LEFT) {
+        Py_INCREF(left);
+    }
+    // A borrowed right can be the local we're about to clear (s += s), so hold
+    // on to it until the append's done, which also stops it being resized in place
+    if (borrowed & BORROWED_RIGHT) {
+        Py_INCREF(right);
+    }
+    if (*target == left) {
+        // The store will replace it anyway, so drop the local's reference now
+        *target = nullptr;
+        Py_DECREF(left);
+    }
+    PyUnicode_Append(&left, right);
+    Py_DECREF(right);
+    return left;
+}
+
 int PyJit_PrintExpr(PyObject *value) {
     _PyJ_IDENTIFIER(displayhook);
     PyObject *hook = _PySys_GetObjectId(&PyId_displayhook);
@@ -1007,6 +1086,223 @@ void PyJit_EhTrace(PyFrameObject *f) {
     //}
 }
 
+// Called when jitted code for a generator starts or resumes.  Like the interpreter
+// we stash away the caller's exception state so it can be restored when we yield.
+// The frame's value stack and blocks only describe the generator while it's suspended,
+// the jitted code takes over ownership of the values on the stack.
+void PyJit_GenEnter(PyFrameObject* f) {
+    auto tstate = PyThreadState_GET();
+    PyObject *type, *value, *tb;
+    if (f->f_exc_type != nullptr && f->f_exc_type != Py_None) {
+        // The interpreter yielded from inside of an except handler, restore its
+        // exception state.
+        type = tstate->exc_type;
+        value = tstate->exc_value;
+        tb = tstate->exc_traceback;
+        tstate->exc_type = f->f_exc_type;
+        tstate->exc_value = f->f_exc_value;
+        tstate->exc_traceback = f->f_exc_traceback;
+        f->f_exc_type = type;
+        f->f_exc_value = value;
+        f->f_exc_traceback = tb;
+    }
+    else {
+        Py_XINCREF(tstate->exc_type);
+        Py_XINCREF(tstate->exc_value);
+        Py_XINCREF(tstate->exc_traceback);
+        type = f->f_exc_type;
+        value = f->f_exc_value;
+        tb = f->f_exc_traceback;
+        f->f_exc_type = tstate->exc_type;
+        f->f_exc_value = tstate->exc_value;
+        f->f_exc_traceback = tstate->exc_traceback;
+        Py_XDECREF(type);
+        Py_XDECREF(value);
+        Py_XDECREF(tb);
+    }
+
+    f->f_stacktop = nullptr;
+    f->f_iblock = 0;
+}
+
+// Called when jitted code for a generator yields, returns, or raises.  We never
+// yield from inside of an except handler so the exception state is always the
+// callers.
+void PyJit_GenExit(PyFrameObject* f) {
+    auto tstate = PyThreadState_GET();
+    auto type = tstate->exc_type;
+    auto value = tstate->exc_value;
+    auto tb = tstate->exc_traceback;
+    tstate->exc_type = f->f_exc_type;
+    tstate->exc_value = f->f_exc_value;
+    tstate->exc_traceback = f->f_exc_traceback;
+    f->f_exc_type = nullptr;
+    f->f_exc_value = nullptr;
+    f->f_exc_traceback = nullptr;
+    Py_XDECREF(type);
+    Py_XDECREF(value);
+    Py_XDECREF(tb);
+}
+
+// Gets the iterator for a yield from, consuming the iterable.
+PyObject* PyJit_GetYieldFromIter(PyObject* iterable, int allowCoroutine) {
+    if (PyCoro_CheckExact(iterable)) {
+        if (!allowCoroutine) {
+            Py_DECREF(iterable);
+            PyErr_SetString(PyExc_TypeError,
+                "cannot 'yield from' a coroutine object in a non-coroutine generator");
+            return nullptr;
+        }
+        return iterable;
+    }
+    else if (PyGen_CheckExact(iterable)) {
+        return iterable;
+    }
+
+    auto iter = PyObject_GetIter(iterable);
+    Py_DECREF(iterable);
+    return iter;
+}
+
+static bool PyJit_IsCoroutine(PyObject* o) {
+    return PyCoro_CheckExact(o) ||
+        (PyGen_CheckExact(o) && (((PyCodeObject *)((PyGenObject*)o)->gi_code)->co_flags & CO_ITERABLE_COROUTINE));
+}
+
+// Gets the iterator for an await, consuming the awaitable.
+PyObject* PyJit_GetAwaitable(PyObject* awaitable) {
+    PyObject* iter = nullptr;
+    if (PyJit_IsCoroutine(awaitable)) {
+        Py_INCREF(awaitable);
+        iter = awaitable;
+    }
+    else {
+        auto type = Py_TYPE(awaitable);
+        if (type->tp_as_async != nullptr && type->tp_as_async->am_await != nullptr) {
+            iter = type->tp_as_async->am_await(awaitable);
+            if (iter != nullptr && PyJit_IsCoroutine(iter)) {
+                PyErr_SetString(PyExc_TypeError, "__await__() returned a coroutine");
+                Py_CLEAR(iter);
+            }
+            else if (iter != nullptr && !PyIter_Check(iter)) {
+                PyErr_Format(PyExc_TypeError,
+                    "__await__() returned non-iterator of type '%.100s'",
+                    Py_TYPE(iter)->tp_name);
+                Py_CLEAR(iter);
+            }
+        }
+        else {
+            PyErr_Format(PyExc_TypeError,
+                "object %.100s can't be used in 'await' expression",
+                type->tp_name);
+        }
+    }
+    Py_DECREF(awaitable);
+
+    if (iter != nullptr && PyCoro_CheckExact(iter)) {
+        // A coroutine which is suspended in a yield from is already being awaited
+        auto f = ((PyGenObject*)iter)->gi_frame;
+        if (f != nullptr && f->f_stacktop != nullptr && f->f_lasti >= 0) {
+            auto code = (unsigned char *)PyBytes_AS_STRING(f->f_code->co_code);
+            if (code[f->f_lasti + sizeof(_Py_CODEUNIT)] == YIELD_FROM) {
+                Py_CLEAR(iter);
+                PyErr_SetString(PyExc_RuntimeError, "coroutine is being awaited already");
+            }
+        }
+    }
+    return iter;
+}
+
+// Sends a value into the iterator a yield from is delegating to, consuming the value.
+// Returns 1 if the iterator produced a value for us to yield, 0 if it's finished and
+// result is the value of the yield from (in which case the iterator is freed), or -1
+// on an error.
+int PyJit_YieldFrom(PyObject* receiver, PyObject* value, PyObject** result) {
+    PyObject* res;
+    if (PyGen_CheckExact(receiver) || PyCoro_CheckExact(receiver)) {
+        res = _PyGen_Send((PyGenObject*)receiver, value);
+    }
+    else if (value == Py_None) {
+        res = Py_TYPE(receiver)->tp_iternext(receiver);
+    }
+    else {
+        res = PyObject_CallMethod(receiver, "send", "O", value);
+    }
+    Py_DECREF(value);
+
+    if (res == nullptr) {
+        if (_PyGen_FetchStopIterationValue(&res) < 0) {
+            return -1;
+        }
+        Py_DECREF(receiver);
+        *result = res;
+        return 0;
+    }
+    *result = res;
+    return 1;
+}
+
+// Enters a with block, returning the result of __enter__ and storing the
+// __exit__ method into exit.  The context manager is consumed.
+PyObject* PyJit_SetupWith(PyObject* mgr, PyObject** exit) {
+    _PyJ_IDENTIFIER(__enter__);
+    _PyJ_IDENTIFIER(__exit__);
+
+    *exit = nullptr;
+    auto enter = _PyObject_LookupSpecial(mgr, &PyId___enter__);
+    if (enter == nullptr) {
+        if (!PyErr_Occurred()) {
+            PyErr_SetObject(PyExc_AttributeError, PyId___enter__.object);
+        }
+        Py_DECREF(mgr);
+        return nullptr;
+    }
+    auto exitFunc = _PyObject_LookupSpecial(mgr, &PyId___exit__);
+    Py_DECREF(mgr);
+    if (exitFunc == nullptr) {
+        if (!PyErr_Occurred()) {
+            PyErr_SetObject(PyExc_AttributeError, PyId___exit__.object);
+        }
+        Py_DECREF(enter);
+        return nullptr;
+    }
+
+    auto res = PyObject_CallFunctionObjArgs(enter, NULL);
+    Py_DECREF(enter);
+    if (res == nullptr) {
+        Py_DECREF(exitFunc);
+        return nullptr;
+    }
+    *exit = exitFunc;
+    return res;
+}
+
+// Calls the __exit__ method of a with block, consuming it.  exc, val, and tb
+// are the exception leaving the block (or None), and are freed if we fail.
+// Returns 1 if the exception should be suppressed, 0 if not, -1 on error.
+int PyJit_WithCleanup(PyObject* exit, PyObject* exc, PyObject* val, PyObject* tb) {
+    auto res = PyObject_CallFunctionObjArgs(exit, exc, val, tb, NULL);
+    Py_DECREF(exit);
+
+    int err = 0;
+    if (res == nullptr) {
+        err = -1;
+    }
+    else {
+        if (exc != Py_None) {
+            err = PyObject_IsTrue(res);
+        }
+        Py_DECREF(res);
+    }
+
+    if (err < 0 && exc != Py_None) {
+        Py_DECREF(exc);
+        Py_DECREF(val);
+        Py_DECREF(tb);
+    }
+    return err;
+}
+
 int PyJit_Raise(PyObject *exc, PyObject *cause) {
     PyObject *type = NULL, *value = NULL;
 
@@ -1165,6 +1461,19 @@ int PyJit_StoreMapNoDecRef(PyObject *key, PyObject *value, PyObject* map) {
 	return res;
 }
 
+PyObject* PyJit_BuildConstKeyMap(PyObject** values, PyObject* keys, Py_ssize_t count) {
+    assert(PyTuple_CheckExact(keys) && PyTuple_GET_SIZE(keys) == count);
+    auto res = _PyDict_NewPresized(count);
+    for (auto i = 0; i < count; i++) {
+        if (res != nullptr && PyDict_SetItem(res, PyTuple_GET_ITEM(keys, i), values[i]) < 0) {
+            Py_CLEAR(res);
+        }
+        Py_DECREF(values[i]);
+    }
+    Py_DECREF(keys);
+    return res;
+}
+
 int PyJit_DictUpdate(PyObject* dict, PyObject* other) {
     assert(PyDict_CheckExact(dict));
     auto res = PyDict_Update(dict, other);
@@ -1187,6 +1496,32 @@ int PyJit_StoreSubscr(PyObject* value, PyObject *container, PyObject *index) {
     return res;
 }
 
+PyObject* PyJit_DictSubscr_Str(PyObject* container, PyObject* key, Py_hash_t hash, int borrowed) {
+    if (!PyDict_CheckExact(container)) {
+        return PyJit_Binary_Borrowed(container, key, BINARY_SUBSCR, borrowed);
+    }
+    auto res = _PyDict_GetItem_KnownHash(container, key, hash);
+    if (res != nullptr) {
+        Py_INCREF(res);
+    }
+    else if (!PyErr_Occurred()) {
+        PyErr_SetObject(PyExc_KeyError, key);
+    }
+    PyJit_ReleaseOwned(container, key, borrowed);
+    return res;
+}
+
+int PyJit_DictStoreSubscr_Str(PyObject* value, PyObject* container, PyObject* key, Py_hash_t hash) {
+    if (!PyDict_CheckExact(container)) {
+        return PyJit_StoreSubscr(value, container, key);
+    }
+    auto res = _PyDict_SetItem_KnownHash(container, key, value, hash);
+    Py_DECREF(key);
+    Py_DECREF(value);
+    Py_DECREF(container);
+    return res;
+}
+
 int PyJit_DeleteSubscr(PyObject *container, PyObject *index) {
     auto res = PyObject_DelItem(container, index);
     Py_DECREF(index);
@@ -1194,6 +1529,83 @@ int PyJit_DeleteSubscr(PyObject *container, PyObject *index) {
     return res;
 }
 
+// Gets a bound of a slice of a sequence of length len, clamped to the sequence
+// the same way slicing does.  Returns false if the bound isn't None or an int.
+static bool PyJit_SliceBound(PyObject* bound, Py_ssize_t len, Py_ssize_t dflt, Py_ssize_t* res) {
+    if (bound == Py_None) {
+        *res = dflt;
+        return true;
+    }
+    if (!PyLong_CheckExact(bound)) {
+        return false;
+    }
+    // Values which don't fit are clipped, which still clamps them correctly
+    auto index = PyNumber_AsSsize_t(bound, nullptr);
+    if (index < 0) {
+        index += len;
+        if (index < 0) {
+            index = 0;
+        }
+    }
+    else if (index > len) {
+        index = len;
+    }
+    *res = index;
+    return true;
+}
+
+static bool PyJit_SliceBounds(Py_ssize_t len, PyObject* start, PyObject* stop, Py_ssize_t* low, Py_ssize_t* high) {
+    if (!PyJit_SliceBound(start, len, 0, low) || !PyJit_SliceBound(stop, len, len, high)) {
+        return false;
+    }
+    if (*high < *low) {
+        *high = *low;
+    }
+    return true;
+}
+
+PyObject* PyJit_GetSlice(PyObject* container, PyObject* start, PyObject* stop) {
+    PyObject* res;
+    Py_ssize_t low, high;
+    if (PyList_CheckExact(container) && PyJit_SliceBounds(PyList_GET_SIZE(container), start, stop, &low, &high)) {
+        res = PyList_GetSlice(container, low, high);
+    }
+    else if (PyTuple_CheckExact(container) && PyJit_SliceBounds(PyTuple_GET_SIZE(container), start, stop, &low, &high)) {
+        res = PyTuple_GetSlice(container, low, high);
+    }
+    else if (PyUnicode_CheckExact(container) && PyUnicode_IS_READY(container) &&
+        PyJit_SliceBounds(PyUnicode_GET_LENGTH(container), start, stop, &low, &high)) {
+        res = PyUnicode_Substring(container, low, high);
+    }
+    else {
+        auto slice = PySlice_New(start, stop, nullptr);
+        res = slice == nullptr ? nullptr : PyObject_GetItem(container, slice);
+        Py_XDECREF(slice);
+    }
+    Py_DECREF(container);
+    Py_DECREF(start);
+    Py_DECREF(stop);
+    return res;
+}
+
+int PyJit_StoreSlice(PyObject* value, PyObject* container, PyObject* start, PyObject* stop) {
+    int res;
+    Py_ssize_t low, high;
+    if (PyList_CheckExact(container) && PyJit_SliceBounds(PyList_GET_SIZE(container), start, stop, &low, &high)) {
+        res = PyList_SetSlice(container, low, high, value);
+    }
+    else {
+        auto slice = PySlice_New(start, stop, nullptr);
+        res = slice == nullptr ? -1 : PyObject_SetItem(container, slice, value);
+        Py_XDECREF(slice);
+    }
+    Py_DECREF(value);
+    Py_DECREF(container);
+    Py_DECREF(start);
+    Py_DECREF(stop);
+    return res;
+}
+
 PyObject* PyJit_CallN(PyObject *target, PyObject* args) {
     // we stole references for the tuple...
     auto res = PyObject_Call(target, args, nullptr);
@@ -1306,6 +1718,37 @@ PyObject* PyJit_LoadGlobal(PyFrameObject* f, PyObject* name) {
     return v;
 }
 
+PyObject* PyJit_LoadGlobalCached(PyFrameObject* f, PyObject* name, GlobalCache* cache) {
+    if (!PyDict_CheckExact(f->f_globals) || !PyDict_CheckExact(f->f_builtins)) {
+        return PyJit_LoadGlobal(f, name);
+    }
+
+    auto globals = (PyDictObject*)f->f_globals;
+    auto builtins = (PyDictObject*)f->f_builtins;
+    auto globalsVersion = globals->ma_version_tag;
+    auto builtinsVersion = builtins->ma_version_tag;
+    auto v = _PyJit_Dict_LoadGlobal(globals, builtins, name);
+    if (v == NULL) {
+        if (!_PyErr_OCCURRED())
+            format_exc_check_arg(PyExc_NameError, NAME_ERROR_MSG, name);
+        return nullptr;
+    }
+
+    // Comparing keys during the lookup can run arbitrary code, only remember the
+    // result if neither dict changed while we looked.
+    if (globals->ma_version_tag == globalsVersion && builtins->ma_version_tag == builtinsVersion) {
+        auto oldBuiltins = cache->Builtins;
+        Py_INCREF(builtins);
+        cache->Builtins = (PyObject*)builtins;
+        cache->GlobalsVersion = globalsVersion;
+        cache->BuiltinsVersion = builtinsVersion;
+        cache->Value = v;
+        Py_XDECREF(oldBuiltins);
+    }
+    Py_INCREF(v);
+    return v;
+}
+
 PyObject* PyJit_GetIter(PyObject* iterable) {
     auto res = PyObject_GetIter(iterable);
     Py_DECREF(iterable);
@@ -1320,58 +1763,457 @@ typedef struct {
     PyObject *length;
 } rangeobject;
 
-PyObject* PyJit_GetIterOptimized(PyObject* iterable, size_t* iterstate1, size_t* iterstate2) {
-    //if (PyRange_Check(iterable)) {
-    //	rangeobject* range = (rangeobject*)iterable;
-    //	auto step = PyLong_AsSize_t(range->step);
-    //	if (PyErr_ExceptionMatches(PyExc_OverflowError)) {
-    //		PyErr_Clear();		
-    //		goto common;
-    //	}
-    //	else if (step == 1) {
-    //		auto start  = PyLong_AsSize_t(range->start);
-    //		if (PyErr_ExceptionMatches(PyExc_OverflowError)) {
-    //			PyErr_Clear();
-    //			goto common;
-    //		}
-    //		auto end = PyLong_AsSize_t(range->start);
-    //		if (PyErr_ExceptionMatches(PyExc_OverflowError)) {
-    //			PyErr_Clear();
-    //			goto common;
-    //		}
-
-    //		// common iteration case
-    //		*iterstate1 = start;
-    //		*iterstate2 = end;
-    //		return (PyObject*)1;
-    //	}
-    //}
-//common:
+// Gets a range attribute as a machine sized integer, returning false if it
+// doesn't fit.
+static bool PyJit_GetRangeValue(PyObject* range, _Py_Identifier* id, Py_ssize_t* value) {
+    auto obj = _PyObject_GetAttrId(range, id);
+    if (obj == nullptr) {
+        PyErr_Clear();
+        return false;
+    }
+    *value = PyLong_AsSsize_t(obj);
+    Py_DECREF(obj);
+    if (*value == -1 && PyErr_Occurred()) {
+        PyErr_Clear();
+        return false;
+    }
+    return true;
+}
+
+PyObject* PyJit_GetIterOptimized(PyObject* iterable, Py_ssize_t* current, Py_ssize_t* step, Py_ssize_t* remaining) {
+    _PyJ_IDENTIFIER(start);
+    _PyJ_IDENTIFIER(step);
+
+    if (PyRange_Check(iterable)) {
+        auto len = PyObject_Size(iterable);
+        if (len < 0) {
+            PyErr_Clear();
+        }
+        else if (PyJit_GetRangeValue(iterable, &PyId_start, current) &&
+            PyJit_GetRangeValue(iterable, &PyId_step, step)) {
+            // The range is kept as the loop's iterator so that it's released
+            // along with everything else when the loop exits.
+            *remaining = len;
+            return iterable;
+        }
+    }
+
+    *step = 0;
     auto res = PyObject_GetIter(iterable);
     Py_DECREF(iterable);
     return res;
 }
 
-PyObject* PyJit_IterNext(PyObject* iter, int*error) {
-    auto res = (*iter->ob_type->tp_iternext)(iter);
-    if (res == nullptr) {
-        if (PyErr_Occurred()) {
-            if (!PyErr_ExceptionMatches(PyExc_StopIteration)) {
-                *error = 1;
-                return nullptr;
+PyObject* PyJit_RangeIterRemaining(PyObject* range, Py_ssize_t current, Py_ssize_t step, Py_ssize_t remaining) {
+    Py_DECREF(range);
+
+    // The end is computed with Python ints as it may not fit in a Py_ssize_t
+    PyObject* res = nullptr;
+    auto start = PyLong_FromSsize_t(current);
+    auto stepValue = PyLong_FromSsize_t(step);
+    auto count = PyLong_FromSsize_t(remaining);
+    if (start != nullptr && stepValue != nullptr && count != nullptr) {
+        auto span = PyNumber_Multiply(stepValue, count);
+        if (span != nullptr) {
+            auto stop = PyNumber_Add(start, span);
+            if (stop != nullptr) {
+                auto rest = PyObject_CallFunctionObjArgs((PyObject*)&PyRange_Type, start, stop, stepValue, nullptr);
+                if (rest != nullptr) {
+                    res = PyObject_GetIter(rest);
+                    Py_DECREF(rest);
+                }
+                Py_DECREF(stop);
+            }
+            Py_DECREF(span);
+        }
+    }
+    Py_XDECREF(start);
+    Py_XDECREF(stepValue);
+    Py_XDECREF(count);
+    return res;
+}
+
+// A value flowing through a loop kernel, which follows Python's rules for
+// mixing ints and floats.
+struct KernelValue {
+    bool IsFloat;
+    double Float;
+    long long Int;
+};
+
+// An operand of a loop kernel.  Elements are read from a buffer indexed by
+// the loop variable, locals and constants are read once before starting.
+struct KernelOperand {
+    int Kind;
+    KernelValue Value;
+    Py_buffer View;
+    char Format;
+};
+
+static PyTypeObject* PyJit_ArrayType() {
+    static PyObject* arrayType;
+    if (arrayType == nullptr) {
+        auto module = PyImport_ImportModule("array");
+        if (module != nullptr) {
+            arrayType = PyObject_GetAttrString(module, "array");
+            Py_DECREF(module);
+        }
+        if (arrayType == nullptr) {
+            PyErr_Clear();
+            return nullptr;
+        }
+    }
+    return (PyTypeObject*)arrayType;
+}
+
+// Only the exact buffer types are known to index into their buffer without
+// running any user code.
+static bool PyJit_IsKernelBuffer(PyObject* obj) {
+    if (PyBytes_CheckExact(obj) || PyByteArray_CheckExact(obj) || Py_TYPE(obj) == &PyMemoryView_Type) {
+        return true;
+    }
+    return strcmp(Py_TYPE(obj)->tp_name, "array.array") == 0 && Py_TYPE(obj) == PyJit_ArrayType();
+}
+
+static char PyJit_KernelFormat(const char* format) {
+    if (format == nullptr) {
+        return 'B';
+    }
+    if (format[0] == '@') {
+        format++;
+    }
+    if (format[0] == '\0' || format[1] != '\0') {
+        return '\0';
+    }
+    switch (format[0]) {
+        case 'd': case 'f':
+        case 'b': case 'B': case 'h': case 'H':
+        case 'i': case 'I': case 'l': case 'q':
+            return format[0];
+    }
+    return '\0';
+}
+
+static bool PyJit_KernelScalar(PyObject* obj, KernelValue& value) {
+    if (obj == nullptr) {
+        return false;
+    }
+    if (PyFloat_CheckExact(obj)) {
+        value.IsFloat = true;
+        value.Float = PyFloat_AS_DOUBLE(obj);
+        return true;
+    }
+    if (PyLong_CheckExact(obj)) {
+        int overflow;
+        value.IsFloat = false;
+        value.Int = PyLong_AsLongLongAndOverflow(obj, &overflow);
+        return !overflow && !(value.Int == -1 && PyErr_Occurred());
+    }
+    return false;
+}
+
+// Gets the operand ready, checking that every index the kernel will use is
+// in range.
+static bool PyJit_KernelOperandInit(PyFrameObject* frame, int encoded, KernelOperand& operand, Py_ssize_t first, Py_ssize_t last, bool writable) {
+    auto index = KERNEL_OPERAND_INDEX(encoded);
+    switch (KERNEL_OPERAND_KIND(encoded)) {
+        case KOK_Const:
+            operand.Kind = KOK_Const;
+            return PyJit_KernelScalar(PyTuple_GET_ITEM(frame->f_code->co_consts, index), operand.Value);
+        case KOK_Local:
+            operand.Kind = KOK_Local;
+            return PyJit_KernelScalar(frame->f_localsplus[index], operand.Value);
+        case KOK_Element:
+        {
+            auto obj = frame->f_localsplus[index];
+            if (obj == nullptr || !PyJit_IsKernelBuffer(obj)) {
+                return false;
+            }
+            if (PyObject_GetBuffer(obj, &operand.View, writable ? PyBUF_RECORDS : PyBUF_RECORDS_RO) < 0) {
+                PyErr_Clear();
+                return false;
+            }
+            // The buffer is released along with the operand from here on
+            operand.Kind = KOK_Element;
+            operand.Format = PyJit_KernelFormat(operand.View.format);
+            auto len = operand.View.ndim == 1 ? operand.View.shape[0] : -1;
+            return operand.Format != '\0' && operand.View.suboffsets == nullptr &&
+                first >= 0 && first < len && last >= 0 && last < len;
+        }
+    }
+    return false;
+}
+
+static void PyJit_KernelOperandFree(KernelOperand& operand) {
+    if (operand.Kind == KOK_Element) {
+        PyBuffer_Release(&operand.View);
+    }
+}
+
+static void PyJit_KernelLoad(KernelOperand& operand, Py_ssize_t index, KernelValue& value) {
+    auto item = (char*)operand.View.buf + index * operand.View.strides[0];
+    value.IsFloat = false;
+    switch (operand.Format) {
+        case 'd': value.IsFloat = true; value.Float = *(double*)item; break;
+        case 'f': value.IsFloat = true; value.Float = *(float*)item; break;
+        case 'b': value.Int = *(signed char*)item; break;
+        case 'B': value.Int = *(unsigned char*)item; break;
+        case 'h': value.Int = *(short*)item; break;
+        case 'H': value.Int = *(unsigned short*)item; break;
+        case 'i': value.Int = *(int*)item; break;
+        case 'I': value.Int = *(unsigned int*)item; break;
+        case 'l': value.Int = *(long*)item; break;
+        case 'q': value.Int = *(long long*)item; break;
+    }
+}
+
+// Stores the value the same way item assignment would, failing for anything
+// which would raise.
+static bool PyJit_KernelStore(KernelOperand& operand, Py_ssize_t index, KernelValue& value) {
+    auto item = (char*)operand.View.buf + index * operand.View.strides[0];
+    switch (operand.Format) {
+        case 'd': *(double*)item = value.IsFloat ? value.Float : (double)value.Int; return true;
+        case 'f': *(float*)item = (float)(value.IsFloat ? value.Float : (double)value.Int); return true;
+    }
+    if (value.IsFloat) {
+        return false;
+    }
+
+    auto v = value.Int;
+    switch (operand.Format) {
+        case 'b': if (v < SCHAR_MIN || v > SCHAR_MAX) return false; *(signed char*)item = (signed char)v; break;
+        case 'B': if (v < 0 || v > UCHAR_MAX) return false; *(unsigned char*)item = (unsigned char)v; break;
+        case 'h': if (v < SHRT_MIN || v > SHRT_MAX) return false; *(short*)item = (short)v; break;
+        case 'H': if (v < 0 || v > USHRT_MAX) return false; *(unsigned short*)item = (unsigned short)v; break;
+        case 'i': if (v < INT_MIN || v > INT_MAX) return false; *(int*)item = (int)v; break;
+        case 'I': if (v < 0 || v > UINT_MAX) return false; *(unsigned int*)item = (unsigned int)v; break;
+        case 'l': if (v < LONG_MIN || v > LONG_MAX) return false; *(long*)item = (long)v; break;
+        case 'q': *(long long*)item = v; break;
+    }
+    return true;
+}
+
+// Applies a binary operator, failing if an int result would overflow and
+// need a long.
+static bool PyJit_KernelApply(int op, KernelValue& left, KernelValue& right, KernelValue& res) {
+    if (left.IsFloat || right.IsFloat) {
+        auto l = left.IsFloat ? left.Float : (double)left.Int;
+        auto r = right.IsFloat ? right.Float : (double)right.Int;
+        res.IsFloat = true;
+        switch (op) {
+            case BINARY_ADD: res.Float = l + r; break;
+            case BINARY_SUBTRACT: res.Float = l - r; break;
+            case BINARY_MULTIPLY: res.Float = l * r; break;
+        }
+        return true;
+    }
+
+    res.IsFloat = false;
+    switch (op) {
+#ifdef _MSC_VER
+        case BINARY_ADD: return SafeAdd(left.Int, right.Int, res.Int);
+        case BINARY_SUBTRACT: return SafeSubtract(left.Int, right.Int, res.Int);
+        case BINARY_MULTIPLY: return SafeMultiply(left.Int, right.Int, res.Int);
+#elif __clang__ || __GNUC__
+        case BINARY_ADD: return !__builtin_add_overflow(left.Int, right.Int, &res.Int);
+        case BINARY_SUBTRACT: return !__builtin_sub_overflow(left.Int, right.Int, &res.Int);
+        case BINARY_MULTIPLY: return !__builtin_mul_overflow(left.Int, right.Int, &res.Int);
+#else
+#error No support for this compiler
+#endif
+    }
+    return false;
+}
+
+static inline double PyJit_KernelOpDouble(int op, double left, double right) {
+    switch (op) {
+        case BINARY_ADD: return left + right;
+        case BINARY_SUBTRACT: return left - right;
+        case BINARY_MULTIPLY: return left * right;
+    }
+    return left;
+}
+
+static double* PyJit_KernelDoubles(KernelOperand& operand, double& scalar) {
+    if (operand.Kind == KOK_Element) {
+        return (double*)operand.View.buf;
+    }
+    scalar = operand.Value.IsFloat ? operand.Value.Float : (double)operand.Value.Int;
+    return nullptr;
+}
+
+static bool PyJit_KernelIsDoubles(KernelOperand& operand) {
+    return operand.Kind != KOK_Element ||
+        (operand.Format == 'd' && operand.View.strides[0] == sizeof(double));
+}
+
+// Runs count iterations of a contiguous loop over doubles, which is simple
+// enough for the C compiler to vectorize.
+static Py_ssize_t PyJit_RunDoubleKernel(int kind, int op, KernelOperand& left, KernelOperand& right, KernelOperand& target, Py_ssize_t first, Py_ssize_t count) {
+    double leftScalar = 0, rightScalar = 0;
+    auto l = PyJit_KernelDoubles(left, leftScalar);
+    auto r = op != 0 ? PyJit_KernelDoubles(right, rightScalar) : nullptr;
+    if (l != nullptr) {
+        l += first;
+    }
+    if (r != nullptr) {
+        r += first;
+    }
+
+    if (kind == LKK_Store) {
+        auto out = (double*)target.View.buf + first;
+        for (Py_ssize_t k = 0; k < count; k++) {
+            auto x = l != nullptr ? l[k] : leftScalar;
+            out[k] = op != 0 ? PyJit_KernelOpDouble(op, x, r != nullptr ? r[k] : rightScalar) : x;
+        }
+    }
+    else {
+        auto acc = target.Value.IsFloat ? target.Value.Float : (double)target.Value.Int;
+        for (Py_ssize_t k = 0; k < count; k++) {
+            auto x = l != nullptr ? l[k] : leftScalar;
+            acc += op != 0 ? PyJit_KernelOpDouble(op, x, r != nullptr ? r[k] : rightScalar) : x;
+        }
+        target.Value.IsFloat = true;
+        target.Value.Float = acc;
+    }
+    return count;
+}
+
+// Runs iterations one at a time with Python's semantics for mixing types,
+// returning how many completed before one would have raised.
+static Py_ssize_t PyJit_RunGenericKernel(int kind, int op, KernelOperand& left, KernelOperand& right, KernelOperand& target, Py_ssize_t first, Py_ssize_t step, Py_ssize_t count) {
+    auto index = first;
+    for (Py_ssize_t k = 0; k < count; k++, index += step) {
+        KernelValue x, y, res;
+        if (left.Kind == KOK_Element) {
+            PyJit_KernelLoad(left, index, x);
+        }
+        else {
+            x = left.Value;
+        }
+        if (op != 0) {
+            if (right.Kind == KOK_Element) {
+                PyJit_KernelLoad(right, index, y);
+            }
+            else {
+                y = right.Value;
+            }
+            if (!PyJit_KernelApply(op, x, y, res)) {
+                return k;
+            }
+        }
+        else {
+            res = x;
+        }
+
+        if (kind == LKK_Store) {
+            if (!PyJit_KernelStore(target, index, res)) {
+                return k;
+            }
+        }
+        else {
+            KernelValue acc;
+            if (!PyJit_KernelApply(BINARY_ADD, target.Value, res, acc)) {
+                return k;
+            }
+            target.Value = acc;
+        }
+    }
+    return count;
+}
+
+// Checks whether the elements of source which the iterations read overlap the
+// elements of target which they write.  Reading and writing the same element
+// within an iteration is fine, anything else could see a store from an
+// earlier iteration in a different order than the loop would.
+static bool PyJit_KernelOverlaps(KernelOperand& source, KernelOperand& target, Py_ssize_t first, Py_ssize_t last) {
+    if (source.Kind != KOK_Element) {
+        return false;
+    }
+    if (source.View.buf == target.View.buf &&
+        source.View.strides[0] == target.View.strides[0] &&
+        source.View.itemsize == target.View.itemsize) {
+        return false;
+    }
+
+    auto sourceFirst = (char*)source.View.buf + first * source.View.strides[0];
+    auto sourceLast = (char*)source.View.buf + last * source.View.strides[0];
+    auto targetFirst = (char*)target.View.buf + first * target.View.strides[0];
+    auto targetLast = (char*)target.View.buf + last * target.View.strides[0];
+    auto sourceStart = sourceFirst < sourceLast ? sourceFirst : sourceLast;
+    auto sourceEnd = (sourceFirst < sourceLast ? sourceLast : sourceFirst) + source.View.itemsize;
+    auto targetStart = targetFirst < targetLast ? targetFirst : targetLast;
+    auto targetEnd = (targetFirst < targetLast ? targetLast : targetFirst) + target.View.itemsize;
+    return sourceStart < targetEnd && targetStart < sourceEnd;
+}
+
+void PyJit_RunLoopKernel(PyFrameObject* frame, int kind, int op, int left, int right, int target, Py_ssize_t* current, Py_ssize_t step, Py_ssize_t* remaining) {
+    // The last iteration always runs in the loop itself, so that it leaves the
+    // loop variable bound along with anything which needs to be raised.
+    if (step == 0) {
+        return;
+    }
+    auto count = *remaining - 1;
+    if (count <= 0) {
+        return;
+    }
+    auto first = *current;
+    auto last = first + (count - 1) * step;
+
+    KernelOperand operands[3];
+    operands[0].Kind = operands[1].Kind = operands[2].Kind = KOK_None;
+    bool ready = PyJit_KernelOperandInit(frame, left, operands[0], first, last, false) &&
+        (op == 0 || PyJit_KernelOperandInit(frame, right, operands[1], first, last, false));
+    if (ready) {
+        if (kind == LKK_Store) {
+            // Overlapping views are left to the loop to run in order
+            ready = PyJit_KernelOperandInit(frame, KERNEL_OPERAND(KOK_Element, target), operands[2], first, last, true) &&
+                !PyJit_KernelOverlaps(operands[0], operands[2], first, last) &&
+                (op == 0 || !PyJit_KernelOverlaps(operands[1], operands[2], first, last));
+        }
+        else {
+            ready = PyJit_KernelScalar(frame->f_localsplus[target], operands[2].Value);
+        }
+    }
+
+    Py_ssize_t done = 0;
+    if (ready) {
+        bool doubles = step == 1 && PyJit_KernelIsDoubles(operands[0]) &&
+            (op == 0 || PyJit_KernelIsDoubles(operands[1])) &&
+            (operands[0].Kind == KOK_Element || operands[1].Kind == KOK_Element);
+        if (kind == LKK_Store) {
+            doubles = doubles && PyJit_KernelIsDoubles(operands[2]);
+        }
+
+        if (doubles) {
+            done = PyJit_RunDoubleKernel(kind, op, operands[0], operands[1], operands[2], first, count);
+        }
+        else {
+            done = PyJit_RunGenericKernel(kind, op, operands[0], operands[1], operands[2], first, step, count);
+        }
+
+        if (done != 0 && kind == LKK_Reduce) {
+            auto& acc = operands[2].Value;
+            auto res = acc.IsFloat ? PyFloat_FromDouble(acc.Float) : PyLong_FromLongLong(acc.Int);
+            if (res == nullptr) {
+                // Nothing has been written yet, the loop can do all of the work
+                PyErr_Clear();
+                done = 0;
+            }
+            else {
+                Py_XSETREF(frame->f_localsplus[target], res);
             }
-            *error = 0;
-            // TODO: Tracing...
-            //else if (tstate->c_tracefunc != NULL)
-            //	call_exc_trace(tstate->c_tracefunc, tstate->c_traceobj, tstate, f);
-            PyErr_Clear();
         }
     }
-    return res;
-}
 
+    for (auto& operand : operands) {
+        PyJit_KernelOperandFree(operand);
+    }
+    *current += done * step;
+    *remaining -= done;
+}
 
-PyObject* PyJit_IterNextOptimized(PyObject* iter, int*error, size_t* iterstate1, size_t* iterstate2) {
+PyObject* PyJit_IterNext(PyObject* iter, int*error) {
     auto res = (*iter->ob_type->tp_iternext)(iter);
     if (res == nullptr) {
         if (PyErr_Occurred()) {
@@ -1389,6 +2231,7 @@ PyObject* PyJit_IterNextOptimized(PyObject* iter, int*error, size_t* iterstate1,
     return res;
 }
 
+
 void PyJit_CellSet(PyObject* value, PyObject* cell) {
     PyCell_Set(cell, value);
     Py_DecRef(value);
@@ -1622,6 +2465,290 @@ int PyJit_DeleteAttr(PyObject* owner, PyObject* name) {
     return res;
 }
 
+static bool PyJit_AttrCacheHit(PyTypeObject* type, AttrCache* cache) {
+    return cache->Version != 0 &&
+        cache->Version == type->tp_version_tag &&
+        PyType_HasFeature(type, Py_TPFLAGS_VALID_VERSION_TAG);
+}
+
+// Looks up the type attribute for name, returning false if the type doesn't use
+// generic attribute access or we can't depend upon its version tag.
+static bool PyJit_AttrCacheLookup(PyTypeObject* type, PyObject* name, AttrCache* cache, PyObject** descr) {
+    cache->Version = 0;
+    if (!PyUnicode_CheckExact(name)) {
+        return false;
+    }
+    if (type->tp_dict == nullptr && PyType_Ready(type) < 0) {
+        PyErr_Clear();
+        return false;
+    }
+
+    // The lookup assigns the type a version tag if it can have one
+    *descr = _PyType_Lookup(type, name);
+    return PyType_HasFeature(type, Py_TPFLAGS_VALID_VERSION_TAG) != 0;
+}
+
+static void PyJit_FillLoadAttrCache(PyTypeObject* type, PyObject* name, AttrCache* cache) {
+    PyObject* descr;
+    if (type->tp_getattro != PyObject_GenericGetAttr ||
+        !PyJit_AttrCacheLookup(type, name, cache, &descr)) {
+        return;
+    }
+
+    if (descr == nullptr) {
+        if (type->tp_dictoffset == 0) {
+            return;
+        }
+        cache->Kind = ACK_InstanceDict;
+    }
+    else if (Py_TYPE(descr) == &PyMemberDescr_Type &&
+        ((PyMemberDescrObject*)descr)->d_member->type == T_OBJECT_EX) {
+        cache->Kind = ACK_Slot;
+        cache->Offset = ((PyMemberDescrObject*)descr)->d_member->offset;
+    }
+    else if (PyFunction_Check(descr) || Py_TYPE(descr) == &PyMethodDescr_Type) {
+        cache->Kind = ACK_Method;
+    }
+    else if (Py_TYPE(descr)->tp_descr_get == nullptr) {
+        cache->Kind = ACK_ClassAttribute;
+    }
+    else if (Py_TYPE(descr)->tp_descr_set != nullptr) {
+        cache->Kind = ACK_DataDescriptor;
+    }
+    else {
+        // Other non-data descriptors, e.g. classmethod, go the generic route
+        return;
+    }
+    cache->Descr = descr;
+    cache->Version = type->tp_version_tag;
+}
+
+static void PyJit_FillStoreAttrCache(PyTypeObject* type, PyObject* name, AttrCache* cache) {
+    PyObject* descr;
+    if (type->tp_setattro != PyObject_GenericSetAttr ||
+        !PyJit_AttrCacheLookup(type, name, cache, &descr)) {
+        return;
+    }
+
+    if (descr != nullptr && Py_TYPE(descr) == &PyMemberDescr_Type &&
+        ((PyMemberDescrObject*)descr)->d_member->type == T_OBJECT_EX &&
+        !(((PyMemberDescrObject*)descr)->d_member->flags & READONLY)) {
+        cache->Kind = ACK_Slot;
+        cache->Offset = ((PyMemberDescrObject*)descr)->d_member->offset;
+    }
+    else if (descr != nullptr && Py_TYPE(descr)->tp_descr_set != nullptr) {
+        cache->Kind = ACK_DataDescriptor;
+    }
+    else if (type->tp_dictoffset != 0) {
+        cache->Kind = ACK_InstanceDict;
+    }
+    else {
+        return;
+    }
+    cache->Descr = descr;
+    cache->Version = type->tp_version_tag;
+}
+
+// Gets name from the instance dict of owner, returning a borrowed reference or
+// nullptr if it isn't there.
+static PyObject* PyJit_InstanceDictLookup(PyObject* owner, PyObject* name) {
+    auto dictptr = _PyObject_GetDictPtr(owner);
+    if (dictptr == nullptr || *dictptr == nullptr) {
+        return nullptr;
+    }
+    return PyDict_GetItem(*dictptr, name);
+}
+
+// Performs a load using a cache which is known to be valid for owner's type,
+// returning a new reference and leaving owner alone.
+static PyObject* PyJit_LoadAttrFromCache(PyObject* owner, PyObject* name, AttrCache* cache) {
+    PyObject* res;
+    switch (cache->Kind) {
+        case ACK_Slot:
+            res = *(PyObject**)((char*)owner + cache->Offset);
+            if (res == nullptr) {
+                // Let the descriptor report the missing value
+                return PyObject_GetAttr(owner, name);
+            }
+            Py_INCREF(res);
+            return res;
+        case ACK_InstanceDict:
+            res = PyJit_InstanceDictLookup(owner, name);
+            if (res == nullptr) {
+                return PyObject_GetAttr(owner, name);
+            }
+            Py_INCREF(res);
+            return res;
+        case ACK_DataDescriptor:
+        {
+            // Hold onto the descriptor in case running it modifies the type
+            auto descr = cache->Descr;
+            Py_INCREF(descr);
+            res = Py_TYPE(descr)->tp_descr_get(descr, owner, (PyObject*)Py_TYPE(owner));
+            Py_DECREF(descr);
+            return res;
+        }
+        case ACK_Method:
+        case ACK_ClassAttribute:
+        {
+            auto descr = cache->Descr;
+            Py_INCREF(descr);
+            res = PyJit_InstanceDictLookup(owner, name);
+            if (res != nullptr) {
+                Py_INCREF(res);
+            }
+            else if (cache->Kind == ACK_Method) {
+                res = Py_TYPE(descr)->tp_descr_get(descr, owner, (PyObject*)Py_TYPE(owner));
+            }
+            else {
+                res = descr;
+                Py_INCREF(res);
+            }
+            Py_DECREF(descr);
+            return res;
+        }
+    }
+    return PyObject_GetAttr(owner, name);
+}
+
+PyObject* PyJit_LoadAttrCached(PyObject* owner, PyObject* name, AttrCache* cache) {
+    auto type = Py_TYPE(owner);
+    if (!PyJit_AttrCacheHit(type, cache)) {
+        PyJit_FillLoadAttrCache(type, name, cache);
+        if (cache->Version == 0) {
+            return PyJit_LoadAttr(owner, name);
+        }
+    }
+
+    auto res = PyJit_LoadAttrFromCache(owner, name, cache);
+    Py_DECREF(owner);
+    return res;
+}
+
+int PyJit_StoreAttrCached(PyObject* value, PyObject* owner, PyObject* name, AttrCache* cache) {
+    auto type = Py_TYPE(owner);
+    if (!PyJit_AttrCacheHit(type, cache)) {
+        PyJit_FillStoreAttrCache(type, name, cache);
+        if (cache->Version == 0) {
+            return PyJit_StoreAttr(value, owner, name);
+        }
+    }
+
+    int res;
+    switch (cache->Kind) {
+        case ACK_Slot:
+        {
+            auto slot = (PyObject**)((char*)owner + cache->Offset);
+            auto old = *slot;
+            *slot = value;
+            Py_XDECREF(old);
+            Py_DECREF(owner);
+            return 0;
+        }
+        case ACK_DataDescriptor:
+        {
+            auto descr = cache->Descr;
+            Py_INCREF(descr);
+            res = Py_TYPE(descr)->tp_descr_set(descr, owner, value);
+            Py_DECREF(descr);
+            break;
+        }
+        default:
+        {
+            auto dictptr = _PyObject_GetDictPtr(owner);
+            if (dictptr == nullptr) {
+                return PyJit_StoreAttr(value, owner, name);
+            }
+            res = _PyObjectDict_SetItem(type, dictptr, name, value);
+            break;
+        }
+    }
+    Py_DECREF(owner);
+    Py_DECREF(value);
+    return res;
+}
+
+PyObject* PyJit_LoadMethod(PyObject* owner, PyObject* name, AttrCache* cache, PyObject** self) {
+    *self = nullptr;
+    auto type = Py_TYPE(owner);
+    if (!PyJit_AttrCacheHit(type, cache)) {
+        PyJit_FillLoadAttrCache(type, name, cache);
+        if (cache->Version == 0) {
+            return PyJit_LoadAttr(owner, name);
+        }
+    }
+
+    if (cache->Kind == ACK_Method) {
+        auto descr = cache->Descr;
+        Py_INCREF(descr);
+        auto res = PyJit_InstanceDictLookup(owner, name);
+        if (res == nullptr) {
+            // We pass our reference to owner on as self
+            *self = owner;
+            return descr;
+        }
+        Py_INCREF(res);
+        Py_DECREF(descr);
+        Py_DECREF(owner);
+        return res;
+    }
+
+    auto res = PyJit_LoadAttrFromCache(owner, name, cache);
+    Py_DECREF(owner);
+    return res;
+}
+
+PyObject* PyJit_CallMethod0(PyObject* target, PyObject* self, CallCache* cache) {
+    if (self == nullptr) {
+        return PyJit_CallDirect0(target, cache);
+    }
+    return PyJit_CallDirect1(target, self, cache);
+}
+
+PyObject* PyJit_CallMethod1(PyObject* target, PyObject* self, PyObject* arg0, CallCache* cache) {
+    if (self == nullptr) {
+        return PyJit_CallDirect1(target, arg0, cache);
+    }
+    return PyJit_CallDirect2(target, self, arg0, cache);
+}
+
+PyObject* PyJit_CallMethod2(PyObject* target, PyObject* self, PyObject* arg0, PyObject* arg1, CallCache* cache) {
+    if (self == nullptr) {
+        return PyJit_CallDirect2(target, arg0, arg1, cache);
+    }
+    return PyJit_CallDirect3(target, self, arg0, arg1, cache);
+}
+
+PyObject* PyJit_CallMethod3(PyObject* target, PyObject* self, PyObject* arg0, PyObject* arg1, PyObject* arg2, CallCache* cache) {
+    if (self == nullptr) {
+        return PyJit_CallDirect3(target, arg0, arg1, arg2, cache);
+    }
+    return PyJit_CallDirect4(target, self, arg0, arg1, arg2, cache);
+}
+
+PyObject* PyJit_CallMethodN(PyObject* target, PyObject* self, PyObject* args) {
+    if (self == nullptr) {
+        return PyJit_CallN(target, args);
+    }
+
+    auto argCount = PyTuple_GET_SIZE(args);
+    auto allArgs = PyTuple_New(argCount + 1);
+    if (allArgs == nullptr) {
+        Py_DECREF(target);
+        Py_DECREF(self);
+        Py_DECREF(args);
+        return nullptr;
+    }
+    PyTuple_SET_ITEM(allArgs, 0, self);
+    for (Py_ssize_t i = 0; i < argCount; i++) {
+        auto arg = PyTuple_GET_ITEM(args, i);
+        Py_INCREF(arg);
+        PyTuple_SET_ITEM(allArgs, i + 1, arg);
+    }
+    Py_DECREF(args);
+    return PyJit_CallN(target, allArgs);
+}
+
 PyObject* PyJit_LoadName(PyFrameObject* f, PyObject* name) {
     PyObject *locals = f->f_locals;
     PyObject *v;
@@ -1706,7 +2833,7 @@ int PyJit_DeleteName(PyFrameObject* f, PyObject* name) {
 }
 
 static PyObject *
-fast_function(PyObject *func, PyObject **pp_stack, int n) {
+fast_function(PyObject *func, PyObject **pp_stack, int n, CallCache* cache = nullptr) {
     PyCodeObject *co = (PyCodeObject *)PyFunction_GET_CODE(func);
     PyObject *globals = PyFunction_GET_GLOBALS(func);
     PyObject *argdefs = PyFunction_GET_DEFAULTS(func);
@@ -1737,7 +2864,12 @@ fast_function(PyObject *func, PyObject **pp_stack, int n) {
             Py_INCREF(*stack);
             fastlocals[i] = *stack++;
         }
-        retval = PyEval_EvalFrameEx(f, 0);
+        if (cache != nullptr) {
+            retval = PyJit_EvalDirect(f, cache);
+        }
+        else {
+            retval = PyEval_EvalFrameEx(f, 0);
+        }
         ++tstate->recursion_depth;
         Py_DECREF(f);
         --tstate->recursion_depth;
@@ -1858,6 +2990,115 @@ PyObject* Call0_Generic(PyObject *target, void** addr) {
 }
 
 
+// Calls target with argCnt arguments, consuming the references to the target
+// and the arguments.  Python functions are run via cache, bound methods are
+// unwrapped so their function can be too.
+static PyObject* call_direct(PyObject* target, PyObject** args, int argCnt, CallCache* cache) {
+    if (PyMethod_Check(target) && PyMethod_GET_SELF(target) != NULL && argCnt < 4) {
+        PyObject* stack[5] = { PyMethod_GET_SELF(target) };
+        for (int i = 0; i < argCnt; i++) {
+            stack[i + 1] = args[i];
+        }
+        auto func = PyMethod_GET_FUNCTION(target);
+        Py_INCREF(stack[0]);
+        Py_INCREF(func);
+        Py_DECREF(target);
+        return call_direct(func, stack, argCnt + 1, cache);
+    }
+
+    if (!PyFunction_Check(target)) {
+        switch (argCnt) {
+            case 0: return Call0(target);
+            case 1: return Call1(target, args[0]);
+            case 2: return Call2(target, args[0], args[1]);
+            case 3: return Call3(target, args[0], args[1], args[2]);
+            default: return Call4(target, args[0], args[1], args[2], args[3]);
+        }
+    }
+
+    auto res = fast_function(target, args, argCnt, cache);
+    Py_DECREF(target);
+    for (int i = 0; i < argCnt; i++) {
+        Py_DECREF(args[i]);
+    }
+    return res;
+}
+
+PyObject* PyJit_CallDirect0(PyObject* target, CallCache* cache) {
+    return call_direct(target, nullptr, 0, cache);
+}
+
+PyObject* PyJit_CallDirect1(PyObject* target, PyObject* arg0, CallCache* cache) {
+    PyObject* stack[1] = { arg0 };
+    return call_direct(target, stack, 1, cache);
+}
+
+PyObject* PyJit_CallDirect2(PyObject* target, PyObject* arg0, PyObject* arg1, CallCache* cache) {
+    PyObject* stack[2] = { arg0, arg1 };
+    return call_direct(target, stack, 2, cache);
+}
+
+PyObject* PyJit_CallDirect3(PyObject* target, PyObject* arg0, PyObject* arg1, PyObject* arg2, CallCache* cache) {
+    PyObject* stack[3] = { arg0, arg1, arg2 };
+    return call_direct(target, stack, 3, cache);
+}
+
+PyObject* PyJit_CallDirect4(PyObject* target, PyObject* arg0, PyObject* arg1, PyObject* arg2, PyObject* arg3, CallCache* cache) {
+    PyObject* stack[4] = { arg0, arg1, arg2, arg3 };
+    return call_direct(target, stack, 4, cache);
+}
+
+PyObject* PyJit_CallLen(PyObject *target, PyObject* arg0) {
+    if (!PyCFunction_Check(target) || PyCFunction_GET_FUNCTION(target) != g_builtinLen) {
+        return Call1(target, arg0);
+    }
+
+    auto len = PyObject_Size(arg0);
+    Py_DECREF(target);
+    Py_DECREF(arg0);
+    if (len < 0 && PyErr_Occurred()) {
+        return nullptr;
+    }
+    return PyLong_FromSsize_t(len);
+}
+
+PyObject* PyJit_CallIsInstance(PyObject *target, PyObject* arg0, PyObject* arg1) {
+    if (!PyCFunction_Check(target) || PyCFunction_GET_FUNCTION(target) != g_builtinIsInstance) {
+        return Call2(target, arg0, arg1);
+    }
+
+    auto res = PyObject_IsInstance(arg0, arg1);
+    Py_DECREF(target);
+    Py_DECREF(arg0);
+    Py_DECREF(arg1);
+    if (res < 0) {
+        return nullptr;
+    }
+    return PyBool_FromLong(res);
+}
+
+PyObject* PyJit_CallInt(PyObject *target, PyObject* arg0) {
+    if (target != (PyObject*)&PyLong_Type) {
+        return Call1(target, arg0);
+    }
+
+    auto res = PyNumber_Long(arg0);
+    Py_DECREF(target);
+    Py_DECREF(arg0);
+    return res;
+}
+
+PyObject* PyJit_CallFloat(PyObject *target, PyObject* arg0) {
+    if (target != (PyObject*)&PyFloat_Type) {
+        return Call1(target, arg0);
+    }
+
+    auto res = PyNumber_Float(arg0);
+    Py_DECREF(target);
+    Py_DECREF(arg0);
+    return res;
+}
+
 PyObject* Call1(PyObject *target, PyObject* arg0) {
     PyObject* res = nullptr;
     if (PyFunction_Check(target)) {
@@ -2369,6 +3610,25 @@ PyObject* PyJit_BoxTaggedPointer(PyObject* value) {
     return value;
 }
 
+PyObject* PyJit_Subscr_Tagged(PyObject* container, PyObject* index) {
+    auto boxed = PyJit_BoxTaggedPointer(index);
+    if (boxed == nullptr) {
+        Py_DECREF(container);
+        return nullptr;
+    }
+    return PyJit_Subscr(container, boxed);
+}
+
+int PyJit_StoreSubscr_Tagged(PyObject* value, PyObject* container, PyObject* index) {
+    auto boxed = PyJit_BoxTaggedPointer(index);
+    if (boxed == nullptr) {
+        Py_DECREF(value);
+        Py_DECREF(container);
+        return -1;
+    }
+    return PyJit_StoreSubscr(value, container, boxed);
+}
+
 #define TAGGED_METHOD(name) \
 	PyObject* PyJit_##name##_Int(PyObject *left, PyObject *right) {						\
 	tagged_ptr leftI = (tagged_ptr)left;												\
@@ -2496,27 +3756,90 @@ int PyJit_Int_ToFloat(PyObject* in, double*out) {
     return *out == -1.0 && PyErr_Occurred();
 }
 
-static int g_counter;
+PyObject* PyJit_Float_ToInt(double value) {
+    // Truncating anything in this range gives a value we can tag, infinities
+    // and NaNs are outside of it and PyLong_FromDouble reports them.
+    if (value > (double)MIN_TAGGED_VALUE - 1.0 && value < (double)MAX_TAGGED_VALUE + 1.0) {
+        return TAG_IT((tagged_ptr)value);
+    }
+    return PyLong_FromDouble(value);
+}
+
+PyObject* PyJit_Abs_Int(PyObject* value) {
+    tagged_ptr valueI = (tagged_ptr)value;
+    if (IS_TAGGED(valueI)) {
+        auto untagged = UNTAG_IT(valueI);
+        if (untagged != MIN_TAGGED_VALUE) {
+            return TAG_IT(untagged < 0 ? -untagged : untagged);
+        }
+        // the magnitude of the smallest value is too big to tag
+        return NEW_LONG(-untagged);
+    }
+
+    auto res = PyNumber_Absolute(value);
+    Py_DECREF(value);
+    return res;
+}
+
+// Keeps left unless right compares with op against it, which is how min and
+// max choose between equal values.
+static PyObject* PyJit_Choose_Int(PyObject* left, PyObject* right, int op) {
+    tagged_ptr leftI = (tagged_ptr)left;
+    tagged_ptr rightI = (tagged_ptr)right;
+    if (IS_TAGGED(leftI) && IS_TAGGED(rightI)) {
+        // Tagging doesn't change the order of values
+        return (op == Py_LT ? rightI < leftI : rightI > leftI) ? right : left;
+    }
+
+    auto boxedLeft = PyJit_BoxTaggedPointer(left);
+    auto boxedRight = PyJit_BoxTaggedPointer(right);
+    int res = -1;
+    if (boxedLeft != nullptr && boxedRight != nullptr) {
+        res = PyObject_RichCompareBool(boxedRight, boxedLeft, op);
+    }
+    if (res < 0) {
+        Py_XDECREF(boxedLeft);
+        Py_XDECREF(boxedRight);
+        return nullptr;
+    }
+    if (res) {
+        Py_DECREF(boxedLeft);
+        return boxedRight;
+    }
+    Py_DECREF(boxedRight);
+    return boxedLeft;
+}
+
+PyObject* PyJit_Min_Int(PyObject* left, PyObject* right) {
+    return PyJit_Choose_Int(left, right, Py_LT);
+}
+
+PyObject* PyJit_Max_Int(PyObject* left, PyObject* right) {
+    return PyJit_Choose_Int(left, right, Py_GT);
+}
+
+int g_periodicTicks = PERIODIC_TICKS;
 int _PyJit_PeriodicWork() {
-	g_counter++;
-	if (!(g_counter & 0xfff)) {
-		// Pulse the GIL
-		g_counter = 0;
+	g_periodicTicks = PERIODIC_TICKS;
+
+	if (Py_MakePendingCalls() < 0) {
+		return -1;
+	}
+
+	auto ts = PyThreadState_GET();
+	auto head = PyInterpreterState_ThreadHead(ts->interp);
+	if (head != ts || PyThreadState_Next(head) != nullptr) {
+		// Pulse the GIL, but only if there's another thread which could take it
 		Py_BEGIN_ALLOW_THREADS
 		Py_END_ALLOW_THREADS
 	}
 
-	if (!(g_counter & 0xffff)) {
-		auto ts = PyThreadState_GET();
-		if (ts->async_exc != nullptr) {
-			PyErr_SetNone(ts->async_exc);
-			Py_DECREF(ts->async_exc);
-			ts->async_exc = nullptr;
-			return -1;
-		}
-		return Py_MakePendingCalls();
+	if (ts->async_exc != nullptr) {
+		PyErr_SetNone(ts->async_exc);
+		Py_DECREF(ts->async_exc);
+		ts->async_exc = nullptr;
+		return -1;
 	}
-
 	return 0;
 }
 
@@ -2547,6 +3870,42 @@ PyObject* PyJit_FormatValue(PyObject* item) {
 	return res;
 }
 
+PyObject* PyJit_FormatNumber(PyObject* item) {
+	if (!PyLong_CheckExact(item) && !PyFloat_CheckExact(item)) {
+		return PyJit_FormatValue(item);
+	}
+
+	// str and repr are the same for both
+	auto res = Py_TYPE(item)->tp_repr(item);
+	Py_DECREF(item);
+	return res;
+}
+
+PyObject* PyJit_FormatNumberSpec(PyObject* item, PyObject* fmtSpec) {
+	if ((!PyLong_CheckExact(item) && !PyFloat_CheckExact(item)) ||
+		!PyUnicode_CheckExact(fmtSpec) || PyUnicode_READY(fmtSpec) == -1) {
+		return PyJit_FormatObject(item, fmtSpec);
+	}
+
+	_PyUnicodeWriter writer;
+	_PyUnicodeWriter_Init(&writer);
+	auto len = PyUnicode_GET_LENGTH(fmtSpec);
+	int err = PyLong_CheckExact(item) ?
+		_PyLong_FormatAdvancedWriter(&writer, item, fmtSpec, 0, len) :
+		_PyFloat_FormatAdvancedWriter(&writer, item, fmtSpec, 0, len);
+	PyObject* res;
+	if (err == -1) {
+		_PyUnicodeWriter_Dealloc(&writer);
+		res = nullptr;
+	}
+	else {
+		res = _PyUnicodeWriter_Finish(&writer);
+	}
+	Py_DECREF(item);
+	Py_DECREF(fmtSpec);
+	return res;
+}
+
 
 Module g_module;
 
@@ -2558,8 +3917,9 @@ class GlobalMethod : IMethod {
 	LocalKind m_retType;
 	void* m_addr;
 	const char* m_name;
+	MethodIntrinsic m_intrinsic;
 public:
-	GlobalMethod(LocalKind returnType, std::vector<Parameter> params, void* addr, const char* name) {
+	GlobalMethod(LocalKind returnType, std::vector<Parameter> params, void* addr, const char* name, MethodIntrinsic intrinsic = MI_None) {
 		int token = BASE_INDEX + g_module.m_tokenToMethod.size();
 
 		m_addr = addr;
@@ -2568,6 +3928,11 @@ public:
 		m_retType = returnType;
 		m_params = params;
 		m_name = name;
+		m_intrinsic = intrinsic;
+	}
+
+	virtual MethodIntrinsic get_intrinsic() {
+		return m_intrinsic;
 	}
 
 	virtual const char* get_name() {
@@ -2612,6 +3977,9 @@ PyObject* PyJit_Float_FromDouble(double val) {
 #define GLOBAL_REF_METHOD(addr, returnType, ...) \
     GlobalMethod g ## addr(returnType, std::vector<Parameter>{__VA_ARGS__}, (void*)addr, #addr);
 
+#define GLOBAL_INTRINSIC(addr, intrinsic, returnType, ...) \
+    GlobalMethod g ## addr(returnType, std::vector<Parameter>{__VA_ARGS__}, (void*)addr, #addr, intrinsic);
+
 GLOBAL_METHOD(PyJit_Add, LK_Pointer, Parameter(LK_Pointer), Parameter(LK_Pointer));
 GLOBAL_METHOD(PyJit_Subscr, LK_Pointer, Parameter(LK_Pointer), Parameter(LK_Pointer));
 
@@ -2634,9 +4002,17 @@ GLOBAL_METHOD(PyJit_ExtendList, LK_Int, Parameter(LK_Pointer), Parameter(LK_Poin
 GLOBAL_METHOD(PyJit_ListToTuple, LK_Pointer, Parameter(LK_Pointer));
 GLOBAL_METHOD(PyJit_StoreMap, LK_Int, Parameter(LK_Pointer), Parameter(LK_Pointer), Parameter(LK_Pointer));
 GLOBAL_METHOD(PyJit_StoreMapNoDecRef, LK_Int, Parameter(LK_Pointer), Parameter(LK_Pointer), Parameter(LK_Pointer));
+GLOBAL_METHOD(PyJit_BuildConstKeyMap, LK_Pointer, Parameter(LK_Pointer), Parameter(LK_Pointer), Parameter(LK_Pointer));
+GLOBAL_METHOD(PyJit_DictSubscr_Str, LK_Pointer, Parameter(LK_Pointer), Parameter(LK_Pointer), Parameter(LK_Pointer), Parameter(LK_Int));
+GLOBAL_METHOD(PyJit_DictStoreSubscr_Str, LK_Int, Parameter(LK_Pointer), Parameter(LK_Pointer), Parameter(LK_Pointer), Parameter(LK_Pointer));
 GLOBAL_METHOD(PyJit_DictUpdate, LK_Int, Parameter(LK_Pointer), Parameter(LK_Pointer));
 GLOBAL_METHOD(PyJit_StoreSubscr, LK_Int, Parameter(LK_Pointer), Parameter(LK_Pointer), Parameter(LK_Pointer));
 GLOBAL_METHOD(PyJit_DeleteSubscr, LK_Int, Parameter(LK_Pointer), Parameter(LK_Pointer));
+GLOBAL_METHOD(PyJit_Binary_Borrowed, LK_Pointer, Parameter(LK_Pointer), Parameter(LK_Pointer), Parameter(LK_Int), Parameter(LK_Int));
+GLOBAL_METHOD(PyJit_RichCompare_Borrowed, LK_Pointer, Parameter(LK_Pointer), Parameter(LK_Pointer), Parameter(LK_Int), Parameter(LK_Int));
+GLOBAL_METHOD(PyJit_UnicodeConcatenate, LK_Pointer, Parameter(LK_Pointer), Parameter(LK_Pointer), Parameter(LK_Pointer), Parameter(LK_Int), Parameter(LK_Int));
+GLOBAL_METHOD(PyJit_GetSlice, LK_Pointer, Parameter(LK_Pointer), Parameter(LK_Pointer), Parameter(LK_Pointer));
+GLOBAL_METHOD(PyJit_StoreSlice, LK_Int, Parameter(LK_Pointer), Parameter(LK_Pointer), Parameter(LK_Pointer), Parameter(LK_Pointer));
 
 GLOBAL_METHOD(_PyDict_NewPresized, LK_Pointer, Parameter(LK_Pointer));
 GLOBAL_METHOD(PyTuple_New, LK_Pointer, Parameter(LK_Pointer));
@@ -2672,6 +4048,22 @@ GLOBAL_METHOD(PySet_Add, LK_Int, Parameter(LK_Pointer), Parameter(LK_Pointer));
 GLOBAL_METHOD(Call0, LK_Pointer, Parameter(LK_Pointer));
 GLOBAL_METHOD(Call1, LK_Pointer, Parameter(LK_Pointer), Parameter(LK_Pointer));
 GLOBAL_METHOD(Call2, LK_Pointer, Parameter(LK_Pointer), Parameter(LK_Pointer), Parameter(LK_Pointer));
+
+GLOBAL_METHOD(PyJit_CallMethod0, LK_Pointer, Parameter(LK_Pointer), Parameter(LK_Pointer), Parameter(LK_Pointer));
+GLOBAL_METHOD(PyJit_CallMethod1, LK_Pointer, Parameter(LK_Pointer), Parameter(LK_Pointer), Parameter(LK_Pointer), Parameter(LK_Pointer));
+GLOBAL_METHOD(PyJit_CallMethod2, LK_Pointer, Parameter(LK_Pointer), Parameter(LK_Pointer), Parameter(LK_Pointer), Parameter(LK_Pointer), Parameter(LK_Pointer));
+GLOBAL_METHOD(PyJit_CallMethod3, LK_Pointer, Parameter(LK_Pointer), Parameter(LK_Pointer), Parameter(LK_Pointer), Parameter(LK_Pointer), Parameter(LK_Pointer), Parameter(LK_Pointer));
+GLOBAL_METHOD(PyJit_CallMethodN, LK_Pointer, Parameter(LK_Pointer), Parameter(LK_Pointer), Parameter(LK_Pointer));
+GLOBAL_METHOD(PyJit_CallDirect0, LK_Pointer, Parameter(LK_Pointer), Parameter(LK_Pointer));
+GLOBAL_METHOD(PyJit_CallDirect1, LK_Pointer, Parameter(LK_Pointer), Parameter(LK_Pointer), Parameter(LK_Pointer));
+GLOBAL_METHOD(PyJit_CallDirect2, LK_Pointer, Parameter(LK_Pointer), Parameter(LK_Pointer), Parameter(LK_Pointer), Parameter(LK_Pointer));
+GLOBAL_METHOD(PyJit_CallDirect3, LK_Pointer, Parameter(LK_Pointer), Parameter(LK_Pointer), Parameter(LK_Pointer), Parameter(LK_Pointer), Parameter(LK_Pointer));
+GLOBAL_METHOD(PyJit_CallDirect4, LK_Pointer, Parameter(LK_Pointer), Parameter(LK_Pointer), Parameter(LK_Pointer), Parameter(LK_Pointer), Parameter(LK_Pointer), Parameter(LK_Pointer));
+
+GLOBAL_METHOD(PyJit_CallLen, LK_Pointer, Parameter(LK_Pointer), Parameter(LK_Pointer));
+GLOBAL_METHOD(PyJit_CallIsInstance, LK_Pointer, Parameter(LK_Pointer), Parameter(LK_Pointer), Parameter(LK_Pointer));
+GLOBAL_METHOD(PyJit_CallInt, LK_Pointer, Parameter(LK_Pointer), Parameter(LK_Pointer));
+GLOBAL_METHOD(PyJit_CallFloat, LK_Pointer, Parameter(LK_Pointer), Parameter(LK_Pointer));
 GLOBAL_METHOD(Call3, LK_Pointer, Parameter(LK_Pointer), Parameter(LK_Pointer), Parameter(LK_Pointer), Parameter(LK_Pointer));
 GLOBAL_METHOD(Call4, LK_Pointer, Parameter(LK_Pointer), Parameter(LK_Pointer), Parameter(LK_Pointer), Parameter(LK_Pointer), Parameter(LK_Pointer));
 GLOBAL_METHOD(PyJit_CallN, LK_Pointer, Parameter(LK_Pointer), Parameter(LK_Pointer));
@@ -2686,9 +4078,13 @@ GLOBAL_METHOD(PyJit_KwCallN, LK_Pointer, Parameter(LK_Pointer), Parameter(LK_Poi
 GLOBAL_METHOD(PyJit_StoreGlobal, LK_Int, Parameter(LK_Pointer), Parameter(LK_Pointer), Parameter(LK_Pointer));
 GLOBAL_METHOD(PyJit_DeleteGlobal, LK_Int, Parameter(LK_Pointer), Parameter(LK_Pointer));
 GLOBAL_METHOD(PyJit_LoadGlobal, LK_Pointer, Parameter(LK_Pointer), Parameter(LK_Pointer));
+GLOBAL_METHOD(PyJit_LoadGlobalCached, LK_Pointer, Parameter(LK_Pointer), Parameter(LK_Pointer), Parameter(LK_Pointer));
 GLOBAL_METHOD(PyJit_LoadAttr, LK_Pointer, Parameter(LK_Pointer), Parameter(LK_Pointer));
+GLOBAL_METHOD(PyJit_LoadAttrCached, LK_Pointer, Parameter(LK_Pointer), Parameter(LK_Pointer), Parameter(LK_Pointer));
+GLOBAL_METHOD(PyJit_LoadMethod, LK_Pointer, Parameter(LK_Pointer), Parameter(LK_Pointer), Parameter(LK_Pointer), Parameter(LK_Pointer));
 
 GLOBAL_METHOD(PyJit_StoreAttr, LK_Int, Parameter(LK_Pointer), Parameter(LK_Pointer), Parameter(LK_Pointer));
+GLOBAL_METHOD(PyJit_StoreAttrCached, LK_Int, Parameter(LK_Pointer), Parameter(LK_Pointer), Parameter(LK_Pointer), Parameter(LK_Pointer));
 GLOBAL_METHOD(PyJit_DeleteAttr, LK_Int, Parameter(LK_Pointer), Parameter(LK_Pointer));
 
 GLOBAL_METHOD(PyJit_LoadName, LK_Pointer, Parameter(LK_Pointer), Parameter(LK_Pointer));
@@ -2754,6 +4150,13 @@ GLOBAL_METHOD(PyJit_DebugDumpFrame, LK_Void, Parameter(LK_Pointer));
 
 GLOBAL_METHOD(PyJit_PopFrame, LK_Void, Parameter(LK_Pointer));
 GLOBAL_METHOD(PyJit_PushFrame, LK_Void, Parameter(LK_Pointer));
+GLOBAL_METHOD(PyJit_GenEnter, LK_Void, Parameter(LK_Pointer));
+GLOBAL_METHOD(PyJit_GenExit, LK_Void, Parameter(LK_Pointer));
+GLOBAL_METHOD(PyJit_GetYieldFromIter, LK_Pointer, Parameter(LK_Pointer), Parameter(LK_Int));
+GLOBAL_METHOD(PyJit_GetAwaitable, LK_Pointer, Parameter(LK_Pointer));
+GLOBAL_METHOD(PyJit_YieldFrom, LK_Int, Parameter(LK_Pointer), Parameter(LK_Pointer), Parameter(LK_Pointer));
+GLOBAL_METHOD(PyJit_SetupWith, LK_Pointer, Parameter(LK_Pointer), Parameter(LK_Pointer));
+GLOBAL_METHOD(PyJit_WithCleanup, LK_Int, Parameter(LK_Pointer), Parameter(LK_Pointer), Parameter(LK_Pointer), Parameter(LK_Pointer));
 GLOBAL_METHOD(PyJit_UnwindEh, LK_Void, Parameter(LK_Pointer), Parameter(LK_Pointer), Parameter(LK_Pointer));
 GLOBAL_METHOD(PyJit_ImportName, LK_Pointer, Parameter(LK_Pointer), Parameter(LK_Pointer), Parameter(LK_Pointer), Parameter(LK_Pointer));
 
@@ -2771,21 +4174,37 @@ GLOBAL_METHOD(PyJit_IsNot, LK_Pointer, Parameter(LK_Pointer), Parameter(LK_Point
 GLOBAL_METHOD(PyJit_Is_Bool, LK_Int, Parameter(LK_Pointer), Parameter(LK_Pointer));
 GLOBAL_METHOD(PyJit_IsNot_Bool, LK_Int, Parameter(LK_Pointer), Parameter(LK_Pointer));
 
-GLOBAL_METHOD(PyJit_GetIterOptimized, LK_Pointer, Parameter(LK_Pointer), Parameter(LK_Pointer), Parameter(LK_Pointer));
-GLOBAL_METHOD(PyJit_IterNextOptimized, LK_Pointer, Parameter(LK_Pointer), Parameter(LK_Pointer), Parameter(LK_Pointer), Parameter(LK_Pointer));
+GLOBAL_METHOD(PyJit_GetIterOptimized, LK_Pointer, Parameter(LK_Pointer), Parameter(LK_Pointer), Parameter(LK_Pointer), Parameter(LK_Pointer));
+GLOBAL_METHOD(PyJit_RangeIterRemaining, LK_Pointer, Parameter(LK_Pointer), Parameter(LK_Pointer), Parameter(LK_Pointer), Parameter(LK_Pointer));
+GLOBAL_METHOD(PyJit_Deopt, LK_Pointer, Parameter(LK_Pointer));
+GLOBAL_METHOD(PyJit_SideExit, LK_Pointer, Parameter(LK_Pointer));
+GLOBAL_METHOD(PyLong_FromSsize_t, LK_Pointer, Parameter(LK_Pointer));
+GLOBAL_METHOD(PyJit_RunLoopKernel, LK_Void, Parameter(LK_Pointer), Parameter(LK_Int), Parameter(LK_Int), Parameter(LK_Int), Parameter(LK_Int), Parameter(LK_Int), Parameter(LK_Pointer), Parameter(LK_Pointer), Parameter(LK_Pointer));
 
 GLOBAL_METHOD(Call0_Generic, LK_Pointer, Parameter(LK_Pointer), Parameter(LK_Pointer));
 
 double(*PyJit_Pow)(double, double) = pow;
 double(*PyJit_Floor)(double) = floor;
 double(*PyJit_FMod)(double, double) = fmod;
+double(*PyJit_Sqrt)(double) = sqrt;
+double(*PyJit_Ceil)(double) = ceil;
+double(*PyJit_FAbs)(double) = fabs;
 
 GLOBAL_REF_METHOD(PyJit_Pow, LK_Float, Parameter(LK_Float), Parameter(LK_Float));
-GLOBAL_REF_METHOD(PyJit_Floor, LK_Float, Parameter(LK_Float));
+GLOBAL_INTRINSIC(PyJit_Floor, MI_Floor, LK_Float, Parameter(LK_Float));
 GLOBAL_REF_METHOD(PyJit_FMod, LK_Float, Parameter(LK_Float), Parameter(LK_Float));
+GLOBAL_INTRINSIC(PyJit_Sqrt, MI_Sqrt, LK_Float, Parameter(LK_Float));
+GLOBAL_INTRINSIC(PyJit_Ceil, MI_Ceiling, LK_Float, Parameter(LK_Float));
+GLOBAL_INTRINSIC(PyJit_FAbs, MI_Abs, LK_Float, Parameter(LK_Float));
+GLOBAL_METHOD(PyJit_Float_ToInt, LK_Pointer, Parameter(LK_Float));
+GLOBAL_METHOD(PyJit_Abs_Int, LK_Pointer, Parameter(LK_Pointer));
+GLOBAL_METHOD(PyJit_Min_Int, LK_Pointer, Parameter(LK_Pointer), Parameter(LK_Pointer));
+GLOBAL_METHOD(PyJit_Max_Int, LK_Pointer, Parameter(LK_Pointer), Parameter(LK_Pointer));
 GLOBAL_METHOD(PyFloat_FromDouble, LK_Pointer, Parameter(LK_Float));
 GLOBAL_METHOD(PyBool_FromLong, LK_Pointer, Parameter(LK_Int));
 GLOBAL_METHOD(PyJit_BoxTaggedPointer, LK_Pointer, Parameter(LK_Pointer));
+GLOBAL_METHOD(PyJit_Subscr_Tagged, LK_Pointer, Parameter(LK_Pointer), Parameter(LK_Pointer));
+GLOBAL_METHOD(PyJit_StoreSubscr_Tagged, LK_Int, Parameter(LK_Pointer), Parameter(LK_Pointer), Parameter(LK_Pointer));
 GLOBAL_METHOD(PyJit_UnboxInt_Tagged, LK_Pointer, Parameter(LK_Pointer));
 
 GLOBAL_METHOD(PyErr_SetString, LK_Void, Parameter(LK_Pointer), Parameter(LK_Pointer));
@@ -2818,4 +4237,6 @@ GLOBAL_METHOD(PyJit_Int_ToFloat, LK_Bool, Parameter(LK_Float), Parameter(LK_Poin
 GLOBAL_METHOD(PyJit_UnicodeJoinArray, LK_Pointer, Parameter(LK_Pointer), Parameter(LK_Pointer));
 GLOBAL_METHOD(PyJit_FormatValue, LK_Pointer, Parameter(LK_Pointer));
 GLOBAL_METHOD(PyJit_FormatObject, LK_Pointer, Parameter(LK_Pointer), Parameter(LK_Pointer));
+GLOBAL_METHOD(PyJit_FormatNumber, LK_Pointer, Parameter(LK_Pointer));
+GLOBAL_METHOD(PyJit_FormatNumberSpec, LK_Pointer, Parameter(LK_Pointer), Parameter(LK_Pointer));
 GLOBAL_METHOD(PyJit_Float_FromDouble, LK_Pointer, Parameter(LK_Float));
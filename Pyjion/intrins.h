@@ -144,6 +144,20 @@ PyObject* PyJit_InplaceAnd(PyObject *left, PyObject *right);
 PyObject* PyJit_InplaceXor(PyObject *left, PyObject *right);
 
 PyObject* PyJit_InplaceOr(PyObject *left, PyObject *right);
+
+// Flags for which arguments of the _Borrowed helpers are borrowed from a local
+// or constant which outlives the call, rather than owned by the helper.
+#define BORROWED_LEFT   0x01
+#define BORROWED_RIGHT  0x02
+
+// Performs the binary operation opcode (a BINARY_ or INPLACE_ opcode), only
+// releasing the arguments which aren't borrowed.
+PyObject* PyJit_Binary_Borrowed(PyObject *left, PyObject *right, int opcode, int borrowed);
+PyObject* PyJit_RichCompare_Borrowed(PyObject *left, PyObject *right, int op, int borrowed);
+// Adds left and right which are assigned to *target.  If they're strs and
+// *target holds left it's cleared first so left can be resized in place.
+PyObject* PyJit_UnicodeConcatenate(PyObject *left, PyObject *right, PyObject** target, int opcode, int borrowed);
+
 int PyJit_PrintExpr(PyObject *value);
 
 const char * ObjInfo(PyObject *obj);
@@ -189,6 +203,15 @@ void PyJit_PopFrame(PyFrameObject* frame);
 
 void PyJit_EhTrace(PyFrameObject *f);
 
+void PyJit_GenEnter(PyFrameObject* f);
+void PyJit_GenExit(PyFrameObject* f);
+PyObject* PyJit_GetYieldFromIter(PyObject* iterable, int allowCoroutine);
+PyObject* PyJit_GetAwaitable(PyObject* awaitable);
+int PyJit_YieldFrom(PyObject* receiver, PyObject* value, PyObject** result);
+
+PyObject* PyJit_SetupWith(PyObject* mgr, PyObject** exit);
+int PyJit_WithCleanup(PyObject* exit, PyObject* exc, PyObject* val, PyObject* tb);
+
 int PyJit_Raise(PyObject *exc, PyObject *cause);
 
 PyObject* PyJit_LoadClassDeref(PyFrameObject* frame, size_t oparg);
@@ -200,12 +223,25 @@ PyObject* PyJit_ListToTuple(PyObject *list);
 int PyJit_StoreMap(PyObject *key, PyObject *value, PyObject* map);
 int PyJit_StoreMapNoDecRef(PyObject *key, PyObject *value, PyObject* map);
 
+// Builds the dict for {'a': x, 'b': y}, the keys being a constant tuple
+PyObject* PyJit_BuildConstKeyMap(PyObject** values, PyObject* keys, Py_ssize_t count);
+
 int PyJit_DictUpdate(PyObject *dict, PyObject* other);
 
 int PyJit_StoreSubscr(PyObject* value, PyObject *container, PyObject *index);
 
 int PyJit_DeleteSubscr(PyObject *container, PyObject *index);
 
+// Subscripts with a constant str key whose hash was computed when the code was
+// compiled.  Anything other than an exact dict takes the generic path.
+PyObject* PyJit_DictSubscr_Str(PyObject* container, PyObject* key, Py_hash_t hash, int borrowed);
+int PyJit_DictStoreSubscr_Str(PyObject* value, PyObject* container, PyObject* key, Py_hash_t hash);
+
+// Subscript with the slice start:stop, which is only created if the container
+// isn't a list, tuple or str or the bounds aren't None or ints.
+PyObject* PyJit_GetSlice(PyObject* container, PyObject* start, PyObject* stop);
+int PyJit_StoreSlice(PyObject* value, PyObject* container, PyObject* start, PyObject* stop);
+
 PyObject* PyJit_CallN(PyObject *target, PyObject* args);
 
 PyObject* PyJit_CallNKW(PyObject *target, PyObject* args, PyObject* kwargs);
@@ -216,9 +252,157 @@ int PyJit_DeleteGlobal(PyFrameObject* f, PyObject* name);
 
 PyObject* PyJit_LoadGlobal(PyFrameObject* f, PyObject* name);
 
+// The result of looking up a global, shared by every LOAD_GLOBAL of a name in a
+// code object.  Dict version tags (PEP 509) are unique across all dicts and
+// change on every mutation, so while the frame's globals and builtins still have
+// the versions we recorded the lookup would produce the same value.  Value is
+// borrowed from whichever dict holds it.
+struct GlobalCache {
+    PY_UINT64_T GlobalsVersion;
+    PyObject* Builtins;
+    PY_UINT64_T BuiltinsVersion;
+    PyObject* Value;
+
+    GlobalCache() : GlobalsVersion(0), Builtins(nullptr), BuiltinsVersion(0), Value(nullptr) {
+    }
+
+    ~GlobalCache() {
+        Py_XDECREF(Builtins);
+    }
+};
+
+PyObject* PyJit_LoadGlobalCached(PyFrameObject* f, PyObject* name, GlobalCache* cache);
+
+// How an attribute access which has been cached is performed.
+enum AttrCacheKind {
+    // A __slots__ member, stored at Offset in the object
+    ACK_Slot,
+    // Nothing on the type, so the attribute lives in the instance dict
+    ACK_InstanceDict,
+    // A function or method descriptor which the instance dict may shadow
+    ACK_Method,
+    // A data descriptor, such as a property, which takes priority over the
+    // instance dict
+    ACK_DataDescriptor,
+    // A plain value on the type which the instance dict may shadow
+    ACK_ClassAttribute
+};
+
+// Inline cache for a LOAD_ATTR or STORE_ATTR site.  The type version tag changes
+// whenever the type or one of its bases is modified, so while an object's type
+// has the recorded version the descriptor found on the type is still Descr
+// (borrowed from the type's dict) and the access can skip the lookup through
+// the MRO.  A Version of 0 means the cache is empty.
+struct AttrCache {
+    unsigned int Version;
+    AttrCacheKind Kind;
+    Py_ssize_t Offset;
+    PyObject* Descr;
+
+    AttrCache() : Version(0), Kind(ACK_InstanceDict), Offset(0), Descr(nullptr) {
+    }
+};
+
+PyObject* PyJit_LoadAttrCached(PyObject* owner, PyObject* name, AttrCache* cache);
+int PyJit_StoreAttrCached(PyObject* value, PyObject* owner, PyObject* name, AttrCache* cache);
+
+// Loads an attribute which is about to be called.  If it's a method we return
+// the function and store owner in self, so it can be called without creating a
+// bound method.  Otherwise self is set to null and we return the attribute.
+PyObject* PyJit_LoadMethod(PyObject* owner, PyObject* name, AttrCache* cache, PyObject** self);
+
+class PyjionJittedCode;
+struct SpecializedTreeNode;
+
+// Cache for a call site, recording the compiled code the last Python function it
+// called was dispatched to.  Code is borrowed, the cache is only valid while the
+// code generation matches, which changes whenever any jitted code is evicted or
+// freed.  Target is the specialization whose types guard the code, or null if
+// the code is the function's generic code.
+struct CallCache {
+    PyObject* Code;
+    size_t Generation;
+    PyjionJittedCode* Jitted;
+    SpecializedTreeNode* Target;
+    void* Addr;
+
+    CallCache() : Code(nullptr), Generation(0), Jitted(nullptr), Target(nullptr), Addr(nullptr) {
+    }
+};
+
+// Runs a frame for a call made from jitted code through cache.  Defined with the
+// rest of the dispatch logic in pyjit.cpp.
+PyObject* PyJit_EvalDirect(PyFrameObject* frame, CallCache* cache);
+
+// Number of times a guard can fail before the function's code is thrown away
+// and recompiled without it.
+#define DEOPT_LIMIT 8
+
+// Finishes running a frame in the interpreter after a guard in its compiled
+// code has failed.  The compiled code has stored its state into the frame the
+// way the interpreter would have, except that tagged ints on the value stack
+// still need boxing, and a NULL on the stack means a value couldn't be moved
+// into the frame and an exception is set.  The frame resumes after f_lasti.
+// Defined with the rest of the dispatch logic in pyjit.cpp.
+PyObject* PyJit_Deopt(PyFrameObject* frame);
+
+// Finishes running a frame in the interpreter from an instruction its compiled
+// code can't run, with the frame left the same way as for PyJit_Deopt.
+PyObject* PyJit_SideExit(PyFrameObject* frame);
+
+// Calls a target produced by PyJit_LoadMethod, passing self first if it's set.
+PyObject* PyJit_CallMethod0(PyObject* target, PyObject* self, CallCache* cache);
+PyObject* PyJit_CallMethod1(PyObject* target, PyObject* self, PyObject* arg0, CallCache* cache);
+PyObject* PyJit_CallMethod2(PyObject* target, PyObject* self, PyObject* arg0, PyObject* arg1, CallCache* cache);
+PyObject* PyJit_CallMethod3(PyObject* target, PyObject* self, PyObject* arg0, PyObject* arg1, PyObject* arg2, CallCache* cache);
+PyObject* PyJit_CallMethodN(PyObject* target, PyObject* self, PyObject* args);
+
+// Calls target through cache, which lets calls to jitted functions go straight
+// to their compiled code.
+PyObject* PyJit_CallDirect0(PyObject* target, CallCache* cache);
+PyObject* PyJit_CallDirect1(PyObject* target, PyObject* arg0, CallCache* cache);
+PyObject* PyJit_CallDirect2(PyObject* target, PyObject* arg0, PyObject* arg1, CallCache* cache);
+PyObject* PyJit_CallDirect3(PyObject* target, PyObject* arg0, PyObject* arg1, PyObject* arg2, CallCache* cache);
+PyObject* PyJit_CallDirect4(PyObject* target, PyObject* arg0, PyObject* arg1, PyObject* arg2, PyObject* arg3, CallCache* cache);
+
 PyObject* PyJit_GetIter(PyObject* iterable);
-PyObject* PyJit_GetIterOptimized(PyObject* iterable, size_t* iterstate1, size_t* iterstate2);
-PyObject* PyJit_IterNextOptimized(PyObject* iter, int*error, size_t* iterstate1, size_t* iterstate2);
+// Gets the iterator for a for loop, which is iterable itself if it's a range
+// we can iterate with a native counter.  In that case current holds the first
+// value and is advanced by step for the remaining iterations.  Otherwise step
+// is set to 0 and we return the object's iterator.
+PyObject* PyJit_GetIterOptimized(PyObject* iterable, Py_ssize_t* current, Py_ssize_t* step, Py_ssize_t* remaining);
+// Gets an iterator for what's left of a range being counted natively, taking
+// over the reference to the range.
+PyObject* PyJit_RangeIterRemaining(PyObject* range, Py_ssize_t current, Py_ssize_t step, Py_ssize_t remaining);
+
+// Loop kernels run the body of a range loop natively over buffers, for
+// bodies which are either target[i] = x op y or target += x op y.
+enum LoopKernelKind {
+    LKK_Store,
+    LKK_Reduce,
+};
+
+// The operands of a kernel are encoded as an int holding the kind and the
+// index of the local or constant.
+enum KernelOperandKind {
+    KOK_None,
+    // local[i] where local is an array, bytes, bytearray or memoryview
+    KOK_Element,
+    KOK_Local,
+    KOK_Const,
+};
+
+#define KERNEL_OPERAND(kind, index) (((index) << 2) | (kind))
+#define KERNEL_OPERAND_KIND(operand) ((operand) & 0x03)
+#define KERNEL_OPERAND_INDEX(operand) ((operand) >> 2)
+
+// Runs as many iterations of a range loop's kernel as it can ahead of the
+// loop, leaving the loop to run the rest.  op is BINARY_ADD, BINARY_SUBTRACT,
+// BINARY_MULTIPLY or 0 if there's no right operand, and target is the index
+// of the local which is either stored into or accumulated.  Nothing is run if
+// the operands aren't buffers of supported formats or an index would be out
+// of range, and iteration stops short of anything that would raise.
+void PyJit_RunLoopKernel(PyFrameObject* frame, int kind, int op, int left, int right, int target, Py_ssize_t* current, Py_ssize_t step, Py_ssize_t* remaining);
 
 PyObject* PyJit_IterNext(PyObject* iter, int*error);
 
@@ -263,7 +447,27 @@ PyObject* Call4(PyObject *target, PyObject* arg0, PyObject* arg1, PyObject* arg2
 
 PyObject* Call0_Generic(PyObject *target, void**addr);
 
+// Calls to globals which are speculated to be well known builtins.  These check
+// the target really is the builtin and fall back to a normal call if not.
+PyObject* PyJit_CallLen(PyObject *target, PyObject* arg0);
+PyObject* PyJit_CallIsInstance(PyObject *target, PyObject* arg0, PyObject* arg1);
+PyObject* PyJit_CallInt(PyObject *target, PyObject* arg0);
+PyObject* PyJit_CallFloat(PyObject *target, PyObject* arg0);
+
 extern PyObject* g_emptyTuple;
+// The C implementations of len and isinstance, which are the same for the
+// builtins of every interpreter.
+extern PyCFunction g_builtinLen;
+extern PyCFunction g_builtinIsInstance;
+// The C implementations of the builtins and math functions which calls with
+// unboxed arguments are replaced with intrinsics for.  The math ones are null
+// if the module couldn't be imported.
+extern PyCFunction g_builtinAbs;
+extern PyCFunction g_builtinMin;
+extern PyCFunction g_builtinMax;
+extern PyCFunction g_mathSqrt;
+extern PyCFunction g_mathFloor;
+extern PyCFunction g_mathCeil;
 
 
 void PyJit_DecRef(PyObject* value);
@@ -285,6 +489,10 @@ PyObject* PyJit_BinaryRShift_Int(PyObject *left, PyObject *right);
 PyObject* PyJit_Power_Int(PyObject *left, PyObject *right);
 
 PyObject* PyJit_BoxTaggedPointer(PyObject* value);
+// Subscripts with an index which may be tagged, for when the direct access
+// to a list or tuple's items can't be used.
+PyObject* PyJit_Subscr_Tagged(PyObject* container, PyObject* index);
+int PyJit_StoreSubscr_Tagged(PyObject* value, PyObject* container, PyObject* index);
 PyObject* PyJit_UnaryNegative_Int(PyObject*value);
 int PyJit_UnaryNot_Int_PushBool(PyObject*value);
 
@@ -296,17 +504,38 @@ int PyJit_GreaterThan_Int(PyObject *left, PyObject *right);
 int PyJit_GreaterThanEquals_Int(PyObject *left, PyObject *right);
 
 int PyJit_Int_ToFloat(PyObject* in, double*out);
+// Truncates a float to an int which may be tagged, raising the same errors as
+// int() for infinities and NaNs.
+PyObject* PyJit_Float_ToInt(double value);
+// abs, min and max of ints which may be tagged.  The arguments are consumed,
+// and min and max return the same argument the builtins would.
+PyObject* PyJit_Abs_Int(PyObject* value);
+PyObject* PyJit_Min_Int(PyObject* left, PyObject* right);
+PyObject* PyJit_Max_Int(PyObject* left, PyObject* right);
 
 PyObject* PyJit_Float_FromDouble(double val);
+// Back edges count this down inline and only call _PyJit_PeriodicWork, which
+// runs pending calls, hands off the GIL and raises async exceptions, when it
+// runs out.
+#define PERIODIC_TICKS 0x400
+extern int g_periodicTicks;
 int _PyJit_PeriodicWork();
 
 PyObject* PyJit_UnicodeJoinArray(PyObject** items, Py_ssize_t count);
 PyObject* PyJit_FormatObject(PyObject* item, PyObject*fmtSpec);
 PyObject* PyJit_FormatValue(PyObject* item);
+// Formats exact ints and floats without looking up __format__
+PyObject* PyJit_FormatNumber(PyObject* item);
+PyObject* PyJit_FormatNumberSpec(PyObject* item, PyObject* fmtSpec);
 
 extern double(*PyJit_Pow)(double, double);
 extern double(*PyJit_Floor)(double);
 extern double(*PyJit_FMod)(double, double);
+// These are also marked as intrinsics, so the JIT can replace them with
+// instructions where it supports that
+extern double(*PyJit_Sqrt)(double);
+extern double(*PyJit_Ceil)(double);
+extern double(*PyJit_FAbs)(double);
 
 
 class Module : public IModule {
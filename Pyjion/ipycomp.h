@@ -68,6 +68,14 @@ enum CompareType {
 	CT_GreaterThanEqual,
 };
 
+// The tiers functions are compiled at.  Baseline code is generated without any
+// type inference and with minimal optimization from the JIT, so it's cheap to
+// produce.  Functions which stay hot are recompiled with full optimization.
+enum CompileTier {
+	TierBaseline,
+	TierOptimized
+};
+
 class Method;
 class IMethod;
 
@@ -99,6 +107,15 @@ public:
 	}
 };
 
+// Helpers the JIT may replace with instructions instead of calling them.
+enum MethodIntrinsic {
+	MI_None,
+	MI_Sqrt,
+	MI_Abs,
+	MI_Floor,
+	MI_Ceiling
+};
+
 class IMethod {
 public:
 	virtual unsigned int get_param_count() = 0;
@@ -118,6 +135,10 @@ public:
 		return nullptr;
 	}
 
+	virtual MethodIntrinsic get_intrinsic() {
+		return MI_None;
+	}
+
 	virtual ~IMethod() {
 	};
 	//    virtual void findSig(CORINFO_SIG_INFO  *sig) = 0;
@@ -160,12 +181,92 @@ return CORINFO_FLG_NOSECURITYWRAP | CORINFO_FLG_VIRTUAL | CORINFO_FLG_NATIVE;
 };
 */
 
+// Measurements taken while compiling a function.  Times are in nanoseconds.
+// jitMemory is the number of bytes RyuJIT allocated while compiling, which it
+// holds onto until the compile finishes, so it's also the peak it used.
+struct CompileStats {
+    unsigned long long preprocessTime, interpretTime, emitTime, jitTime;
+    size_t ilSize, codeSize, roDataSize, gcInfoSize, jitMemory;
+
+    CompileStats() : preprocessTime(0), interpretTime(0), emitTime(0), jitTime(0),
+        ilSize(0), codeSize(0), roDataSize(0), gcInfoSize(0), jitMemory(0) {
+    }
+
+    // Accumulates the measurements from another compile.  Peak memory is the
+    // largest of either compile, everything else is summed.
+    void add(const CompileStats& other) {
+        preprocessTime += other.preprocessTime;
+        interpretTime += other.interpretTime;
+        emitTime += other.emitTime;
+        jitTime += other.jitTime;
+        ilSize += other.ilSize;
+        codeSize += other.codeSize;
+        roDataSize += other.roDataSize;
+        gcInfoSize += other.gcInfoSize;
+        if (other.jitMemory > jitMemory) {
+            jitMemory = other.jitMemory;
+        }
+    }
+};
+
+// Maps an offset in the IL or native code to the offset of the bytecode
+// instruction it was compiled from.
+struct SequencePoint {
+    unsigned int offset;
+    int bytecodeIndex;
+
+    SequencePoint() : offset(0), bytecodeIndex(-1) {
+    }
+
+    SequencePoint(unsigned int offset, int bytecodeIndex) : offset(offset), bytecodeIndex(bytecodeIndex) {
+    }
+};
+
+// Finds the last of the points, which are in increasing order, at or before offset.
+inline SequencePoint* find_sequence_point(SequencePoint* points, size_t count, unsigned int offset) {
+    size_t low = 0, high = count;
+    while (low < high) {
+        auto mid = (low + high) / 2;
+        if (points[mid].offset <= offset) {
+            low = mid + 1;
+        }
+        else {
+            high = mid;
+        }
+    }
+    return low == 0 ? nullptr : &points[low - 1];
+}
+
 class JittedCode {
 public:
     virtual ~JittedCode() {
     }
     virtual void* get_code_addr() = 0;
+    // Gets the number of bytes of native code and data owned by this object
+    virtual size_t get_code_size() = 0;
+    // Gets the measurements taken while this code was compiled
+    virtual CompileStats& get_stats() = 0;
+    // Gets the offset of the bytecode instruction the native code at addr was
+    // compiled from, or -1 if it isn't known.  For a return address pass the
+    // address of the call, e.g. addr - 1.
+    virtual int find_bytecode_offset(void* addr) = 0;
+    // Gets the native offsets the bytecode instructions start at, in increasing
+    // order, and stores how many there are in count.
+    virtual SequencePoint* get_pc_map(size_t* count) = 0;
+
+};
 
+// A method whose IL has been generated but which hasn't been compiled to native code
+// yet.  Compiling doesn't touch any Python objects so it can be done without the GIL.
+class PendingCode {
+public:
+    virtual ~PendingCode() {
+    }
+    // Compiles the method to native code, returning nullptr on failure.
+    virtual JittedCode* compile() = 0;
+    // Gets the measurements from producing the IL, the native compile adds its own
+    // to these.
+    virtual CompileStats& get_stats() = 0;
 };
 
 // Defines the interface between the abstract compiler and code generator
@@ -186,6 +287,12 @@ public:
     virtual void emit_mark_label(Label label) = 0;
     // Emits a branch to the specified label 
     virtual void emit_branch(BranchType branchType, Label label) = 0;
+    // Records that the IL emitted from here on is for the bytecode instruction
+    // at bytecodeIndex, so native code can be mapped back to it
+    virtual void mark_sequence_point(int bytecodeIndex) = 0;
+    // Sizes the compiler's buffers up front for a method with codeSize bytes of
+    // bytecode
+    virtual void reserve(size_t codeSize) = 0;
     // Compares if the last two values pushed onto the stack are equal
     virtual void emit_compare_equal() = 0;
 
@@ -244,11 +351,17 @@ public:
        
     // Performs a comparison of two unboxed floating point values on the stack
     virtual void emit_compare_float(CompareType compareType) = 0;
+    // Performs a signed comparison of two native ints on the stack
+    virtual void emit_compare_int(CompareType compareType) = 0;
 
 	virtual void emit_load_arg(int arg) = 0;
 	virtual void emit_bitwise_and() = 0;
+	virtual void emit_bitwise_or() = 0;
+	virtual void emit_bitwise_xor() = 0;
 	/* Compiles the generated code */
-    virtual JittedCode* emit_compile() = 0;
+    virtual JittedCode* emit_compile(CompileTier tier) = 0;
+	/* Packages up the generated code so it can be compiled later, possibly on another thread */
+	virtual PendingCode* emit_deferred_compile(CompileTier tier) = 0;
 
 	// Allows passing any function delegate w/o implicit conversion
 	template<typename T> inline void emit_call(T* func) {
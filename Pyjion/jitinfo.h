@@ -44,6 +44,7 @@
 
 #include "cee.h"
 #include "ipycomp.h"
+#include "perfmap.h"
 
 using namespace std;
 
@@ -61,22 +62,45 @@ class CorJitInfo : public ICorJitInfo, public JittedCode {
     CExecutionEngine& m_executionEngine;
     void* m_codeAddr;
     void* m_dataAddr;
+    size_t m_codeSize;
 	IMethod* m_method;
+    // Ask the JIT to skip optimizations, used for baseline code
+    bool m_minOpts;
+    CompileStats m_stats;
+    // Where the bytecode instructions start in the IL, which is only available
+    // while the method is being compiled
+    SequencePoint* m_sequencePoints;
+    size_t m_sequencePointCount;
+    // The native offsets the bytecode instructions start at, in increasing order
+    SequencePoint* m_pcMap;
+    size_t m_pcMapCount, m_pcMapAllocated;
 
 public:
 
-    CorJitInfo(CExecutionEngine& executionEngine, IMethod* method) : m_executionEngine(executionEngine) {
+    CorJitInfo(CExecutionEngine& executionEngine, IMethod* method, bool minOpts = false) : m_executionEngine(executionEngine) {
         m_codeAddr = m_dataAddr = nullptr;
+        m_codeSize = 0;
         m_method = method;
+        m_minOpts = minOpts;
+        m_sequencePoints = nullptr;
+        m_sequencePointCount = 0;
+        m_pcMap = nullptr;
+        m_pcMapCount = m_pcMapAllocated = 0;
     }
 
     ~CorJitInfo() {
         if (m_codeAddr != nullptr) {
+            pyjit_perf_unregister(m_codeAddr);
             freeMem(m_codeAddr);
         }
         if (m_dataAddr != nullptr) {
+#ifdef PLATFORM_UNIX
+            m_executionEngine.FreeExecutable(m_dataAddr);
+#else
             free(m_dataAddr);
+#endif
         }
+        free(m_pcMap);
         delete m_method;
     }
 
@@ -84,6 +108,45 @@ public:
         return m_codeAddr;
     }
 
+    size_t get_code_size() {
+        return m_codeSize;
+    }
+
+    CompileStats& get_stats() {
+        return m_stats;
+    }
+
+    void set_sequence_points(SequencePoint* points, size_t count) {
+        m_sequencePoints = points;
+        m_sequencePointCount = count;
+    }
+
+    int find_bytecode_offset(void* addr) {
+        if (addr < m_codeAddr || addr >= (char*)m_codeAddr + m_codeSize) {
+            return -1;
+        }
+        auto point = find_sequence_point(m_pcMap, m_pcMapCount, (unsigned int)((char*)addr - (char*)m_codeAddr));
+        return point == nullptr ? -1 : point->bytecodeIndex;
+    }
+
+    SequencePoint* get_pc_map(size_t* count) {
+        *count = m_pcMapCount;
+        return m_pcMap;
+    }
+
+    // Called once the JIT has finished writing the method.  The code becomes
+    // executable and the read-only data becomes read-only.
+    void seal() {
+#ifdef PLATFORM_UNIX
+        m_executionEngine.SealExecutable(m_codeAddr);
+        if (m_dataAddr != nullptr) {
+            m_executionEngine.SealExecutable(m_dataAddr);
+        }
+#endif
+        m_sequencePoints = nullptr;
+        m_sequencePointCount = 0;
+    }
+
     /* ICorJitInfo */
     IEEMemoryManager* getMemoryManager() {
         return &m_executionEngine;
@@ -103,23 +166,22 @@ public:
         void **             coldCodeBlock,  /* OUT */
         void **             roDataBlock     /* OUT */
         ) {
+        m_codeSize = hotCodeSize + roDataSize;
+        m_stats.codeSize = hotCodeSize;
+        m_stats.roDataSize = roDataSize;
 
 #ifdef PLATFORM_UNIX
 		// The JIT will produce accesses to the roDataBlock which are relative
 		// to the generated code and uses 32-bit offsets to access it.  Therefore
 		// if we have a range that's greater than 32-bits the access will be invalid
-		// and fail.  On Windows, malloc() is returning addresses close to the executable
-		// heap and everything is okay.  On Linux we're currently just allocating the
-		// executable + ro blocks together so we know they're close.  This has the downside
-		// that we have some data which is marked as executable which isn't the best.
-#define ALIGN(size, align) \
-    (((size)+((align)-1)) & ~((align)-1))
-
-		auto size = ALIGN(hotCodeSize, 16) + roDataSize;
-		auto code = m_executionEngine.AllocExecutable(size);
+		// and fail.  The code heap always hands out the data from the same region
+		// as the code so they're known to be close, and keeps the data in pages
+		// which are never executable.
+		void* data = nullptr;
+		auto code = m_executionEngine.AllocExecutable(hotCodeSize, roDataSize, &data);
 		*hotCodeBlock = m_codeAddr = code;
 		if (roDataSize != 0) {
-			*roDataBlock = ((char*)code) + ALIGN(hotCodeSize, 16);
+			*roDataBlock = m_dataAddr = data;
 		}
 #else
 		auto code = m_executionEngine.AllocExecutable(hotCodeSize);
@@ -154,6 +216,7 @@ public:
         size_t                  size        /* IN */
         ) {
         //printf("allocGCInfo\r\n");
+        m_stats.gcInfoSize += size;
         return malloc(size);
     }
 
@@ -729,7 +792,11 @@ public:
         CORINFO_METHOD_HANDLE       ftn         /* IN */
         ) {
         //printf("getMethodAttribs\r\n");
-        return CORINFO_FLG_NOSECURITYWRAP | CORINFO_FLG_STATIC | CORINFO_FLG_NATIVE;;
+        DWORD attribs = CORINFO_FLG_NOSECURITYWRAP | CORINFO_FLG_STATIC | CORINFO_FLG_NATIVE;
+        if (((IMethod*)ftn)->get_intrinsic() != MI_None) {
+            attribs |= CORINFO_FLG_INTRINSIC;
+        }
+        return attribs;
     }
 
     // sets private JIT flags, which can be, retrieved using getAttrib.
@@ -869,7 +936,15 @@ public:
         CORINFO_METHOD_HANDLE       method,
 		bool * pMustExpand = NULL
         ) {
-        printf("getIntrinsicID\r\n"); return CORINFO_INTRINSIC_Object_GetType;
+        // The JIT calls the helper anyway for any of these it can't expand
+        switch (((IMethod*)method)->get_intrinsic()) {
+            case MI_Sqrt: return CORINFO_INTRINSIC_Sqrt;
+            case MI_Abs: return CORINFO_INTRINSIC_Abs;
+            case MI_Floor: return CORINFO_INTRINSIC_Floor;
+            case MI_Ceiling: return CORINFO_INTRINSIC_Ceiling;
+            default: break;
+        }
+        return CORINFO_INTRINSIC_Illegal;
     }
 
 #ifndef RYUJIT_CTPBUILD
@@ -1701,7 +1776,19 @@ public:
         //       jit MUST free with freeArray!
         ICorDebugInfo::BoundaryTypes *implictBoundaries // [OUT] tell jit, all boundries of this type
         ) {
-        printf("getBoundaries\r\n");
+        // The starts of the bytecode instructions, which the JIT can only map
+        // where the IL stack is empty, and every call, which is where the frame
+        // can be inspected or an exception raised from
+        auto offsets = (DWORD*)allocateArray(sizeof(DWORD) * m_sequencePointCount);
+        unsigned int count = 0;
+        for (size_t i = 0; i < m_sequencePointCount; i++) {
+            if (count == 0 || offsets[count - 1] != m_sequencePoints[i].offset) {
+                offsets[count++] = m_sequencePoints[i].offset;
+            }
+        }
+        *cILOffsets = count;
+        *pILOffsets = offsets;
+        *implictBoundaries = ICorDebugInfo::CALL_SITE_BOUNDARIES;
     }
 
     // Report back the mapping from IL to native code,
@@ -1717,7 +1804,29 @@ public:
         ICorDebugInfo::OffsetMapping *pMap      // [IN] map including all points of interest.
         //      jit allocated with allocateArray, EE frees
         ) {
-        printf("setBoundaries\r\n");
+        for (ULONG32 i = 0; i < cMap; i++) {
+            // Skip the prolog, epilog and unmapped code
+            if ((int)pMap[i].ilOffset < 0) {
+                continue;
+            }
+            // The last instruction starting at or before the IL offset
+            auto point = find_sequence_point(m_sequencePoints, m_sequencePointCount, pMap[i].ilOffset);
+            if (point == nullptr ||
+                (m_pcMapCount != 0 && m_pcMap[m_pcMapCount - 1].bytecodeIndex == point->bytecodeIndex)) {
+                continue;
+            }
+            if (m_pcMapCount == m_pcMapAllocated) {
+                auto allocated = m_pcMapAllocated == 0 ? 16 : m_pcMapAllocated * 2;
+                auto grown = (SequencePoint*)realloc(m_pcMap, allocated * sizeof(SequencePoint));
+                if (grown == nullptr) {
+                    break;
+                }
+                m_pcMap = grown;
+                m_pcMapAllocated = allocated;
+            }
+            m_pcMap[m_pcMapCount++] = SequencePoint(pMap[i].nativeOffset, point->bytecodeIndex);
+        }
+        freeArray(pMap);
     }
 
     // Query the EE to find out the scope of local varables.
@@ -1760,8 +1869,7 @@ public:
     virtual void * allocateArray(
         ULONG              cBytes
         ) {
-        printf("\r\n");
-        return nullptr;
+        return malloc(cBytes);
     }
 
     // JitCompiler will free arrays passed by the EE using this
@@ -1771,7 +1879,7 @@ public:
     virtual void freeArray(
         void               *array
         ) {
-        printf("freeArray\r\n");
+        free(array);
     }
 
     /*********************************************************************************/
@@ -2005,6 +2113,15 @@ public:
     DWORD CorJitInfo::getJitFlags(CORJIT_FLAGS * flags, DWORD sizeInBytes) { 
         if (sizeInBytes == sizeof(CORJIT_FLAGS)) {
             *flags = CORJIT_FLAGS::CORJIT_FLAG_SKIP_VERIFICATION;
+            if (m_minOpts) {
+                flags->Set(CORJIT_FLAGS::CORJIT_FLAG_MIN_OPT);
+            }
+            // Report where the bytecode instructions ended up, see setBoundaries
+            flags->Set(CORJIT_FLAGS::CORJIT_FLAG_DEBUG_INFO);
+            // Keep a frame chain profilers can walk without unwind info
+            if (pyjit_frame_pointers()) {
+                flags->Set(CORJIT_FLAGS::CORJIT_FLAG_FRAMED);
+            }
             return sizeof(CORJIT_FLAGS);
         }
         return 0;
@@ -0,0 +1,82 @@
+/*
+* The MIT License (MIT)
+*
+* Copyright (c) Microsoft Corporation
+*
+* Permission is hereby granted, free of charge, to any person obtaining a
+* copy of this software and associated documentation files (the "Software"),
+* to deal in the Software without restriction, including without limitation
+* the rights to use, copy, modify, merge, publish, distribute, sublicense,
+* and/or sell copies of the Software, and to permit persons to whom the
+* Software is furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included
+* in all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+* OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+* THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+* OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+* ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+* OTHER DEALINGS IN THE SOFTWARE.
+*
+*/
+
+#ifndef OPCODEMAP_H
+#define OPCODEMAP_H
+
+#include <Python.h>
+#include <vector>
+#include <cassert>
+
+using namespace std;
+
+// Per instruction table used by the abstract interpreter.  Instructions live at
+// dense, fixed size offsets in the byte code so rather than hashing the offset
+// we keep a flat array with one slot per instruction, plus a trailing slot for
+// the end of the code which branches can target.  A slot is present once it's
+// been written to via operator[].
+template<typename T> class OpcodeMap {
+    struct Slot {
+        T Value;
+        bool Present;
+
+        Slot() : Value(), Present(false) {
+        }
+    };
+
+    vector<Slot> m_slots;
+
+    static size_t slot(size_t offset) {
+        return offset / sizeof(_Py_CODEUNIT);
+    }
+
+public:
+    // Sizes the table for a code object with codeSize bytes of byte code,
+    // discarding any existing entries.
+    void resize(size_t codeSize) {
+        m_slots.assign(slot(codeSize) + 1, Slot());
+    }
+
+    T& operator[](size_t offset) {
+        assert(slot(offset) < m_slots.size());
+        auto& entry = m_slots[slot(offset)];
+        entry.Present = true;
+        return entry.Value;
+    }
+
+    bool contains(size_t offset) {
+        return slot(offset) < m_slots.size() && m_slots[slot(offset)].Present;
+    }
+
+    // Returns the entry at offset, or nullptr if it hasn't been set.
+    T* find(size_t offset) {
+        if (!contains(offset)) {
+            return nullptr;
+        }
+        return &m_slots[slot(offset)].Value;
+    }
+};
+
+#endif
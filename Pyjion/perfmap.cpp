@@ -0,0 +1,466 @@
+/*
+* The MIT License (MIT)
+*
+* Copyright (c) Microsoft Corporation
+*
+* Permission is hereby granted, free of charge, to any person obtaining a
+* copy of this software and associated documentation files (the "Software"),
+* to deal in the Software without restriction, including without limitation
+* the rights to use, copy, modify, merge, publish, distribute, sublicense,
+* and/or sell copies of the Software, and to permit persons to whom the
+* Software is furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included
+* in all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+* OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+* THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+* OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+* ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+* OTHER DEALINGS IN THE SOFTWARE.
+*
+*/
+
+/* Profiler and debugger support for jitted code, see perfmap.h for an overview.
+ * This lives on the normal C++ side of the world (like codeheap.cpp) so it can
+ * use the standard library and the platform headers.
+ */
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <string>
+
+#ifdef PLATFORM_UNIX
+#include <elf.h>
+#include <unistd.h>
+#endif
+
+#include "perfmap.h"
+
+using namespace std;
+
+static int g_perfFlags;
+static int g_framePointers;
+
+extern "C" int pyjit_set_frame_pointers(int enabled) {
+	auto prev = g_framePointers;
+	g_framePointers = enabled;
+	return prev;
+}
+
+extern "C" int pyjit_frame_pointers() {
+	return g_framePointers;
+}
+
+extern "C" int pyjit_perf_enabled() {
+	return g_perfFlags;
+}
+
+#ifdef PLATFORM_UNIX
+
+/* The GDB JIT interface.  GDB puts a breakpoint on __jit_debug_register_code
+ * and reads the entry the descriptor points at whenever it's called. */
+extern "C" {
+	enum jit_actions_t {
+		JIT_NOACTION = 0,
+		JIT_REGISTER_FN,
+		JIT_UNREGISTER_FN
+	};
+
+	struct jit_code_entry {
+		jit_code_entry* next_entry;
+		jit_code_entry* prev_entry;
+		const char* symfile_addr;
+		uint64_t symfile_size;
+	};
+
+	struct jit_descriptor {
+		uint32_t version;
+		uint32_t action_flag;
+		jit_code_entry* relevant_entry;
+		jit_code_entry* first_entry;
+	};
+
+	void __attribute__((noinline)) __jit_debug_register_code() {
+		__asm__ __volatile__("");
+	}
+
+	jit_descriptor __jit_debug_descriptor = { 1, JIT_NOACTION, nullptr, nullptr };
+}
+
+#if defined(__aarch64__)
+#define PERF_ELF_MACHINE	EM_AARCH64
+#else
+#define PERF_ELF_MACHINE	EM_X86_64
+#endif
+
+// The sections of the ELF objects we describe methods with
+enum PerfSection {
+	PS_Null,
+	PS_Text,
+	PS_ShStrTab,
+	PS_StrTab,
+	PS_SymTab,
+	PS_DebugInfo,
+	PS_DebugAbbrev,
+	PS_DebugLine,
+	PS_Count
+};
+
+// DWARF 2 constants used in the debug sections
+#define DW_TAG_compile_unit		0x11
+#define DW_CHILDREN_no			0x00
+#define DW_AT_name				0x03
+#define DW_AT_stmt_list			0x10
+#define DW_AT_low_pc			0x11
+#define DW_AT_high_pc			0x12
+#define DW_FORM_addr			0x01
+#define DW_FORM_data4			0x06
+#define DW_FORM_string			0x08
+#define DW_LNS_copy				0x01
+#define DW_LNS_advance_pc		0x02
+#define DW_LNS_advance_line		0x03
+#define DW_LNE_end_sequence		0x01
+#define DW_LNE_set_address		0x02
+
+// Builds up the contents of a section
+class PerfBuffer {
+public:
+	string m_data;
+
+	template<typename T> void put(T value) {
+		m_data.append((const char*)&value, sizeof(T));
+	}
+
+	template<typename T> void patch(size_t offset, T value) {
+		memcpy(&m_data[offset], &value, sizeof(T));
+	}
+
+	void put_string(const char* value) {
+		m_data.append(value, strlen(value) + 1);
+	}
+
+	void put_uleb(uint64_t value) {
+		do {
+			uint8_t byte = value & 0x7f;
+			value >>= 7;
+			if (value != 0) {
+				byte |= 0x80;
+			}
+			put(byte);
+		} while (value != 0);
+	}
+
+	void put_sleb(int64_t value) {
+		bool more;
+		do {
+			uint8_t byte = value & 0x7f;
+			value >>= 7;
+			more = !((value == 0 && !(byte & 0x40)) || (value == -1 && (byte & 0x40)));
+			if (more) {
+				byte |= 0x80;
+			}
+			put(byte);
+		} while (more);
+	}
+
+	size_t size() {
+		return m_data.size();
+	}
+};
+
+static void perf_debug_abbrev(PerfBuffer& buf) {
+	buf.put_uleb(1);
+	buf.put_uleb(DW_TAG_compile_unit);
+	buf.put<uint8_t>(DW_CHILDREN_no);
+	buf.put_uleb(DW_AT_name);		buf.put_uleb(DW_FORM_string);
+	buf.put_uleb(DW_AT_low_pc);		buf.put_uleb(DW_FORM_addr);
+	buf.put_uleb(DW_AT_high_pc);	buf.put_uleb(DW_FORM_addr);
+	buf.put_uleb(DW_AT_stmt_list);	buf.put_uleb(DW_FORM_data4);
+	buf.put_uleb(0);
+	buf.put_uleb(0);
+	buf.put_uleb(0);
+}
+
+static void perf_debug_info(PerfBuffer& buf, void* code, size_t size, const char* name) {
+	buf.put<uint32_t>(0);		// unit length, patched below
+	buf.put<uint16_t>(2);		// version
+	buf.put<uint32_t>(0);		// abbrev offset
+	buf.put<uint8_t>(sizeof(void*));
+	buf.put_uleb(1);
+	buf.put_string(name);
+	buf.put<uint64_t>((uint64_t)code);
+	buf.put<uint64_t>((uint64_t)code + size);
+	buf.put<uint32_t>(0);		// stmt list, the start of .debug_line
+	buf.patch<uint32_t>(0, (uint32_t)(buf.size() - sizeof(uint32_t)));
+}
+
+static void perf_debug_line(PerfBuffer& buf, void* code, size_t size, const char* file, const PyjitCodeLine* lines, size_t lineCount) {
+	static const uint8_t standardOpcodeLengths[] = { 0, 1, 1, 1, 1, 0, 0, 0, 1, 0, 0, 1 };
+
+	buf.put<uint32_t>(0);		// unit length, patched below
+	buf.put<uint16_t>(2);		// version
+	buf.put<uint32_t>(0);		// header length, patched below
+	auto headerStart = buf.size();
+	buf.put<uint8_t>(1);		// minimum instruction length
+	buf.put<uint8_t>(1);		// default is_stmt
+	buf.put<int8_t>(-5);		// line base
+	buf.put<uint8_t>(14);		// line range
+	buf.put<uint8_t>(sizeof(standardOpcodeLengths) + 1);
+	for (auto length : standardOpcodeLengths) {
+		buf.put(length);
+	}
+	buf.put<uint8_t>(0);		// no include directories
+	buf.put_string(file);
+	buf.put_uleb(0);			// directory
+	buf.put_uleb(0);			// modification time
+	buf.put_uleb(0);			// length
+	buf.put<uint8_t>(0);
+	buf.patch<uint32_t>(headerStart - sizeof(uint32_t), (uint32_t)(buf.size() - headerStart));
+
+	buf.put<uint8_t>(0);
+	buf.put_uleb(1 + sizeof(uint64_t));
+	buf.put<uint8_t>(DW_LNE_set_address);
+	buf.put<uint64_t>((uint64_t)code);
+
+	size_t offset = 0;
+	int line = 1;
+	for (size_t i = 0; i < lineCount; i++) {
+		if (lines[i].offset >= size) {
+			break;
+		}
+		if (lines[i].offset > offset) {
+			buf.put<uint8_t>(DW_LNS_advance_pc);
+			buf.put_uleb(lines[i].offset - offset);
+			offset = lines[i].offset;
+		}
+		if (lines[i].line != line) {
+			buf.put<uint8_t>(DW_LNS_advance_line);
+			buf.put_sleb(lines[i].line - line);
+			line = lines[i].line;
+		}
+		buf.put<uint8_t>(DW_LNS_copy);
+	}
+
+	if (size > offset) {
+		buf.put<uint8_t>(DW_LNS_advance_pc);
+		buf.put_uleb(size - offset);
+	}
+	buf.put<uint8_t>(0);
+	buf.put_uleb(1);
+	buf.put<uint8_t>(DW_LNE_end_sequence);
+	buf.patch<uint32_t>(0, (uint32_t)(buf.size() - sizeof(uint32_t)));
+}
+
+// Builds a relocatable ELF object describing the method.  The text section has
+// no contents, just the address of the code, which the symbol and the debug
+// info are relative to.
+static string perf_build_elf(void* code, size_t size, const char* name, const char* file,
+	const PyjitCodeLine* lines, size_t lineCount) {
+	PerfBuffer sections[PS_Count];
+	size_t names[PS_Count] = { 0 };
+
+	auto& shstrtab = sections[PS_ShStrTab];
+	static const char* const sectionNames[PS_Count] = {
+		"", ".text", ".shstrtab", ".strtab", ".symtab", ".debug_info", ".debug_abbrev", ".debug_line"
+	};
+	for (int i = 0; i < PS_Count; i++) {
+		names[i] = shstrtab.size();
+		shstrtab.put_string(sectionNames[i]);
+	}
+
+	auto& strtab = sections[PS_StrTab];
+	strtab.put<uint8_t>(0);
+	auto fileName = strtab.size();
+	strtab.put_string(file);
+	auto funcName = strtab.size();
+	strtab.put_string(name);
+
+	auto& symtab = sections[PS_SymTab];
+	Elf64_Sym sym;
+	memset(&sym, 0, sizeof(sym));
+	symtab.put(sym);
+	sym.st_name = (Elf64_Word)fileName;
+	sym.st_info = ELF64_ST_INFO(STB_LOCAL, STT_FILE);
+	sym.st_shndx = SHN_ABS;
+	symtab.put(sym);
+	sym.st_name = (Elf64_Word)funcName;
+	sym.st_info = ELF64_ST_INFO(STB_GLOBAL, STT_FUNC);
+	sym.st_shndx = PS_Text;
+	sym.st_value = 0;
+	sym.st_size = size;
+	symtab.put(sym);
+
+	perf_debug_info(sections[PS_DebugInfo], code, size, name);
+	perf_debug_abbrev(sections[PS_DebugAbbrev]);
+	perf_debug_line(sections[PS_DebugLine], code, size, file, lines, lineCount);
+
+	PerfBuffer elf;
+	Elf64_Ehdr header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.e_ident, ELFMAG, SELFMAG);
+	header.e_ident[EI_CLASS] = ELFCLASS64;
+	header.e_ident[EI_DATA] = ELFDATA2LSB;
+	header.e_ident[EI_VERSION] = EV_CURRENT;
+	header.e_type = ET_REL;
+	header.e_machine = PERF_ELF_MACHINE;
+	header.e_version = EV_CURRENT;
+	header.e_ehsize = sizeof(Elf64_Ehdr);
+	header.e_shentsize = sizeof(Elf64_Shdr);
+	header.e_shnum = PS_Count;
+	header.e_shstrndx = PS_ShStrTab;
+	elf.put(header);
+
+	size_t offsets[PS_Count] = { 0 };
+	for (int i = 0; i < PS_Count; i++) {
+		while (elf.size() % 8) {
+			elf.put<uint8_t>(0);
+		}
+		offsets[i] = elf.size();
+		elf.m_data.append(sections[i].m_data);
+	}
+	while (elf.size() % 8) {
+		elf.put<uint8_t>(0);
+	}
+	elf.patch<Elf64_Off>(offsetof(Elf64_Ehdr, e_shoff), elf.size());
+
+	for (int i = 0; i < PS_Count; i++) {
+		Elf64_Shdr shdr;
+		memset(&shdr, 0, sizeof(shdr));
+		if (i != PS_Null) {
+			shdr.sh_name = (Elf64_Word)names[i];
+			shdr.sh_offset = offsets[i];
+			shdr.sh_size = sections[i].size();
+			shdr.sh_addralign = 1;
+			switch (i) {
+				case PS_Text:
+					shdr.sh_type = SHT_NOBITS;
+					shdr.sh_flags = SHF_ALLOC | SHF_EXECINSTR;
+					shdr.sh_addr = (Elf64_Addr)code;
+					shdr.sh_size = size;
+					shdr.sh_addralign = 16;
+					break;
+				case PS_ShStrTab:
+				case PS_StrTab:
+					shdr.sh_type = SHT_STRTAB;
+					break;
+				case PS_SymTab:
+					shdr.sh_type = SHT_SYMTAB;
+					shdr.sh_link = PS_StrTab;
+					shdr.sh_info = 2;		// the first global symbol
+					shdr.sh_entsize = sizeof(Elf64_Sym);
+					shdr.sh_addralign = 8;
+					break;
+				default:
+					shdr.sh_type = SHT_PROGBITS;
+					break;
+			}
+		}
+		elf.put(shdr);
+	}
+	return elf.m_data;
+}
+
+static mutex g_perfLock;
+static FILE* g_perfMap;
+static map<void*, jit_code_entry*> g_gdbEntries;
+
+extern "C" int pyjit_perf_enable(int flags) {
+	lock_guard<mutex> lock(g_perfLock);
+	auto prev = g_perfFlags;
+	if ((flags & PYJIT_PERF_MAP) && g_perfMap == nullptr) {
+		char path[64];
+		snprintf(path, sizeof(path), "/tmp/perf-%d.map", (int)getpid());
+		g_perfMap = fopen(path, "a");
+		if (g_perfMap == nullptr) {
+			flags &= ~PYJIT_PERF_MAP;
+		}
+	}
+	g_perfFlags |= flags;
+	return prev;
+}
+
+extern "C" void pyjit_perf_register(void* code, size_t size, const char* name, const char* file,
+	const PyjitCodeLine* lines, size_t lineCount) {
+	lock_guard<mutex> lock(g_perfLock);
+	if (g_perfFlags & PYJIT_PERF_MAP) {
+		fprintf(g_perfMap, "%llx %llx py::%s\n", (unsigned long long)code, (unsigned long long)size, name);
+		fflush(g_perfMap);
+	}
+
+	if ((g_perfFlags & PYJIT_GDB_JIT) && g_gdbEntries.find(code) == g_gdbEntries.end()) {
+		auto elf = perf_build_elf(code, size, name, file, lines, lineCount);
+		auto symfile = (char*)malloc(elf.size());
+		if (symfile == nullptr) {
+			return;
+		}
+		memcpy(symfile, elf.data(), elf.size());
+
+		auto entry = new jit_code_entry();
+		entry->symfile_addr = symfile;
+		entry->symfile_size = elf.size();
+		entry->prev_entry = nullptr;
+		entry->next_entry = __jit_debug_descriptor.first_entry;
+		if (entry->next_entry != nullptr) {
+			entry->next_entry->prev_entry = entry;
+		}
+		__jit_debug_descriptor.first_entry = entry;
+		__jit_debug_descriptor.relevant_entry = entry;
+		__jit_debug_descriptor.action_flag = JIT_REGISTER_FN;
+		__jit_debug_register_code();
+		g_gdbEntries[code] = entry;
+	}
+}
+
+extern "C" void pyjit_perf_unregister(void* code) {
+	if (!(g_perfFlags & PYJIT_GDB_JIT)) {
+		return;
+	}
+
+	lock_guard<mutex> lock(g_perfLock);
+	auto find = g_gdbEntries.find(code);
+	if (find == g_gdbEntries.end()) {
+		return;
+	}
+	auto entry = find->second;
+	g_gdbEntries.erase(find);
+
+	if (entry->prev_entry != nullptr) {
+		entry->prev_entry->next_entry = entry->next_entry;
+	}
+	else {
+		__jit_debug_descriptor.first_entry = entry->next_entry;
+	}
+	if (entry->next_entry != nullptr) {
+		entry->next_entry->prev_entry = entry->prev_entry;
+	}
+	__jit_debug_descriptor.relevant_entry = entry;
+	__jit_debug_descriptor.action_flag = JIT_UNREGISTER_FN;
+	__jit_debug_register_code();
+
+	free((void*)entry->symfile_addr);
+	delete entry;
+}
+
+#else
+
+// perf and GDB aren't available on Windows, so there's nothing to listen
+extern "C" int pyjit_perf_enable(int flags) {
+	return g_perfFlags;
+}
+
+extern "C" void pyjit_perf_register(void* code, size_t size, const char* name, const char* file,
+	const PyjitCodeLine* lines, size_t lineCount) {
+}
+
+extern "C" void pyjit_perf_unregister(void* code) {
+}
+
+#endif
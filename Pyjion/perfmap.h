@@ -0,0 +1,69 @@
+/*
+* The MIT License (MIT)
+*
+* Copyright (c) Microsoft Corporation
+*
+* Permission is hereby granted, free of charge, to any person obtaining a
+* copy of this software and associated documentation files (the "Software"),
+* to deal in the Software without restriction, including without limitation
+* the rights to use, copy, modify, merge, publish, distribute, sublicense,
+* and/or sell copies of the Software, and to permit persons to whom the
+* Software is furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included
+* in all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+* OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+* THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+* OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+* ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+* OTHER DEALINGS IN THE SOFTWARE.
+*
+*/
+
+#ifndef PERFMAP_H
+#define PERFMAP_H
+
+/* Makes jitted code visible to native profilers and debuggers.  Like
+ * codeheap.h this header is shared between the CoreCLR (PAL) portion of Pyjion
+ * and the normal C++ portion, so it can't bring in any header files.
+ *
+ * With the perf map enabled each method is written to /tmp/perf-<pid>.map,
+ * which perf reads to name the addresses it samples.  With the GDB JIT
+ * interface enabled each method is also described by a small in-memory ELF
+ * object holding its symbol and line table, which GDB (and other tools which
+ * implement the interface) load when __jit_debug_register_code is called.
+ * Methods can also be compiled with frame pointers so the stack can be walked
+ * through jitted code without unwind tables.
+ */
+
+// The line a native code offset within a method was compiled from.
+struct PyjitCodeLine {
+	unsigned int offset;
+	int line;
+};
+
+#define PYJIT_PERF_MAP	0x01
+#define PYJIT_GDB_JIT	0x02
+
+// Enables the listeners in flags.  Returns the ones which were enabled before.
+extern "C" int pyjit_perf_enable(int flags);
+
+// Returns the enabled listeners.
+extern "C" int pyjit_perf_enabled();
+
+// Reports a newly compiled method to the enabled listeners.  lines is in order of
+// increasing offset.
+extern "C" void pyjit_perf_register(void* code, size_t size, const char* name, const char* file,
+	const PyjitCodeLine* lines, size_t lineCount);
+
+// Tells the listeners a method's code is being freed.
+extern "C" void pyjit_perf_unregister(void* code);
+
+// Sets if methods are compiled with frame pointers, returning the previous setting.
+extern "C" int pyjit_set_frame_pointers(int enabled);
+extern "C" int pyjit_frame_pointers();
+
+#endif
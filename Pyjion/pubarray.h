@@ -0,0 +1,90 @@
+/*
+* The MIT License (MIT)
+*
+* Copyright (c) Microsoft Corporation
+*
+* Permission is hereby granted, free of charge, to any person obtaining a
+* copy of this software and associated documentation files (the "Software"),
+* to deal in the Software without restriction, including without limitation
+* the rights to use, copy, modify, merge, publish, distribute, sublicense,
+* and/or sell copies of the Software, and to permit persons to whom the
+* Software is furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included
+* in all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+* OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+* THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+* OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+* ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+* OTHER DEALINGS IN THE SOFTWARE.
+*
+*/
+
+#ifndef PUBARRAY_H
+#define PUBARRAY_H
+
+#include <atomic>
+#include <cassert>
+#include <cstddef>
+
+// Fixed capacity array of pointers which readers go through without taking a
+// lock while a writer adds to it.  Entries are stored before the size is bumped,
+// so a reader only ever sees fully published entries.  Writers must be serialized
+// by the caller (we hold the GIL for them).
+//
+// Readers racing with promote() can see one entry twice and miss its neighbour,
+// so a writer which doesn't find what it's looking for needs to check again
+// before it adds a duplicate.  Entries dropped by clear() can only be freed once
+// nothing can still be reading them.
+template<typename T, size_t N> class PublishedArray {
+    std::atomic<T*> m_items[N];
+    std::atomic<size_t> m_size;
+
+public:
+    PublishedArray() : m_size(0) {
+        for (size_t i = 0; i < N; i++) {
+            m_items[i].store(nullptr, std::memory_order_relaxed);
+        }
+    }
+
+    size_t size() const {
+        return m_size.load(std::memory_order_acquire);
+    }
+
+    bool full() const {
+        return size() == N;
+    }
+
+    T* operator[](size_t index) const {
+        assert(index < N);
+        return m_items[index].load(std::memory_order_acquire);
+    }
+
+    // Publishes an entry at the end, returns false if there's no room.
+    bool push_back(T* item) {
+        auto count = m_size.load(std::memory_order_relaxed);
+        if (count == N) {
+            return false;
+        }
+        m_items[count].store(item, std::memory_order_release);
+        m_size.store(count + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Swaps an entry with the one before it so it's found sooner.
+    void promote(size_t index) {
+        assert(index > 0 && index < size());
+        auto prev = m_items[index - 1].load(std::memory_order_relaxed);
+        m_items[index - 1].store(m_items[index].load(std::memory_order_relaxed), std::memory_order_release);
+        m_items[index].store(prev, std::memory_order_release);
+    }
+
+    void clear() {
+        m_size.store(0, std::memory_order_release);
+    }
+};
+
+#endif
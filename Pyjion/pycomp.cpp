@@ -208,6 +208,14 @@ void PythonCompiler::emit_bitwise_and() {
 	m_il.bitwise_and();
 }
 
+void PythonCompiler::emit_bitwise_or() {
+	m_il.bitwise_or();
+}
+
+void PythonCompiler::emit_bitwise_xor() {
+	m_il.bitwise_xor();
+}
+
 Label PythonCompiler::emit_define_label() {
     return m_il.define_label();
 }
@@ -220,6 +228,14 @@ void PythonCompiler::emit_mark_label(Label label) {
     m_il.mark_label(label);
 }
 
+void PythonCompiler::mark_sequence_point(int bytecodeIndex) {
+    m_il.mark_sequence_point(bytecodeIndex);
+}
+
+void PythonCompiler::reserve(size_t codeSize) {
+    m_il.reserve(codeSize);
+}
+
 void PythonCompiler::emit_compare_float(CompareType compareType) {
     // TODO: If we know we're followed by the pop jump we could combine
     // and do a single branch comparison.
@@ -233,17 +249,77 @@ void PythonCompiler::emit_compare_float(CompareType compareType) {
     }
 }
 
+void PythonCompiler::emit_compare_int(CompareType compareType) {
+    switch (compareType) {
+        case CT_Equal:  m_il.compare_eq(); break;
+        case CT_LessThan: m_il.compare_lt(); break;
+        case CT_LessThanEqual: m_il.compare_le(); break;
+        case CT_NotEqual: m_il.compare_ne(); break;
+        case CT_GreaterThan: m_il.compare_gt(); break;
+        case CT_GreaterThanEqual: m_il.compare_ge(); break;
+    }
+}
+
 extern CExecutionEngine g_execEngine;
 
-JittedCode* PythonCompiler::emit_compile() {
-    CorJitInfo* jitInfo = new CorJitInfo(g_execEngine, m_method);
-    auto addr = m_il.compile(jitInfo, g_jit, 256);
+static JittedCode* compile_il(ILGenerator& il, IMethod* method, CompileTier tier, CompileStats& stats) {
+    // The CorJitInfo takes ownership of the method
+    CorJitInfo* jitInfo = new CorJitInfo(g_execEngine, method, tier == TierBaseline);
+    jitInfo->set_sequence_points(il.m_sequencePoints.m_items, il.m_sequencePoints.size());
+    auto allocated = CCorJitHost::s_allocated;
+    auto start = pyjit_now();
+    auto addr = il.compile(jitInfo, g_jit, 256);
     if (addr == nullptr) {
         delete jitInfo;
         return nullptr;
     }
+    jitInfo->seal();
+
+    // Keep the sizes the JIT reported and fill in the rest of the measurements
+    auto& jitStats = jitInfo->get_stats();
+    stats.jitTime = pyjit_now() - start;
+    stats.jitMemory = CCorJitHost::s_allocated - allocated;
+    stats.ilSize = il.m_il.size();
+    stats.codeSize = jitStats.codeSize;
+    stats.roDataSize = jitStats.roDataSize;
+    stats.gcInfoSize = jitStats.gcInfoSize;
+    jitStats = stats;
     return jitInfo;
+}
+
+// The IL for a method which is waiting to be compiled to native code.
+class PendingMethod : public PendingCode {
+    ILGenerator m_il;
+    IMethod* m_method;
+    CompileTier m_tier;
+    CompileStats m_stats;
+
+public:
+    PendingMethod(ILGenerator& il, IMethod* method, CompileTier tier) : m_il(il), m_method(method), m_tier(tier) {
+    }
+
+    ~PendingMethod() {
+        delete m_method;
+    }
+
+    JittedCode* compile() {
+        auto method = m_method;
+        m_method = nullptr;
+        return compile_il(m_il, method, m_tier, m_stats);
+    }
+
+    CompileStats& get_stats() {
+        return m_stats;
+    }
+};
+
+JittedCode* PythonCompiler::emit_compile(CompileTier tier) {
+    CompileStats stats;
+    return compile_il(m_il, m_method, tier, stats);
+}
 
+PendingCode* PythonCompiler::emit_deferred_compile(CompileTier tier) {
+    return new PendingMethod(m_il, m_method, tier);
 }
 
 /************************************************************************
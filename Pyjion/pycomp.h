@@ -72,9 +72,12 @@ public:
     virtual Label emit_define_label();
     virtual void emit_mark_label(Label label);
     virtual void emit_branch(BranchType branchType, Label label);
+    virtual void mark_sequence_point(int bytecodeIndex);
+    virtual void reserve(size_t codeSize);
 
 	virtual void emit_compare_equal();
 	virtual void emit_compare_float(CompareType compareType);
+	virtual void emit_compare_int(CompareType compareType);
 
 	virtual void emit_null();
 	virtual void emit_int(int value);
@@ -101,8 +104,11 @@ public:
 	virtual void emit_subtract();
 	virtual void emit_negate();
 	virtual void emit_bitwise_and();
+	virtual void emit_bitwise_or();
+	virtual void emit_bitwise_xor();
 
-	virtual JittedCode* emit_compile();
+	virtual JittedCode* emit_compile(CompileTier tier);
+	virtual PendingCode* emit_deferred_compile(CompileTier tier);
 
 	// TODO: Pull out of compiler interface
 	virtual Local emit_spill();
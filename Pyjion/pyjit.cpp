@@ -28,10 +28,23 @@
 #include "pyjit.h"
 
 #include <vector>
+#include <string>
+#include <unordered_set>
+#include <algorithm>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
 #include "ipycomp.h"
 #include "absvalue.h"
 #include "absint.h"
 #include "intrins.h"
+#include "codeheap.h"
+#include "codecache.h"
+#include "perfmap.h"
+#include "compilearena.h"
+#include "bridge.h"
 #ifndef PLATFORM_UNIX
 #include <Windows.h>
 #endif
@@ -46,63 +59,79 @@ HINSTANCE            g_pMSCorEE;
 IPythonCompiler* CreateCLRCompiler(IMethod* method);
 
 
-// Tracks types for a function call.  Each argument has a SpecializedTreeNode with
-// children for the subsequent arguments.  When we get to the leaves of the tree
-// we'll have a jitted code object & optimized evalutation function optimized
-// for those arguments.  
-struct SpecializedTreeNode {
-#ifdef TRACE_TREE
-	vector<pair<PyTypeObject*, SpecializedTreeNode*>> children;
-#else
-	vector<PyTypeObject*> types;
-#endif
-	Py_EvalFunc addr;
-	JittedCode* jittedCode;
-	int hitCount;
 
-#ifdef TRACE_TREE
-	SpecializedTreeNode() {
-#else
-	SpecializedTreeNode(vector<PyTypeObject*>& types) : types(types) {
-#endif
-		addr = nullptr;
-		jittedCode = nullptr;
-		hitCount = 0;
-	}
 
-#ifdef TRACE_TREE
-	SpecializedTreeNode* getNextNode(PyTypeObject* type) {
-		for (auto cur = children.begin(); cur != children.end(); cur++) {
-			if (cur->first == type) {
-				return cur->second;
-			}
-		}
+// Settings and totals which can differ between interpreters live in each
+// interpreter's PyjionInterpState, what's left here is shared by the process.
 
-		auto res = new SpecializedTreeNode();
-		children.push_back(pair<PyTypeObject*, SpecializedTreeNode*>(type, res));
-		return res;
+// Bumped whenever jitted code is evicted or freed, invalidating every CallCache.
+static atomic<size_t> g_codeGeneration(1);
+// Time spent interpreting frames on this thread which have finished, for
+// excluding the time spent in interpreted callees from their callers.
+static thread_local PY_UINT64_T g_nestedInterpretedTime = 0;
+// The frame on this thread which is being watched for hot loops, see
+// PyJit_RunInterpreter.
+static thread_local PyFrameObject* g_osrFrame = nullptr;
+
+static CodeCache g_codeCache;
+
+// State for on-stack replacement (OSR) of a function's frames which are running
+// in the interpreter.
+struct OsrState {
+	// The loop heads we can enter the code at, and the code compiled for each
+	unordered_map<size_t, JittedCode*> loopHeads;
+	// Which code units are loop heads, so the trace function can ignore
+	// everything else without a lookup
+	vector<bool> isLoopHead;
+	// A RETURN_VALUE we can resume the interpreter at to return the result
+	int returnOffset;
+	PY_UINT64_T backEdges;
+	bool failed;
+
+	OsrState() {
+		returnOffset = -1;
+		backEdges = 0;
+		failed = false;
 	}
-#endif
 
-	~SpecializedTreeNode() {
-		delete jittedCode;
-#ifdef TRACE_TREE
-		for (auto cur = children.begin(); cur != children.end(); cur++) {
+	~OsrState() {
+		for (auto cur = loopHeads.begin(); cur != loopHeads.end(); cur++) {
 			delete cur->second;
 		}
-#endif
 	}
 };
 
-
 PyjionJittedCode::~PyjionJittedCode() {
+	g_codeGeneration++;
+	j_state->codeSize -= j_code_size;
+	j_state->compiledCode.erase(this);
+	j_state->allCode.erase(this);
 #ifdef TRACE_TREE
 	delete funcs;
 #else
-	for (auto cur = j_optimized.begin(); cur != j_optimized.end(); cur++) {
-		delete *cur;
+	for (size_t i = 0; i < j_optimized.size(); i++) {
+		delete j_optimized[i];
 	}
+	delete j_megamorphic;
 #endif
+	delete j_baseline_code;
+	delete j_osr;
+	delete[] j_global_caches;
+	delete[] j_attr_caches;
+	delete[] j_call_caches;
+	for (auto cur = j_inlined_code.begin(); cur != j_inlined_code.end(); cur++) {
+		Py_DECREF(*cur);
+	}
+	j_state->release();
+}
+
+static int PyJit_OsrTrace(PyObject* obj, PyFrameObject* frame, int what, PyObject* arg);
+
+// Checks if frames need to run in the interpreter for a trace function.  Ours
+// only watches the frames it's looking for hot loops in, so jitted code can run
+// while it's installed.
+static bool PyJit_IsTracing(PyThreadState* tstate) {
+	return tstate->use_tracing && tstate->c_tracefunc != nullptr && tstate->c_tracefunc != PyJit_OsrTrace;
 }
 
 PyObject* Jit_EvalHelper(void* state, PyFrameObject*frame) {
@@ -117,10 +146,8 @@ PyObject* Jit_EvalHelper(void* state, PyFrameObject*frame) {
 #endif
 
     PyThreadState *tstate = PyThreadState_GET();
-    if (tstate->use_tracing) {
-        if (tstate->c_tracefunc != NULL) {
-            return _PyEval_EvalFrameDefault(frame, 0);
-        }
+    if (PyJit_IsTracing(tstate)) {
+        return _PyEval_EvalFrameDefault(frame, 0);
     }
 
     if (Py_EnterRecursiveCall("")) {
@@ -140,13 +167,87 @@ PyObject* Jit_EvalHelper(void* state, PyFrameObject*frame) {
     return _Py_CheckFunctionResult(NULL, res, "Jit_EvalHelper");
 }
 
-static ssize_t g_extraIndex;
+// Dispatches to jitted code for a function, keeping track of when it was last
+// used and whether it's currently running so we know if it's safe to evict.
+PyObject* Jit_EvalJitted(PyjionJittedCode* jitted, Py_EvalFunc addr, PyFrameObject* frame) {
+	jitted->j_last_used = ++jitted->j_state->useClock;
+	auto tstate = PyThreadState_GET();
+	if (PyJit_IsTracing(tstate)) {
+		// Jit_EvalHelper runs it in the interpreter so the trace function sees it
+		PYJIT_COUNT(jitted->j_counters.traced);
+	}
+	else {
+		PYJIT_COUNT(jitted->j_counters.jitted);
+	}
+	jitted->j_executing++;
+	auto res = Jit_EvalHelper((void*)addr, frame);
+	jitted->j_executing--;
+	return res;
+}
+
+// The empty tuple is a singleton shared by every interpreter.
 PyObject* g_emptyTuple;
+// The implementations of the builtins which calls are specialized for.  Each
+// interpreter has its own builtin function objects, so the targets of calls to
+// globals with the same names are compared against these.
+PyCFunction g_builtinLen;
+PyCFunction g_builtinIsInstance;
+PyCFunction g_builtinAbs;
+PyCFunction g_builtinMin;
+PyCFunction g_builtinMax;
+PyCFunction g_mathSqrt;
+PyCFunction g_mathFloor;
+PyCFunction g_mathCeil;
+
+static PyCFunction PyJit_GetBuiltinImpl(PyObject* builtins, const char* name) {
+	auto func = PyDict_GetItemString(builtins, name);
+	if (func == nullptr || !PyCFunction_Check(func)) {
+		return nullptr;
+	}
+	return PyCFunction_GET_FUNCTION(func);
+}
 
-extern "C" DLL_EXPORT void JitInit() {
-	g_extraIndex = _PyEval_RequestCodeExtraIndex(PyjionJitFree);
+// Sets up what's shared by every interpreter, the first time any of them
+// initializes the JIT.
+static void PyJit_InitProcess() {
+	static bool initialized = false;
+	if (initialized) {
+		return;
+	}
+	initialized = true;
+
+	g_emptyTuple = PyTuple_New(0);
+
+	auto builtins = PyThreadState_GET()->interp->builtins;
+	g_builtinLen = PyJit_GetBuiltinImpl(builtins, "len");
+	g_builtinIsInstance = PyJit_GetBuiltinImpl(builtins, "isinstance");
+	g_builtinAbs = PyJit_GetBuiltinImpl(builtins, "abs");
+	g_builtinMin = PyJit_GetBuiltinImpl(builtins, "min");
+	g_builtinMax = PyJit_GetBuiltinImpl(builtins, "max");
+
+	// The math module is an extension which stays loaded once it's imported
+	auto math = PyImport_ImportModule("math");
+	if (math != nullptr) {
+		auto mathDict = PyModule_GetDict(math);
+		g_mathSqrt = PyJit_GetBuiltinImpl(mathDict, "sqrt");
+		g_mathFloor = PyJit_GetBuiltinImpl(mathDict, "floor");
+		g_mathCeil = PyJit_GetBuiltinImpl(mathDict, "ceil");
+		Py_DECREF(math);
+	}
+	else {
+		PyErr_Clear();
+	}
 
-    g_emptyTuple = PyTuple_New(0);
+	// Profiler support can be turned on without changing the program being profiled
+	if (Py_GETENV("PYJION_PERF_MAP")) {
+		pyjit_perf_enable(PYJIT_PERF_MAP);
+	}
+	if (Py_GETENV("PYJION_GDB_JIT")) {
+		pyjit_perf_enable(PYJIT_GDB_JIT);
+	}
+	if (Py_GETENV("PYJION_FRAME_POINTERS")) {
+		pyjit_set_frame_pointers(1);
+	}
 }
 
 #ifdef NO_TRACE
@@ -236,32 +337,777 @@ AbstractValueKind GetAbstractType(PyTypeObject* type) {
     return AVK_Any;
 }
 
+// Gets the type we'll specialize an argument on, or null if we don't specialize on
+// the argument's type.  User defined types need a valid version tag, which lets
+// us detect when the class has since been modified.
 PyTypeObject* GetArgType(int arg, PyObject** locals) {
     auto objValue = locals[arg];
-    PyTypeObject* type = nullptr;
-    if (objValue != nullptr) {
-        type = objValue->ob_type;
-        // We currently only generate optimal code for ints and floats,
-        // so don't bother specializing on other types...
-        if (type != &PyLong_Type && type != &PyFloat_Type) {
-            type = nullptr;
-        }
+    if (objValue == nullptr) {
+        return nullptr;
+    }
+
+    auto type = objValue->ob_type;
+    if (type == &PyLong_Type || type == &PyFloat_Type ||
+        type == &PyUnicode_Type || type == &PyBytes_Type ||
+        type == &PyList_Type || type == &PyTuple_Type || type == &PyDict_Type) {
+        return type;
     }
-    return type;
+    if (PyType_HasFeature(type, Py_TPFLAGS_HEAPTYPE) &&
+        PyType_HasFeature(type, Py_TPFLAGS_VALID_VERSION_TAG)) {
+        return type;
+    }
+    return nullptr;
 }
 
 PyObject* Jit_EvalGeneric(PyjionJittedCode* state, PyFrameObject*frame) {
     auto trace = (PyjionJittedCode*)state;
-    return Jit_EvalHelper((void*)trace->j_generic, frame);
+    return Jit_EvalJitted(trace, trace->j_generic, frame);
+}
+
+PyObject* Jit_EvalTrace(PyjionJittedCode* state, PyFrameObject *frame);
+static void PyJit_CheckCompiles();
+
+// Finds the compiled code a call from jitted code should run for a frame, which
+// is the code Jit_EvalTrace would dispatch to.  Returns false if there isn't any
+// yet, in which case the frame needs to go through the normal dispatch.
+static bool PyJit_ResolveDirect(PyFrameObject* frame, CallCache* cache) {
+	auto jitted = PyJit_EnsureExtra((PyObject*)frame->f_code);
+	if (jitted == nullptr || jitted->j_failed || jitted->j_invalidated) {
+		return false;
+	}
+
+	SpecializedTreeNode* target = nullptr;
+	Py_EvalFunc addr = nullptr;
+	if (jitted->j_evalfunc == Jit_EvalGeneric) {
+		addr = jitted->j_generic;
+	}
+#ifndef TRACE_TREE
+	else if (jitted->j_evalfunc == Jit_EvalTrace) {
+		for (size_t i = 0; i < jitted->j_optimized.size(); i++) {
+			auto node = jitted->j_optimized[i];
+			if (node->matches(frame->f_localsplus)) {
+				// Specializations running baseline code need to go through
+				// Jit_EvalTrace to be counted towards being optimized
+				target = node;
+				addr = target->jittedCode != nullptr ? (Py_EvalFunc)target->addr : nullptr;
+				break;
+			}
+		}
+	}
+#endif
+	if (addr == nullptr) {
+		return false;
+	}
+
+	cache->Code = (PyObject*)frame->f_code;
+	cache->Generation = g_codeGeneration;
+	cache->Jitted = jitted;
+	cache->Target = target;
+	cache->Addr = (void*)addr;
+	return true;
+}
+
+// Checks that the code a call cache holds can still run the frame.  Evicting
+// and invalidating code both bump the generation, but code which has been
+// invalidated is checked for too, so that nothing new is dispatched to it.
+static bool PyJit_DirectCacheHit(PyFrameObject* frame, CallCache* cache) {
+	if (cache->Code != (PyObject*)frame->f_code || cache->Generation != g_codeGeneration ||
+		cache->Jitted->j_invalidated) {
+		return false;
+	}
+	if (cache->Target == nullptr) {
+		return cache->Jitted->j_evalfunc == Jit_EvalGeneric;
+	}
+#ifdef TRACE_TREE
+	return false;
+#else
+	return cache->Target->matches(frame->f_localsplus);
+#endif
+}
+
+// Runs a frame set up by a call from jitted code.  If the call site's cache has
+// code which is valid for the frame we run that directly, skipping the lookup of
+// the function's jitted state and the search of its specializations.
+PyObject* PyJit_EvalDirect(PyFrameObject* frame, CallCache* cache) {
+	auto tstate = PyThreadState_GET();
+	if ((tstate->use_tracing && (tstate->c_profilefunc != nullptr || PyJit_IsTracing(tstate))) ||
+		tstate->interp->eval_frame != PyJit_EvalFrame) {
+		return PyEval_EvalFrameEx(frame, 0);
+	}
+
+	// Like the normal dispatch, pick up anything the compiler thread has
+	// finished, which may give the callee better code than we've cached.
+	PyJit_CheckCompiles();
+
+	if (!PyJit_DirectCacheHit(frame, cache) && !PyJit_ResolveDirect(frame, cache)) {
+		return PyEval_EvalFrameEx(frame, 0);
+	}
+	PYJIT_COUNT(cache->Jitted->j_counters.direct);
+	return Jit_EvalJitted(cache->Jitted, (Py_EvalFunc)cache->Addr, frame);
+}
+
+// Frees all of the jitted code for a function and puts it back into tracing, so
+// it runs in the interpreter until it becomes hot again.
+static void PyJit_EvictCode(PyjionJittedCode* jitted) {
+	// Dispatch only reads the specializations while holding the GIL, which we
+	// have, so nothing can still be looking at them.
+	for (size_t i = 0; i < jitted->j_optimized.size(); i++) {
+		delete jitted->j_optimized[i];
+	}
+	jitted->j_optimized.clear();
+	delete jitted->j_megamorphic;
+	jitted->j_megamorphic = nullptr;
+	jitted->j_generic = nullptr;
+	delete jitted->j_baseline_code;
+	jitted->j_baseline = nullptr;
+	jitted->j_baseline_code = nullptr;
+	if (jitted->j_osr != nullptr) {
+		for (auto cur = jitted->j_osr->loopHeads.begin(); cur != jitted->j_osr->loopHeads.end(); cur++) {
+			delete cur->second;
+			cur->second = nullptr;
+		}
+	}
+	jitted->j_evalfunc = &Jit_EvalTrace;
+	g_codeGeneration++;
+
+	jitted->j_state->codeSize -= jitted->j_code_size;
+	jitted->j_code_size = 0;
+	jitted->j_state->compiledCode.erase(jitted);
+}
+
+// Runs the rest of a frame whose compiled code has given up on it in the
+// interpreter, see PyJit_Deopt.
+static PyObject* PyJit_ResumeInterpreter(PyFrameObject* frame) {
+	int throwflag = 0;
+	for (auto cur = frame->f_valuestack; cur != frame->f_stacktop; cur++) {
+		if (*cur != nullptr && IS_TAGGED((tagged_ptr)*cur)) {
+			*cur = NEW_LONG(UNTAG_IT((tagged_ptr)*cur));
+		}
+		if (*cur == nullptr) {
+			// The interpreter releases everything else on the stack as it unwinds
+			throwflag = 1;
+		}
+	}
+	return _PyEval_EvalFrameDefault(frame, throwflag);
+}
+
+// Gets the data we're tracking for a code object in the current interpreter
+// without creating it, or null if there isn't any.
+static PyjionJittedCode* PyJit_FindExtra(PyObject* code) {
+	auto state = PyJit_GetInterpState();
+	PyjionJittedCode* jitted = nullptr;
+	if (state == nullptr || _PyCode_GetExtra(code, state->extraIndex, (void**)&jitted) != 0) {
+		return nullptr;
+	}
+	return jitted;
+}
+
+PyObject* PyJit_Deopt(PyFrameObject* frame) {
+	auto jitted = PyJit_FindExtra((PyObject*)frame->f_code);
+	if (jitted != nullptr && ++jitted->j_deopts[frame->f_lasti] == DEOPT_LIMIT) {
+		// The code is still running so it can't be freed yet, but nothing new
+		// should be dispatched to it.
+		jitted->j_invalidated = true;
+		jitted->j_evalfunc = &Jit_EvalTrace;
+		g_codeGeneration++;
+	}
+	return PyJit_ResumeInterpreter(frame);
+}
+
+PyObject* PyJit_SideExit(PyFrameObject* frame) {
+	// Recompiling won't help, so unlike a deopt this doesn't count against the code
+	auto jitted = PyJit_FindExtra((PyObject*)frame->f_code);
+	if (jitted != nullptr) {
+		PYJIT_COUNT(jitted->j_counters.sideExits);
+	}
+	return PyJit_ResumeInterpreter(frame);
+}
+
+// Evicts the least recently used functions in an interpreter until it's back
+// under its code budget.  Functions which are currently running are skipped, as
+// is keep (which we're about to run).
+static void PyJit_EnforceCodeBudget(PyjionInterpState* state, PyjionJittedCode* keep) {
+	if (state->codeBudget == 0 || state->codeSize <= state->codeBudget) {
+		return;
+	}
+
+	vector<PyjionJittedCode*> candidates;
+	for (auto cur = state->compiledCode.begin(); cur != state->compiledCode.end(); cur++) {
+		if (*cur != keep && (*cur)->j_executing == 0) {
+			candidates.push_back(*cur);
+		}
+	}
+	sort(candidates.begin(), candidates.end(), [](PyjionJittedCode* x, PyjionJittedCode* y) {
+		return x->j_last_used < y->j_last_used;
+	});
+
+	for (auto cur = candidates.begin(); cur != candidates.end() && state->codeSize > state->codeBudget; cur++) {
+		PyJit_EvictCode(*cur);
+	}
+}
+
+// Gets the LOAD_GLOBAL caches shared by all of the code compiled for a function,
+// they live until the function is freed.
+static GlobalCache* PyJit_GetGlobalCaches(PyjionJittedCode* jitted) {
+	if (jitted->j_global_caches == nullptr) {
+		auto code = (PyCodeObject*)jitted->j_code;
+		jitted->j_global_caches = new GlobalCache[PyTuple_GET_SIZE(code->co_names)];
+	}
+	return jitted->j_global_caches;
+}
+
+// Gets the attribute caches shared by all of the code compiled for a function.
+static AttrCache* PyJit_GetAttrCaches(PyjionJittedCode* jitted) {
+	if (jitted->j_attr_caches == nullptr) {
+		auto code = (PyCodeObject*)jitted->j_code;
+		jitted->j_attr_caches = new AttrCache[PyBytes_GET_SIZE(code->co_code) / sizeof(_Py_CODEUNIT)];
+	}
+	return jitted->j_attr_caches;
+}
+
+// Gets the call caches shared by all of the code compiled for a function.
+static CallCache* PyJit_GetCallCaches(PyjionJittedCode* jitted) {
+	if (jitted->j_call_caches == nullptr) {
+		auto code = (PyCodeObject*)jitted->j_code;
+		jitted->j_call_caches = new CallCache[PyBytes_GET_SIZE(code->co_code) / sizeof(_Py_CODEUNIT)];
+	}
+	return jitted->j_call_caches;
+}
+
+// Stops compiling a function after a compile has failed.  It's tried again
+// after a number of calls which doubles with each failure, as the types,
+// globals and guards it's compiled with change, up to MAX_COMPILE_RETRIES times.
+static void PyJit_DisableCompiles(PyjionJittedCode* jitted) {
+	jitted->j_failed = true;
+	if (jitted->j_retries < MAX_COMPILE_RETRIES) {
+		jitted->j_retry_countdown = COMPILE_RETRY_CALLS << jitted->j_retries;
+		jitted->j_retries++;
+	}
+	else {
+		jitted->j_retry_countdown = 0;
+	}
+}
+
+// Tells other processes sharing the code cache about a function which doesn't
+// compile.  Only failures we've given up retrying are recorded, anything else
+// may well compile when it's retried with different types, globals and guards.
+static void PyJit_CacheFailure(PyjionJittedCode* jitted, bool cacheable, PY_UINT64_T cacheKey) {
+	if (cacheable && jitted->j_failed && jitted->j_retry_countdown == 0) {
+		g_codeCache.record_failure(cacheKey, (PyCodeObject*)jitted->j_code);
+	}
+}
+
+// Records a compile for a function which didn't produce any code, along with
+// why (a static string) and the opcode responsible or -1.
+static void PyJit_RecordFailure(PyjionJittedCode* jitted, const char* reason, int opcode) {
+	jitted->j_fail_reason = reason;
+	jitted->j_fail_opcode = opcode;
+	jitted->j_compiles++;
+	jitted->j_compile_failures++;
+	jitted->j_state->compiles++;
+	jitted->j_state->compileFailures++;
+}
+
+// Tells profilers and debuggers which function newly compiled code belongs to.
+// variant describes which compile of the function it is, e.g. the argument types
+// it's specialized for.
+static void PyJit_AnnounceCode(PyjionJittedCode* jitted, JittedCode* code, const string& variant) {
+	if (!pyjit_perf_enabled()) {
+		return;
+	}
+
+	auto pyCode = (PyCodeObject*)jitted->j_code;
+	auto file = PyUnicode_AsUTF8(pyCode->co_filename);
+	auto funcName = PyUnicode_AsUTF8(pyCode->co_name);
+	if (file == nullptr || funcName == nullptr) {
+		PyErr_Clear();
+		return;
+	}
+
+	string name = funcName;
+	name += " (";
+	name += file;
+	name += ':';
+	name += to_string(pyCode->co_firstlineno);
+	name += ") [";
+	name += variant;
+	name += ']';
+
+	size_t count;
+	auto pcMap = code->get_pc_map(&count);
+	vector<PyjitCodeLine> lines;
+	for (size_t i = 0; i < count; i++) {
+		PyjitCodeLine line = { pcMap[i].offset, PyCode_Addr2Line(pyCode, pcMap[i].bytecodeIndex) };
+		if (lines.empty() || lines.back().line != line.line) {
+			lines.push_back(line);
+		}
+	}
+
+	pyjit_perf_register(code->get_code_addr(), code->get_stats().codeSize, name.c_str(), file,
+		lines.data(), lines.size());
+}
+
+// Records newly compiled code for a function against the code budget.
+static void PyJit_TrackCode(PyjionJittedCode* jitted, JittedCode* code, const string& variant) {
+	PyJit_AnnounceCode(jitted, code, variant);
+
+	auto state = jitted->j_state;
+	jitted->j_compiles++;
+	jitted->j_stats.add(code->get_stats());
+	state->compiles++;
+	state->compileStats.add(code->get_stats());
+
+	jitted->j_code_size += code->get_code_size();
+	state->codeSize += code->get_code_size();
+	state->compiledCode.insert(jitted);
+
+	PyJit_EnforceCodeBudget(state, jitted);
+}
+
+// Makes newly compiled code for a specialization available for dispatch.
+static void PyJit_PublishCode(PyjionJittedCode* trace, SpecializedTreeNode* target, JittedCode* res, bool isSpecialized) {
+	// Update the jitted information for this tree node, publishing the address last
+	auto addr = (Py_EvalFunc)res->get_code_addr();
+	target->jittedCode = res;
+	target->addr = addr;
+	if (!isSpecialized) {
+		// We didn't produce a specialized function, so it can be shared by every
+		// specialization which can't do any better.
+		trace->j_generic = addr;
+
+		bool haveSpecialized = false;
+		for (size_t i = 0; i < trace->j_optimized.size(); i++) {
+			auto node = trace->j_optimized[i];
+			if (node != target && (node->jittedCode != nullptr || node->pending != nullptr)) {
+				haveSpecialized = true;
+			}
+		}
+		if (!haveSpecialized) {
+			// Nothing is specialized, force all code down the generic code path.
+			trace->j_evalfunc = Jit_EvalGeneric;
+		}
+	}
+
+	string variant;
+#ifndef TRACE_TREE
+	for (auto cur = target->types.begin(); cur != target->types.end(); cur++) {
+		if (!variant.empty()) {
+			variant += ", ";
+		}
+		variant += *cur == nullptr ? "*" : (*cur)->tp_name;
+	}
+#endif
+	PyJit_TrackCode(trace, res, variant);
 }
 
-#define MAX_TRACE 5
+// Makes newly compiled baseline code available for all specializations which
+// don't have optimized code yet.
+static void PyJit_PublishBaseline(PyjionJittedCode* trace, JittedCode* res) {
+	trace->j_baseline = (Py_EvalFunc)res->get_code_addr();
+	trace->j_baseline_code = res;
+	PyJit_TrackCode(trace, res, "baseline");
+}
+
+// Background compilation.  When it's enabled the IL for a hot function is still
+// generated on the calling thread (that needs the GIL), but the native compile is
+// handed off to the compiler thread.  The frame keeps running in the interpreter,
+// and the finished code is published under the GIL by the next trace dispatch.
+struct CompileRequest {
+	PyjionJittedCode* jitted;
+	SpecializedTreeNode* target;
+	PendingCode* pending;
+	bool isSpecialized;
+	// Set if the compiler thread was stopped before getting to the request
+	bool cancelled;
+	bool cacheable;
+	PY_UINT64_T cacheKey;
+	JittedCode* result;
+};
+
+static bool g_backgroundCompile = false;
+static bool g_compilerShutdown = false;
+static bool g_registeredAtExit = false;
+static thread g_compilerThread;
+static mutex g_compileLock;
+static condition_variable g_compileReady;
+static deque<CompileRequest*> g_compileQueue;
+static vector<CompileRequest*> g_compileCompleted;
+static atomic<bool> g_compilesCompleted(false);
+
+static void PyJit_CompilerThread() {
+	while (true) {
+		CompileRequest* request;
+		{
+			unique_lock<mutex> lock(g_compileLock);
+			g_compileReady.wait(lock, [] { return g_compilerShutdown || !g_compileQueue.empty(); });
+			if (g_compilerShutdown) {
+				JitPagePool::current().release();
+				CompileArena::current().release();
+				return;
+			}
+			request = g_compileQueue.front();
+			g_compileQueue.pop_front();
+		}
+
+		request->result = request->pending->compile();
+		delete request->pending;
+		request->pending = nullptr;
+
+		lock_guard<mutex> guard(g_compileLock);
+		g_compileCompleted.push_back(request);
+		g_compilesCompleted = true;
+	}
+}
+
+// Hands the native compile off to the compiler thread.  The code object is kept
+// alive, and the function can't be evicted, until the result is published.
+static void PyJit_QueueCompile(PyjionJittedCode* trace, SpecializedTreeNode* target, PendingCode* pending, bool isSpecialized, bool cacheable, PY_UINT64_T cacheKey) {
+	auto request = new CompileRequest();
+	request->jitted = trace;
+	request->target = target;
+	request->pending = pending;
+	request->isSpecialized = isSpecialized;
+	request->cancelled = false;
+	request->cacheable = cacheable;
+	request->cacheKey = cacheKey;
+	request->result = nullptr;
+
+	target->pending = request;
+	trace->j_executing++;
+	Py_INCREF(trace->j_code);
+
+	{
+		lock_guard<mutex> guard(g_compileLock);
+		g_compileQueue.push_back(request);
+	}
+	g_compileReady.notify_one();
+}
+
+// Publishes everything the compiler thread has finished.  Must hold the GIL.
+static void PyJit_PublishCompiles() {
+	vector<CompileRequest*> completed;
+	{
+		lock_guard<mutex> guard(g_compileLock);
+		completed.swap(g_compileCompleted);
+		g_compilesCompleted = false;
+	}
+
+	for (auto cur = completed.begin(); cur != completed.end(); cur++) {
+		auto request = *cur;
+		auto trace = request->jitted;
+
+		request->target->pending = nullptr;
+		trace->j_executing--;
+		if (request->cancelled) {
+			// Start counting again so it'll get queued up the next time it's hot
+			request->target->hitCount = 0;
+		}
+		else if (request->result == nullptr && trace->j_baseline != nullptr) {
+			// We can't optimize it, so stick with the baseline code
+			PyJit_RecordFailure(trace, "native compile failed", -1);
+			request->target->addr = trace->j_baseline;
+		}
+		else if (request->result == nullptr) {
+			PyJit_RecordFailure(trace, "native compile failed", -1);
+			PyJit_DisableCompiles(trace);
+			PyJit_CacheFailure(trace, request->cacheable, request->cacheKey);
+		}
+		else {
+			PyJit_PublishCode(trace, request->target, request->result, request->isSpecialized);
+		}
+
+		// This can free the code object (and trace) if it's otherwise dead
+		Py_DECREF(trace->j_code);
+		delete request;
+	}
+}
+
+// Publishes anything the compiler thread has finished since we last looked,
+// which is cheap enough to check for on every dispatch.  Must hold the GIL.
+static void PyJit_CheckCompiles() {
+	if (g_compilesCompleted) {
+		PyJit_PublishCompiles();
+	}
+}
+
+static void PyJit_StopCompilerThread() {
+	g_backgroundCompile = false;
+	if (!g_compilerThread.joinable()) {
+		return;
+	}
+
+	{
+		lock_guard<mutex> guard(g_compileLock);
+		g_compilerShutdown = true;
+	}
+	g_compileReady.notify_one();
+
+	// The compiler thread never takes the GIL, so we can wait for it to finish
+	// the method it's working on while holding it
+	g_compilerThread.join();
+
+	{
+		lock_guard<mutex> guard(g_compileLock);
+		g_compilerShutdown = false;
+		for (auto cur = g_compileQueue.begin(); cur != g_compileQueue.end(); cur++) {
+			delete (*cur)->pending;
+			(*cur)->pending = nullptr;
+			(*cur)->cancelled = true;
+			g_compileCompleted.push_back(*cur);
+		}
+		g_compileQueue.clear();
+	}
+	PyJit_PublishCompiles();
+}
+
+static PyObject *pyjion_stop_compiler(PyObject *self, PyObject* args) {
+	PyJit_StopCompilerThread();
+	Py_RETURN_NONE;
+}
+
+static PyMethodDef g_stopCompilerDef = { "_stop_compiler", pyjion_stop_compiler, METH_NOARGS, NULL };
+
+static bool PyJit_StartCompilerThread() {
+	if (g_compilerThread.joinable()) {
+		return true;
+	}
+
+	PyEval_InitThreads();
+
+	// The compiler thread needs to be stopped while the interpreter can still
+	// hand out the GIL.
+	if (!g_registeredAtExit) {
+		auto atexit = PyImport_ImportModule("atexit");
+		if (atexit == nullptr) {
+			return false;
+		}
+		auto stop = PyCFunction_New(&g_stopCompilerDef, nullptr);
+		PyObject* res = nullptr;
+		if (stop != nullptr) {
+			res = PyObject_CallMethod(atexit, "register", "O", stop);
+			Py_DECREF(stop);
+		}
+		Py_DECREF(atexit);
+		if (res == nullptr) {
+			return false;
+		}
+		Py_DECREF(res);
+		g_registeredAtExit = true;
+	}
+
+	g_compilerThread = thread(PyJit_CompilerThread);
+	return true;
+}
+
+// On-stack replacement.  Hotness is normally only counted when a function is
+// called, so a frame which is entered once and then spends all of its time in a
+// loop (e.g. module level code, or main()) would never get jitted.  Frames with
+// loops run in the interpreter with our trace function installed, which counts
+// the times we get back to a loop head.  CPython doesn't give us any other way to
+// see back edges, and that isn't free: while it's installed the interpreter
+// checks for a new line on every instruction and calls us at the start of each
+// line, not just at loop heads.  So we only watch frames which start out in the
+// interpreter with a loop we can enter at, and we stop watching as soon as a
+// loop gets hot or the function turns out not to be able to be entered part way
+// through.  Functions the frame calls which run in the interpreter are traced
+// too, we ignore them rather than swap the trace function out around each call.
+// Jitted code ignores our trace function.  When a loop gets hot we compile baseline
+// code which can be entered at that loop head, and from the trace function run
+// the rest of the frame in it, taking over the frame's value stack.  The jitted
+// code handles all of the blocks from then on.  When it's done we resume the
+// interpreter at a RETURN_VALUE with the result on the stack (or raise the
+// exception), which is the only thing left for it to do.
+static OsrState* PyJit_GetOsrState(PyjionJittedCode* jitted) {
+	if (jitted->j_osr == nullptr) {
+		auto osr = new OsrState();
+		auto code = (PyCodeObject*)jitted->j_code;
+
+		unordered_set<size_t> loopHeads;
+		AbstractInterpreter interp(code, nullptr);
+		osr->isLoopHead.resize(PyBytes_GET_SIZE(code->co_code) / sizeof(_Py_CODEUNIT));
+		if (interp.get_loop_heads(loopHeads)) {
+			for (auto cur = loopHeads.begin(); cur != loopHeads.end(); cur++) {
+				osr->loopHeads[*cur] = nullptr;
+				osr->isLoopHead[*cur / sizeof(_Py_CODEUNIT)] = true;
+			}
+		}
+
+		auto byteCode = (_Py_CODEUNIT *)PyBytes_AS_STRING(code->co_code);
+		for (auto i = PyBytes_GET_SIZE(code->co_code) / sizeof(_Py_CODEUNIT); i-- > 0; ) {
+			if (_Py_OPCODE(byteCode[i]) == RETURN_VALUE) {
+				osr->returnOffset = (int)(i * sizeof(_Py_CODEUNIT));
+				break;
+			}
+		}
+
+		// Generators keep their frames around between calls, so they're only
+		// jitted from the start
+		osr->failed = osr->loopHeads.size() == 0 || osr->returnOffset == -1 ||
+			(code->co_flags & (CO_GENERATOR | CO_COROUTINE));
+		jitted->j_osr = osr;
+	}
+	return jitted->j_osr;
+}
+
+// Moves a frame which is at a loop head into jitted code.  Called from our trace
+// function, the return value is passed back to the interpreter.
+static int PyJit_OnStackReplace(PyjionJittedCode* jitted, OsrState* osr, PyFrameObject* frame) {
+	// We're done watching this frame, either it's about to finish in jitted code
+	// or it can't be jitted and may as well run without the tracing overhead.
+	// If it was called from a frame which is being watched we go back to
+	// watching that when it returns.
+	g_osrFrame = nullptr;
+	PyEval_SetTrace(nullptr, nullptr);
+	if (frame->f_stacktop == nullptr) {
+		return 0;
+	}
+
+	auto& code = osr->loopHeads[frame->f_lasti];
+	if (code == nullptr) {
+		if (jitted->j_compiling.exchange(true)) {
+			// Another thread is compiling the function, this frame finishes in
+			// the interpreter
+			return 0;
+		}
+		AbstractInterpreter interp((PyCodeObject*)jitted->j_code, &CreateCLRCompiler);
+		interp.set_global_caches(PyJit_GetGlobalCaches(jitted));
+		interp.set_attr_caches(PyJit_GetAttrCaches(jitted));
+		interp.set_call_caches(PyJit_GetCallCaches(jitted));
+		interp.set_globals(frame->f_globals);
+		jitted->j_executing++;
+		code = interp.compile_osr(frame->f_lasti, frame->f_stacktop - frame->f_valuestack);
+		jitted->j_executing--;
+		jitted->j_compiling = false;
+		interp.take_inlined_code(jitted->j_inlined_code);
+		if (code == nullptr) {
+			PyJit_RecordFailure(jitted, interp.get_fail_reason(), interp.get_fail_opcode());
+			osr->failed = true;
+			return 0;
+		}
+		PyJit_TrackCode(jitted, code, "osr");
+	}
+
+	// The jitted code owns the values on the stack now, and the interpreter's
+	// blocks are irrelevant.  We're running from inside of the trace function,
+	// but the rest of the frame should run as if we weren't.
+	auto tstate = PyThreadState_GET();
+	frame->f_stacktop = frame->f_valuestack;
+	frame->f_iblock = 0;
+	tstate->tracing--;
+	tstate->use_tracing = tstate->c_tracefunc != nullptr || tstate->c_profilefunc != nullptr;
+
+	auto res = Jit_EvalJitted(jitted, (Py_EvalFunc)code->get_code_addr(), frame);
+
+	tstate->tracing++;
+	tstate->use_tracing = 0;
+	tstate->frame = frame;
+	frame->f_executing = 1;
+
+	if (res == nullptr) {
+		// The jitted code recorded the traceback for this frame, but the
+		// interpreter will do that again when it sees the error.
+		PyObject *type, *value, *tb;
+		PyErr_Fetch(&type, &value, &tb);
+		if (tb != nullptr && ((PyTracebackObject*)tb)->tb_frame == frame) {
+			auto next = (PyObject*)((PyTracebackObject*)tb)->tb_next;
+			Py_XINCREF(next);
+			Py_DECREF(tb);
+			tb = next;
+		}
+		PyErr_Restore(type, value, tb);
+		return -1;
+	}
+
+	frame->f_valuestack[0] = res;
+	frame->f_stacktop = frame->f_valuestack + 1;
+	frame->f_lasti = osr->returnOffset;
+	return 0;
+}
+
+static int PyJit_OsrTrace(PyObject* obj, PyFrameObject* frame, int what, PyObject* arg) {
+	// Everything the watched frame calls in the interpreter gets traced too
+	if (what != PyTrace_LINE || frame != g_osrFrame) {
+		return 0;
+	}
+
+	auto jitted = PyJit_EnsureExtra((PyObject*)frame->f_code);
+	if (jitted == nullptr) {
+		return 0;
+	}
+
+	// Line events are delivered when we jump backwards, so we see every trip
+	// around a loop, along with the start of every other line which we ignore.
+	auto osr = PyJit_GetOsrState(jitted);
+	if (osr->failed || frame->f_lasti < 0 || !osr->isLoopHead[frame->f_lasti / sizeof(_Py_CODEUNIT)] ||
+		++osr->backEdges < jitted->j_state->osrThreshold) {
+		return 0;
+	}
+
+	return PyJit_OnStackReplace(jitted, osr, frame);
+}
+
+// Runs a frame in the interpreter, watching it for hot loops if it has any.
+static PyObject* PyJit_RunInterpreter(PyjionJittedCode* jitted, PyFrameObject* frame, int throwflag) {
+	auto tstate = PyThreadState_GET();
+	if (jitted == nullptr || jitted->j_state->osrThreshold == 0 || throwflag || frame->f_lasti != -1 ||
+		PyJit_IsTracing(tstate) || tstate->tracing ||
+		PyJit_GetOsrState(jitted)->failed) {
+		return _PyEval_EvalFrameDefault(frame, throwflag);
+	}
+
+	// The trace function stays installed for everything the frame calls, which
+	// it ignores, and is only changed when a watched frame starts or finishes.
+	auto outer = g_osrFrame;
+	g_osrFrame = frame;
+	if (tstate->c_tracefunc == nullptr) {
+		PyEval_SetTrace(PyJit_OsrTrace, nullptr);
+	}
+	auto res = _PyEval_EvalFrameDefault(frame, 0);
+	g_osrFrame = outer;
+	if (outer == nullptr && tstate->c_tracefunc == PyJit_OsrTrace) {
+		PyEval_SetTrace(nullptr, nullptr);
+	}
+	else if (outer != nullptr && tstate->c_tracefunc == nullptr) {
+		PyEval_SetTrace(PyJit_OsrTrace, nullptr);
+	}
+	return res;
+}
+
+// Runs a frame in the interpreter, charging the function for the time it takes
+// less the time spent in any interpreted functions it calls.
+static PyObject* PyJit_Interpret(PyjionJittedCode* jitted, PyFrameObject* frame, int throwflag = 0) {
+#ifndef NO_DISPATCH_COUNTERS
+	if (jitted != nullptr) {
+		jitted->j_counters.interpreted++;
+		auto nestedBefore = g_nestedInterpretedTime;
+		auto start = pyjit_now();
+		auto res = PyJit_RunInterpreter(jitted, frame, throwflag);
+		auto elapsed = pyjit_now() - start;
+		// Other threads can run while we're in the interpreter, so don't trust
+		// the nested time to be within our own.
+		auto nested = g_nestedInterpretedTime - nestedBefore;
+		jitted->j_counters.interpretedTime += nested < elapsed ? elapsed - nested : 0;
+		g_nestedInterpretedTime = nestedBefore + elapsed;
+		return res;
+	}
+#endif
+	return PyJit_RunInterpreter(jitted, frame, throwflag);
+}
 
 PyObject* Jit_EvalTrace(PyjionJittedCode* state, PyFrameObject *frame) {
 	// Walk our tree of argument types to find the SpecializedTreeNode which
     // corresponds with our sets of arguments here.
     auto trace = (PyjionJittedCode*)state;
 
+	PyJit_CheckCompiles();
+
+	if (trace->j_invalidated && trace->j_executing == 0) {
+		// A guard has failed too often, start over so the function gets
+		// recompiled without it.
+		trace->j_invalidated = false;
+		PyJit_EvictCode(trace);
+	}
+
 #ifdef TRACE_TREE
     // no match on specialized functions...
 
@@ -324,42 +1170,58 @@ PyObject* Jit_EvalTrace(PyjionJittedCode* state, PyFrameObject *frame) {
     }
 #else
 
+	// The specializations form a polymorphic inline cache of type guards, with
+	// each hit moving an entry towards the front so the common cases are found
+	// first.  We hold the GIL, so we're the only thread changing them.
 	SpecializedTreeNode* target = nullptr;
-    for (auto cur = trace->j_optimized.begin(); cur != trace->j_optimized.end() && target == nullptr; cur++) {
-        PyObject** locals = frame->f_localsplus;
-
-		target = *cur;
-        for (auto type = target->types.begin(); type != target->types.end(); type++, locals++) {
-            PyTypeObject *argType = nullptr;
-            if (*locals != nullptr) {
-                argType = (*locals)->ob_type;
-                // We currently only generate optimal code for ints and floats,
-                // so don't bother specializing on other types...
-                if (argType != &PyLong_Type && argType != &PyFloat_Type) {
-                    argType = nullptr;
-                }
-            }
+	auto& specializations = trace->j_optimized;
+	for (size_t i = 0; i < specializations.size(); i++) {
+		auto node = specializations[i];
+		if (node->matches(frame->f_localsplus)) {
+			target = node;
+			if (i != 0) {
+				specializations.promote(i);
+			}
+			break;
+		}
+	}
 
-            if (*type != argType) {
-				target = nullptr;
-                break;
-            }
-        }
-    }
+	if (target == nullptr) {
+		PYJIT_COUNT(trace->j_counters.traceMisses);
+		int argCount = frame->f_code->co_argcount + frame->f_code->co_kwonlyargcount;
+		vector<PyTypeObject*> types;
+		if (!specializations.full()) {
+			// record the new trace...
+			for (int i = 0; i < argCount; i++) {
+				auto type = GetArgType(i, frame->f_localsplus);
+				types.push_back(type);
+			}
+			target = new SpecializedTreeNode(types);
+			specializations.push_back(target);
+		}
+		else {
+			// We've seen too many types, everything else shares a single body
+			// which isn't specialized.
+			PYJIT_COUNT(trace->j_counters.megamorphic);
+			if (trace->j_megamorphic == nullptr) {
+				types.resize(argCount, nullptr);
+				trace->j_megamorphic = new SpecializedTreeNode(types);
+			}
+			target = trace->j_megamorphic;
+		}
 
-    // record the new trace...
-    if (target == nullptr && trace->j_optimized.size() < MAX_TRACE) {
-        int argCount = frame->f_code->co_argcount + frame->f_code->co_kwonlyargcount;
-        vector<PyTypeObject*> types;
-        for (int i = 0; i < argCount; i++) {
-            auto type = GetArgType(i, frame->f_localsplus);
-            types.push_back(type);
-        }
-		target = new SpecializedTreeNode(types);
-        trace->j_optimized.push_back(target);
+		if (trace->j_generic != nullptr && target->addr == nullptr && !target->has_unboxable_types()) {
+			// The code would be the same as the generic code we already have
+			target->addr = trace->j_generic;
+		}
 	}
+	PYJIT_COUNT(target->calls);
 #endif
 
+	if (trace->j_failed && trace->j_retry_countdown != 0 && --trace->j_retry_countdown == 0) {
+		trace->j_failed = false;
+	}
+
 	if (target != nullptr && !trace->j_failed) {
 		if (target->addr != nullptr) {
 			// we have a specialized function for this, just invoke it
@@ -370,29 +1232,69 @@ PyObject* Jit_EvalTrace(PyjionJittedCode* state, PyFrameObject *frame) {
 				target->addr,
 				frame
 			);*/
-			auto res = Jit_EvalHelper((void*)target->addr, frame);
+			auto res = Jit_EvalJitted(trace, target->addr, frame);
 			//printf("Returning from %s", PyUnicode_AsUTF8(frame->f_code->co_name));
 			return res;
 		}
 
-		target->hitCount++;
-		// we've recorded these types before...
-		// No specialized function yet, let's see if we should create one...
-		if (target->hitCount >= trace->j_specialization_threshold) {
+		target->hitCount++;
+		// we've recorded these types before...
+		// No specialized function yet, let's see if we should create one (unless
+		// it's already being compiled in the background).  Hot functions first get
+		// baseline code, and specializations which stay hot are then optimized.
+		// If another thread is already compiling the function we keep running what
+		// we've got until it's done.
+		bool baseline = trace->j_optimize_threshold != 0 && target->hitCount < trace->j_optimize_threshold;
+		if (target->hitCount >= trace->j_specialization_threshold && target->pending == nullptr &&
+			!(baseline && trace->j_baseline != nullptr) && !trace->j_compiling.exchange(true)) {
+			auto tier = baseline ? TierBaseline : TierOptimized;
+
+			// Don't bother if another process has already given up on compiling it
+			PY_UINT64_T cacheKey = 0;
+			bool cacheable = trace->j_baseline == nullptr && g_codeCache.enabled() &&
+				CodeCache::get_key((PyCodeObject*)trace->j_code, target->types, cacheKey);
+			if (cacheable && g_codeCache.is_known_failure(cacheKey)) {
+				trace->j_compiling = false;
+				trace->j_failed = true;
+				trace->j_fail_reason = "failed in another process";
+				return PyJit_Interpret(trace, frame);
+			}
+
 			// Compile and run the now compiled code...
 			AbstractInterpreter interp((PyCodeObject*)trace->j_code, &CreateCLRCompiler);
+			interp.set_global_caches(PyJit_GetGlobalCaches(trace));
+			interp.set_attr_caches(PyJit_GetAttrCaches(trace));
+			interp.set_call_caches(PyJit_GetCallCaches(trace));
+			interp.set_globals(frame->f_globals);
+			interp.set_deopts(&trace->j_deopts);
 			int argCount = frame->f_code->co_argcount + frame->f_code->co_kwonlyargcount;
 
 			// provide the interpreter information about the specialized types
-			for (int i = 0; i < argCount; i++) {
-				auto type = GetAbstractType(GetArgType(i, frame->f_localsplus));
-				interp.set_local_type(i, type);
+			if (tier == TierOptimized) {
+				for (int i = 0; i < argCount; i++) {
+					auto type = GetAbstractType(target->types[i]);
+					interp.set_local_type(i, type);
+				}
 			}
 
-			auto res = interp.compile();
+			// Hold the function as in use while we compile so that nothing
+			// which runs in the meantime can evict it out from under us.  Baseline
+			// code is cheap enough to produce that it's always compiled inline.
+			trace->j_executing++;
+			JittedCode* res = nullptr;
+			PendingCode* pending = nullptr;
+			if (g_backgroundCompile && tier == TierOptimized) {
+				pending = interp.compile_deferred(tier);
+			}
+			else {
+				res = interp.compile(tier);
+			}
+			trace->j_executing--;
+			trace->j_compiling = false;
+			interp.take_inlined_code(trace->j_inlined_code);
 			bool isSpecialized = false;
-			for (int i = 0; i < argCount; i++) {
-				auto type = GetAbstractType(GetArgType(i, frame->f_localsplus));
+			for (int i = 0; tier == TierOptimized && i < argCount; i++) {
+				auto type = GetAbstractType(target->types[i]);
 				if (type == AVK_Integer || type == AVK_Float) {
 					if (!interp.get_local_info(0, i).ValueInfo.needs_boxing()) {
 						isSpecialized = true;
@@ -408,24 +1310,38 @@ PyObject* Jit_EvalTrace(PyjionJittedCode* state, PyFrameObject *frame) {
 			);
 #endif
 
-			if (res == nullptr) {
+			if (res == nullptr && pending == nullptr) {
 #if DEBUG_TRACE
 				static int failCount;
 				printf("Compilation failure #%d\r\n", ++failCount);
 #endif
-				trace->j_failed = true;
-				return _PyEval_EvalFrameDefault(frame, 0);
+				PyJit_RecordFailure(trace, interp.get_fail_reason(), interp.get_fail_opcode());
+				if (trace->j_baseline != nullptr) {
+					// We can't optimize it, so stick with the baseline code
+					target->addr = trace->j_baseline;
+					return Jit_EvalJitted(trace, target->addr, frame);
+				}
+
+				PyJit_DisableCompiles(trace);
+				PyJit_CacheFailure(trace, cacheable, cacheKey);
+				return PyJit_Interpret(trace, frame);
+			}
+
+			if (pending != nullptr) {
+				// Keep running the code we've got until the compiler thread is done
+				PyJit_QueueCompile(trace, target, pending, isSpecialized, cacheable, cacheKey);
+				if (trace->j_baseline != nullptr) {
+					return Jit_EvalJitted(trace, trace->j_baseline, frame);
+				}
+				return PyJit_Interpret(trace, frame);
 			}
 
-			// Update the jitted information for this tree node
-			target->addr = (Py_EvalFunc)res->get_code_addr();
-			//opt->jittedCode = res;
-			if (!isSpecialized) {
-				// We didn't produce a specialized function, force all code down
-				// the generic code path.
-				trace->j_generic = target->addr;
-				trace->j_evalfunc = Jit_EvalGeneric;
+			if (tier == TierBaseline) {
+				PyJit_PublishBaseline(trace, res);
+				return Jit_EvalJitted(trace, trace->j_baseline, frame);
 			}
+
+			PyJit_PublishCode(trace, target, res, isSpecialized);
 			
 			/*printf("Entering %s from %s line %d %s\r\n",
 				PyUnicode_AsUTF8(frame->f_code->co_name),
@@ -441,10 +1357,15 @@ PyObject* Jit_EvalTrace(PyjionJittedCode* state, PyFrameObject *frame) {
 				frame->f_code->co_firstlineno,
 				target->addr
 			);*/
-			return Jit_EvalHelper((void*)target->addr, frame);
+			return Jit_EvalJitted(trace, target->addr, frame);
 		}
 	}
 
+	if (trace->j_baseline != nullptr) {
+		// Not hot enough to be optimized yet (or we've run out of specializations)
+		return Jit_EvalJitted(trace, trace->j_baseline, frame);
+	}
+
 #ifdef DEBUG_CALL_TRACE
 	printf("Invoking default %s from %s line %d %s %p %p\r\n",
 		PyUnicode_AsUTF8(frame->f_code->co_name),
@@ -454,7 +1375,7 @@ PyObject* Jit_EvalTrace(PyjionJittedCode* state, PyFrameObject *frame) {
 		frame
 	);
 #endif
-	auto res = _PyEval_EvalFrameDefault(frame, 0);
+	auto res = PyJit_Interpret(trace, frame);
 #ifdef DEBUG_CALL_TRACE
     printf("Returning default %s from %s line %d %s %p\r\n",
 		PyUnicode_AsUTF8(frame->f_code->co_name),
@@ -482,6 +1403,9 @@ DLL_EXPORT bool jit_compile(PyCodeObject* code) {
 #endif
 
 	auto jittedCode = PyJit_EnsureExtra((PyObject*)code);
+	if (jittedCode == nullptr) {
+		return false;
+	}
 	jittedCode->j_evalfunc = &Jit_EvalTrace;
     return true;
 }
@@ -489,22 +1413,36 @@ DLL_EXPORT bool jit_compile(PyCodeObject* code) {
 #endif
 
 
+DLL_EXPORT CompilerFactory* PyJit_GetCompilerFactory() {
+	return &CreateCLRCompiler;
+}
+
+DLL_EXPORT bool PyJit_SetCodeCache(const char* dir) {
+	return g_codeCache.set_dir(dir);
+}
+
 extern "C" DLL_EXPORT PyjionJittedCode* PyJit_EnsureExtra(PyObject* codeObject) {
+	auto state = PyJit_GetInterpState();
+	if (state == nullptr) {
+		return nullptr;
+	}
+
 	PyjionJittedCode *jitted = nullptr;
-	if (_PyCode_GetExtra(codeObject, g_extraIndex, (void**)&jitted)) {
+	if (_PyCode_GetExtra(codeObject, state->extraIndex, (void**)&jitted)) {
 		PyErr_Clear();
 		return nullptr;
 	}
 
 	if (jitted == nullptr) {
-	    jitted = new PyjionJittedCode(codeObject);
+	    jitted = new PyjionJittedCode(codeObject, state);
 		if (jitted != nullptr) {
-			if (_PyCode_SetExtra(codeObject, g_extraIndex, jitted)) {
+			if (_PyCode_SetExtra(codeObject, state->extraIndex, jitted)) {
 				PyErr_Clear();
 
 				delete jitted;
 				return nullptr;
 			}
+			state->allCode.insert(jitted);
 		}
 	}
 	return jitted;
@@ -554,6 +1492,7 @@ extern "C" DLL_EXPORT PyObject *PyJit_EvalFrame(PyFrameObject *f, int throwflag)
 
 			// no longer try and compile this method...
 			jitted->j_failed = true;
+			jitted->j_fail_reason = "module level code or generator expression";
 		}
 	}
 #ifdef MS_WINDOWS
@@ -568,7 +1507,7 @@ extern "C" DLL_EXPORT PyObject *PyJit_EvalFrame(PyFrameObject *f, int throwflag)
 	);
 #endif
 
-	auto res = _PyEval_EvalFrameDefault(f, throwflag);
+	auto res = PyJit_Interpret(jitted, f, throwflag);
 #ifdef DEBUG_CALL_TRACE
 	printf("Returning EFD %s from %s line %d %s %p\r\n",
 		PyUnicode_AsUTF8(f->f_code->co_name),
@@ -623,6 +1562,115 @@ static PyObject *pyjion_status(PyObject *self, PyObject* args) {
     Py_RETURN_FALSE;
 }
 
+// Adds the measurements from compiles to a dictionary being returned to Python.
+static bool PyJit_AddStats(PyObject* dict, CompileStats& stats, int compiles, int failures) {
+	const char* names[] = {
+		"compiles", "compile_failures", "preprocess_ns", "interpret_ns", "emit_ns", "jit_ns",
+		"il_size", "native_size", "rodata_size", "gcinfo_size", "peak_jit_memory"
+	};
+	unsigned long long values[] = {
+		(unsigned long long)compiles, (unsigned long long)failures,
+		stats.preprocessTime, stats.interpretTime, stats.emitTime, stats.jitTime,
+		stats.ilSize, stats.codeSize, stats.roDataSize, stats.gcInfoSize, stats.jitMemory
+	};
+	for (size_t i = 0; i < sizeof(values) / sizeof(values[0]); i++) {
+		auto value = PyLong_FromUnsignedLongLong(values[i]);
+		if (value == nullptr || PyDict_SetItemString(dict, names[i], value) != 0) {
+			Py_XDECREF(value);
+			return false;
+		}
+		Py_DECREF(value);
+	}
+	return true;
+}
+
+// Adds a value to a dictionary being returned to Python, stealing the reference.
+static bool PyJit_SetItem(PyObject* dict, const char* name, PyObject* value) {
+	if (value == nullptr || PyDict_SetItemString(dict, name, value) != 0) {
+		Py_XDECREF(value);
+		return false;
+	}
+	Py_DECREF(value);
+	return true;
+}
+
+// Adds how calls to a function have been dispatched, and why it couldn't be
+// compiled if it couldn't, to a dictionary being returned to Python.
+static bool PyJit_AddCounters(PyObject* dict, PyjionJittedCode* jitted) {
+	auto& counters = jitted->j_counters;
+	const char* names[] = {
+		"jitted_calls", "trace_misses", "megamorphic_calls", "interpreted_calls", "traced_calls", "interpreted_ns",
+		"side_exits", "direct_calls", "compile_retries"
+	};
+	PY_UINT64_T values[] = {
+		counters.jitted, counters.traceMisses, counters.megamorphic, counters.interpreted, counters.traced,
+		counters.interpretedTime, counters.sideExits, counters.direct, (PY_UINT64_T)jitted->j_retries
+	};
+	for (size_t i = 0; i < sizeof(values) / sizeof(values[0]); i++) {
+		if (!PyJit_SetItem(dict, names[i], PyLong_FromUnsignedLongLong(values[i]))) {
+			return false;
+		}
+	}
+
+	// The opcode is reported as a number, dis.opname has the names
+	PyObject* reason = Py_None;
+	PyObject* opcode = Py_None;
+	if (jitted->j_fail_reason != nullptr) {
+		reason = PyUnicode_FromString(jitted->j_fail_reason);
+	}
+	else {
+		Py_INCREF(reason);
+	}
+	if (jitted->j_fail_opcode != -1) {
+		opcode = PyLong_FromLong(jitted->j_fail_opcode);
+	}
+	else {
+		Py_INCREF(opcode);
+	}
+	if (!PyJit_SetItem(dict, "fail_reason", reason)) {
+		Py_XDECREF(opcode);
+		return false;
+	}
+	if (!PyJit_SetItem(dict, "fail_opcode", opcode)) {
+		return false;
+	}
+
+#ifndef TRACE_TREE
+	// The calls made with each set of argument types we've specialized for, with
+	// None for arguments which aren't specialized on.
+	auto specializations = PyList_New(0);
+	if (!PyJit_SetItem(dict, "specializations", specializations)) {
+		return false;
+	}
+	for (size_t i = 0; i <= jitted->j_optimized.size(); i++) {
+		auto node = i < jitted->j_optimized.size() ? jitted->j_optimized[i] : jitted->j_megamorphic;
+		if (node == nullptr) {
+			break;
+		}
+
+		auto types = PyTuple_New(node->types.size());
+		if (types == nullptr) {
+			return false;
+		}
+		for (size_t j = 0; j < node->types.size(); j++) {
+			auto type = node->types[j] == nullptr ? Py_None : (PyObject*)node->types[j];
+			Py_INCREF(type);
+			PyTuple_SET_ITEM(types, j, type);
+		}
+		auto entry = Py_BuildValue("{sNsKsO}",
+			"types", types,
+			"calls", (unsigned long long)node->calls,
+			"compiled", node->jittedCode != nullptr ? Py_True : Py_False);
+		if (entry == nullptr || PyList_Append(specializations, entry) != 0) {
+			Py_XDECREF(entry);
+			return false;
+		}
+		Py_DECREF(entry);
+	}
+#endif
+	return true;
+}
+
 static PyObject *pyjion_info(PyObject *self, PyObject* func) {
 	PyObject* code;
 	if (PyFunction_Check(func)) {
@@ -635,23 +1683,94 @@ static PyObject *pyjion_info(PyObject *self, PyObject* func) {
 		PyErr_SetString(PyExc_TypeError, "Expected function or code");
 		return nullptr;
 	}
+	PyjionJittedCode* jitted = PyJit_EnsureExtra(code);
+	if (jitted == nullptr) {
+		PyErr_SetString(PyExc_RuntimeError, "Can't store jitted code on the code object");
+		return nullptr;
+	}
+
 	auto res = PyDict_New();
 	if (res == nullptr) {
 		return nullptr;
 	}
 
-	PyjionJittedCode* jitted = PyJit_EnsureExtra(code);
-
 	PyDict_SetItemString(res, "failed", jitted->j_failed ? Py_True : Py_False);
 	PyDict_SetItemString(res, "compiled", jitted->j_evalfunc != nullptr ? Py_True : Py_False);
 	
 	auto runCount = PyLong_FromLongLong(jitted->j_run_count);
 	PyDict_SetItemString(res, "run_count", runCount);
 	Py_DECREF(runCount);
+
+	auto codeSize = PyLong_FromSize_t(jitted->j_code_size);
+	PyDict_SetItemString(res, "code_size", codeSize);
+	Py_DECREF(codeSize);
+
+	if (!PyJit_AddStats(res, jitted->j_stats, jitted->j_compiles, jitted->j_compile_failures) ||
+		!PyJit_AddCounters(res, jitted)) {
+		Py_DECREF(res);
+		return nullptr;
+	}
 	
 	return res;
 }
 
+// Gets the state for the interpreter the module a function belongs to was
+// imported into.
+static PyjionInterpState* PyJit_GetModuleState(PyObject* module) {
+	return *(PyjionInterpState**)PyModule_GetState(module);
+}
+
+static PyObject *pyjion_dump_stats(PyObject *self, PyObject* args) {
+	// Report the functions which could most use being jitted first
+	auto state = PyJit_GetModuleState(self);
+	vector<PyjionJittedCode*> functions;
+	for (auto cur = state->allCode.begin(); cur != state->allCode.end(); cur++) {
+		auto& counters = (*cur)->j_counters;
+		if (counters.jitted != 0 || counters.interpreted != 0 || counters.traced != 0) {
+			functions.push_back(*cur);
+		}
+	}
+	sort(functions.begin(), functions.end(), [](PyjionJittedCode* a, PyjionJittedCode* b) {
+		return a->j_counters.interpretedTime > b->j_counters.interpretedTime;
+	});
+
+	auto res = PyList_New(0);
+	if (res == nullptr) {
+		return nullptr;
+	}
+	for (auto cur = functions.begin(); cur != functions.end(); cur++) {
+		auto code = (PyCodeObject*)(*cur)->j_code;
+		auto entry = Py_BuildValue("{sOsOsi}",
+			"name", code->co_name,
+			"filename", code->co_filename,
+			"line", code->co_firstlineno);
+		if (entry == nullptr ||
+			!PyJit_AddStats(entry, (*cur)->j_stats, (*cur)->j_compiles, (*cur)->j_compile_failures) ||
+			!PyJit_AddCounters(entry, *cur) ||
+			PyList_Append(res, entry) != 0) {
+			Py_XDECREF(entry);
+			Py_DECREF(res);
+			return nullptr;
+		}
+		Py_DECREF(entry);
+	}
+	return res;
+}
+
+static PyObject *pyjion_stats(PyObject *self, PyObject* args) {
+	auto res = PyDict_New();
+	if (res == nullptr) {
+		return nullptr;
+	}
+
+	auto state = PyJit_GetModuleState(self);
+	if (!PyJit_AddStats(res, state->compileStats, state->compiles, state->compileFailures)) {
+		Py_DECREF(res);
+		return nullptr;
+	}
+	return res;
+}
+
 static PyObject *pyjion_set_threshold(PyObject *self, PyObject* args) {
 	if (!PyLong_Check(args)) {
 		PyErr_SetString(PyExc_TypeError, "Expected int for new threshold");
@@ -664,13 +1783,181 @@ static PyObject *pyjion_set_threshold(PyObject *self, PyObject* args) {
 		return nullptr;
 	}
 
-	auto prev = PyLong_FromLongLong(HOT_CODE);
-	HOT_CODE = PyLong_AsLongLong(args);
+	auto state = PyJit_GetModuleState(self);
+	auto prev = PyLong_FromLongLong(state->hotCode);
+	state->hotCode = newValue;
 	return prev;
 }
 
 static PyObject *pyjion_get_threshold(PyObject *self, PyObject* args) {
-	return PyLong_FromLongLong(HOT_CODE);
+	return PyLong_FromLongLong(PyJit_GetModuleState(self)->hotCode);
+}
+
+static PyObject *pyjion_set_optimize_threshold(PyObject *self, PyObject* args) {
+	if (!PyLong_Check(args)) {
+		PyErr_SetString(PyExc_TypeError, "Expected int for new threshold");
+		return nullptr;
+	}
+
+	auto newValue = PyLong_AsLongLong(args);
+	if (newValue == -1 && PyErr_Occurred()) {
+		return nullptr;
+	}
+	if (newValue < 0) {
+		PyErr_SetString(PyExc_ValueError, "Expected positive threshold");
+		return nullptr;
+	}
+
+	auto state = PyJit_GetModuleState(self);
+	auto prev = PyLong_FromLongLong(state->optimizeCode);
+	state->optimizeCode = newValue;
+	return prev;
+}
+
+static PyObject *pyjion_get_optimize_threshold(PyObject *self, PyObject* args) {
+	return PyLong_FromLongLong(PyJit_GetModuleState(self)->optimizeCode);
+}
+
+static PyObject *pyjion_set_osr_threshold(PyObject *self, PyObject* args) {
+	if (!PyLong_Check(args)) {
+		PyErr_SetString(PyExc_TypeError, "Expected int for new threshold");
+		return nullptr;
+	}
+
+	auto newValue = PyLong_AsLongLong(args);
+	if (newValue == -1 && PyErr_Occurred()) {
+		return nullptr;
+	}
+	if (newValue < 0) {
+		PyErr_SetString(PyExc_ValueError, "Expected positive threshold");
+		return nullptr;
+	}
+
+	auto state = PyJit_GetModuleState(self);
+	auto prev = PyLong_FromLongLong(state->osrThreshold);
+	state->osrThreshold = newValue;
+	return prev;
+}
+
+static PyObject *pyjion_get_osr_threshold(PyObject *self, PyObject* args) {
+	return PyLong_FromLongLong(PyJit_GetModuleState(self)->osrThreshold);
+}
+
+static PyObject *pyjion_set_code_budget(PyObject *self, PyObject* args) {
+	if (!PyLong_Check(args)) {
+		PyErr_SetString(PyExc_TypeError, "Expected int for new code budget");
+		return nullptr;
+	}
+
+	auto newValue = PyLong_AsLongLong(args);
+	if (newValue == -1 && PyErr_Occurred()) {
+		return nullptr;
+	}
+	if (newValue < 0) {
+		PyErr_SetString(PyExc_ValueError, "Expected positive code budget");
+		return nullptr;
+	}
+
+	auto state = PyJit_GetModuleState(self);
+	auto prev = PyLong_FromSize_t(state->codeBudget);
+	state->codeBudget = (size_t)newValue;
+	PyJit_EnforceCodeBudget(state, nullptr);
+	return prev;
+}
+
+static PyObject *pyjion_get_code_budget(PyObject *self, PyObject* args) {
+	return PyLong_FromSize_t(PyJit_GetModuleState(self)->codeBudget);
+}
+
+static PyObject *pyjion_set_background_compile(PyObject *self, PyObject* args) {
+	auto enable = PyObject_IsTrue(args);
+	if (enable == -1) {
+		return nullptr;
+	}
+
+	auto prev = g_backgroundCompile;
+	if (enable) {
+		if (!PyJit_StartCompilerThread()) {
+			return nullptr;
+		}
+		g_backgroundCompile = true;
+	}
+	else {
+		PyJit_StopCompilerThread();
+	}
+	return PyBool_FromLong(prev);
+}
+
+static PyObject *pyjion_set_code_cache(PyObject *self, PyObject* args) {
+	const char* dir = "";
+	if (args != Py_None) {
+		if (!PyUnicode_Check(args)) {
+			PyErr_SetString(PyExc_TypeError, "Expected str or None for the code cache directory");
+			return nullptr;
+		}
+		dir = PyUnicode_AsUTF8(args);
+		if (dir == nullptr) {
+			return nullptr;
+		}
+	}
+
+	if (!PyJit_SetCodeCache(dir)) {
+		PyErr_Format(PyExc_ValueError, "Can't use %s as the code cache directory", dir);
+		return nullptr;
+	}
+	Py_RETURN_NONE;
+}
+
+static PyObject *pyjion_get_code_cache(PyObject *self, PyObject* args) {
+	if (!g_codeCache.enabled()) {
+		Py_RETURN_NONE;
+	}
+	return PyUnicode_FromString(g_codeCache.get_dir().c_str());
+}
+
+static PyObject *pyjion_code_heap(PyObject *self, PyObject* args) {
+	PyjitCodeHeapStats stats;
+	pyjit_code_heap_stats(&stats);
+
+	auto res = PyDict_New();
+	if (res == nullptr) {
+		return nullptr;
+	}
+
+	const char* names[] = { "reserved", "committed", "in_use", "blocks", "regions" };
+	size_t values[] = { stats.reserved, stats.committed, stats.in_use, stats.blocks, stats.regions };
+	for (size_t i = 0; i < sizeof(values) / sizeof(values[0]); i++) {
+		auto value = PyLong_FromSize_t(values[i]);
+		if (value == nullptr || PyDict_SetItemString(res, names[i], value) != 0) {
+			Py_XDECREF(value);
+			Py_DECREF(res);
+			return nullptr;
+		}
+		Py_DECREF(value);
+	}
+	return res;
+}
+
+static PyObject *pyjion_enable_perf_map(PyObject *self, PyObject* args) {
+	auto prev = pyjit_perf_enable(PYJIT_PERF_MAP);
+	if (!(pyjit_perf_enabled() & PYJIT_PERF_MAP)) {
+		PyErr_SetString(PyExc_OSError, "Can't create the perf map");
+		return nullptr;
+	}
+	return PyBool_FromLong(prev & PYJIT_PERF_MAP);
+}
+
+static PyObject *pyjion_enable_gdb_jit(PyObject *self, PyObject* args) {
+	auto prev = pyjit_perf_enable(PYJIT_GDB_JIT);
+	return PyBool_FromLong(prev & PYJIT_GDB_JIT);
+}
+
+static PyObject *pyjion_set_frame_pointers(PyObject *self, PyObject* args) {
+	auto enable = PyObject_IsTrue(args);
+	if (enable == -1) {
+		return nullptr;
+	}
+	return PyBool_FromLong(pyjit_set_frame_pointers(enable));
 }
 
 static PyMethodDef PyjionMethods[] = {
@@ -698,6 +1985,18 @@ static PyMethodDef PyjionMethods[] = {
 		METH_O,
 		"Returns a dictionary describing information about a function or code objects current JIT status."
 	},
+	{
+		"stats",
+		pyjion_stats,
+		METH_NOARGS,
+		"Returns a dictionary of the time spent in each phase of compilation and the sizes of the code produced, summed over all compiles."
+	},
+	{
+		"dump_stats",
+		pyjion_dump_stats,
+		METH_NOARGS,
+		"Returns a list with the information pyjion.info() gives for every function which has been called, along with its name, filename and line, sorted by the time spent running it in the interpreter."
+	},
 	{
 		"set_threshold",
 		pyjion_set_threshold,
@@ -710,24 +2009,172 @@ static PyMethodDef PyjionMethods[] = {
 		METH_O,
 		"Gets the number of times a method needs to be executed before the JIT is triggered."
 	},
+	{
+		"set_optimize_threshold",
+		pyjion_set_optimize_threshold,
+		METH_O,
+		"Sets the number of times a method needs to be executed before its baseline code is replaced with optimized code.  0 disables the baseline tier."
+	},
+	{
+		"get_optimize_threshold",
+		pyjion_get_optimize_threshold,
+		METH_NOARGS,
+		"Gets the number of times a method needs to be executed before its baseline code is replaced with optimized code."
+	},
+	{
+		"set_osr_threshold",
+		pyjion_set_osr_threshold,
+		METH_O,
+		"Sets the number of loop iterations after which a frame running in the interpreter is moved into jitted code.  0 disables it.  Frames are watched with a trace function until then, which slows down the interpreter while they're running."
+	},
+	{
+		"get_osr_threshold",
+		pyjion_get_osr_threshold,
+		METH_NOARGS,
+		"Gets the number of loop iterations after which a frame running in the interpreter is moved into jitted code."
+	},
+	{
+		"set_code_budget",
+		pyjion_set_code_budget,
+		METH_O,
+		"Sets the maximum number of bytes of jitted code to keep alive, evicting the least recently used code when it's exceeded.  0 disables the limit."
+	},
+	{
+		"get_code_budget",
+		pyjion_get_code_budget,
+		METH_NOARGS,
+		"Gets the maximum number of bytes of jitted code to keep alive, 0 if there's no limit."
+	},
+	{
+		"set_background_compile",
+		pyjion_set_background_compile,
+		METH_O,
+		"Enables or disables compiling hot functions to native code on a background thread.  Returns the previous setting."
+	},
+	{
+		"set_code_cache",
+		pyjion_set_code_cache,
+		METH_O,
+		"Sets the directory used to share which functions can't be compiled between processes, or None to disable it."
+	},
+	{
+		"get_code_cache",
+		pyjion_get_code_cache,
+		METH_NOARGS,
+		"Gets the directory used to share which functions can't be compiled between processes, or None if it's disabled."
+	},
+	{
+		"code_heap",
+		pyjion_code_heap,
+		METH_NOARGS,
+		"Returns a dictionary describing how much memory the JIT has reserved and is using for jitted code."
+	},
+	{
+		"enable_perf_map",
+		pyjion_enable_perf_map,
+		METH_NOARGS,
+		"Writes the address and name of each function compiled from now on to /tmp/perf-<pid>.map for perf.  Returns True if it was already enabled."
+	},
+	{
+		"enable_gdb_jit",
+		pyjion_enable_gdb_jit,
+		METH_NOARGS,
+		"Registers each function compiled from now on, with its line numbers, with gdb's JIT interface.  Returns True if it was already enabled."
+	},
+	{
+		"set_frame_pointers",
+		pyjion_set_frame_pointers,
+		METH_O,
+		"Sets if functions are compiled with a frame pointer chain, so profilers can unwind jitted frames without unwind tables.  Returns the previous setting."
+	},
 	{NULL, NULL, 0, NULL}        /* Sentinel */
 };
 
+static void pyjion_free(void* module) {
+	auto state = (PyjionInterpState**)PyModule_GetState((PyObject*)module);
+	if (state != nullptr && *state != nullptr) {
+		(*state)->release();
+		*state = nullptr;
+	}
+}
+
 static struct PyModuleDef pyjionmodule = {
 	PyModuleDef_HEAD_INIT,
 	"pyjion",   /* name of module */
 	"Pyjion - A Just-in-Time Compiler for CPython 3.6.x", /* module documentation, may be NULL */
-	-1,       /* size of per-interpreter state of the module,
+	sizeof(PyjionInterpState*),       /* size of per-interpreter state of the module,
 			  or -1 if the module keeps state in global variables. */
-	PyjionMethods
+	PyjionMethods,
+	nullptr,
+	nullptr,
+	nullptr,
+	pyjion_free
 }; 
 
+// The module is initialized again in each interpreter which imports it, and the
+// instance in an interpreter's module table owns the interpreter's state.
+DLL_EXPORT PyjionInterpState* PyJit_GetInterpState() {
+	auto module = PyState_FindModule(&pyjionmodule);
+	if (module == nullptr) {
+		return nullptr;
+	}
+	return PyJit_GetModuleState(module);
+}
+
+DLL_EXPORT PyObject* PyJit_GetModule() {
+	return PyState_FindModule(&pyjionmodule);
+}
+
+// Creates a module object for the current interpreter, sharing the interpreter's
+// state if it already has one.
+static PyObject* PyJit_CreateModule() {
+	PyJit_InitProcess();
+
+	auto state = PyJit_GetInterpState();
+	if (state != nullptr) {
+		state->add_ref();
+	}
+	else {
+		auto extraIndex = _PyEval_RequestCodeExtraIndex(PyjionJitFree);
+		if (extraIndex < 0) {
+			PyErr_SetString(PyExc_RuntimeError, "No room to store jitted code on code objects");
+			return nullptr;
+		}
+		state = new PyjionInterpState(extraIndex);
+	}
+
+	auto module = PyModule_Create(&pyjionmodule);
+	if (module == nullptr) {
+		state->release();
+		return nullptr;
+	}
+	*(PyjionInterpState**)PyModule_GetState(module) = state;
+	return module;
+}
+
+// Sets up the JIT in the current interpreter for embedders (like the tests) which
+// don't import the module.
+extern "C" DLL_EXPORT void JitInit() {
+	if (PyJit_GetInterpState() != nullptr) {
+		return;
+	}
+
+	auto module = PyJit_CreateModule();
+	if (module == nullptr || PyState_AddModule(module, &pyjionmodule) != 0) {
+		PyErr_Clear();
+	}
+	Py_XDECREF(module);
+}
+
 PyMODINIT_FUNC PyInit_pyjion(void)
 {
+	auto module = PyJit_CreateModule();
+	if (module == nullptr) {
+		return nullptr;
+	}
+
 	// Install our frame evaluation function
-	JitInit();
 	auto ts = PyThreadState_Get();
 	ts->interp->eval_frame = PyJit_EvalFrame;
-
-	return PyModule_Create(&pyjionmodule);
+	return module;
 }
@@ -42,13 +42,33 @@
 
 #include <vector>
 #include <unordered_map>
+#include <unordered_set>
+#include <atomic>
+
+#include "ipycomp.h"
+#include "pubarray.h"
 
 
  //#define NO_TRACE
  //#define TRACE_TREE
+ //#define NO_DISPATCH_COUNTERS
+
+// Bumps one of the counters describing how calls were dispatched, which are
+// reported by pyjion.info() and pyjion.dump_stats().
+#ifndef NO_DISPATCH_COUNTERS
+#define PYJIT_COUNT(counter) ((counter)++)
+#else
+#define PYJIT_COUNT(counter)
+#endif
 
 struct SpecializedTreeNode;
 class PyjionJittedCode;
+class JittedCode;
+struct OsrState;
+struct CompileRequest;
+struct GlobalCache;
+struct AttrCache;
+struct CallCache;
 
 #ifndef PLATFORM_UNIX
 #define DLL_EXPORT __declspec(dllexport)
@@ -63,41 +83,333 @@ extern "C" DLL_EXPORT PyjionJittedCode* PyJit_EnsureExtra(PyObject* codeObject);
 class PyjionJittedCode;
 typedef PyObject* (*Py_EvalFunc)(PyjionJittedCode*, struct _frame*);
 
-static PY_UINT64_T HOT_CODE = 0;
+// The number of sets of argument types we'll compile specializations for before
+// everything else shares a single unspecialized body.
+#define MAX_TRACE 5
+
+// Number of calls after a failed compile before the function is compiled again,
+// which doubles for each retry.
+#define COMPILE_RETRY_CALLS 64
+#define MAX_COMPILE_RETRIES 5
 
 void PyjionJitFree(void* obj);
 
+// The JIT's settings and totals for one interpreter.  Each interpreter gets its
+// own, owned by its instance of the pyjion module, and every function we track
+// holds a reference to the state it was created in so the state outlives the
+// module during interpreter shutdown.  Everything except the reference count is
+// protected by the GIL.
+struct PyjionInterpState {
+	std::atomic<int> refs;
+	// The co_extra index our data is stored under, which is allocated per interpreter
+	Py_ssize_t extraIndex;
+	// Number of calls before a function is compiled
+	PY_UINT64_T hotCode;
+	// Number of calls after which a specialization running baseline code is
+	// recompiled with full optimization.  0 disables the baseline tier.
+	PY_UINT64_T optimizeCode;
+	// Number of times the loops in a frame running in the interpreter need to go
+	// around before we move the frame into jitted code.  0 disables it.
+	PY_UINT64_T osrThreshold;
+	// The maximum number of bytes of jitted code we'll keep alive, or 0 for no
+	// limit, and the number of bytes currently alive.  Once we go over the budget
+	// the least recently used functions have their code freed.
+	size_t codeBudget;
+	size_t codeSize;
+	// Ticks each time we dispatch to jitted code, used for the last used accounting.
+	PY_UINT64_T useClock;
+	// All of the functions which currently own jitted code.
+	std::unordered_set<PyjionJittedCode*> compiledCode;
+	// Every function we're tracking, reported by pyjion.dump_stats().
+	std::unordered_set<PyjionJittedCode*> allCode;
+	// Measurements accumulated over every successful compile, and the number of
+	// compiles attempted and failed, reported by pyjion.stats().
+	CompileStats compileStats;
+	int compiles;
+	int compileFailures;
+
+	PyjionInterpState(Py_ssize_t extraIndex) : refs(1), extraIndex(extraIndex) {
+		hotCode = 0;
+		optimizeCode = 0;
+		osrThreshold = 0;
+		codeBudget = 0;
+		codeSize = 0;
+		useClock = 0;
+		compiles = 0;
+		compileFailures = 0;
+	}
+
+	void add_ref() {
+		refs++;
+	}
+
+	void release() {
+		if (--refs == 0) {
+			delete this;
+		}
+	}
+};
+
+// Gets the state for the current thread's interpreter, or null if the JIT hasn't
+// been set up in it.
+DLL_EXPORT PyjionInterpState* PyJit_GetInterpState();
+
+// Gets a borrowed reference to the pyjion module of the current thread's
+// interpreter, or null if the JIT hasn't been set up in it.
+DLL_EXPORT PyObject* PyJit_GetModule();
+
 /* Jitted code object.  This object is returned from the JIT implementation.  The JIT can allocate
 a jitted code object and fill in the state for which is necessary for it to perform an evaluation. */
 
+// How calls to a function have been dispatched.
+struct DispatchCounters {
+	// Calls which ran jitted code
+	PY_UINT64_T jitted;
+	// Calls whose argument types didn't match any of the specializations
+	PY_UINT64_T traceMisses;
+	// Calls which got the shared unspecialized body as there were already MAX_TRACE
+	// specializations
+	PY_UINT64_T megamorphic;
+	// Calls which ran in the interpreter, those which did because a trace function
+	// was set, and the time spent in the interpreter excluding any interpreted
+	// functions called from it.
+	PY_UINT64_T interpreted;
+	PY_UINT64_T traced;
+	PY_UINT64_T interpretedTime;
+	// Calls which handed the frame over to the interpreter at an instruction the
+	// compiled code couldn't run
+	PY_UINT64_T sideExits;
+	// Calls from jitted code which ran the code cached at the call site, skipping
+	// the normal dispatch
+	PY_UINT64_T direct;
+
+	DispatchCounters() : jitted(0), traceMisses(0), megamorphic(0), interpreted(0), traced(0), interpretedTime(0),
+		sideExits(0), direct(0) {
+	}
+};
+
+// Gets the type we'll specialize an argument on, or null if we don't specialize on
+// the argument's type.
+PyTypeObject* GetArgType(int arg, PyObject** locals);
+
+// Tracks types for a function call.  Each argument has a SpecializedTreeNode with
+// children for the subsequent arguments.  When we get to the leaves of the tree
+// we'll have a jitted code object & optimized evalutation function optimized
+// for those arguments.  
+struct SpecializedTreeNode {
+#ifdef TRACE_TREE
+	std::vector<std::pair<PyTypeObject*, SpecializedTreeNode*>> children;
+#else
+	// The exact type of each argument, or null for arguments we don't specialize
+	// on.  User defined types are also guarded by their version tag, which changes
+	// when the class is modified.
+	std::vector<PyTypeObject*> types;
+	std::vector<unsigned int> versionTags;
+#endif
+	// Dispatch reads this without a lock, so jittedCode is always filled in first
+	std::atomic<Py_EvalFunc> addr;
+	JittedCode* jittedCode;
+	PY_UINT64_T hitCount;
+	// Calls whose arguments matched the node, however they were run
+	PY_UINT64_T calls;
+	// Non-null while the code is being compiled on the background thread
+	CompileRequest* pending;
+
+#ifdef TRACE_TREE
+	SpecializedTreeNode() {
+#else
+	SpecializedTreeNode(std::vector<PyTypeObject*>& types) : types(types) {
+		for (auto cur = types.begin(); cur != types.end(); cur++) {
+			unsigned int versionTag = 0;
+			if (*cur != nullptr) {
+				if (PyType_HasFeature(*cur, Py_TPFLAGS_HEAPTYPE)) {
+					versionTag = (*cur)->tp_version_tag;
+				}
+				// Keep the type alive so its address can't be reused by another type
+				Py_INCREF(*cur);
+			}
+			versionTags.push_back(versionTag);
+		}
+#endif
+		addr = nullptr;
+		jittedCode = nullptr;
+		hitCount = 0;
+		calls = 0;
+		pending = nullptr;
+	}
+
+#ifdef TRACE_TREE
+	SpecializedTreeNode* getNextNode(PyTypeObject* type) {
+		for (auto cur = children.begin(); cur != children.end(); cur++) {
+			if (cur->first == type) {
+				return cur->second;
+			}
+		}
+
+		auto res = new SpecializedTreeNode();
+		children.push_back(std::pair<PyTypeObject*, SpecializedTreeNode*>(type, res));
+		return res;
+	}
+#endif
+
+#ifndef TRACE_TREE
+	// Checks if the arguments of a frame have the types we were specialized for.
+	bool matches(PyObject** locals) {
+		for (size_t i = 0; i < types.size(); i++) {
+			auto type = types[i];
+			if (type == nullptr) {
+				if (GetArgType((int)i, locals) != nullptr) {
+					return false;
+				}
+			}
+			else if (locals[i] == nullptr || Py_TYPE(locals[i]) != type ||
+				(versionTags[i] != 0 && (type->tp_version_tag != versionTags[i] ||
+					!PyType_HasFeature(type, Py_TPFLAGS_VALID_VERSION_TAG)))) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	// Checks if we could use one of the argument types to produce better code.
+	bool has_unboxable_types() {
+		for (auto cur = types.begin(); cur != types.end(); cur++) {
+			if (*cur == &PyLong_Type || *cur == &PyFloat_Type) {
+				return true;
+			}
+		}
+		return false;
+	}
+#endif
+
+	~SpecializedTreeNode() {
+		delete jittedCode;
+#ifdef TRACE_TREE
+		for (auto cur = children.begin(); cur != children.end(); cur++) {
+			delete cur->second;
+		}
+#else
+		for (auto cur = types.begin(); cur != types.end(); cur++) {
+			Py_XDECREF(*cur);
+		}
+#endif
+	}
+};
+
 class PyjionJittedCode {
 public:
 	PY_UINT64_T j_run_count;
+	// Set when compiling has failed, until j_retry_countdown more calls have
+	// been made (or forever if it's 0).  j_retries is how many times it's failed.
 	bool j_failed;
+	PY_UINT64_T j_retry_countdown;
+	int j_retries;
 	Py_EvalFunc j_evalfunc;
 	PY_UINT64_T j_specialization_threshold;
+	PY_UINT64_T j_optimize_threshold;
 	PyObject* j_code;
+	PyjionInterpState* j_state;
 #ifdef TRACE_TREE
 	SpecializedTreeNode* funcs;
 #else
-	std::vector<SpecializedTreeNode*> j_optimized;
+	// Dispatch searches these without taking a lock while other threads can be
+	// adding to them.
+	PublishedArray<SpecializedTreeNode, MAX_TRACE> j_optimized;
+	// Shared by every call once we've run out of room for specializations.
+	SpecializedTreeNode* j_megamorphic;
 #endif
 	Py_EvalFunc j_generic;
+	// Unoptimized code shared by all specializations until they're hot enough to
+	// be optimized.  It's kept until the function is evicted as frames may still
+	// be running it.
+	Py_EvalFunc j_baseline;
+	JittedCode* j_baseline_code;
+	// Loop heads and code for moving frames running in the interpreter into
+	// jitted code, created the first time the function is interpreted.
+	OsrState* j_osr;
+	// Caches for LOAD_GLOBAL indexed by name, shared by all of the compiled code.
+	GlobalCache* j_global_caches;
+	// Caches for attribute access indexed by instruction, also shared.
+	AttrCache* j_attr_caches;
+	// Caches for calls made by the compiled code, indexed by instruction.
+	CallCache* j_call_caches;
+	// References to the code of functions inlined into any of the compiled code,
+	// which the inlining guards compare against.
+	std::vector<PyObject*> j_inlined_code;
+	// Value of the use clock the last time any jitted code for this function ran,
+	// used to pick what to evict when we're over the code budget.
+	PY_UINT64_T j_last_used;
+	// Number of invocations of jitted code for this function currently on the stack
+	// (or compiles in progress), code can't be evicted while it's in use.
+	int j_executing;
+	// Bytes of native code owned by all of the compiled specializations.
+	size_t j_code_size;
+	// Measurements accumulated over every successful compile of the function, along
+	// with how many compiles were attempted and how many failed.
+	CompileStats j_stats;
+	int j_compiles;
+	int j_compile_failures;
+	// Why the last failed compile failed, and the opcode responsible or -1
+	const char* j_fail_reason;
+	int j_fail_opcode;
+	DispatchCounters j_counters;
+	// Number of times each guard in the compiled code has failed, indexed by the
+	// instruction the guard follows.  Guards which keep failing are left out when
+	// the function is recompiled.
+	std::unordered_map<int, int> j_deopts;
+	// Set when a guard has failed too often, the code is evicted the next time
+	// nothing is running it.
+	bool j_invalidated;
+	// Set while a thread is compiling the function inline.  Compiling can run
+	// Python code which lets other threads in, they keep running whatever code
+	// we've already got rather than compiling the same thing again.
+	std::atomic<bool> j_compiling;
 
-	PyjionJittedCode(PyObject* code) {
+	PyjionJittedCode(PyObject* code, PyjionInterpState* state) : j_compiling(false) {
 		j_code = code;
+		j_state = state;
+		state->add_ref();
 		j_run_count = 0;
 		j_failed = false;
+		j_retry_countdown = 0;
+		j_retries = 0;
 		j_evalfunc = nullptr;
-		j_specialization_threshold = HOT_CODE;
+		j_specialization_threshold = state->hotCode;
+		j_optimize_threshold = state->optimizeCode;
 #ifdef TRACE_TREE
 		funcs = new SpecializedTreeNode();
+#else
+		j_megamorphic = nullptr;
 #endif
 		j_generic = nullptr;
+		j_baseline = nullptr;
+		j_baseline_code = nullptr;
+		j_osr = nullptr;
+		j_global_caches = nullptr;
+		j_attr_caches = nullptr;
+		j_call_caches = nullptr;
+		j_last_used = 0;
+		j_executing = 0;
+		j_code_size = 0;
+		j_compiles = 0;
+		j_compile_failures = 0;
+		j_fail_reason = nullptr;
+		j_fail_opcode = -1;
+		j_invalidated = false;
 	}
 
 	~PyjionJittedCode();
 };
 DLL_EXPORT bool jit_compile(PyCodeObject* code);
 
+// Gets the factory for the compiler which produces jitted code, for driving an
+// AbstractInterpreter directly.
+DLL_EXPORT CompilerFactory* PyJit_GetCompilerFactory();
+
+// Sets the directory of the code cache, where the functions which can't be
+// compiled are recorded for other processes, or disables it if dir is empty,
+// like set_code_cache.  No native code is stored, see codecache.h.  Returns
+// false if it can't be used.
+DLL_EXPORT bool PyJit_SetCodeCache(const char* dir);
+
 #endif
\ No newline at end of file
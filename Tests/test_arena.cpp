@@ -0,0 +1,85 @@
+/*
+* The MIT License (MIT)
+*
+* Copyright (c) Microsoft Corporation
+*
+* Permission is hereby granted, free of charge, to any person obtaining a
+* copy of this software and associated documentation files (the "Software"),
+* to deal in the Software without restriction, including without limitation
+* the rights to use, copy, modify, merge, publish, distribute, sublicense,
+* and/or sell copies of the Software, and to permit persons to whom the
+* Software is furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included
+* in all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+* OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+* THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+* OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+* ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+* OTHER DEALINGS IN THE SOFTWARE.
+*
+*/
+
+/**
+  Test the compile arena and the abstract source sets allocated from it.
+*/
+
+#include "stdafx.h"
+#include "catch.hpp"
+#include <cstring>
+#include <arena.h>
+#include <absvalue.h>
+
+TEST_CASE("Arena allocation", "[arena]") {
+    SECTION("allocations are aligned and share blocks") {
+        Arena arena;
+        auto one = arena.allocate(3, 1);
+        auto two = arena.allocate(sizeof(double), alignof(double));
+        CHECK(((uintptr_t)two % alignof(double)) == 0);
+        CHECK((char*)two > (char*)one);
+        CHECK(arena.allocations() == 2);
+        CHECK(arena.block_count() == 1);
+    }
+
+    SECTION("large allocations get their own block") {
+        Arena arena;
+        arena.allocate(16);
+        auto big = (char*)arena.allocate(64 * 1024);
+        memset(big, 0, 64 * 1024);
+        CHECK(arena.block_count() == 2);
+    }
+}
+
+TEST_CASE("Abstract source sets", "[arena][sources]") {
+    Arena arena;
+    auto one = arena.make<LocalSource>();
+    auto two = arena.make<IntermediateSource>();
+    auto three = arena.make<ConstSource>();
+
+    SECTION("combined sources escape together") {
+        auto combined = AbstractSource::combine(one, two);
+        CHECK(combined->same_set(one));
+        CHECK(combined->same_set(two));
+        CHECK(!three->needs_boxing());
+
+        two->escapes();
+        CHECK(one->needs_boxing());
+        CHECK(!three->needs_boxing());
+    }
+
+    SECTION("escaping is kept when combining") {
+        three->escapes();
+        AbstractSource::combine(one, AbstractSource::combine(two, three));
+        CHECK(one->needs_boxing());
+        CHECK(one->same_set(three));
+    }
+
+    SECTION("combining with an unknown source escapes") {
+        AbstractSource::combine(one, nullptr);
+        CHECK(one->needs_boxing());
+        CHECK(!two->needs_boxing());
+    }
+}
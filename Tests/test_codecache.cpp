@@ -0,0 +1,158 @@
+/*
+* The MIT License (MIT)
+*
+* Copyright (c) Microsoft Corporation
+*
+* Permission is hereby granted, free of charge, to any person obtaining a
+* copy of this software and associated documentation files (the "Software"),
+* to deal in the Software without restriction, including without limitation
+* the rights to use, copy, modify, merge, publish, distribute, sublicense,
+* and/or sell copies of the Software, and to permit persons to whom the
+* Software is furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included
+* in all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+* OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+* THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+* OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+* ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+* OTHER DEALINGS IN THE SOFTWARE.
+*
+*/
+
+/**
+  Test the persistent negative code cache.
+*/
+
+#include "stdafx.h"
+#include "catch.hpp"
+#include "testing_util.h"
+#include <codecache.h>
+#include <util.h>
+
+static PY_UINT64_T cache_key(const char* code, std::vector<PyTypeObject*> types = std::vector<PyTypeObject*>()) {
+    auto codeObj = CompileCode(code);
+    PY_UINT64_T key = 0;
+    REQUIRE(CodeCache::get_key(codeObj, types, key));
+    Py_DECREF(codeObj);
+    return key;
+}
+
+TEST_CASE("Code cache keys", "[codecache]") {
+    SECTION("identical code has the same key") {
+        CHECK(cache_key("def f():\n    return 1") == cache_key("def f():\n    return 1"));
+    }
+
+    SECTION("different constants have different keys") {
+        CHECK(cache_key("def f():\n    return 1") != cache_key("def f():\n    return 2"));
+        CHECK(cache_key("def f():\n    return 1") != cache_key("def f():\n    return 1.0"));
+    }
+
+    SECTION("different names have different keys") {
+        CHECK(cache_key("def f():\n    return x") != cache_key("def f():\n    return y"));
+    }
+
+    SECTION("specializations have different keys") {
+        std::vector<PyTypeObject*> intType{ &PyLong_Type };
+        std::vector<PyTypeObject*> floatType{ &PyFloat_Type };
+        CHECK(cache_key("def f(x):\n    return x", intType) != cache_key("def f(x):\n    return x", floatType));
+        CHECK(cache_key("def f(x):\n    return x", intType) != cache_key("def f(x):\n    return x"));
+    }
+}
+
+// A cache in a new temporary directory, which is removed along with its entries
+// when it goes away.
+class TempCodeCache {
+    PyObject_ptr m_dir;
+
+public:
+    CodeCache cache;
+
+    TempCodeCache() : m_dir(nullptr) {
+        auto tempfile = PyObject_ptr(PyImport_ImportModule("tempfile"));
+        REQUIRE(tempfile.get() != nullptr);
+        m_dir.reset(PyObject_CallMethod(tempfile.get(), "mkdtemp", nullptr));
+        REQUIRE(m_dir.get() != nullptr);
+        REQUIRE(cache.set_dir(dir()));
+    }
+
+    ~TempCodeCache() {
+        auto shutil = PyObject_ptr(PyImport_ImportModule("shutil"));
+        auto res = PyObject_ptr(PyObject_CallMethod(shutil.get(), "rmtree", "O", m_dir.get()));
+        if (res.get() == nullptr) {
+            PyErr_Clear();
+        }
+    }
+
+    const char* dir() {
+        return PyUnicode_AsUTF8(m_dir.get());
+    }
+
+    // The names of the files in the directory
+    std::vector<std::string> files() {
+        auto os = PyObject_ptr(PyImport_ImportModule("os"));
+        auto names = PyObject_ptr(PyObject_CallMethod(os.get(), "listdir", "O", m_dir.get()));
+        REQUIRE(names.get() != nullptr);
+        std::vector<std::string> res;
+        for (Py_ssize_t i = 0; i < PyList_GET_SIZE(names.get()); i++) {
+            res.push_back(PyUnicode_AsUTF8(PyList_GET_ITEM(names.get(), i)));
+        }
+        return res;
+    }
+};
+
+TEST_CASE("Code cache entries", "[codecache]") {
+    auto code = CompileCode("def f():\n    return 1");
+    std::vector<PyTypeObject*> types;
+    PY_UINT64_T key = 0, otherKey = 0;
+    REQUIRE(CodeCache::get_key(code, types, key));
+    std::vector<PyTypeObject*> intType{ &PyLong_Type };
+    REQUIRE(CodeCache::get_key(code, intType, otherKey));
+
+    SECTION("failures are visible to other caches using the directory") {
+        TempCodeCache temp;
+        CHECK(!temp.cache.is_known_failure(key));
+        temp.cache.record_failure(key, code);
+        CHECK(temp.cache.is_known_failure(key));
+        CHECK(!temp.cache.is_known_failure(otherKey));
+
+        CodeCache other;
+        REQUIRE(other.set_dir(temp.dir()));
+        CHECK(other.is_known_failure(key));
+        CHECK(!other.is_known_failure(otherKey));
+    }
+
+    SECTION("each failure is a single entry") {
+        TempCodeCache temp;
+        temp.cache.record_failure(key, code);
+        temp.cache.record_failure(key, code);
+        auto files = temp.files();
+        REQUIRE(files.size() == 1);
+        CHECK(files[0].size() == 20);
+        CHECK(files[0].substr(16) == ".pjc");
+    }
+
+    SECTION("directories are created") {
+        TempCodeCache temp;
+        auto nested = std::string(temp.dir()) + "/nested";
+        CodeCache other;
+        REQUIRE(other.set_dir(nested.c_str()));
+        other.record_failure(key, code);
+        CHECK(other.is_known_failure(key));
+        CHECK(!temp.cache.is_known_failure(key));
+    }
+
+    SECTION("files can't be used as the directory") {
+        TempCodeCache temp;
+        temp.cache.record_failure(key, code);
+        auto entry = std::string(temp.dir()) + "/" + temp.files()[0];
+        CodeCache other;
+        CHECK(!other.set_dir(entry.c_str()));
+        CHECK(!other.enabled());
+    }
+
+    Py_DECREF(code);
+}
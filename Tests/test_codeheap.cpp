@@ -0,0 +1,142 @@
+/*
+* The MIT License (MIT)
+*
+* Copyright (c) Microsoft Corporation
+*
+* Permission is hereby granted, free of charge, to any person obtaining a
+* copy of this software and associated documentation files (the "Software"),
+* to deal in the Software without restriction, including without limitation
+* the rights to use, copy, modify, merge, publish, distribute, sublicense,
+* and/or sell copies of the Software, and to permit persons to whom the
+* Software is furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included
+* in all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+* OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+* THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+* OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+* ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+* OTHER DEALINGS IN THE SOFTWARE.
+*
+*/
+
+/**
+  Test the executable code heap.
+*/
+
+#include "stdafx.h"
+#include "catch.hpp"
+#include <cstddef>
+#include <cstring>
+#include <vector>
+#include <codeheap.h>
+
+#ifdef PLATFORM_UNIX
+
+typedef int(*ReturnsInt)();
+
+// mov eax, 42; ret
+static const unsigned char g_return42[] = { 0xb8, 42, 0, 0, 0, 0xc3 };
+
+static PyjitCodeHeapStats heap_stats() {
+    PyjitCodeHeapStats stats;
+    pyjit_code_heap_stats(&stats);
+    return stats;
+}
+
+TEST_CASE("Code heap allocation", "[codeheap]") {
+    SECTION("code and data are within rel32 range") {
+        void* data = nullptr;
+        auto code = (char*)pyjit_code_alloc(100, 40, &data);
+        REQUIRE(code != nullptr);
+        REQUIRE(data != nullptr);
+
+        auto delta = code > (char*)data ? code - (char*)data : (char*)data - code;
+        CHECK(delta < 0x7fffffff);
+
+        CHECK(pyjit_code_free(data) == 0);
+        CHECK(pyjit_code_free(code) == 0);
+    }
+
+    SECTION("sealed code is executable") {
+        auto code = pyjit_code_alloc(sizeof(g_return42), 0, nullptr);
+        REQUIRE(code != nullptr);
+        memcpy(code, g_return42, sizeof(g_return42));
+        REQUIRE(pyjit_code_seal(code) == 0);
+
+        CHECK(((ReturnsInt)code)() == 42);
+        CHECK(pyjit_code_free(code) == 0);
+    }
+
+    SECTION("sealed neighbors stay executable") {
+        auto first = pyjit_code_alloc(sizeof(g_return42), 0, nullptr);
+        REQUIRE(first != nullptr);
+        memcpy(first, g_return42, sizeof(g_return42));
+        REQUIRE(pyjit_code_seal(first) == 0);
+        CHECK(((ReturnsInt)first)() == 42);
+
+        // A fresh block is writable while first is still running...
+        auto second = pyjit_code_alloc(sizeof(g_return42), 0, nullptr);
+        REQUIRE(second != nullptr);
+        CHECK(((ReturnsInt)first)() == 42);
+        memcpy(second, g_return42, sizeof(g_return42));
+        CHECK(((ReturnsInt)first)() == 42);
+
+        // ...and freeing one leaves the other alone
+        CHECK(pyjit_code_free(second) == 0);
+        CHECK(((ReturnsInt)first)() == 42);
+        CHECK(pyjit_code_free(first) == 0);
+    }
+
+    SECTION("large blocks") {
+        auto code = pyjit_code_alloc(100000, 0, nullptr);
+        REQUIRE(code != nullptr);
+        memcpy(code, g_return42, sizeof(g_return42));
+        REQUIRE(pyjit_code_seal(code) == 0);
+
+        CHECK(((ReturnsInt)code)() == 42);
+        CHECK(pyjit_code_free(code) == 0);
+    }
+
+    SECTION("freeing unknown memory fails") {
+        int value;
+        CHECK(pyjit_code_free(&value) != 0);
+    }
+}
+
+TEST_CASE("Code heap statistics", "[codeheap]") {
+    auto before = heap_stats();
+
+    std::vector<void*> blocks;
+    for (int i = 0; i < 1000; i++) {
+        void* data = nullptr;
+        auto code = pyjit_code_alloc(32 * (i % 20) + 1, i % 3 == 0 ? 16 : 0, &data);
+        REQUIRE(code != nullptr);
+        blocks.push_back(code);
+        if (data != nullptr) {
+            blocks.push_back(data);
+        }
+    }
+
+    auto during = heap_stats();
+    CHECK(during.blocks == before.blocks + blocks.size());
+    CHECK(during.in_use > before.in_use);
+    CHECK(during.committed >= during.in_use);
+    CHECK(during.reserved >= during.committed);
+    // Everything fits within a single region's worth of slabs.
+    CHECK(during.regions <= before.regions + 1);
+
+    for (auto block : blocks) {
+        CHECK(pyjit_code_free(block) == 0);
+    }
+
+    auto after = heap_stats();
+    CHECK(after.blocks == before.blocks);
+    CHECK(after.in_use == before.in_use);
+    CHECK(after.committed <= before.committed);
+}
+
+#endif
@@ -0,0 +1,151 @@
+/*
+* The MIT License (MIT)
+*
+* Copyright (c) Microsoft Corporation
+*
+* Permission is hereby granted, free of charge, to any person obtaining a
+* copy of this software and associated documentation files (the "Software"),
+* to deal in the Software without restriction, including without limitation
+* the rights to use, copy, modify, merge, publish, distribute, sublicense,
+* and/or sell copies of the Software, and to permit persons to whom the
+* Software is furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included
+* in all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+* OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+* THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+* OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+* ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+* OTHER DEALINGS IN THE SOFTWARE.
+*
+*/
+
+/**
+  Test the per thread memory compiles use for their IL and the pool which
+  recycles the JIT's pages.
+*/
+
+#include "stdafx.h"
+#include "catch.hpp"
+#include <compilearena.h>
+
+TEST_CASE("Compile arena", "[compilearena]") {
+    SECTION("allocations are aligned and distinct") {
+        CompileArena arena;
+        auto first = (char*)arena.allocate(3);
+        auto second = (char*)arena.allocate(5);
+        REQUIRE(first != nullptr);
+        REQUIRE(second != nullptr);
+        REQUIRE(second >= first + 3);
+        REQUIRE(((size_t)first % sizeof(void*)) == 0);
+        REQUIRE(((size_t)second % sizeof(void*)) == 0);
+        arena.release();
+    }
+
+    SECTION("the last allocation grows in place") {
+        CompileArena arena;
+        arena.allocate(16);
+        auto last = (char*)arena.allocate(16);
+        memset(last, 42, 16);
+        auto grown = (char*)arena.grow(last, 16, 64);
+        REQUIRE(grown == last);
+        auto next = (char*)arena.allocate(8);
+        REQUIRE(next >= grown + 64);
+        arena.release();
+    }
+
+    SECTION("growing an older allocation copies it") {
+        CompileArena arena;
+        auto first = (char*)arena.allocate(16);
+        memset(first, 42, 16);
+        arena.allocate(16);
+        auto grown = (char*)arena.grow(first, 16, 32);
+        REQUIRE(grown != first);
+        for (int i = 0; i < 16; i++) {
+            REQUIRE(grown[i] == 42);
+        }
+        arena.release();
+    }
+
+    SECTION("memory is reused once the outermost session ends") {
+        CompileArena arena;
+        arena.enter();
+        auto first = arena.allocate(128);
+        arena.enter();
+        arena.allocate(128);
+        arena.leave();
+        // Still in the outer session, so nothing's been recycled
+        REQUIRE(arena.allocate(128) != first);
+        arena.leave();
+
+        arena.enter();
+        REQUIRE(arena.allocate(128) == first);
+        arena.leave();
+        arena.release();
+    }
+
+    SECTION("blocks are coalesced when a session needed more than one") {
+        CompileArena arena;
+        arena.enter();
+        arena.allocate(48 * 1024);
+        arena.allocate(48 * 1024);
+        arena.allocate(48 * 1024);
+        REQUIRE(arena.block_count() == 3);
+        arena.leave();
+        REQUIRE(arena.block_count() == 1);
+
+        arena.enter();
+        arena.allocate(48 * 1024);
+        arena.allocate(48 * 1024);
+        arena.allocate(48 * 1024);
+        REQUIRE(arena.block_count() == 1);
+        arena.leave();
+        arena.release();
+        REQUIRE(arena.block_count() == 0);
+    }
+
+    SECTION("each thread has its own arena") {
+        REQUIRE(&CompileArena::current() == &CompileArena::current());
+    }
+}
+
+TEST_CASE("JIT page pool", "[compilearena]") {
+    SECTION("freed pages are reused for the same size") {
+        JitPagePool pool;
+        auto page = pool.allocate(0x10000, true);
+        REQUIRE(page != nullptr);
+        pool.free(page, true);
+        REQUIRE(pool.free_count() == 1);
+
+        REQUIRE(pool.allocate(0x20000, true) != page);
+        REQUIRE(pool.allocate(0x10000, true) == page);
+        REQUIRE(pool.free_count() == 0);
+        pool.free(page, true);
+        pool.release();
+    }
+
+    SECTION("other allocations aren't pooled") {
+        JitPagePool pool;
+        auto block = pool.allocate(100, false);
+        REQUIRE(block != nullptr);
+        pool.free(block, false);
+        REQUIRE(pool.free_count() == 0);
+    }
+
+    SECTION("only a bounded number of pages are kept") {
+        JitPagePool pool;
+        void* pages[32];
+        for (int i = 0; i < 32; i++) {
+            pages[i] = pool.allocate(4096, true);
+        }
+        for (int i = 0; i < 32; i++) {
+            pool.free(pages[i], true);
+        }
+        REQUIRE(pool.free_count() == 16);
+        pool.release();
+        REQUIRE(pool.free_count() == 0);
+    }
+}
@@ -34,21 +34,33 @@
 #include <frameobject.h>
 #include <util.h>
 #include <pyjit.h>
+#include <absint.h>
+#include <codecache.h>
 
 class EmissionTest {
 private:
     py_ptr<PyCodeObject> m_code;
     py_ptr<PyjionJittedCode> m_jittedcode;
+    // Module level code run in each frame's globals before the test code
+    const char* m_globalCode;
 
-    PyObject* run() {
+    PyFrameObject* new_frame() {
         auto sysModule = PyObject_ptr(PyImport_ImportModule("sys"));
         auto globals = PyObject_ptr(PyDict_New());
         auto builtins = PyThreadState_GET()->interp->builtins;
         PyDict_SetItemString(globals.get(), "__builtins__", builtins);
         PyDict_SetItemString(globals.get(), "sys", sysModule.get());
+        if (m_globalCode != nullptr) {
+            auto res = PyObject_ptr(PyRun_String(m_globalCode, Py_file_input, globals.get(), globals.get()));
+            REQUIRE(res.get() != nullptr);
+        }
 
         // Don't DECREF as frames are recycled.
-        auto frame = PyFrame_New(PyThreadState_Get(), m_code.get(), globals.get(), PyObject_ptr(PyDict_New()).get());
+        return PyFrame_New(PyThreadState_Get(), m_code.get(), globals.get(), PyObject_ptr(PyDict_New()).get());
+    }
+
+    PyObject* run() {
+        auto frame = new_frame();
 
         auto res = m_jittedcode->j_evalfunc(m_jittedcode.get(), frame);
 
@@ -56,7 +68,8 @@ private:
     }
 
 public:
-    EmissionTest(const char *code) {
+    EmissionTest(const char *code, PY_UINT64_T optimizeThreshold = 0, const char* globalCode = nullptr) {
+        m_globalCode = globalCode;
         m_code.reset(CompileCode(code));
         if (m_code.get() == nullptr) {
             FAIL("failed to compile code");
@@ -65,9 +78,18 @@ public:
         if (!jit_compile(m_code.get())) {
             FAIL("failed to JIT code");
         }
+        jitted->j_optimize_threshold = optimizeThreshold;
         m_jittedcode.reset(jitted);
     }
 
+    bool is_baseline() {
+        return m_jittedcode->j_baseline != nullptr && m_jittedcode->j_generic == nullptr;
+    }
+
+    PyjionJittedCode* jitted() {
+        return m_jittedcode.get();
+    }
+
     std::string returns() {
         auto res = PyObject_ptr(run());
         REQUIRE(res.get() != nullptr);
@@ -84,6 +106,48 @@ public:
         return std::string(repr);
     }
 
+    // Runs the code with the arguments produced by evaluating a tuple expression.
+    std::string returns_with(const char* args) {
+        auto frame = new_frame();
+        auto values = PyObject_ptr(PyRun_String(args, Py_eval_input, frame->f_globals, frame->f_globals));
+        REQUIRE(values.get() != nullptr);
+        for (Py_ssize_t i = 0; i < PyTuple_GET_SIZE(values.get()); i++) {
+            auto value = PyTuple_GET_ITEM(values.get(), i);
+            Py_INCREF(value);
+            frame->f_localsplus[i] = value;
+        }
+
+        auto res = PyObject_ptr(m_jittedcode->j_evalfunc(m_jittedcode.get(), frame));
+        REQUIRE(res.get() != nullptr);
+        REQUIRE(!PyErr_Occurred());
+        return std::string(PyUnicode_AsUTF8(PyObject_ptr(PyObject_Repr(res.get())).get()));
+    }
+
+    // Runs the code as a generator the same way gen_send_ex does, sending None
+    // in each time it yields.  Returns the yielded values followed by the result.
+    std::string generates() {
+        auto frame = new_frame();
+        std::string values;
+        while (true) {
+            auto res = PyObject_ptr(m_jittedcode->j_evalfunc(m_jittedcode.get(), frame));
+            REQUIRE(res.get() != nullptr);
+            REQUIRE(!PyErr_Occurred());
+
+            auto repr = PyObject_ptr(PyObject_Repr(res.get()));
+            if (frame->f_stacktop == nullptr) {
+                return values + " -> " + PyUnicode_AsUTF8(repr.get());
+            }
+
+            if (values.size() != 0) {
+                values += ", ";
+            }
+            values += PyUnicode_AsUTF8(repr.get());
+
+            Py_INCREF(Py_None);
+            *(frame->f_stacktop++) = Py_None;
+        }
+    }
+
     PyObject* raises() {
         auto res = run();
         REQUIRE(res == nullptr);
@@ -93,6 +157,26 @@ public:
     }
 };
 
+// Checks the module rejects a threshold too big to store, leaving the current
+// setting alone.
+static void check_rejects_overflow(const char* setter, const char* getter) {
+    auto module = PyJit_GetModule();
+    REQUIRE(module != nullptr);
+    auto prev = PyObject_ptr(PyObject_CallMethod(module, getter, nullptr));
+    REQUIRE(prev.get() != nullptr);
+
+    auto huge = PyObject_ptr(PyRun_String("2 ** 70", Py_eval_input, PyEval_GetBuiltins(), nullptr));
+    REQUIRE(huge.get() != nullptr);
+    auto res = PyObject_ptr(PyObject_CallMethod(module, setter, "O", huge.get()));
+    CHECK(res.get() == nullptr);
+    CHECK(PyErr_ExceptionMatches(PyExc_OverflowError));
+    PyErr_Clear();
+
+    auto cur = PyObject_ptr(PyObject_CallMethod(module, getter, nullptr));
+    REQUIRE(cur.get() != nullptr);
+    CHECK(PyObject_RichCompareBool(prev.get(), cur.get(), Py_EQ) == 1);
+}
+
 TEST_CASE("General list unpacking", "[list][BUILD_LIST_UNPACK][emission]") {
     SECTION("common case") {
         auto t = EmissionTest("def f(): return [1, *[2], 3]");
@@ -140,3 +224,1137 @@ TEST_CASE("General dict unpacking", "[dict][BUILD_MAP_UNPACK][emission]") {
         CHECK(t.raises() == PyExc_TypeError);
     }
 }
+
+TEST_CASE("Baseline tier", "[baseline][emission]") {
+    SECTION("runs baseline code until it's hot") {
+        auto t = EmissionTest("def f():\n    x = 1.5\n    return x + 2.0", 3);
+        CHECK(t.returns() == "3.5");
+        CHECK(t.is_baseline());
+        CHECK(t.returns() == "3.5");
+        CHECK(t.is_baseline());
+        CHECK(t.returns() == "3.5");
+        CHECK(!t.is_baseline());
+        CHECK(t.returns() == "3.5");
+    }
+
+    SECTION("takes int and float arguments") {
+        auto t = EmissionTest("def f(x, y):\n    return x * 2 + y", 2);
+        CHECK(t.returns_with("(2, 1.5)") == "5.5");
+        CHECK(t.is_baseline());
+        CHECK(t.returns_with("(3, 0.5)") == "6.5");
+        CHECK(t.returns_with("(4, 0.25)") == "8.25");
+        CHECK(!t.is_baseline());
+        CHECK(t.returns_with("(5, 1.0)") == "11.0");
+    }
+
+    SECTION("raises from baseline code") {
+        auto t = EmissionTest("def f():\n    x = 1\n    return x / 0", 100);
+        CHECK(t.raises() == PyExc_ZeroDivisionError);
+        CHECK(t.is_baseline());
+    }
+
+    SECTION("thresholds which don't fit") {
+        check_rejects_overflow("set_optimize_threshold", "get_optimize_threshold");
+    }
+}
+
+TEST_CASE("Compile statistics", "[stats][emission]") {
+    SECTION("records each phase of a compile") {
+        auto t = EmissionTest("def f():\n    x = 1.5\n    return x + 2.0");
+        CHECK(t.jitted()->j_compiles == 0);
+        CHECK(t.returns() == "3.5");
+        CHECK(t.jitted()->j_compiles == 1);
+        CHECK(t.jitted()->j_compile_failures == 0);
+
+        auto& stats = t.jitted()->j_stats;
+        CHECK(stats.ilSize > 0);
+        CHECK(stats.codeSize > 0);
+        CHECK(stats.codeSize + stats.roDataSize == t.jitted()->j_code_size);
+        CHECK(stats.jitTime > 0);
+    }
+
+    SECTION("accumulates over tiers") {
+        auto t = EmissionTest("def f():\n    x = 1.5\n    return x + 2.0", 2);
+        CHECK(t.returns() == "3.5");
+        auto baselineIl = t.jitted()->j_stats.ilSize;
+        CHECK(t.returns() == "3.5");
+        CHECK(t.jitted()->j_compiles == 2);
+        CHECK(t.jitted()->j_stats.ilSize > baselineIl);
+    }
+}
+
+TEST_CASE("Dispatch counters", "[stats][emission]") {
+    SECTION("counts calls to each specialization") {
+        auto t = EmissionTest("def f(x):\n    return x + x");
+        CHECK(t.returns_with("(2.5,)") == "5.0");
+        CHECK(t.returns_with("('a',)") == "'aa'");
+        CHECK(t.returns_with("(2.5,)") == "5.0");
+
+        auto& counters = t.jitted()->j_counters;
+        CHECK(counters.jitted == 3);
+        CHECK(counters.traceMisses == 2);
+        CHECK(counters.megamorphic == 0);
+        CHECK(counters.interpreted == 0);
+        auto& specializations = t.jitted()->j_optimized;
+        for (size_t i = 0; i < specializations.size(); i++) {
+            CHECK(specializations[i]->calls == (specializations[i]->types[0] == &PyFloat_Type ? 2 : 1));
+        }
+    }
+
+    SECTION("counts calls which miss once megamorphic") {
+        auto t = EmissionTest("def f(x):\n    return x * 2");
+        const char* args[] = { "(1.5,)", "('a',)", "(b'a',)", "([1],)", "((1,),)", "(2,)", "(True,)" };
+        for (auto arg : args) {
+            t.returns_with(arg);
+        }
+        CHECK(t.jitted()->j_counters.traceMisses == 7);
+        CHECK(t.jitted()->j_counters.megamorphic == 2);
+        CHECK(t.jitted()->j_megamorphic->calls == 2);
+    }
+
+    SECTION("records why a compile failed") {
+        // The frame can't be handed over to the interpreter within a with block
+        auto t = EmissionTest(
+            "def f():\n"
+            "    class C:\n"
+            "        def __enter__(self): pass\n"
+            "        def __exit__(self, *args): pass\n"
+            "    with C():\n"
+            "        return max(*[1], *[2])");
+        CHECK(t.returns() == "2");
+        CHECK(t.jitted()->j_failed);
+        CHECK(t.jitted()->j_fail_reason == std::string("unsupported opcode"));
+        CHECK(t.jitted()->j_fail_opcode != -1);
+        CHECK(t.jitted()->j_counters.interpreted == 1);
+        CHECK(t.jitted()->j_counters.jitted == 0);
+    }
+}
+
+TEST_CASE("Side exits", "[side exit][emission]") {
+    SECTION("hands the frame to the interpreter at an unsupported opcode") {
+        auto t = EmissionTest("def f():\n    a = [1]\n    b = [2]\n    x = 3.5\n    return max(*a, *b) + x");
+        CHECK(t.returns() == "5.5");
+        CHECK(!t.jitted()->j_failed);
+        CHECK(t.jitted()->j_counters.sideExits == 1);
+    }
+
+    SECTION("moves unboxed locals into the frame") {
+        auto t = EmissionTest("def f():\n    x = 1.5\n    y = x * 2.0\n    return sorted(locals().items())");
+        CHECK(t.returns() == "[('x', 1.5), ('y', 3.0)]");
+        CHECK(!t.jitted()->j_failed);
+    }
+
+    SECTION("moves the stack into the frame") {
+        auto t = EmissionTest("def f():\n    x = 2\n    return [x, x + 1, *(lambda *a: list(a))(*[x], *[x])]");
+        CHECK(t.returns() == "[2, 3, 2, 2]");
+        CHECK(!t.jitted()->j_failed);
+    }
+
+    SECTION("only exits on the paths which reach the instruction") {
+        auto t = EmissionTest("def f(n):\n    if n > 5:\n        return sorted(locals())\n    return n + 1");
+        CHECK(t.returns_with("(1,)") == "2");
+        CHECK(t.jitted()->j_counters.sideExits == 0);
+        CHECK(t.returns_with("(7,)") == "['n']");
+        CHECK(t.jitted()->j_counters.sideExits == 1);
+        CHECK(t.returns_with("(2,)") == "3");
+    }
+
+    SECTION("exits within a loop") {
+        auto t = EmissionTest("def f():\n    total = 0\n    for i in range(4):\n        total += i\n        if i == 2:\n            return max(*[total], *[i])\n    return -1");
+        CHECK(t.returns() == "3");
+    }
+}
+
+TEST_CASE("Compile retries", "[stats][emission]") {
+    auto t = EmissionTest(
+        "def f():\n"
+        "    class C:\n"
+        "        def __enter__(self): pass\n"
+        "        def __exit__(self, *args): pass\n"
+        "    with C():\n"
+        "        return max(*[1], *[2])");
+    CHECK(t.returns() == "2");
+    CHECK(t.jitted()->j_compile_failures == 1);
+    CHECK(t.jitted()->j_retry_countdown == COMPILE_RETRY_CALLS);
+
+    for (int i = 0; i < COMPILE_RETRY_CALLS - 1; i++) {
+        CHECK(t.returns() == "2");
+    }
+    CHECK(t.jitted()->j_compile_failures == 1);
+    CHECK(t.returns() == "2");
+    CHECK(t.jitted()->j_compile_failures == 2);
+    CHECK(t.jitted()->j_retry_countdown == COMPILE_RETRY_CALLS * 2);
+}
+
+TEST_CASE("Compile retries with the code cache", "[stats][codecache][emission]") {
+    auto tempfile = PyObject_ptr(PyImport_ImportModule("tempfile"));
+    REQUIRE(tempfile.get() != nullptr);
+    auto dir = PyObject_ptr(PyObject_CallMethod(tempfile.get(), "mkdtemp", nullptr));
+    REQUIRE(dir.get() != nullptr);
+    REQUIRE(PyJit_SetCodeCache(PyUnicode_AsUTF8(dir.get())));
+
+    auto t = EmissionTest(
+        "def f():\n"
+        "    class C:\n"
+        "        def __enter__(self): pass\n"
+        "        def __exit__(self, *args): pass\n"
+        "    with C():\n"
+        "        return max(*[1], *[2])");
+    std::vector<PyTypeObject*> types;
+    PY_UINT64_T key;
+    REQUIRE(CodeCache::get_key((PyCodeObject*)t.jitted()->j_code, types, key));
+    CodeCache cache;
+    REQUIRE(cache.set_dir(PyUnicode_AsUTF8(dir.get())));
+
+    CHECK(t.returns() == "2");
+    CHECK(t.jitted()->j_compile_failures == 1);
+
+    // Failures are only shared once we've given up retrying
+    for (int retry = 0; retry < MAX_COMPILE_RETRIES; retry++) {
+        CHECK(!cache.is_known_failure(key));
+        auto calls = t.jitted()->j_retry_countdown;
+        REQUIRE(calls != 0);
+        for (PY_UINT64_T i = 0; i < calls; i++) {
+            CHECK(t.returns() == "2");
+        }
+        CHECK(t.jitted()->j_compile_failures == retry + 2);
+    }
+    CHECK(t.jitted()->j_retry_countdown == 0);
+    CHECK(cache.is_known_failure(key));
+
+    PyJit_SetCodeCache("");
+    auto shutil = PyObject_ptr(PyImport_ImportModule("shutil"));
+    REQUIRE(shutil.get() != nullptr);
+    auto res = PyObject_ptr(PyObject_CallMethod(shutil.get(), "rmtree", "O", dir.get()));
+    CHECK(res.get() != nullptr);
+}
+
+TEST_CASE("Interpreter state", "[threads][emission]") {
+    SECTION("subinterpreters get their own state") {
+        auto state = PyJit_GetInterpState();
+        REQUIRE(state != nullptr);
+
+        auto main = PyThreadState_Get();
+        auto sub = Py_NewInterpreter();
+        REQUIRE(sub != nullptr);
+        CHECK(PyJit_GetInterpState() == nullptr);
+        JitInit();
+        auto subState = PyJit_GetInterpState();
+        CHECK(subState != nullptr);
+        CHECK(subState != state);
+        Py_EndInterpreter(sub);
+        PyThreadState_Swap(main);
+
+        CHECK(PyJit_GetInterpState() == state);
+    }
+
+    SECTION("threads share the code compiled for a function") {
+        auto interp = PyThreadState_GET()->interp;
+        auto globals = PyObject_ptr(PyDict_New());
+        PyDict_SetItemString(globals.get(), "__builtins__", interp->builtins);
+
+        auto prev = interp->eval_frame;
+        interp->eval_frame = PyJit_EvalFrame;
+        auto res = PyObject_ptr(PyRun_String(
+            "import threading\n"
+            "def f(x):\n    return x + 1\n"
+            "def work():\n    for i in range(10000):\n        f(i)\n"
+            "threads = [threading.Thread(target=work) for i in range(4)]\n"
+            "for t in threads:\n    t.start()\n"
+            "for t in threads:\n    t.join()\n",
+            Py_file_input, globals.get(), globals.get()));
+        interp->eval_frame = prev;
+        REQUIRE(res.get() != nullptr);
+
+        auto f = (PyFunctionObject*)PyDict_GetItemString(globals.get(), "f");
+        auto jitted = PyJit_EnsureExtra(f->func_code);
+        CHECK(jitted->j_compiles == 1);
+        CHECK(jitted->j_counters.jitted + jitted->j_counters.interpreted == 40000);
+    }
+}
+
+TEST_CASE("Generators", "[generator][YIELD_VALUE][YIELD_FROM][emission]") {
+    SECTION("yields values") {
+        auto t = EmissionTest("def f():\n    yield 1\n    yield 2");
+        CHECK(t.generates() == "1, 2 -> None");
+    }
+
+    SECTION("yields from within a for loop") {
+        auto t = EmissionTest("def f():\n    for i in range(3):\n        yield i * 2");
+        CHECK(t.generates() == "0, 2, 4 -> None");
+    }
+
+    SECTION("yields from an iterable") {
+        auto t = EmissionTest("def f():\n    x = yield from [1, 2]\n    return x");
+        CHECK(t.generates() == "1, 2 -> None");
+    }
+
+    SECTION("yields within a try/finally") {
+        auto t = EmissionTest("def f():\n    x = 1\n    try:\n        yield x\n    finally:\n        x = 2\n    return x");
+        CHECK(t.generates() == "1 -> 2");
+    }
+
+    SECTION("keeps unboxed locals across yields") {
+        auto t = EmissionTest("def f():\n    x = 1.5\n    yield x\n    x = x + 2.0\n    yield x\n    return x + 1.0");
+        CHECK(t.generates() == "1.5, 3.5 -> 4.5");
+    }
+}
+
+TEST_CASE("With blocks", "[with][SETUP_WITH][WITH_CLEANUP_START][emission]") {
+    const char* manager =
+        "def f():\n"
+        "    log = []\n"
+        "    class C:\n"
+        "        def __init__(self, suppress=False):\n"
+        "            self.suppress = suppress\n"
+        "        def __enter__(self):\n"
+        "            log.append('enter')\n"
+        "            return 42\n"
+        "        def __exit__(self, exc, val, tb):\n"
+        "            log.append(exc and exc.__name__)\n"
+        "            return self.suppress\n";
+
+    SECTION("enters and exits") {
+        auto t = EmissionTest((std::string(manager) +
+            "    with C() as x:\n"
+            "        log.append(x)\n"
+            "    return log").c_str());
+        CHECK(t.returns() == "['enter', 42, None]");
+    }
+
+    SECTION("exits when returning") {
+        auto t = EmissionTest((std::string(manager) +
+            "    with C() as x:\n"
+            "        return log").c_str());
+        CHECK(t.returns() == "['enter', None]");
+    }
+
+    SECTION("exits when breaking out of a loop") {
+        auto t = EmissionTest((std::string(manager) +
+            "    for i in range(3):\n"
+            "        with C():\n"
+            "            break\n"
+            "    return log").c_str());
+        CHECK(t.returns() == "['enter', None]");
+    }
+
+    SECTION("suppresses an exception") {
+        auto t = EmissionTest((std::string(manager) +
+            "    with C(True):\n"
+            "        1 / 0\n"
+            "    return log").c_str());
+        CHECK(t.returns() == "['enter', 'ZeroDivisionError']");
+    }
+
+    SECTION("propagates an exception") {
+        auto t = EmissionTest((std::string(manager) +
+            "    with C():\n"
+            "        1 / 0\n"
+            "    return log").c_str());
+        CHECK(t.raises() == PyExc_ZeroDivisionError);
+    }
+
+    SECTION("not a context manager") {
+        auto t = EmissionTest("def f():\n    with 1:\n        pass");
+        CHECK(t.raises() == PyExc_AttributeError);
+    }
+}
+
+TEST_CASE("Specialization dispatch", "[specialization][emission]") {
+    SECTION("keeps a specialization for each set of argument types") {
+        auto t = EmissionTest("def f(x):\n    return x + x");
+        CHECK(t.returns_with("(2.5,)") == "5.0");
+        CHECK(t.returns_with("('a',)") == "'aa'");
+        CHECK(t.returns_with("([1],)") == "[1, 1]");
+        CHECK(t.returns_with("(2.5,)") == "5.0");
+        CHECK(t.jitted()->j_optimized.size() == 3);
+    }
+
+    SECTION("shares generic code once megamorphic") {
+        auto t = EmissionTest("def f(x):\n    return x * 2");
+        CHECK(t.returns_with("(1.5,)") == "3.0");
+        CHECK(t.returns_with("('a',)") == "'aa'");
+        CHECK(t.returns_with("(b'a',)") == "b'aa'");
+        CHECK(t.returns_with("([1],)") == "[1, 1]");
+        CHECK(t.returns_with("((1,),)") == "(1, 1)");
+        CHECK(t.returns_with("(2,)") == "4");
+        CHECK(t.returns_with("(True,)") == "2");
+        CHECK(t.jitted()->j_optimized.size() == 5);
+        CHECK(t.jitted()->j_megamorphic != nullptr);
+        // Only the float specialization and the generic code get compiled
+        CHECK(t.jitted()->j_compiles == 2);
+    }
+}
+
+TEST_CASE("Global loads", "[LOAD_GLOBAL][emission]") {
+    SECTION("sees globals rebound by the function") {
+        auto t = EmissionTest("def f():\n  global x\n  x = 1\n  a = x\n  x = 2\n  return a, x");
+        CHECK(t.returns() == "(1, 2)");
+    }
+
+    SECTION("sees globals shadowing builtins") {
+        auto t = EmissionTest("def f():\n  global len\n  a = len([1, 2])\n  len = lambda x: 42\n  return a, len([1, 2])");
+        CHECK(t.returns() == "(2, 42)");
+    }
+
+    SECTION("reloads globals in a new frame") {
+        auto t = EmissionTest("def f():\n  global x\n  try:\n    x += 1\n  except NameError:\n    x = 1\n  return x");
+        CHECK(t.returns() == "1");
+        CHECK(t.returns() == "1");
+    }
+
+    SECTION("raises for undefined names") {
+        auto t = EmissionTest("def f():\n  return undefined_name");
+        CHECK(t.raises() == PyExc_NameError);
+    }
+}
+
+TEST_CASE("Builtin calls", "[CALL_FUNCTION][emission]") {
+    SECTION("len") {
+        auto t = EmissionTest("def f():\n  return len([1, 2, 3])");
+        CHECK(t.returns() == "3");
+    }
+
+    SECTION("len of an object without one") {
+        auto t = EmissionTest("def f():\n  return len(1)");
+        CHECK(t.raises() == PyExc_TypeError);
+    }
+
+    SECTION("isinstance") {
+        auto t = EmissionTest("def f():\n  return isinstance(1, int), isinstance(1.0, (str, bytes))");
+        CHECK(t.returns() == "(True, False)");
+    }
+
+    SECTION("int and float") {
+        auto t = EmissionTest("def f():\n  return int('42'), int(2.5), float(2), float('1.5')");
+        CHECK(t.returns() == "(42, 2, 2.0, 1.5)");
+    }
+
+    SECTION("with other arguments") {
+        auto t = EmissionTest("def f():\n  return int('ff', 16)");
+        CHECK(t.returns() == "255");
+    }
+}
+
+TEST_CASE("Attribute access", "[LOAD_ATTR][STORE_ATTR][emission]") {
+    SECTION("slots") {
+        auto t = EmissionTest("def f():\n  class C:\n    __slots__ = ('a',)\n  c = C()\n  r = []\n  for i in range(3):\n    c.a = i\n    r.append(c.a)\n  return r");
+        CHECK(t.returns() == "[0, 1, 2]");
+    }
+
+    SECTION("unset slots") {
+        auto t = EmissionTest("def f():\n  class C:\n    __slots__ = ('a',)\n  c = C()\n  return c.a");
+        CHECK(t.raises() == PyExc_AttributeError);
+    }
+
+    SECTION("instance dict") {
+        auto t = EmissionTest("def f():\n  class C: pass\n  c = C()\n  r = []\n  for i in range(3):\n    c.a = i\n    r.append(c.a)\n  return r");
+        CHECK(t.returns() == "[0, 1, 2]");
+    }
+
+    SECTION("properties") {
+        auto t = EmissionTest("def f():\n  class C:\n    def __init__(self): self._x = 1\n    @property\n    def x(self): return self._x\n    @x.setter\n    def x(self, value): self._x = value * 2\n  c = C()\n  c.x = 2\n  return c.x, c._x");
+        CHECK(t.returns() == "(4, 4)");
+    }
+
+    SECTION("class attributes shadowed by the instance") {
+        auto t = EmissionTest("def f():\n  class C:\n    a = 1\n  c = C()\n  r = []\n  for i in range(2):\n    r.append(c.a)\n    c.a = 2\n  return r");
+        CHECK(t.returns() == "[1, 2]");
+    }
+
+    SECTION("types modified after caching") {
+        auto t = EmissionTest("def f():\n  class C:\n    a = 1\n  c = C()\n  r = []\n  for i in range(3):\n    r.append(c.a)\n    C.a = property(lambda self: 42)\n  return r");
+        CHECK(t.returns() == "[1, 42, 42]");
+    }
+
+    SECTION("different types at one site") {
+        auto t = EmissionTest("def f():\n  class C:\n    a = 1\n  class D:\n    __slots__ = ('a',)\n  d = D()\n  d.a = 2\n  return [x.a for x in (C(), d, C())]");
+        CHECK(t.returns() == "[1, 2, 1]");
+    }
+
+    SECTION("missing attributes") {
+        auto t = EmissionTest("def f():\n  class C: pass\n  return C().missing");
+        CHECK(t.raises() == PyExc_AttributeError);
+    }
+
+    SECTION("read only attributes") {
+        auto t = EmissionTest("def f():\n  (1).real = 2");
+        CHECK(t.raises() == PyExc_AttributeError);
+    }
+}
+
+TEST_CASE("Method calls", "[LOAD_ATTR][CALL_FUNCTION][emission]") {
+    SECTION("python methods") {
+        auto t = EmissionTest("def f():\n  class C:\n    def m0(self): return 0\n    def m1(self, a): return a\n    def m3(self, a, b, c): return a + b + c\n    def m5(self, a, b, c, d, e): return a + b + c + d + e\n  c = C()\n  return c.m0(), c.m1(1), c.m3(1, 2, 3), c.m5(1, 2, 3, 4, 5)");
+        CHECK(t.returns() == "(0, 1, 6, 15)");
+    }
+
+    SECTION("builtin methods") {
+        auto t = EmissionTest("def f():\n  x = []\n  for i in range(3):\n    x.append(i * 2)\n  x.insert(0, 'a')\n  return x, 'a,b'.split(',')");
+        CHECK(t.returns() == "(['a', 0, 2, 4], ['a', 'b'])");
+    }
+
+    SECTION("nested calls") {
+        auto t = EmissionTest("def f():\n  x = []\n  x.append(x.__len__() + len(x.copy()))\n  return x");
+        CHECK(t.returns() == "[0]");
+    }
+
+    SECTION("methods shadowed by the instance") {
+        auto t = EmissionTest("def f():\n  class C:\n    def m(self): return 1\n  c = C()\n  r = [c.m()]\n  c.m = lambda: 2\n  r.append(c.m())\n  return r");
+        CHECK(t.returns() == "[1, 2]");
+    }
+
+    SECTION("static and class methods") {
+        auto t = EmissionTest("def f():\n  class C:\n    @staticmethod\n    def s(a): return a\n    @classmethod\n    def c(cls, a): return cls.__name__, a\n  return C().s(1), C().c(2)");
+        CHECK(t.returns() == "(1, ('C', 2))");
+    }
+
+    SECTION("methods which raise") {
+        auto t = EmissionTest("def f():\n  x = []\n  return x.pop()");
+        CHECK(t.raises() == PyExc_IndexError);
+    }
+
+    SECTION("missing methods") {
+        auto t = EmissionTest("def f():\n  x = []\n  return x.missing(1, 2)");
+        CHECK(t.raises() == PyExc_AttributeError);
+    }
+}
+
+// Installs our frame evaluation function while it's alive, so calls made by the
+// code being tested are dispatched the way they are once pyjion is imported.
+class JitEvaluator {
+    _PyFrameEvalFunction m_prev;
+
+public:
+    JitEvaluator() {
+        auto interp = PyThreadState_GET()->interp;
+        m_prev = interp->eval_frame;
+        interp->eval_frame = PyJit_EvalFrame;
+    }
+
+    ~JitEvaluator() {
+        PyThreadState_GET()->interp->eval_frame = m_prev;
+    }
+};
+
+// Gets the jitted state of the function called name defined by the test's code.
+static PyjionJittedCode* nested_jitted(EmissionTest& t, const char* name) {
+    auto consts = ((PyCodeObject*)t.jitted()->j_code)->co_consts;
+    for (Py_ssize_t i = 0; i < PyTuple_GET_SIZE(consts); i++) {
+        auto item = PyTuple_GET_ITEM(consts, i);
+        if (PyCode_Check(item) && PyUnicode_CompareWithASCIIString(((PyCodeObject*)item)->co_name, name) == 0) {
+            return PyJit_EnsureExtra(item);
+        }
+    }
+    FAIL("no nested function");
+    return nullptr;
+}
+
+TEST_CASE("Direct calls", "[CALL_FUNCTION][emission]") {
+    JitEvaluator evaluator;
+
+    SECTION("hot functions") {
+        auto t = EmissionTest("def f():\n  def g(x): return x + 1\n  r = 0\n  for i in range(2000):\n    r = g(r)\n  return r");
+        CHECK(t.returns() == "2000");
+        auto g = nested_jitted(t, "g");
+        CHECK(g->j_counters.direct > 1900);
+        CHECK(g->j_counters.jitted == 2000);
+    }
+
+    SECTION("arguments of changing types") {
+        auto t = EmissionTest("def f():\n  def g(x, y): return x + y\n  r = []\n  for i in range(2000):\n    r.append(g(i, 1) if i % 2 else g(str(i), 'a'))\n  return r[-2:]");
+        CHECK(t.returns() == "['1998a', 2000]");
+        CHECK(nested_jitted(t, "g")->j_counters.direct > 1900);
+    }
+
+    SECTION("rebound callees") {
+        auto t = EmissionTest("def f():\n  def g(): return 1\n  def h(): return 2\n  r = 0\n  for i in range(2000):\n    r += g()\n    if i == 1000:\n      g = h\n  return r");
+        CHECK(t.returns() == "2999");
+        CHECK(nested_jitted(t, "h")->j_counters.direct > 900);
+    }
+
+    SECTION("bound methods") {
+        auto t = EmissionTest("def f():\n  class C:\n    def m(self, a, b, c): return a + b + c\n  m = C().m\n  r = 0\n  for i in range(2000):\n    r = m(r, 1, 1)\n  return r");
+        CHECK(t.returns() == "4000");
+    }
+
+    SECTION("recursion") {
+        auto t = EmissionTest("def f():\n  def fib(n): return n if n < 2 else fib(n - 1) + fib(n - 2)\n  return fib(18)");
+        CHECK(t.returns() == "2584");
+        CHECK(nested_jitted(t, "fib")->j_counters.direct > 0);
+    }
+
+    SECTION("unbounded recursion") {
+        auto t = EmissionTest("def f():\n  def g(x): return g(x)\n  return g(1)");
+        CHECK(t.raises() == PyExc_RecursionError);
+    }
+
+    SECTION("callees which raise") {
+        auto t = EmissionTest("def f():\n  def g(x): return 1 / x\n  r = 0\n  for i in range(2000, -1, -1):\n    r += g(i)\n  return r");
+        CHECK(t.raises() == PyExc_ZeroDivisionError);
+    }
+
+    SECTION("callees which are invalidated") {
+        auto t = EmissionTest(
+            "def f():\n"
+            "  global range\n"
+            "  def g(n):\n"
+            "    r = 0\n"
+            "    for i in range(n):\n"
+            "      r += i\n"
+            "    return r\n"
+            "  t = 0\n"
+            "  for i in builtins.range(2000):\n"
+            "    if i == 1000:\n"
+            "      range = lambda n: [n, n]\n"
+            "    t += g(3)\n"
+            "  return t", 0, "import builtins");
+        CHECK(t.returns() == "9000");
+        // Once it's invalidated nothing more runs the guarded code
+        auto g = nested_jitted(t, "g");
+        int deopts = 0;
+        for (auto cur = g->j_deopts.begin(); cur != g->j_deopts.end(); cur++) {
+            deopts += cur->second;
+        }
+        CHECK(deopts == DEOPT_LIMIT);
+    }
+}
+
+TEST_CASE("Inlined calls", "[CALL_FUNCTION][inlining][emission]") {
+    SECTION("small functions") {
+        auto t = EmissionTest("def f():\n  r = 0\n  for i in range(10):\n    r += sq(i)\n  return r", 0, "def sq(x): return x * x");
+        CHECK(t.returns() == "285");
+    }
+
+    SECTION("expressions with constants") {
+        auto t = EmissionTest("def f():\n  return poly(2.0), poly(2), scale('a', 2)", 0, "def poly(x): return -x * 2.5 + ~3 + +x\ndef scale(x, n): return x * n");
+        CHECK(t.returns() == "(-7.0, -7.0, 'aa')");
+    }
+
+    SECTION("comparisons") {
+        auto t = EmissionTest("def f():\n  return lt(1, 2), lt(2, 1)", 0, "def lt(a, b): return a < b");
+        CHECK(t.returns() == "(True, False)");
+    }
+
+    SECTION("rebound functions") {
+        auto t = EmissionTest("def f():\n  global sq\n  a = sq(3)\n  sq = lambda x: x + 1\n  return a, sq(3)", 0, "def sq(x): return x * x");
+        CHECK(t.returns() == "(9, 4)");
+    }
+
+    SECTION("replaced code") {
+        auto t = EmissionTest("def f():\n  a = sq(3)\n  sq.__code__ = (lambda x: x - 1).__code__\n  return a, sq(3)", 0, "def sq(x): return x * x");
+        CHECK(t.returns() == "(9, 2)");
+    }
+
+    SECTION("result kinds") {
+        auto t = EmissionTest("def f():\n  r = 0.0\n  for i in range(4):\n    r += half(i)\n  return r", 0, "def half(x): return x / 2");
+        CHECK(t.returns() == "3.0");
+    }
+
+    SECTION("unboxed results") {
+        auto t = EmissionTest("def f():\n  x = 1.5\n  return scale(x) + 1.0", 0, "def scale(x): return x * 2.0");
+        CHECK(t.returns() == "4.0");
+    }
+
+    SECTION("rebound functions which return other kinds") {
+        auto t = EmissionTest("def f():\n  global half\n  a = half(3)\n  half = lambda x: str(x)\n  return a, half(3) + '!'", 0, "def half(x): return x / 2");
+        CHECK(t.returns() == "(1.5, '3!')");
+    }
+
+    SECTION("callees which raise") {
+        auto t = EmissionTest("def f():\n  x = [1]\n  return x, inv(0)", 0, "def inv(x): return 1 / x");
+        CHECK(t.raises() == PyExc_ZeroDivisionError);
+    }
+
+    SECTION("callees which raise in a handler") {
+        auto t = EmissionTest("def f():\n  try:\n    return 1 + inv(0)\n  except ZeroDivisionError:\n    return 'caught'", 0, "def inv(x): return 1 / x");
+        CHECK(t.returns() == "'caught'");
+    }
+
+    SECTION("callees which aren't simple") {
+        auto t = EmissionTest("def f():\n  return g(2), h(2)", 0, "def g(x):\n  y = x + 1\n  return y\ndef h(x, y=3): return x + y");
+        CHECK(t.returns() == "(3, 5)");
+    }
+}
+
+TEST_CASE("Range loops", "[FOR_ITER][emission]") {
+    SECTION("counting up") {
+        auto t = EmissionTest("def f():\n  r = 0\n  for i in range(1000):\n    r += i\n  return r");
+        CHECK(t.returns() == "499500");
+    }
+
+    SECTION("negative steps") {
+        auto t = EmissionTest("def f():\n  r = []\n  for i in range(10, -5, -4):\n    r.append(i)\n  return r");
+        CHECK(t.returns() == "[10, 6, 2, -2]");
+    }
+
+    SECTION("empty ranges") {
+        auto t = EmissionTest("def f():\n  r = 0\n  for i in range(5, 0):\n    r += 1\n  for i in range(0):\n    r += 1\n  return r");
+        CHECK(t.returns() == "0");
+    }
+
+    SECTION("values larger than machine ints") {
+        auto t = EmissionTest("def f():\n  r = []\n  for i in range(2 ** 70, 2 ** 70 + 2):\n    r.append(i)\n  return r");
+        CHECK(t.returns() == "[1180591620717411303424, 1180591620717411303425]");
+    }
+
+    SECTION("break and continue") {
+        auto t = EmissionTest("def f():\n  r = 0\n  for i in range(100):\n    if i % 2:\n      continue\n    if i > 10:\n      break\n    r += i\n  return r, i");
+        CHECK(t.returns() == "(30, 12)");
+    }
+
+    SECTION("nested loops") {
+        auto t = EmissionTest("def f():\n  r = 0\n  for i in range(4):\n    for j in range(i, 4):\n      r += i * j\n  return r");
+        CHECK(t.returns() == "25");
+    }
+
+    SECTION("exceptions in the body") {
+        auto t = EmissionTest("def f():\n  for i in range(10):\n    x = 1 / (5 - i)");
+        CHECK(t.raises() == PyExc_ZeroDivisionError);
+    }
+
+    SECTION("other iterables") {
+        auto t = EmissionTest("def f():\n  r = 0\n  for i in [1, 2, 3]:\n    r += i\n  for c in 'ab':\n    r += ord(c)\n  return r");
+        CHECK(t.returns() == "201");
+    }
+
+    SECTION("rebound range") {
+        auto t = EmissionTest("def f():\n  range = lambda n: [n]\n  r = 0\n  for i in range(7):\n    r += i\n  return r");
+        CHECK(t.returns() == "7");
+    }
+
+    SECTION("unboxed loop variables") {
+        auto t = EmissionTest("def f():\n  x = [1, 2, 3]\n  r = 0\n  for i in range(3):\n    if i != 1:\n      r += x[i]\n  return r");
+        CHECK(t.returns() == "4");
+    }
+
+    SECTION("unboxed loop variables too big to tag") {
+        auto t = EmissionTest("def f():\n  r = 0\n  for i in range(2 ** 62 - 2, 2 ** 62 + 2):\n    if i >= 2 ** 62:\n      r += 1\n  return r");
+        CHECK(t.returns() == "2");
+    }
+
+    SECTION("unboxed loop variables after deoptimizing") {
+        auto t = EmissionTest("def f():\n  global abs\n  r = 0.0\n  x = -1.5\n  y = 0.0\n  for i in range(4):\n    if i == 2:\n      abs = lambda v: 10\n    y = abs(x) + i\n    r += y\n  return r");
+        CHECK(t.returns() == "29.0");
+    }
+}
+
+TEST_CASE("Deoptimization", "[FOR_ITER][emission]") {
+    SECTION("loops over other iterables don't deoptimize") {
+        auto t = EmissionTest("def f():\n  r = 0\n  for i in [1, 2, 3]:\n    r += i\n  for c in 'ab':\n    r += 1\n  for k in {4: 5}:\n    r += k\n  return r");
+        CHECK(t.returns() == "12");
+        CHECK(t.jitted()->j_deopts.size() == 0);
+    }
+
+    SECTION("loops over unknown values which aren't ranges don't deoptimize") {
+        auto t = EmissionTest("def f():\n  r = 0\n  for i in x:\n    r += i\n  return r", 0, "x = (1, 2, 3)");
+        CHECK(t.returns() == "6");
+        CHECK(t.jitted()->j_deopts.size() == 0);
+    }
+
+    SECTION("replaced ranges finish in the interpreter") {
+        auto t = EmissionTest("def f():\n  r = 0\n  for i in range(3):\n    r += i\n  return r", 0, "range = lambda n: [4, 5, 6]");
+        CHECK(t.returns() == "15");
+    }
+
+    SECTION("unboxed locals are boxed into the frame") {
+        auto t = EmissionTest("def f():\n  x = 1.5\n  n = 3\n  for i in range(2):\n    x += i\n    n += i\n  return x, n", 0, "range = lambda n: (1, 2)");
+        CHECK(t.returns() == "(4.5, 6)");
+    }
+
+    SECTION("outer range loops carry on in the interpreter") {
+        auto t = EmissionTest("def f():\n  r = []\n  for i in range(3):\n    for j in range(2):\n      r.append((i, j))\n  return r", 0,
+            "import builtins\ndef range(*args):\n  return 'ab' if args == (2,) else builtins.range(*args)");
+        CHECK(t.returns() == "[(0, 'a'), (0, 'b'), (1, 'a'), (1, 'b'), (2, 'a'), (2, 'b')]");
+    }
+
+    SECTION("outer range loops with large values") {
+        auto t = EmissionTest("def f():\n  r = 0\n  for i in range(2 ** 62, 2 ** 63 - 1, 2 ** 61):\n    for j in range(i):\n      r += 1\n  return r", 0,
+            "import builtins\ndef range(*args):\n  return [args[0]] if len(args) == 1 else builtins.range(*args)");
+        CHECK(t.returns() == "2");
+    }
+
+    SECTION("exception handlers are kept") {
+        auto t = EmissionTest("def f():\n  r = 0\n  try:\n    for i in range(2):\n      r += 1 / i\n  except ZeroDivisionError:\n    r = -r\n  return r", 0, "range = lambda n: [1, 0]");
+        CHECK(t.returns() == "-1.0");
+    }
+
+    SECTION("break") {
+        auto t = EmissionTest("def f():\n  for i in range(3):\n    if i == 2:\n      break\n  else:\n    i = 0\n  return i", 0, "range = lambda n: [1, 2, 3]");
+        CHECK(t.returns() == "2");
+    }
+
+    SECTION("errors after resuming") {
+        auto t = EmissionTest("def f():\n  for i in range(2):\n    x = i / 0", 0, "range = lambda n: [1, 2]");
+        CHECK(t.raises() == PyExc_ZeroDivisionError);
+    }
+}
+
+TEST_CASE("Temporaries", "[BUILD_TUPLE][BUILD_SLICE][emission]") {
+    SECTION("unpacked tuples") {
+        auto t = EmissionTest("def f():\n  a, b, c, d = 1, 2.5, 'c', 4\n  a, b, c, d = d, c, b, a\n  return a, b, c, d");
+        CHECK(t.returns() == "(4, 'c', 2.5, 1)");
+    }
+
+    SECTION("unpacked tuples of unboxed values") {
+        auto t = EmissionTest("def f():\n  a, b, c, d = 1.0, 2.0, 3, 4\n  for i in range(3):\n    a, b, c, d = b, a + b, d, c + d\n  return a, b, c, d");
+        CHECK(t.returns() == "(5.0, 8.0, 11, 18)");
+    }
+
+    SECTION("unpacking the wrong number of values") {
+        auto t = EmissionTest("def f():\n  a, b, c = 1, 2");
+        CHECK(t.raises() == PyExc_ValueError);
+    }
+
+    SECTION("slices") {
+        auto t = EmissionTest("def f():\n  x = [1, 2, 3, 4]\n  i = 1\n  return x[i:3], x[-2:], x[:-5], x[3:1], (1, 2, 3)[1:], 'abcd'[i:-1], b'abc'[1:]");
+        CHECK(t.returns() == "([2, 3], [3, 4], [], [], (2, 3), 'bc', b'bc')");
+    }
+
+    SECTION("slices with large bounds") {
+        auto t = EmissionTest("def f():\n  x = 'abc'\n  return x[-2 ** 70:2 ** 70], x[2 ** 70:]");
+        CHECK(t.returns() == "('abc', '')");
+    }
+
+    SECTION("slices of other objects") {
+        auto t = EmissionTest("def f():\n  class C:\n    def __getitem__(self, i): return i\n  return C()[1:'a']");
+        CHECK(t.returns() == "slice(1, 'a', None)");
+    }
+
+    SECTION("bad slice bounds") {
+        auto t = EmissionTest("def f():\n  return [1, 2][1.0:]");
+        CHECK(t.raises() == PyExc_TypeError);
+    }
+
+    SECTION("slice stores") {
+        auto t = EmissionTest("def f():\n  x = [1, 2, 3, 4]\n  x[1:3] = 'ab'\n  x[:0] = x\n  x[10:] = [5]\n  return x");
+        CHECK(t.returns() == "[1, 'a', 'b', 4, 1, 'a', 'b', 4, 5]");
+    }
+}
+
+TEST_CASE("Borrowed operands", "[LOAD_FAST][LOAD_CONST][emission]") {
+    SECTION("binary operations and comparisons") {
+        auto t = EmissionTest("def f():\n  x = 'a'\n  y = 'b'\n  return x + y, x < y, x * 3, y == 'b', x[0], 'abc'[x == 'a']");
+        CHECK(t.returns() == "('ab', True, 'aaa', True, 'a', 'b')");
+    }
+
+    SECTION("reference counts are kept") {
+        auto t = EmissionTest("def f():\n  import sys\n  x = []\n  for i in range(10):\n    y = x + x\n    z = x != x\n    x += []\n  return sys.getrefcount(x)");
+        CHECK(t.returns() == "2");
+    }
+
+    SECTION("reference counts are kept on errors") {
+        auto t = EmissionTest("def f():\n  import sys\n  x = object()\n  for i in range(10):\n    try:\n      x + x\n    except TypeError:\n      pass\n  return sys.getrefcount(x)");
+        CHECK(t.returns() == "2");
+    }
+
+    SECTION("unbound locals") {
+        auto t = EmissionTest("def f():\n  if False:\n    y = 1\n  return 'a' + y");
+        CHECK(t.raises() == PyExc_UnboundLocalError);
+    }
+}
+
+TEST_CASE("Dict construction and access", "[BUILD_CONST_KEY_MAP][BINARY_SUBSCR][STORE_SUBSCR][emission]") {
+    SECTION("constant keys") {
+        auto t = EmissionTest("def f():\n  x = 2\n  return {'a': 1, 'b': x, 'c': x * 1.5, 'a': 4}");
+        CHECK(t.returns() == "{'a': 4, 'b': 2, 'c': 3.0}");
+    }
+
+    SECTION("str keys") {
+        auto t = EmissionTest("def f():\n  x = {'a': 1}\n  x['b'] = 2\n  x['a'] += x['b']\n  return x['a'], x");
+        CHECK(t.returns() == "(3, {'a': 3, 'b': 2})");
+    }
+
+    SECTION("missing str keys") {
+        auto t = EmissionTest("def f():\n  x = {'a': 1}\n  return x['b']");
+        CHECK(t.raises() == PyExc_KeyError);
+    }
+
+    SECTION("str keys on other containers") {
+        auto t = EmissionTest("def f():\n  class D(dict):\n    def __missing__(self, key):\n      return key * 2\n  x = D()\n  y = {'a': D()}\n  y['a']['b'] = 1\n  return x['a'], y['a']['b'], y['a']['c']");
+        CHECK(t.returns() == "('aa', 1, 'cc')");
+    }
+
+    SECTION("errors building values") {
+        auto t = EmissionTest("def f():\n  x = []\n  return {'a': x, 'b': {'c': x}['d']}");
+        CHECK(t.raises() == PyExc_KeyError);
+    }
+}
+
+TEST_CASE("String building", "[FORMAT_VALUE][BUILD_STRING][INPLACE_ADD][emission]") {
+    SECTION("formatted numbers") {
+        auto t = EmissionTest("def f():\n  x = 42\n  y = 2.5\n  return f'{x}-{y}-{x:04d}-{y:.2f}-{x!r}-{True}'");
+        CHECK(t.returns() == "'42-2.5-0042-2.50-42-True'");
+    }
+
+    SECTION("invalid format specs") {
+        auto t = EmissionTest("def f():\n  x = 2.5\n  return f'{x:d}'");
+        CHECK(t.raises() == PyExc_ValueError);
+    }
+
+    SECTION("concatenation in loops") {
+        auto t = EmissionTest("def f():\n  import sys\n  s = ''\n  t = 'b'\n  for i in range(100):\n    s += 'a'\n    t = t + s[-1]\n  return len(s), len(t), sys.getrefcount(s)");
+        CHECK(t.returns() == "(100, 101, 2)");
+    }
+
+    SECTION("concatenation with itself") {
+        auto t = EmissionTest("def f():\n  import sys\n  s = 'ab'\n  t = 'c'\n  for i in range(10):\n    s += s\n    t = t + t\n  return s == 'ab' * 1024, t == 'c' * 1024, sys.getrefcount(s), sys.getrefcount(t)");
+        CHECK(t.returns() == "(True, True, 2, 2)");
+    }
+
+    SECTION("concatenation of other values") {
+        auto t = EmissionTest("def f():\n  x = [1]\n  y = x\n  x += [2]\n  z = 'a'\n  z = y + z");
+        CHECK(t.raises() == PyExc_TypeError);
+    }
+}
+
+TEST_CASE("Periodic work", "[JUMP_ABSOLUTE][emission]") {
+    SECTION("pending calls run in loops") {
+        auto t = EmissionTest("def f():\n  import _thread\n  _thread.interrupt_main()\n  i = 0\n  while i < 1000000:\n    i += 1\n  return i");
+        CHECK(t.raises() == PyExc_KeyboardInterrupt);
+    }
+
+    SECTION("loops without pending calls") {
+        auto t = EmissionTest("def f():\n  i = 0\n  while i < 100000:\n    i += 1\n  return i");
+        CHECK(t.returns() == "100000");
+    }
+}
+
+TEST_CASE("Line numbers", "[f_lasti][emission]") {
+    SECTION("unboxed operations which raise") {
+        auto t = EmissionTest("def f():\n  import sys\n  x = 1.0\n  y = 0.0\n  try:\n    x = x / y\n  except ZeroDivisionError:\n    return sys.exc_info()[2].tb_lineno");
+        CHECK(t.returns() == "6");
+    }
+
+    SECTION("unbound locals") {
+        auto t = EmissionTest("def f():\n  import sys\n  try:\n    if False:\n      y = 1\n    x = 1\n    z = y\n  except UnboundLocalError:\n    return sys.exc_info()[2].tb_lineno");
+        CHECK(t.returns() == "7");
+    }
+
+    SECTION("frames inspected by calls") {
+        auto t = EmissionTest("def f():\n  import sys\n  x = sys._getframe().f_lineno\n  y = (x,\n    sys._getframe().f_lineno)\n  return y");
+        CHECK(t.returns() == "(3, 5)");
+    }
+}
+
+TEST_CASE("Sequence subscripts", "[BINARY_SUBSCR][STORE_SUBSCR][emission]") {
+    SECTION("list indexes") {
+        auto t = EmissionTest("def f():\n  x = [1, 2, 3]\n  i = 0\n  r = 0\n  while i < 3:\n    r += x[i] * x[-1 - i]\n    i += 1\n  return r");
+        CHECK(t.returns() == "10");
+    }
+
+    SECTION("tuple indexes") {
+        auto t = EmissionTest("def f():\n  x = ('a', 'b', 'c')\n  i = 2\n  return x[i], x[-3], x[0]");
+        CHECK(t.returns() == "('c', 'a', 'a')");
+    }
+
+    SECTION("list stores") {
+        auto t = EmissionTest("def f():\n  x = [0] * 4\n  i = 0\n  while i < 4:\n    x[i] = i * i\n    i += 1\n  x[-1] = 'end'\n  return x");
+        CHECK(t.returns() == "[0, 1, 4, 'end']");
+    }
+
+    SECTION("indexes out of range") {
+        auto t = EmissionTest("def f():\n  x = [1, 2, 3]\n  i = 3\n  return x[i]");
+        CHECK(t.raises() == PyExc_IndexError);
+    }
+
+    SECTION("negative indexes out of range") {
+        auto t = EmissionTest("def f():\n  x = (1, 2, 3)\n  i = -4\n  return x[i]");
+        CHECK(t.raises() == PyExc_IndexError);
+    }
+
+    SECTION("stores out of range") {
+        auto t = EmissionTest("def f():\n  x = [1, 2, 3]\n  i = 5\n  x[i] = 1");
+        CHECK(t.raises() == PyExc_IndexError);
+    }
+
+    SECTION("indexes which don't fit in a tagged int") {
+        auto t = EmissionTest("def f():\n  x = [1, 2, 3]\n  i = 2 ** 70\n  try:\n    return x[i]\n  except IndexError:\n    return x[i - 2 ** 70 + 1]");
+        CHECK(t.returns() == "2");
+    }
+}
+
+TEST_CASE("Loop kernels", "[FOR_ITER][kernel][emission]") {
+    SECTION("dot products") {
+        auto t = EmissionTest("def f():\n  a = array('d', [1.5, 2.0, 3.0, 4.0])\n  b = array('d', [2.0, 0.5, 1.0, 0.25])\n  s = 0\n  for i in range(len(a)):\n    s += a[i] * b[i]\n  return s, i", 0, "from array import array");
+        CHECK(t.returns() == "(8.0, 3)");
+    }
+
+    SECTION("element wise stores") {
+        auto t = EmissionTest("def f():\n  a = array('d', [1.0, 2.0, 3.0])\n  out = array('d', [0.0] * 3)\n  c = 0.5\n  for i in range(3):\n    out[i] = a[i] + c\n  return list(out)", 0, "from array import array");
+        CHECK(t.returns() == "[1.5, 2.5, 3.5]");
+    }
+
+    SECTION("int sums") {
+        auto t = EmissionTest("def f():\n  b = b'abc'\n  s = 0\n  for i in range(0, 3, 2):\n    s += b[i]\n  return s", 0);
+        CHECK(t.returns() == "196");
+    }
+
+    SECTION("int overflow") {
+        auto t = EmissionTest("def f():\n  a = array('q', [2 ** 62] * 4)\n  s = 0\n  for i in range(4):\n    s += a[i] * 2\n  return s", 0, "from array import array");
+        CHECK(t.returns() == "36893488147419103232");
+    }
+
+    SECTION("stores which overflow") {
+        auto t = EmissionTest("def f():\n  a = array('b', [0] * 5)\n  b = array('q', [0, 27, 28, 0, 0])\n  try:\n    for i in range(5):\n      a[i] = b[i] + 100\n  except OverflowError:\n    return list(a), i", 0, "from array import array");
+        CHECK(t.returns() == "([100, 127, 0, 0, 0], 2)");
+    }
+
+    SECTION("indexes out of range") {
+        auto t = EmissionTest("def f():\n  a = array('d', [1.0, 2.0])\n  out = array('d', [0.0] * 3)\n  try:\n    for i in range(3):\n      out[i] = a[i] * 2\n  except IndexError:\n    return list(out), i", 0, "from array import array");
+        CHECK(t.returns() == "([2.0, 4.0, 0.0], 2)");
+    }
+
+    SECTION("overlapping memoryviews") {
+        auto t = EmissionTest("def f():\n  a = array('d', [1.0, 2.0, 3.0, 4.0])\n  m = memoryview(a)\n  n = m[1:]\n  for i in range(3):\n    n[i] = m[i] - 1\n  return list(a)", 0, "from array import array");
+        CHECK(t.returns() == "[1.0, 0.0, -1.0, -2.0]");
+    }
+
+    SECTION("overlapping memoryviews read ahead of the store") {
+        auto t = EmissionTest("def f():\n  a = array('i', [1, 2, 3, 4, 5])\n  m = memoryview(a)\n  n = m[2:]\n  for i in range(3):\n    m[i] = n[i] + m[i]\n  return list(a)", 0, "from array import array");
+        CHECK(t.returns() == "[4, 6, 8, 4, 5]");
+    }
+
+    SECTION("stores in place") {
+        auto t = EmissionTest("def f():\n  a = array('d', [1.0, 2.0, 3.0, 4.0])\n  for i in range(4):\n    a[i] = a[i] * 2\n  return list(a)", 0, "from array import array");
+        CHECK(t.returns() == "[2.0, 4.0, 6.0, 8.0]");
+    }
+
+    SECTION("other sequences") {
+        auto t = EmissionTest("def f():\n  a = [1, 2, 3]\n  s = 0.5\n  for i in range(3):\n    s += a[i] * 2\n  return s", 0);
+        CHECK(t.returns() == "12.5");
+    }
+}
+
+TEST_CASE("Tagged int arithmetic", "[int][binary op][emission]") {
+    SECTION("adds and subtracts") {
+        auto t = EmissionTest("def f():\n  x = 0\n  i = 0\n  while i < 100:\n    x = x + i - 3\n    i += 1\n  return x");
+        CHECK(t.returns() == "4650");
+    }
+
+    SECTION("adds which overflow") {
+        auto t = EmissionTest("def f():\n  x = 4611686018427387903\n  y = 1\n  z = -4611686018427387904\n  return x + y, z + z, z - y, x - z");
+        CHECK(t.returns() == "(4611686018427387904, -9223372036854775808, -4611686018427387905, 9223372036854775807)");
+    }
+
+    SECTION("bitwise operators") {
+        auto t = EmissionTest("def f():\n  x = -6\n  y = 3\n  return x & y, x | y, x ^ y, x & -1");
+        CHECK(t.returns() == "(2, -5, -7, -6)");
+    }
+
+    SECTION("compares") {
+        auto t = EmissionTest("def f():\n  x = -2\n  y = 3\n  z = 2 ** 70\n  return x < y, x >= y, x == -2, y != 3, y <= 3, z > y, x > -z");
+        CHECK(t.returns() == "(True, False, True, False, True, True, True)");
+    }
+
+    SECTION("longs") {
+        auto t = EmissionTest("def f():\n  x = 2 ** 70\n  y = 5\n  return x + y, x - y, y - x, x & y, x | y, x ^ y");
+        CHECK(t.returns() == "(1180591620717411303429, 1180591620717411303419, -1180591620717411303419, 0, 1180591620717411303429, 1180591620717411303429)");
+    }
+}
+
+TEST_CASE("Math intrinsics", "[CALL_FUNCTION][intrinsics][emission]") {
+    SECTION("math functions of floats") {
+        auto t = EmissionTest("def f():\n  x = 2.25\n  y = -1.5\n  return math.sqrt(x) + 1.0, math.floor(y) + 1, math.ceil(y) + 1", 0, "import math");
+        CHECK(t.returns() == "(2.5, -1, 0)");
+    }
+
+    SECTION("math functions of ints") {
+        auto t = EmissionTest("def f():\n  x = 16\n  return math.sqrt(x) * 2.0, math.floor(x) - 1, math.ceil(x) + 1", 0, "import math");
+        CHECK(t.returns() == "(8.0, 15, 17)");
+    }
+
+    SECTION("abs, min and max") {
+        auto t = EmissionTest("def f():\n  x = -2.5\n  y = 1.5\n  i = -3\n  j = 4\n  return abs(x) + 0.0, min(x, y) + 0.0, max(x, y) + 0.0, abs(i) + 0, min(i, j) + 0, max(i, j) + 0");
+        CHECK(t.returns() == "(2.5, -2.5, 1.5, 3, -3, 4)");
+    }
+
+    SECTION("int and float conversions") {
+        auto t = EmissionTest("def f():\n  x = 2.5\n  i = 3\n  return int(x) + 1, float(i) + 0.5, int(-x) - 1");
+        CHECK(t.returns() == "(3, 3.5, -3)");
+    }
+
+    SECTION("conversions of large values") {
+        auto t = EmissionTest("def f():\n  x = 1e20\n  i = 2 ** 62\n  return int(x) + 0, float(i) + 0.0");
+        CHECK(t.returns() == "(100000000000000000000, 4.611686018427388e+18)");
+    }
+
+    SECTION("sqrt of a negative value") {
+        auto t = EmissionTest("def f():\n  x = -1.0\n  return math.sqrt(x) + 1.0", 0, "import math");
+        CHECK(t.raises() == PyExc_ValueError);
+    }
+
+    SECTION("int of infinity") {
+        auto t = EmissionTest("def f():\n  x = 1e308 * 10\n  return int(x) + 1");
+        CHECK(t.raises() == PyExc_OverflowError);
+    }
+
+    SECTION("replaced builtins") {
+        auto t = EmissionTest("def f():\n  x = 2.5\n  return abs(x) + 1.0", 0, "abs = lambda x: x * 2");
+        CHECK(t.returns() == "6.0");
+    }
+
+    SECTION("replaced builtins returning something else") {
+        auto t = EmissionTest("def f():\n  x = 2.5\n  return math.sqrt(x) + 1.0", 0, "import math\nmath.sqrt = lambda x: 3");
+        CHECK(t.returns() == "4.0");
+    }
+
+    SECTION("replaced builtins returning something else with a float under the call") {
+        auto t = EmissionTest("def f():\n  x = 2.25\n  return 2.0 * math.sqrt(x)", 0, "import math\nmath.sqrt = lambda v: 3");
+        CHECK(t.returns() == "6.0");
+    }
+
+    SECTION("replaced builtins returning something else in a handler") {
+        auto t = EmissionTest("def f():\n  x = -2.5\n  try:\n    raise ValueError()\n  except ValueError:\n    return abs(x) + 1.0", 0, "abs = lambda v: 3");
+        CHECK(t.returns() == "4.0");
+    }
+
+    SECTION("replaced builtins returning something else in a with block") {
+        auto t = EmissionTest("def f():\n  x = 2.25\n  with C():\n    return math.sqrt(x) + 1.0", 0,
+            "import math\nmath.sqrt = lambda v: 3\nclass C:\n  def __enter__(self): return self\n  def __exit__(self, *args): return False");
+        CHECK(t.returns() == "4.0");
+    }
+}
+
+TEST_CASE("On-stack replacement", "[osr][emission]") {
+    SECTION("functions with arguments can be entered at a loop head") {
+        auto code = CompileCode("def f(a, b):\n  for i in range(a):\n    b += i\n  return b");
+        AbstractInterpreter interp(code, PyJit_GetCompilerFactory());
+        auto jitted = interp.compile_osr(10, 1);   // FOR_ITER, with the iterator on the stack
+        CHECK(jitted != nullptr);
+        delete jitted;
+        Py_DECREF(code);
+    }
+
+    SECTION("thresholds which don't fit") {
+        check_rejects_overflow("set_osr_threshold", "get_osr_threshold");
+    }
+
+    SECTION("frames which call other watched frames") {
+        JitEvaluator evaluator;
+        auto state = PyJit_GetInterpState();
+        auto prevHot = state->hotCode;
+        auto prevOsr = state->osrThreshold;
+        state->hotCode = 1000000;
+        state->osrThreshold = 50;
+
+        auto globals = PyObject_ptr(PyDict_New());
+        PyDict_SetItemString(globals.get(), "__builtins__", PyThreadState_GET()->interp->builtins);
+        auto res = PyObject_ptr(PyRun_String(
+            "def g(n):\n  r = 0\n  for i in range(n):\n    r += i\n  return r\n"
+            "def f():\n  t = 0\n  for i in range(200):\n    t += g(3)\n  return t\n"
+            "res = f()\n",
+            Py_file_input, globals.get(), globals.get()));
+        state->hotCode = prevHot;
+        state->osrThreshold = prevOsr;
+        REQUIRE(res.get() != nullptr);
+
+        CHECK(PyLong_AsLong(PyDict_GetItemString(globals.get(), "res")) == 600);
+        // Both loops got hot, and nothing is left watching
+        auto f = (PyFunctionObject*)PyDict_GetItemString(globals.get(), "f");
+        auto g = (PyFunctionObject*)PyDict_GetItemString(globals.get(), "g");
+        CHECK(PyJit_EnsureExtra(f->func_code)->j_compiles == 1);
+        CHECK(PyJit_EnsureExtra(g->func_code)->j_compiles == 1);
+        CHECK(PyThreadState_GET()->c_tracefunc == nullptr);
+    }
+}
@@ -38,6 +38,7 @@
 #include <util.h>
 #include <memory>
 #include <vector>
+#include <unordered_set>
 
 class InferenceTest {
 private:
@@ -4566,3 +4567,30 @@ TEST_CASE("Generalize unpacking within a dict", "[dict][BUILD_MAP_UNPACK][infere
         REQUIRE(t.kind(22, 0) == AVK_Dict);       // LOAD_CONST 0
     }
 }
+
+static std::unordered_set<size_t> loop_heads(const char* code) {
+    auto pyCode = CompileCode(code);
+    AbstractInterpreter interpreter(pyCode, nullptr);
+    std::unordered_set<size_t> loopHeads;
+    REQUIRE(interpreter.get_loop_heads(loopHeads));
+    Py_DECREF(pyCode);
+    return loopHeads;
+}
+
+TEST_CASE("Loop heads for on-stack replacement", "[osr][inference]") {
+    SECTION("for loops are entered at the FOR_ITER") {
+        auto heads = loop_heads("def f():\n  for i in range(10):\n    pass");
+        CHECK(heads.size() == 1);
+        CHECK(heads.count(10) == 1);  // FOR_ITER
+    }
+
+    SECTION("while loops are entered at the condition") {
+        auto heads = loop_heads("def f():\n  x = 0\n  while x < 10:\n    x += 1");
+        CHECK(heads.size() == 1);
+        CHECK(heads.count(6) == 1);   // LOAD_FAST 0
+    }
+
+    SECTION("no loops") {
+        CHECK(loop_heads("def f():\n  return 42").size() == 0);
+    }
+}
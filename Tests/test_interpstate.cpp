@@ -0,0 +1,149 @@
+/*
+* The MIT License (MIT)
+*
+* Copyright (c) Microsoft Corporation
+*
+* Permission is hereby granted, free of charge, to any person obtaining a
+* copy of this software and associated documentation files (the "Software"),
+* to deal in the Software without restriction, including without limitation
+* the rights to use, copy, modify, merge, publish, distribute, sublicense,
+* and/or sell copies of the Software, and to permit persons to whom the
+* Software is furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included
+* in all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+* OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+* THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+* OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+* ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+* OTHER DEALINGS IN THE SOFTWARE.
+*
+*/
+
+/**
+  Test the per opcode tables and copy on write locals which make up the
+  abstract interpreter's state, and measure compile throughput on large
+  functions.
+*/
+
+#include "stdafx.h"
+#include "catch.hpp"
+#include "testing_util.h"
+#include <Python.h>
+#include <chrono>
+#include <string>
+#include <absint.h>
+#include <pyjit.h>
+#include <util.h>
+
+TEST_CASE("Opcode map", "[interpstate]") {
+    OpcodeMap<int> map;
+    map.resize(4 * sizeof(_Py_CODEUNIT));
+
+    SECTION("entries are present once set") {
+        CHECK(!map.contains(0));
+        CHECK(map.find(0) == nullptr);
+        map[sizeof(_Py_CODEUNIT)] = 42;
+        CHECK(map.contains(sizeof(_Py_CODEUNIT)));
+        CHECK(*map.find(sizeof(_Py_CODEUNIT)) == 42);
+        CHECK(!map.contains(0));
+    }
+
+    SECTION("the end of the code can be targeted") {
+        map[4 * sizeof(_Py_CODEUNIT)] = 1;
+        CHECK(map.contains(4 * sizeof(_Py_CODEUNIT)));
+        CHECK(!map.contains(5 * sizeof(_Py_CODEUNIT)));
+    }
+
+    SECTION("resizing discards entries") {
+        map[0] = 1;
+        map.resize(2 * sizeof(_Py_CODEUNIT));
+        CHECK(!map.contains(0));
+    }
+}
+
+TEST_CASE("Copy on write locals", "[interpstate]") {
+    SECTION("copies share until written") {
+        CowVector<int> locals(3);
+        auto copy = locals;
+        CHECK(copy == locals);
+
+        copy.replace(0, 42);
+        CHECK(copy != locals);
+        CHECK(copy[0] == 42);
+        CHECK(locals[0] == 0);
+        CHECK(locals.size() == 3);
+    }
+
+    SECTION("copies outlive the original") {
+        auto locals = new CowVector<int>(2);
+        locals->replace(0, 42);
+        auto copy = *locals;
+        delete locals;
+        CHECK(copy[0] == 42);
+        CHECK(copy.size() == 2);
+    }
+
+    SECTION("default constructed data is empty") {
+        CowVector<int> locals;
+        CHECK(locals.size() == 0);
+        locals.push_back(1);
+        CHECK(locals.size() == 1);
+    }
+}
+
+// Builds a function with a few thousand opcodes made up of branches and
+// arithmetic, so there are lots of distinct interpreter states to track.
+static std::string large_function(int statements) {
+    std::string code = "def f(a, b):\n    x = 0\n";
+    for (int i = 0; i < statements; i++) {
+        auto n = std::to_string(i);
+        code += "    if a > " + n + ":\n        x = x + a * b - " + n + "\n";
+    }
+    code += "    return x\n";
+    return code;
+}
+
+static double elapsed_ms(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+TEST_CASE("Compile throughput", "[.][perf]") {
+    const int iterations = 20;
+    auto source = large_function(250);
+
+    SECTION("abstract interpretation") {
+        auto code = py_ptr<PyCodeObject>(CompileCode(source.c_str()));
+        auto opcodes = PyBytes_Size(code->co_code) / sizeof(_Py_CODEUNIT);
+        REQUIRE(opcodes > 1000);
+
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < iterations; i++) {
+            AbstractInterpreter interp(code.get(), nullptr);
+            REQUIRE(interp.interpret());
+        }
+        auto total = elapsed_ms(start);
+        WARN(opcodes << " opcodes interpreted in " << total / iterations << "ms ("
+            << opcodes * iterations / total << " opcodes/ms)");
+    }
+
+    SECTION("full compile") {
+        double total = 0;
+        size_t opcodes = 0;
+        for (int i = 0; i < iterations; i++) {
+            // Each compile needs a fresh code object as the jitted code is cached on it
+            auto code = py_ptr<PyCodeObject>(CompileCode(source.c_str()));
+            opcodes = PyBytes_Size(code->co_code) / sizeof(_Py_CODEUNIT);
+            PyJit_EnsureExtra((PyObject*)code.get());
+
+            auto start = std::chrono::steady_clock::now();
+            REQUIRE(jit_compile(code.get()));
+            total += elapsed_ms(start);
+        }
+        WARN(opcodes << " opcodes compiled in " << total / iterations << "ms ("
+            << opcodes * iterations / total << " opcodes/ms)");
+    }
+}
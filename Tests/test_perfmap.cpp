@@ -0,0 +1,144 @@
+/*
+* The MIT License (MIT)
+*
+* Copyright (c) Microsoft Corporation
+*
+* Permission is hereby granted, free of charge, to any person obtaining a
+* copy of this software and associated documentation files (the "Software"),
+* to deal in the Software without restriction, including without limitation
+* the rights to use, copy, modify, merge, publish, distribute, sublicense,
+* and/or sell copies of the Software, and to permit persons to whom the
+* Software is furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included
+* in all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+* OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+* THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+* OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+* ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+* OTHER DEALINGS IN THE SOFTWARE.
+*
+*/
+
+/**
+  Test reporting jitted code to profilers and debuggers.
+*/
+
+#include "stdafx.h"
+#include "catch.hpp"
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <perfmap.h>
+
+#ifdef PLATFORM_UNIX
+
+#include <unistd.h>
+
+// The GDB JIT interface's descriptor, as laid out by perfmap.cpp
+extern "C" {
+    struct jit_code_entry {
+        jit_code_entry* next_entry;
+        jit_code_entry* prev_entry;
+        const char* symfile_addr;
+        uint64_t symfile_size;
+    };
+
+    struct jit_descriptor {
+        uint32_t version;
+        uint32_t action_flag;
+        jit_code_entry* relevant_entry;
+        jit_code_entry* first_entry;
+    };
+
+    extern jit_descriptor __jit_debug_descriptor;
+}
+
+// mov eax, 42; ret
+static unsigned char g_code[] = { 0xb8, 42, 0, 0, 0, 0xc3 };
+static const PyjitCodeLine g_lines[] = { { 0, 3 }, { 5, 4 } };
+
+static std::string read_perf_map() {
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/perf-%d.map", (int)getpid());
+    std::string res;
+    auto file = fopen(path, "r");
+    if (file != nullptr) {
+        char buffer[256];
+        size_t read;
+        while ((read = fread(buffer, 1, sizeof(buffer), file)) != 0) {
+            res.append(buffer, read);
+        }
+        fclose(file);
+    }
+    return res;
+}
+
+TEST_CASE("Perf map", "[perfmap]") {
+    pyjit_perf_enable(PYJIT_PERF_MAP);
+    REQUIRE((pyjit_perf_enabled() & PYJIT_PERF_MAP) != 0);
+
+    pyjit_perf_register(g_code, sizeof(g_code), "perf_map_test (test.py:3) [int]", "test.py",
+        g_lines, sizeof(g_lines) / sizeof(g_lines[0]));
+
+    char expected[128];
+    snprintf(expected, sizeof(expected), "%llx %llx py::perf_map_test (test.py:3) [int]\n",
+        (unsigned long long)g_code, (unsigned long long)sizeof(g_code));
+    CHECK(read_perf_map().find(expected) != std::string::npos);
+}
+
+TEST_CASE("GDB JIT interface", "[perfmap]") {
+    pyjit_perf_enable(PYJIT_GDB_JIT);
+    REQUIRE((pyjit_perf_enabled() & PYJIT_GDB_JIT) != 0);
+    CHECK(__jit_debug_descriptor.version == 1);
+
+    SECTION("registering links an object file") {
+        pyjit_perf_register(g_code, sizeof(g_code), "gdb_test", "test.py",
+            g_lines, sizeof(g_lines) / sizeof(g_lines[0]));
+
+        auto entry = __jit_debug_descriptor.first_entry;
+        REQUIRE(entry != nullptr);
+        CHECK(__jit_debug_descriptor.relevant_entry == entry);
+        CHECK(__jit_debug_descriptor.action_flag == 1);
+        REQUIRE(entry->symfile_size > 4);
+        CHECK(memcmp(entry->symfile_addr, "\x7f" "ELF", 4) == 0);
+
+        // The symbol name ends up in the object file's string table
+        std::string symfile(entry->symfile_addr, (size_t)entry->symfile_size);
+        CHECK(symfile.find("gdb_test") != std::string::npos);
+
+        pyjit_perf_unregister(g_code);
+        CHECK(__jit_debug_descriptor.first_entry != entry);
+        CHECK(__jit_debug_descriptor.action_flag == 2);
+    }
+
+    SECTION("registering the same code twice adds one entry") {
+        pyjit_perf_register(g_code, sizeof(g_code), "gdb_test", "test.py", nullptr, 0);
+        auto entry = __jit_debug_descriptor.first_entry;
+        pyjit_perf_register(g_code, sizeof(g_code), "gdb_test", "test.py", nullptr, 0);
+        CHECK(__jit_debug_descriptor.first_entry == entry);
+
+        pyjit_perf_unregister(g_code);
+        CHECK(__jit_debug_descriptor.first_entry != entry);
+    }
+
+    SECTION("unregistering unknown code is ignored") {
+        auto entry = __jit_debug_descriptor.first_entry;
+        pyjit_perf_unregister(g_code + 1);
+        CHECK(__jit_debug_descriptor.first_entry == entry);
+    }
+}
+
+TEST_CASE("Frame pointers", "[perfmap]") {
+    auto prev = pyjit_set_frame_pointers(1);
+    CHECK(pyjit_frame_pointers() == 1);
+    CHECK(pyjit_set_frame_pointers(0) == 1);
+    CHECK(pyjit_frame_pointers() == 0);
+    pyjit_set_frame_pointers(prev);
+}
+
+#endif
@@ -0,0 +1,107 @@
+/*
+* The MIT License (MIT)
+*
+* Copyright (c) Microsoft Corporation
+*
+* Permission is hereby granted, free of charge, to any person obtaining a
+* copy of this software and associated documentation files (the "Software"),
+* to deal in the Software without restriction, including without limitation
+* the rights to use, copy, modify, merge, publish, distribute, sublicense,
+* and/or sell copies of the Software, and to permit persons to whom the
+* Software is furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included
+* in all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+* OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+* THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+* OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+* ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+* OTHER DEALINGS IN THE SOFTWARE.
+*
+*/
+
+/**
+  Test the array jitted functions publish their specializations through, which
+  dispatch reads without taking a lock.
+*/
+
+#include "stdafx.h"
+#include "catch.hpp"
+#include <atomic>
+#include <thread>
+#include <pubarray.h>
+
+TEST_CASE("Published array", "[pubarray]") {
+    int values[4] = { 0, 1, 2, 3 };
+
+    SECTION("entries are published in order") {
+        PublishedArray<int, 3> items;
+        CHECK(items.size() == 0);
+        CHECK(items.push_back(&values[0]));
+        CHECK(items.push_back(&values[1]));
+        CHECK(items.size() == 2);
+        CHECK(items[0] == &values[0]);
+        CHECK(items[1] == &values[1]);
+        CHECK(!items.full());
+    }
+
+    SECTION("the capacity is enforced") {
+        PublishedArray<int, 2> items;
+        CHECK(items.push_back(&values[0]));
+        CHECK(items.push_back(&values[1]));
+        CHECK(items.full());
+        CHECK(!items.push_back(&values[2]));
+        CHECK(items.size() == 2);
+    }
+
+    SECTION("promoted entries move towards the front") {
+        PublishedArray<int, 3> items;
+        items.push_back(&values[0]);
+        items.push_back(&values[1]);
+        items.push_back(&values[2]);
+        items.promote(2);
+        CHECK(items[0] == &values[0]);
+        CHECK(items[1] == &values[2]);
+        CHECK(items[2] == &values[1]);
+    }
+
+    SECTION("clearing allows reuse") {
+        PublishedArray<int, 1> items;
+        items.push_back(&values[0]);
+        items.clear();
+        CHECK(items.size() == 0);
+        CHECK(items.push_back(&values[1]));
+        CHECK(items[0] == &values[1]);
+    }
+
+    SECTION("readers only see published entries") {
+        const int count = 64;
+        PublishedArray<int, count> items;
+        int data[count];
+        std::atomic<bool> done(false);
+        std::atomic<bool> ok(true);
+
+        std::thread reader([&] {
+            while (!done) {
+                auto size = items.size();
+                for (size_t i = 0; i < size; i++) {
+                    auto item = items[i];
+                    if (item == nullptr || *item != (int)i) {
+                        ok = false;
+                    }
+                }
+            }
+        });
+        for (int i = 0; i < count; i++) {
+            data[i] = i;
+            items.push_back(&data[i]);
+        }
+        done = true;
+        reader.join();
+        CHECK(ok);
+        CHECK(items.size() == count);
+    }
+}
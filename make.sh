@@ -10,6 +10,9 @@ clang++-3.9 -DPLATFORM_UNIX=1 -std=c++11 $SRC_DIR/absint.cpp $PY_INC_DIRS  -o $O
 clang++-3.9 -DPLATFORM_UNIX=1 -std=c++11 $SRC_DIR/jitinit.cpp $PY_INC_DIRS  -o $OUT_DIR/jitinit.o -c -fPIC -g -D_TARGET_AMD64_=1 
 clang++-3.9 -DPLATFORM_UNIX=1 -std=c++11 $SRC_DIR/pyjit.cpp $PY_INC_DIRS  -o $OUT_DIR/pyjit.o -c -fPIC -g -D_TARGET_AMD64_=1 
 clang++-3.9 -DPLATFORM_UNIX=1 -std=c++11 $SRC_DIR/bridge.cpp -o $OUT_DIR/bridge.o -c -fPIC -g -D_TARGET_AMD64_=1 
+clang++-3.9 -DPLATFORM_UNIX=1 -std=c++11 $SRC_DIR/codecache.cpp $PY_INC_DIRS -o $OUT_DIR/codecache.o -c -fPIC -g -D_TARGET_AMD64_=1 
+clang++-3.9 -DPLATFORM_UNIX=1 -std=c++11 $SRC_DIR/codeheap.cpp -o $OUT_DIR/codeheap.o -c -fPIC -g -D_TARGET_AMD64_=1 
+clang++-3.9 -DPLATFORM_UNIX=1 -std=c++11 $SRC_DIR/perfmap.cpp -o $OUT_DIR/perfmap.o -c -fPIC -g -D_TARGET_AMD64_=1 
 clang++-3.9 -DPLATFORM_UNIX=1 -std=c++11 $SRC_DIR/ipycomp.cpp -o $OUT_DIR/ipycomp.o -c -fPIC -g -D_TARGET_AMD64_=1 
 
 # Build the CoreCLR integration
@@ -18,8 +21,10 @@ clang++-3.9 -DFEATURE_PAL_SXS   -DAMD64 -DBIT64=1 -DFEATURE_CORECLR -DFEATURE_PA
 clang++-3.9 -DFEATURE_PAL_SXS   -DAMD64 -DBIT64=1 -DFEATURE_CORECLR -DFEATURE_PAL -DFEATURE_PAL_ANSI  -DLINUX64 -DPLATFORM_UNIX=1 -DUNICODE -DUNIX_AMD64_ABI -D_AMD64_ -D_TARGET_AMD64_=1 -D_UNICODE -D_WIN64 $CORECLR_INCS -Wall -std=c++11 -g  -fno-omit-frame-pointer -fms-extensions -fstack-protector-strong -Werror -Wno-microsoft -nostdinc -o $OUT_DIR/pycomp.o -c $SRC_DIR/pycomp.cpp -c -fPIC -Wno-invalid-noreturn
 
 # And link it all together...
-clang++-3.9 -shared -o   $OUT_DIR/pyjion.so $OUT_DIR/absint.o  $OUT_DIR/absvalue.o  $OUT_DIR/intrins.o  $OUT_DIR/jitinit.o  $OUT_DIR/pycomp.o  $OUT_DIR/pyjit.o $OUT_DIR/cee.o $OUT_DIR/ipycomp.o $OUT_DIR/bridge.o  CoreCLR/bin/obj/Linux.x64.Debug/src/jit/dll/libclrjit_static.a  CoreCLR/bin/obj/Linux.x64.Debug/src/gcinfo/lib/libgcinfo.a  CoreCLR/bin/obj/Linux.x64.Debug/src/utilcode/staticnohost/libutilcodestaticnohost.a CoreCLR/bin/obj/Linux.x64.Debug/src/dlls/mscorrc/full/libmscorrc_debug.a CoreCLR/bin/obj/Linux.x64.Debug/src/nativeresources/libnativeresourcestring.a CoreCLR/bin/obj/Linux.x64.Debug/src/pal/src/libcoreclrpal.a CoreCLR/bin/obj/Linux.x64.Debug/src/palrt/libpalrt.a  -lstdc++ -lc -lm  -lgcc_s -lgcc -lc   -lrt -ldl -luuid -lpthread -lutil   -lunwind-x86_64 -lunwind -Wl,-z,noexecstack
+clang++-3.9 -shared -o   $OUT_DIR/pyjion.so $OUT_DIR/absint.o  $OUT_DIR/absvalue.o  $OUT_DIR/intrins.o  $OUT_DIR/jitinit.o  $OUT_DIR/pycomp.o  $OUT_DIR/pyjit.o $OUT_DIR/cee.o $OUT_DIR/ipycomp.o $OUT_DIR/bridge.o $OUT_DIR/codeheap.o $OUT_DIR/perfmap.o $OUT_DIR/codecache.o  CoreCLR/bin/obj/Linux.x64.Debug/src/jit/dll/libclrjit_static.a  CoreCLR/bin/obj/Linux.x64.Debug/src/gcinfo/lib/libgcinfo.a  CoreCLR/bin/obj/Linux.x64.Debug/src/utilcode/staticnohost/libutilcodestaticnohost.a CoreCLR/bin/obj/Linux.x64.Debug/src/dlls/mscorrc/full/libmscorrc_debug.a CoreCLR/bin/obj/Linux.x64.Debug/src/nativeresources/libnativeresourcestring.a CoreCLR/bin/obj/Linux.x64.Debug/src/pal/src/libcoreclrpal.a CoreCLR/bin/obj/Linux.x64.Debug/src/palrt/libpalrt.a  -lstdc++ -lc -lm  -lgcc_s -lgcc -lc   -lrt -ldl -luuid -lpthread -lutil   -lunwind-x86_64 -lunwind -Wl,-z,noexecstack
 
 clang++-3.9 -DPLATFORM_UNIX=1 -std=c++11 Test/Test.cpp -o Test/test.o  -fPIC -g -D_TARGET_AMD64_=1  -IPyjion/ $PY_INC_DIRS $OUT_DIR/pyjion.so Python/libpython3.6m.a -ldl -lpthread -lutil -lnuma
 
-clang++-3.9 -DPLATFORM_UNIX=1 -std=c++11 Tests/Tests.cpp Tests/test_emission.cpp Tests/test_inference.cpp Tests/testing_util.cpp -o Tests/tests.o -fPIC -g -D_TARGET_AMD64_=1 -ITests/Catch/include/ -IPyjion/ $PY_INC_DIRS $OUT_DIR/pyjion.so Python/libpython3.6m.a -ldl -lpthread -lutil -lnuma
+clang++-3.9 -DPLATFORM_UNIX=1 -std=c++11 Tests/Tests.cpp Tests/test_emission.cpp Tests/test_inference.cpp Tests/test_codeheap.cpp Tests/test_codecache.cpp Tests/test_arena.cpp Tests/test_interpstate.cpp Tests/test_perfmap.cpp Tests/test_pubarray.cpp Tests/test_compilearena.cpp Tests/testing_util.cpp -o Tests/tests.o -fPIC -g -D_TARGET_AMD64_=1 -ITests/Catch/include/ -IPyjion/ $PY_INC_DIRS $OUT_DIR/pyjion.so Python/libpython3.6m.a -ldl -lpthread -lutil -lnuma
+
+clang++-3.9 -DPLATFORM_UNIX=1 -std=c++11 Benchmarks/Benchmarks.cpp Benchmarks/bench_compile.cpp Benchmarks/bench_execute.cpp -o Benchmarks/benchmarks.o -fPIC -g -D_TARGET_AMD64_=1 -IPyjion/ $PY_INC_DIRS $OUT_DIR/pyjion.so Python/libpython3.6m.a -ldl -lpthread -lutil -lnuma